@@ -11,7 +11,10 @@
  * NOTE: Buffer size needs to keep in sync with other implementations
  *       e.g. dependencies/nDPIsrvd.py
  */
-#define NETWORK_BUFFER_MAX_SIZE 12288u /* 8192 + 4096 */
+#define NETWORK_BUFFER_MAX_SIZE 12328u /* 8192 + 4096 + NETWORK_BUFFER_SEQ_RESERVE */
+/* nDPIsrvd prepends `"distributor_seq":<u64>,' to every line, collectors (nDPId) may only use the remaining space */
+#define NETWORK_BUFFER_SEQ_RESERVE 40u
+#define NETWORK_BUFFER_COLLECTOR_MAX_SIZE (NETWORK_BUFFER_MAX_SIZE - NETWORK_BUFFER_SEQ_RESERVE)
 #define NETWORK_BUFFER_LENGTH_DIGITS 5u
 #define NETWORK_BUFFER_LENGTH_DIGITS_STR "5"
 
@@ -25,6 +28,9 @@
 #define nDPId_COMPRESSION_SCAN_PERIOD 20000u /* 20 sec */
 #define nDPId_COMPRESSION_FLOW_INACTIVITY 30000u /* 30 sec */
 #define nDPId_IDLE_SCAN_PERIOD 10000u /* 10 sec */
+#define nDPId_STATUS_INTERVAL 60000u /* 60 sec */
+#define nDPId_PCAP_POLL_TIMEOUT 250 /* msec, live captures only */
+#define nDPId_STAGE_TIMINGS 0u
 #define nDPId_GENERIC_IDLE_TIME 600000u /* 600 */
 #define nDPId_ICMP_IDLE_TIME 30000u /* 30 sec */
 #define nDPId_TCP_IDLE_TIME 7440000u /* 7440 sec */
@@ -34,8 +40,29 @@
 #define nDPId_PACKETS_PER_FLOW_TO_SEND 15u
 #define nDPId_PACKETS_PER_FLOW_TO_PROCESS 255u
 #define nDPId_FLOW_STRUCT_SEED 0x5defc104
+#define nDPId_FLOW_ID_BLOCK_SIZE 1024u
+#define nDPId_PACKET_BATCH_SIZE 1u
+#define nDPId_MAX_PACKET_BATCH_SIZE 64u
+#define nDPId_PACKET_BATCH_SLOT_SIZE 1536u /* bytes per batched packet, larger packets end a batch early */
+#define nDPId_ORDERED_REPLAY 0u
+#define nDPId_ORDERED_REPLAY_ROUND 8192u /* packets */
+#define nDPId_CAPTURE_GUESSED 0u
+#define nDPId_CAPTURE_UNDETECTED 1u
+#define nDPId_CAPTURE_RISKY 1u
+#define nDPId_CAPTURE_MIDSTREAM 0u
+#define nDPId_CAPTURE_ROTATION 0u /* one pcap file per flow */
+#define nDPId_CAPTURE_BUFFER_SIZE 1048576u /* 1 MiB */
+#define nDPId_CAPTURE_MAX_PENDING 67108864u /* 64 MiB queued for the writer thread */
+#define nDPId_CAPTURE_FLUSH_INTERVAL 1u /* sec, rotated files only */
 
 /* nDPIsrvd default config options */
 #define nDPIsrvd_PIDFILE "/tmp/ndpisrvd.pid"
+#define nDPIsrvd_DISTRIBUTOR_BUFFER_SIZE 1048576u /* 1 MiB per distributor, must exceed NETWORK_BUFFER_MAX_SIZE */
+#define nDPIsrvd_MAX_COLLECTOR_WORKERS 32u
+#define nDPIsrvd_MAX_COLLECTORS_PER_WORKER 32u
+#define nDPIsrvd_COLLECTOR_WORKER_RING_SIZE 1048576u /* 1 MiB, must be a power of 2 */
+
+/* nDPIsrvd.h client library defaults */
+#define nDPIsrvd_FLOW_TIMEOUT 7800u /* sec, must exceed nDPId_TCP_IDLE_TIME + nDPId_IDLE_SCAN_PERIOD */
 
 #endif
@@ -4,23 +4,26 @@
 #include <arpa/inet.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "config.h"
 #include "jsmn.h"
+#include "nDPIsrvd_keys.h"
 #include "utarray.h"
 #include "uthash.h"
+#include "utlist.h"
 
 #define nDPIsrvd_MAX_JSON_TOKENS 128
-#define nDPIsrvd_FLOW_KEY_TOKENS 3
-#define nDPIsrvd_FLOW_KEY_STRLEN 24
 #define nDPIsrvd_JSON_KEY_STRLEN 32
+#define nDPIsrvd_FLOW_TIMER_SLOTS 256u /* one slot per second, must be a power of 2 */
 
 #define nDPIsrvd_STRLEN_SZ(s) (sizeof(s) / sizeof(s[0]) - sizeof(s[0]))
 #define TOKEN_GET_SZ(sock, key) token_get(sock, (char const *)key, nDPIsrvd_STRLEN_SZ(key))
@@ -30,6 +33,9 @@
     token_value_equals(token, string_to_check, nDPIsrvd_STRLEN_SZ(string_to_check))
 #define TOKEN_KEY_TO_ULL(token, key) token_key_to_ull(token, key)
 #define TOKEN_VALUE_TO_ULL(token, value) token_value_to_ull(token, value)
+#define TOKEN_VALUE_TO_BOOL(token, value) token_value_to_bool(token, value)
+#define TOKEN_GET_ULL_SZ(sock, key, value) token_get_ull(sock, (char const *)key, nDPIsrvd_STRLEN_SZ(key), value)
+#define TOKEN_GET_BOOL_SZ(sock, key, value) token_get_bool(sock, (char const *)key, nDPIsrvd_STRLEN_SZ(key), value)
 
 #define FIRST_ENUM_VALUE 1
 #define LAST_ENUM_VALUE CONVERSION_LAST_ENUM_VALUE
@@ -87,19 +93,50 @@ enum nDPIsrvd_conversion_return
     CONVERSION_LAST_ENUM_VALUE
 };
 
+/* Why a flow was removed from the flow table, passed to the `flow_end_callback'. */
+enum nDPIsrvd_cleanup_reason
+{
+    CLEANUP_REASON_DAEMON_INIT,     // the nDPId instance (re)started, it does not know about any older flows
+    CLEANUP_REASON_DAEMON_SHUTDOWN, // the nDPId instance shut down, there won't be any more events for its flows
+    CLEANUP_REASON_FLOW_END,
+    CLEANUP_REASON_FLOW_IDLE,
+    CLEANUP_REASON_FLOW_TIMEOUT, // no event seen for `flow_timeout' seconds e.g. lost due to a reconnect
+    CLEANUP_REASON_APP_SHUTDOWN, // nDPIsrvd_free()
+
+    CLEANUP_REASON_LAST_ENUM_VALUE
+};
+
 typedef unsigned long long int nDPIsrvd_ull;
 typedef nDPIsrvd_ull * nDPIsrvd_ull_ptr;
 
+/* A nDPId instance, identified by its `alias' and `source'. Interned once per connection. */
+struct nDPIsrvd_instance
+{
+    UT_hash_handle hh;
+    uint64_t instance_id;
+    int alias_length;
+    int source_length;
+    nDPIsrvd_ull next_thread_seq[nDPId_MAX_READER_THREADS]; // expected `thread_seq', 0 if none seen yet
+    char key[]; // `alias' + '\0' + `source'
+};
+
 struct nDPIsrvd_flow_key
 {
-    char key[nDPIsrvd_FLOW_KEY_STRLEN];
+    uint64_t flow_id;
+    uint64_t instance_id;
 };
 
 struct nDPIsrvd_flow
 {
     struct nDPIsrvd_flow_key flow_key;
     nDPIsrvd_ull id_as_ull;
+    struct nDPIsrvd_instance * instance;
+    nDPIsrvd_ull thread_id;
     UT_hash_handle hh;
+    uint64_t last_seen; // seconds, see nDPIsrvd_expire_flows()
+    unsigned int timer_slot;
+    struct nDPIsrvd_flow * timer_prev;
+    struct nDPIsrvd_flow * timer_next;
     uint8_t flow_user_data[0];
 };
 
@@ -111,6 +148,12 @@ struct nDPIsrvd_json_token
     int key_length;
     int value_length;
     int token_index;
+    unsigned int generation; // the value is only valid if this equals the socket's current generation
+
+    /* numeric value, converted on first access and cached for the rest of the message */
+    unsigned int converted_generation;
+    enum nDPIsrvd_conversion_return converted_return;
+    nDPIsrvd_ull converted_value;
 };
 
 struct nDPIsrvd_socket;
@@ -121,7 +164,19 @@ static inline void nDPIsrvd_uthash_free(void * const freeable, size_t const size
 
 typedef enum nDPIsrvd_callback_return (*json_callback)(struct nDPIsrvd_socket * const sock,
                                                        struct nDPIsrvd_flow * const flow);
-typedef void (*flow_end_callback)(struct nDPIsrvd_socket * const sock, struct nDPIsrvd_flow * const flow);
+typedef void (*flow_end_callback)(struct nDPIsrvd_socket * const sock,
+                                  struct nDPIsrvd_flow * const flow,
+                                  enum nDPIsrvd_cleanup_reason reason);
+/*
+ * Called before the event with the unexpected sequence number is handed to the json_callback.
+ * `instance' is NULL if nDPIsrvd dropped events (`distributor_seq'),
+ * otherwise nDPId lost events of reader thread `thread_id' (`thread_seq').
+ */
+typedef void (*sequence_gap_callback)(struct nDPIsrvd_socket * const sock,
+                                      struct nDPIsrvd_instance const * const instance,
+                                      nDPIsrvd_ull thread_id,
+                                      nDPIsrvd_ull expected_seq,
+                                      nDPIsrvd_ull received_seq);
 
 struct nDPIsrvd_address
 {
@@ -161,17 +216,41 @@ struct nDPIsrvd_socket
 
     size_t flow_user_data_size;
     struct nDPIsrvd_flow * flow_table;
+    struct nDPIsrvd_instance * instance_table;
+    struct nDPIsrvd_instance * last_instance;
+    uint64_t next_instance_id;
     json_callback json_callback;
     flow_end_callback flow_end_callback;
+    sequence_gap_callback sequence_gap_callback;
+    nDPIsrvd_ull next_distributor_seq; // expected `distributor_seq', starts at 0 for every connection
 
     struct nDPIsrvd_buffer buffer;
     struct nDPIsrvd_jsmn jsmn;
 
-    /* easy and fast JSON key/value access via hash table and a static array */
+    /*
+     * Flows are expired by a timer wheel if no event was seen for `flow_timeout' seconds.
+     * A flow is linked into the slot of its expiry time and only re-linked lazily once that slot is due,
+     * so updating `last_seen' for every event is cheap.
+     */
+    struct
+    {
+        struct nDPIsrvd_flow * slots[nDPIsrvd_FLOW_TIMER_SLOTS];
+        uint64_t now;
+        uint64_t next_tick;
+        uint64_t flow_timeout; // 0 disables the expiry
+    } flow_timer;
+
+    /*
+     * easy and fast JSON key/value access:
+     * keys from the schema map to fixed slots via a perfect hash,
+     * all others are kept in a hash table and a static array
+     */
     struct
     {
         UT_array * tokens;
         struct nDPIsrvd_json_token * token_table;
+        struct nDPIsrvd_json_token known_tokens[nDPIsrvd_KNOWN_KEYS];
+        unsigned int generation;
     } json;
 
     size_t global_user_data_size;
@@ -179,6 +258,9 @@ struct nDPIsrvd_socket
 };
 
 static inline void nDPIsrvd_free(struct nDPIsrvd_socket ** const sock);
+static inline void nDPIsrvd_cleanup_flow(struct nDPIsrvd_socket * const sock,
+                                         struct nDPIsrvd_flow * const flow,
+                                         enum nDPIsrvd_cleanup_reason reason);
 
 /* Slightly modified code: https://en.wikibooks.org/wiki/Algorithm_Implementation/Miscellaneous/Base64 */
 #define WHITESPACE 64
@@ -294,6 +376,35 @@ static inline char const * nDPIsrvd_enum_to_string(int enum_value)
     return enum_str[enum_value - FIRST_ENUM_VALUE];
 }
 
+static inline char const * nDPIsrvd_cleanup_reason_to_string(enum nDPIsrvd_cleanup_reason reason)
+{
+    static char const * const reason_str[CLEANUP_REASON_LAST_ENUM_VALUE] = {"daemon-init",
+                                                                             "daemon-shutdown",
+                                                                             "flow-end",
+                                                                             "flow-idle",
+                                                                             "flow-timeout",
+                                                                             "app-shutdown"};
+
+    if ((int)reason < (int)CLEANUP_REASON_DAEMON_INIT || reason >= CLEANUP_REASON_LAST_ENUM_VALUE)
+    {
+        return NULL;
+    }
+
+    return reason_str[reason];
+}
+
+static inline uint64_t nDPIsrvd_get_monotonic_sec(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+    {
+        return 0;
+    }
+
+    return (uint64_t)ts.tv_sec;
+}
+
 static inline int nDPIsrvd_buffer_init(struct nDPIsrvd_buffer * const buffer, size_t buffer_size)
 {
     if (buffer->ptr.raw != NULL && buffer->max != buffer_size)
@@ -319,6 +430,9 @@ static inline int nDPIsrvd_buffer_init(struct nDPIsrvd_buffer * const buffer, si
 static inline void nDPIsrvd_buffer_free(struct nDPIsrvd_buffer * const buffer)
 {
     free(buffer->ptr.raw);
+    buffer->ptr.raw = NULL;
+    buffer->used = 0;
+    buffer->max = 0;
 }
 
 static inline struct nDPIsrvd_socket * nDPIsrvd_init(size_t global_user_data_size,
@@ -356,6 +470,15 @@ static inline struct nDPIsrvd_socket * nDPIsrvd_init(size_t global_user_data_siz
         }
         utarray_reserve(sock->json.tokens, nDPIsrvd_MAX_JSON_TOKENS);
 
+        for (size_t i = 0; i < nDPIsrvd_KNOWN_KEYS; ++i)
+        {
+            sock->json.known_tokens[i].key_length = nDPIsrvd_known_key_lengths[i];
+            snprintf(sock->json.known_tokens[i].key, nDPIsrvd_JSON_KEY_STRLEN, "%s", nDPIsrvd_known_keys[i]);
+        }
+        sock->json.generation = 1;
+
+        sock->flow_timer.flow_timeout = nDPIsrvd_FLOW_TIMEOUT;
+
         sock->global_user_data_size = global_user_data_size;
     }
 
@@ -366,10 +489,19 @@ error:
     return NULL;
 }
 
+/* Reports lost events, see sequence_gap_callback. Disabled by default. */
+static inline void nDPIsrvd_set_sequence_gap_callback(struct nDPIsrvd_socket * const sock,
+                                                      sequence_gap_callback sequence_gap_cb)
+{
+    sock->sequence_gap_callback = sequence_gap_cb;
+}
+
 static inline void nDPIsrvd_free(struct nDPIsrvd_socket ** const sock)
 {
     struct nDPIsrvd_flow * current_flow;
     struct nDPIsrvd_flow * ftmp;
+    struct nDPIsrvd_instance * current_instance;
+    struct nDPIsrvd_instance * itmp;
     struct nDPIsrvd_json_token * current_json_token;
     struct nDPIsrvd_json_token * jtmp;
 
@@ -396,16 +528,19 @@ static inline void nDPIsrvd_free(struct nDPIsrvd_socket ** const sock)
     {
         HASH_ITER(hh, (*sock)->flow_table, current_flow, ftmp)
         {
-            if ((*sock)->flow_end_callback != NULL)
-            {
-                (*sock)->flow_end_callback(*sock, current_flow);
-            }
-            HASH_DEL((*sock)->flow_table, current_flow);
-            free(current_flow);
+            nDPIsrvd_cleanup_flow(*sock, current_flow, CLEANUP_REASON_APP_SHUTDOWN);
         }
         (*sock)->flow_table = NULL;
     }
 
+    HASH_ITER(hh, (*sock)->instance_table, current_instance, itmp)
+    {
+        HASH_DEL((*sock)->instance_table, current_instance);
+        free(current_instance);
+    }
+    (*sock)->instance_table = NULL;
+    (*sock)->last_instance = NULL;
+
     nDPIsrvd_buffer_free(&(*sock)->buffer);
     free(*sock);
 
@@ -486,6 +621,7 @@ static inline int nDPIsrvd_setup_address(struct nDPIsrvd_address * const address
 static inline enum nDPIsrvd_connect_return nDPIsrvd_connect(struct nDPIsrvd_socket * const sock)
 {
     sock->fd = socket(sock->address.raw.sa_family, SOCK_STREAM, 0);
+    sock->next_distributor_seq = 0;
 
     if (sock->fd < 0)
     {
@@ -541,14 +677,30 @@ static inline int jsmn_token_is_jsmn_type(struct nDPIsrvd_socket const * const s
     return sock->jsmn.tokens[current_token_index].type == type_to_check;
 }
 
+static inline struct nDPIsrvd_json_token * token_find(struct nDPIsrvd_socket const * const sock,
+                                                      char const * const key,
+                                                      size_t key_length)
+{
+    struct nDPIsrvd_json_token * token = NULL;
+    int const known_key_index = nDPIsrvd_known_key_index(key, key_length);
+
+    if (known_key_index >= 0)
+    {
+        return (struct nDPIsrvd_json_token *)&sock->json.known_tokens[known_key_index];
+    }
+
+    HASH_FIND(hh, sock->json.token_table, key, key_length, token);
+    return token;
+}
+
 static inline struct nDPIsrvd_json_token const * token_get(struct nDPIsrvd_socket const * const sock,
                                                            char const * const key,
                                                            size_t key_length)
 {
-    struct nDPIsrvd_json_token * token = NULL;
+    struct nDPIsrvd_json_token const * const token = token_find(sock, key, key_length);
 
-    HASH_FIND(hh, sock->json.token_table, key, key_length, token);
-    if (token != NULL && token->value_length > 0 && token->value != NULL)
+    if (token != NULL && token->generation == sock->json.generation && token->value_length > 0 &&
+        token->value != NULL)
     {
         return token;
     }
@@ -652,6 +804,32 @@ static inline enum nDPIsrvd_conversion_return token_key_to_ull(struct nDPIsrvd_j
     return str_value_to_ull(token->key, key);
 }
 
+static inline enum nDPIsrvd_conversion_return token_value_parse_ull(struct nDPIsrvd_json_token const * const token,
+                                                                    nDPIsrvd_ull_ptr const value)
+{
+    nDPIsrvd_ull result = 0;
+    int i;
+
+    /* plain decimal digits are the common case, everything else is left to strtoull() */
+    for (i = 0; i < token->value_length && token->value[i] >= '0' && token->value[i] <= '9'; ++i)
+    {
+        nDPIsrvd_ull const digit = token->value[i] - '0';
+
+        if (result > (ULLONG_MAX - digit) / 10)
+        {
+            return str_value_to_ull(token->value, value);
+        }
+        result = result * 10 + digit;
+    }
+    if (i == 0)
+    {
+        return str_value_to_ull(token->value, value);
+    }
+
+    *value = result;
+    return CONVERSION_OK;
+}
+
 static inline enum nDPIsrvd_conversion_return token_value_to_ull(struct nDPIsrvd_json_token const * const token,
                                                                  nDPIsrvd_ull_ptr const value)
 {
@@ -660,48 +838,144 @@ static inline enum nDPIsrvd_conversion_return token_value_to_ull(struct nDPIsrvd
         return CONVERISON_KEY_NOT_FOUND;
     }
 
-    return str_value_to_ull(token->value, value);
+    if (token->converted_generation != token->generation)
+    {
+        struct nDPIsrvd_json_token * const cached = (struct nDPIsrvd_json_token *)token;
+
+        cached->converted_return = token_value_parse_ull(token, &cached->converted_value);
+        cached->converted_generation = token->generation;
+    }
+
+    *value = token->converted_value;
+    return token->converted_return;
 }
 
-static inline int nDPIsrvd_build_flow_key(struct nDPIsrvd_flow_key * const key,
-                                          struct nDPIsrvd_json_token const * const tokens[nDPIsrvd_FLOW_KEY_TOKENS])
+static inline enum nDPIsrvd_conversion_return token_value_to_bool(struct nDPIsrvd_json_token const * const token,
+                                                                  int * const value)
 {
-    if (tokens[0] == NULL || tokens[1] == NULL || tokens[2] == NULL)
+    nDPIsrvd_ull value_as_ull = 0;
+    enum nDPIsrvd_conversion_return ret;
+
+    if (token == NULL)
     {
-        return 1;
+        return CONVERISON_KEY_NOT_FOUND;
     }
 
-    if (snprintf(key->key,
-                 nDPIsrvd_FLOW_KEY_STRLEN,
-                 "%.*s-%.*s-%.*s",
-                 tokens[0]->value_length,
-                 tokens[0]->value,
-                 tokens[1]->value_length,
-                 tokens[1]->value,
-                 tokens[2]->value_length,
-                 tokens[2]->value) <= 0)
+    if (token_value_equals(token, "true", nDPIsrvd_STRLEN_SZ("true")) != 0)
     {
-        return 1;
+        *value = 1;
+        return CONVERSION_OK;
+    }
+    if (token_value_equals(token, "false", nDPIsrvd_STRLEN_SZ("false")) != 0)
+    {
+        *value = 0;
+        return CONVERSION_OK;
     }
 
-    return 0;
+    ret = token_value_to_ull(token, &value_as_ull);
+    *value = (value_as_ull != 0);
+    return ret;
+}
+
+static inline enum nDPIsrvd_conversion_return token_get_ull(struct nDPIsrvd_socket const * const sock,
+                                                            char const * const key,
+                                                            size_t key_length,
+                                                            nDPIsrvd_ull_ptr const value)
+{
+    return token_value_to_ull(token_get(sock, key, key_length), value);
+}
+
+static inline enum nDPIsrvd_conversion_return token_get_bool(struct nDPIsrvd_socket const * const sock,
+                                                             char const * const key,
+                                                             size_t key_length,
+                                                             int * const value)
+{
+    return token_value_to_bool(token_get(sock, key, key_length), value);
+}
+
+static inline int nDPIsrvd_instance_equals(struct nDPIsrvd_instance const * const instance,
+                                           struct nDPIsrvd_json_token const * const alias,
+                                           struct nDPIsrvd_json_token const * const source)
+{
+    return instance->alias_length == alias->value_length && instance->source_length == source->value_length &&
+           memcmp(instance->key, alias->value, alias->value_length) == 0 &&
+           memcmp(instance->key + alias->value_length + 1, source->value, source->value_length) == 0;
+}
+
+/* Returns the interned instance for `alias' and `source', consecutive messages usually come from the same one. */
+static inline struct nDPIsrvd_instance * nDPIsrvd_get_instance(struct nDPIsrvd_socket * const sock,
+                                                               struct nDPIsrvd_json_token const * const alias,
+                                                               struct nDPIsrvd_json_token const * const source)
+{
+    struct nDPIsrvd_instance * instance = sock->last_instance;
+    size_t const key_length = alias->value_length + 1 + source->value_length;
+    char key_buffer[256];
+    char * key;
+
+    if (instance != NULL && nDPIsrvd_instance_equals(instance, alias, source) != 0)
+    {
+        return instance;
+    }
+
+    key = (key_length <= sizeof(key_buffer) ? key_buffer : (char *)malloc(key_length));
+    if (key == NULL)
+    {
+        return NULL;
+    }
+    memcpy(key, alias->value, alias->value_length);
+    key[alias->value_length] = '\0';
+    memcpy(key + alias->value_length + 1, source->value, source->value_length);
+
+    HASH_FIND(hh, sock->instance_table, key, key_length, instance);
+    if (instance == NULL)
+    {
+        instance = (struct nDPIsrvd_instance *)malloc(sizeof(*instance) + key_length);
+        if (instance != NULL)
+        {
+            instance->instance_id = sock->next_instance_id++;
+            memset(instance->next_thread_seq, 0, sizeof(instance->next_thread_seq));
+            instance->alias_length = alias->value_length;
+            instance->source_length = source->value_length;
+            memcpy(instance->key, key, key_length);
+            HASH_ADD_KEYPTR(hh, sock->instance_table, instance->key, key_length, instance);
+        }
+    }
+    if (key != key_buffer)
+    {
+        free(key);
+    }
+
+    sock->last_instance = instance;
+    return instance;
 }
 
+/*
+ * A `flow_id' is unique only within a nDPId instance, therefore the key also contains the interned `alias' and
+ * `source'. nDPId leases flow ids per reader thread in blocks, so ids of different threads are not ordered:
+ * A flow with a smaller id may be announced after a flow with a bigger id. Within a thread
+ * (same `thread_id'), ids are strictly increasing until the 32 bit `flow_id' wraps around.
+ */
 static inline struct nDPIsrvd_flow * nDPIsrvd_get_flow(struct nDPIsrvd_socket * const sock,
                                                        struct nDPIsrvd_json_token const * const flow_id)
 {
-    struct nDPIsrvd_json_token const * const tokens[nDPIsrvd_FLOW_KEY_TOKENS] = {
-        flow_id,
-        TOKEN_GET_SZ(sock, "alias"),
-        TOKEN_GET_SZ(sock, "source"),
-    };
-    struct nDPIsrvd_flow_key key = {};
+    struct nDPIsrvd_json_token const * const alias = TOKEN_GET_SZ(sock, "alias");
+    struct nDPIsrvd_json_token const * const source = TOKEN_GET_SZ(sock, "source");
+    struct nDPIsrvd_instance * instance;
+    nDPIsrvd_ull flow_id_as_ull;
+    nDPIsrvd_ull thread_id = 0;
 
-    if (nDPIsrvd_build_flow_key(&key, tokens) != 0)
+    if (alias == NULL || source == NULL || TOKEN_VALUE_TO_ULL(flow_id, &flow_id_as_ull) != CONVERSION_OK)
     {
         return NULL;
     }
 
+    instance = nDPIsrvd_get_instance(sock, alias, source);
+    if (instance == NULL)
+    {
+        return NULL;
+    }
+
+    struct nDPIsrvd_flow_key const key = {.flow_id = flow_id_as_ull, .instance_id = instance->instance_id};
     struct nDPIsrvd_flow * flow = NULL;
     HASH_FIND(hh, sock->flow_table, &key, sizeof(key), flow);
 
@@ -713,14 +987,78 @@ static inline struct nDPIsrvd_flow * nDPIsrvd_get_flow(struct nDPIsrvd_socket *
             return NULL;
         }
 
-        TOKEN_VALUE_TO_ULL(tokens[0], &flow->id_as_ull);
-        memcpy(flow->flow_key.key, key.key, nDPIsrvd_FLOW_KEY_STRLEN);
+        TOKEN_GET_ULL_SZ(sock, "thread_id", &thread_id);
+        flow->id_as_ull = flow_id_as_ull;
+        flow->instance = instance;
+        flow->thread_id = thread_id;
+        flow->flow_key = key;
         HASH_ADD(hh, sock->flow_table, flow_key, sizeof(flow->flow_key), flow);
+
+        flow->timer_slot = (sock->flow_timer.now + sock->flow_timer.flow_timeout) & (nDPIsrvd_FLOW_TIMER_SLOTS - 1);
+        DL_APPEND2(sock->flow_timer.slots[flow->timer_slot], flow, timer_prev, timer_next);
     }
+    flow->last_seen = sock->flow_timer.now;
 
     return flow;
 }
 
+static inline void nDPIsrvd_cleanup_flow(struct nDPIsrvd_socket * const sock,
+                                         struct nDPIsrvd_flow * const flow,
+                                         enum nDPIsrvd_cleanup_reason reason)
+{
+    if (sock->flow_end_callback != NULL)
+    {
+        sock->flow_end_callback(sock, flow, reason);
+    }
+    DL_DELETE2(sock->flow_timer.slots[flow->timer_slot], flow, timer_prev, timer_next);
+    HASH_DEL(sock->flow_table, flow);
+    free(flow);
+}
+
+/*
+ * Removes all flows without any event for `flow_timeout' seconds, e.g. because their `idle'/`end' event was lost
+ * while nDPId reconnected to the collector. Called by nDPIsrvd_parse_all(), but may be called periodically by
+ * consumers which do not receive events for a while. Every second elapsed since the last call visits one slot.
+ */
+static inline void nDPIsrvd_expire_flows(struct nDPIsrvd_socket * const sock, uint64_t now)
+{
+    uint64_t const flow_timeout = sock->flow_timer.flow_timeout;
+
+    sock->flow_timer.now = now;
+    if (flow_timeout == 0)
+    {
+        return;
+    }
+
+    if (sock->flow_timer.next_tick + nDPIsrvd_FLOW_TIMER_SLOTS < now)
+    {
+        sock->flow_timer.next_tick = now - nDPIsrvd_FLOW_TIMER_SLOTS;
+    }
+
+    for (; sock->flow_timer.next_tick <= now; ++sock->flow_timer.next_tick)
+    {
+        unsigned int const slot = sock->flow_timer.next_tick & (nDPIsrvd_FLOW_TIMER_SLOTS - 1);
+        struct nDPIsrvd_flow * current_flow;
+        struct nDPIsrvd_flow * ftmp;
+
+        DL_FOREACH_SAFE2(sock->flow_timer.slots[slot], current_flow, ftmp, timer_next)
+        {
+            uint64_t const expiry = current_flow->last_seen + flow_timeout;
+
+            if (expiry <= now)
+            {
+                nDPIsrvd_cleanup_flow(sock, current_flow, CLEANUP_REASON_FLOW_TIMEOUT);
+            }
+            else if ((expiry & (nDPIsrvd_FLOW_TIMER_SLOTS - 1)) != slot)
+            {
+                DL_DELETE2(sock->flow_timer.slots[slot], current_flow, timer_prev, timer_next);
+                current_flow->timer_slot = expiry & (nDPIsrvd_FLOW_TIMER_SLOTS - 1);
+                DL_APPEND2(sock->flow_timer.slots[current_flow->timer_slot], current_flow, timer_prev, timer_next);
+            }
+        }
+    }
+}
+
 static inline int nDPIsrvd_check_flow_end(struct nDPIsrvd_socket * const sock,
                                           struct nDPIsrvd_flow * const current_flow)
 {
@@ -731,16 +1069,124 @@ static inline int nDPIsrvd_check_flow_end(struct nDPIsrvd_socket * const sock,
 
     struct nDPIsrvd_json_token const * const flow_event_name = TOKEN_GET_SZ(sock, "flow_event_name");
 
-    if (TOKEN_VALUE_EQUALS_SZ(flow_event_name, "idle") != 0 || TOKEN_VALUE_EQUALS_SZ(flow_event_name, "end") != 0)
+    if (TOKEN_VALUE_EQUALS_SZ(flow_event_name, "idle") != 0)
     {
-        if (sock->flow_end_callback != NULL)
+        nDPIsrvd_cleanup_flow(sock, current_flow, CLEANUP_REASON_FLOW_IDLE);
+    }
+    else if (TOKEN_VALUE_EQUALS_SZ(flow_event_name, "end") != 0)
+    {
+        nDPIsrvd_cleanup_flow(sock, current_flow, CLEANUP_REASON_FLOW_END);
+    }
+
+    return 0;
+}
+
+/*
+ * A (re)started or stopped nDPId reader thread does not send any more events for flows it announced before,
+ * remove them all. Every reader thread sends its own `init' and `shutdown' event. On a `reconnect' the instance
+ * still knows its flows, lost `idle'/`end' events are handled by nDPIsrvd_expire_flows().
+ */
+static inline int nDPIsrvd_check_daemon_event(struct nDPIsrvd_socket * const sock)
+{
+    struct nDPIsrvd_json_token const * const daemon_event_name = TOKEN_GET_SZ(sock, "daemon_event_name");
+    struct nDPIsrvd_json_token const * alias;
+    struct nDPIsrvd_json_token const * source;
+    struct nDPIsrvd_instance * instance;
+    struct nDPIsrvd_flow * current_flow;
+    struct nDPIsrvd_flow * ftmp;
+    enum nDPIsrvd_cleanup_reason reason;
+    nDPIsrvd_ull thread_id;
+
+    if (TOKEN_VALUE_EQUALS_SZ(daemon_event_name, "init") != 0)
+    {
+        reason = CLEANUP_REASON_DAEMON_INIT;
+    }
+    else if (TOKEN_VALUE_EQUALS_SZ(daemon_event_name, "shutdown") != 0)
+    {
+        reason = CLEANUP_REASON_DAEMON_SHUTDOWN;
+    }
+    else
+    {
+        return 0;
+    }
+
+    alias = TOKEN_GET_SZ(sock, "alias");
+    source = TOKEN_GET_SZ(sock, "source");
+    if (alias == NULL || source == NULL)
+    {
+        return 0;
+    }
+
+    instance = nDPIsrvd_get_instance(sock, alias, source);
+    if (instance == NULL || TOKEN_GET_ULL_SZ(sock, "thread_id", &thread_id) != CONVERSION_OK)
+    {
+        return 1;
+    }
+
+    HASH_ITER(hh, sock->flow_table, current_flow, ftmp)
+    {
+        if (current_flow->instance == instance && current_flow->thread_id == thread_id)
+        {
+            nDPIsrvd_cleanup_flow(sock, current_flow, reason);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * nDPIsrvd numbers the events per distributor connection (`distributor_seq'), nDPId per reader thread (`thread_seq').
+ * A sequence number bigger than the expected one means lost events. A smaller one is not reported, the connection
+ * or the reader thread was restarted. The first `thread_seq' of a reader thread is accepted as it is,
+ * a consumer may connect at any time.
+ */
+static inline int nDPIsrvd_check_sequence(struct nDPIsrvd_socket * const sock)
+{
+    struct nDPIsrvd_json_token const * alias;
+    struct nDPIsrvd_json_token const * source;
+    struct nDPIsrvd_instance * instance;
+    nDPIsrvd_ull thread_id;
+    nDPIsrvd_ull seq;
+
+    if (sock->sequence_gap_callback == NULL)
+    {
+        return 0;
+    }
+
+    if (TOKEN_GET_ULL_SZ(sock, "distributor_seq", &seq) == CONVERSION_OK)
+    {
+        if (seq > sock->next_distributor_seq)
         {
-            sock->flow_end_callback(sock, current_flow);
+            sock->sequence_gap_callback(sock, NULL, 0, sock->next_distributor_seq, seq);
         }
-        HASH_DEL(sock->flow_table, current_flow);
-        free(current_flow);
+        sock->next_distributor_seq = seq + 1;
     }
 
+    if (TOKEN_GET_ULL_SZ(sock, "thread_seq", &seq) != CONVERSION_OK ||
+        TOKEN_GET_ULL_SZ(sock, "thread_id", &thread_id) != CONVERSION_OK || thread_id >= nDPId_MAX_READER_THREADS)
+    {
+        return 0;
+    }
+
+    alias = TOKEN_GET_SZ(sock, "alias");
+    source = TOKEN_GET_SZ(sock, "source");
+    if (alias == NULL || source == NULL)
+    {
+        return 0;
+    }
+
+    instance = nDPIsrvd_get_instance(sock, alias, source);
+    if (instance == NULL)
+    {
+        return 1;
+    }
+
+    if (instance->next_thread_seq[thread_id] != 0 && seq > instance->next_thread_seq[thread_id])
+    {
+        sock->sequence_gap_callback(sock, instance, thread_id, instance->next_thread_seq[thread_id], seq);
+    }
+    instance->next_thread_seq[thread_id] = seq + 1;
+
     return 0;
 }
 
@@ -808,6 +1254,8 @@ static inline enum nDPIsrvd_parse_return nDPIsrvd_parse_all(struct nDPIsrvd_sock
 {
     enum nDPIsrvd_parse_return ret;
 
+    nDPIsrvd_expire_flows(sock, nDPIsrvd_get_monotonic_sec());
+
     while ((ret = nDPIsrvd_parse_line(&sock->buffer, &sock->jsmn)) == PARSE_OK)
     {
         char const * key = NULL;
@@ -833,20 +1281,22 @@ static inline enum nDPIsrvd_parse_return nDPIsrvd_parse_all(struct nDPIsrvd_sock
             }
             else
             {
-                struct nDPIsrvd_json_token * token = NULL;
-                HASH_FIND(hh, sock->json.token_table, key, (size_t)key_length, token);
+                struct nDPIsrvd_json_token * const token = token_find(sock, key, (size_t)key_length);
 
                 if (token != NULL)
                 {
                     token->value = jsmn_token_get(sock, current_token);
                     token->value_length = jsmn_token_size(sock, current_token);
+                    token->token_index = current_token - 1;
+                    token->generation = sock->json.generation;
                 }
                 else
                 {
                     struct nDPIsrvd_json_token jt = {.value = jsmn_token_get(sock, current_token),
                                                      .value_length = jsmn_token_size(sock, current_token),
                                                      .hh = {},
-                                                     .token_index = current_token - 1};
+                                                     .token_index = current_token - 1,
+                                                     .generation = sock->json.generation};
 
                     if (key == NULL || key_length > nDPIsrvd_JSON_KEY_STRLEN ||
                         utarray_len(sock->json.tokens) == nDPIsrvd_MAX_JSON_TOKENS)
@@ -868,6 +1318,11 @@ static inline enum nDPIsrvd_parse_return nDPIsrvd_parse_all(struct nDPIsrvd_sock
             }
         }
 
+        if (ret == PARSE_OK && nDPIsrvd_check_sequence(sock) != 0)
+        {
+            ret = PARSE_FLOW_MGMT_ERROR;
+        }
+
         struct nDPIsrvd_json_token const * const flow_id = TOKEN_GET_SZ(sock, "flow_id");
         struct nDPIsrvd_flow * flow = NULL;
         if (flow_id != NULL)
@@ -886,17 +1341,29 @@ static inline enum nDPIsrvd_parse_return nDPIsrvd_parse_all(struct nDPIsrvd_sock
         {
             ret = PARSE_FLOW_MGMT_ERROR;
         }
+        if (flow_id == NULL && nDPIsrvd_check_daemon_event(sock) != 0)
+        {
+            ret = PARSE_FLOW_MGMT_ERROR;
+        }
 
         sock->jsmn.tokens_found = 0;
+        /* Invalidates all token values at once, only a wrap around requires resetting them. */
+        if (++sock->json.generation == 0)
         {
             struct nDPIsrvd_json_token * current_token = NULL;
             struct nDPIsrvd_json_token * jtmp = NULL;
 
+            for (size_t i = 0; i < nDPIsrvd_KNOWN_KEYS; ++i)
+            {
+                sock->json.known_tokens[i].generation = 0;
+                sock->json.known_tokens[i].converted_generation = 0;
+            }
             HASH_ITER(hh, sock->json.token_table, current_token, jtmp)
             {
-                current_token->value = NULL;
-                current_token->value_length = 0;
+                current_token->generation = 0;
+                current_token->converted_generation = 0;
             }
+            sock->json.generation = 1;
         }
 
         nDPIsrvd_drain_buffer(&sock->buffer);
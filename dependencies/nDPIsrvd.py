@@ -4,8 +4,9 @@ import argparse
 import array
 import base64
 import json
-import re
+import multiprocessing
 import os
+import re
 import stat
 import socket
 import sys
@@ -17,6 +18,12 @@ except ImportError:
     sys.stderr.write('Python module colorama not found, using fallback.\n')
     USE_COLORAMA=False
 
+try:
+    import orjson
+    USE_ORJSON=True
+except ImportError:
+    USE_ORJSON=False
+
 try:
     import scapy.all
 except ImportError:
@@ -27,11 +34,19 @@ DEFAULT_PORT = 7000
 DEFAULT_UNIX = '/tmp/ndpid-distributor.sock'
 
 NETWORK_BUFFER_MIN_SIZE = 6 # NETWORK_BUFFER_LENGTH_DIGITS + 1
-NETWORK_BUFFER_MAX_SIZE = 12288 # Please keep this value in sync with the one in config.h
+NETWORK_BUFFER_MAX_SIZE = 12328 # Please keep this value in sync with the one in config.h
 
 PKT_TYPE_ETH_IP4 = 0x0800
 PKT_TYPE_ETH_IP6 = 0x86DD
 
+FLOW_ID_REGEX = re.compile(rb'"flow_id":(\d+)')
+# nDPIsrvd prepends the `distributor_seq', the other keys are searched independently of their order
+DISTRIBUTOR_SEQ_REGEX = re.compile(rb'\{"distributor_seq":(\d+)')
+THREAD_ID_REGEX = re.compile(rb'"thread_id":(\d+)')
+THREAD_SEQ_REGEX = re.compile(rb'"thread_seq":(\d+)')
+SOURCE_REGEX = re.compile(rb'"source":"((?:[^"\\]|\\.)*)"')
+ALIAS_REGEX = re.compile(rb'"alias":"((?:[^"\\]|\\.)*)"')
+
 
 class TermColor:
     HINT = '\033[33m'
@@ -159,10 +174,53 @@ class CallbackReturnedFalse(nDPIsrvdException):
     def __str__(self):
         return 'Callback returned False, abort.'
 
+class SequenceTracker:
+    """
+    Detects lost events by gaps in the `distributor_seq' (per connection) and the `thread_seq'
+    (per nDPId instance and reader thread), see README.md.
+    A smaller sequence number than the expected one is not reported, the connection or the reader thread was restarted.
+    Calls gap_callback(alias, source, thread_id, expected_seq, received_seq) before the event is parsed,
+    alias, source and thread_id are None if nDPIsrvd dropped events.
+    """
+    def __init__(self, gap_callback):
+        self.gap_callback = gap_callback
+        self.next_distributor_seq = 0
+        self.next_thread_seq = dict()
+
+    def check(self, json_line):
+        distributor_seq = DISTRIBUTOR_SEQ_REGEX.match(json_line)
+        if distributor_seq is not None:
+            seq = int(distributor_seq.group(1))
+            if seq > self.next_distributor_seq:
+                self.gap_callback(None, None, None, self.next_distributor_seq, seq)
+            self.next_distributor_seq = seq + 1
+
+        thread_seq = THREAD_SEQ_REGEX.search(json_line)
+        if thread_seq is None:
+            return
+        thread_id = THREAD_ID_REGEX.search(json_line)
+        source = SOURCE_REGEX.search(json_line)
+        alias = ALIAS_REGEX.search(json_line)
+        if thread_id is None or source is None or alias is None:
+            return
+
+        seq = int(thread_seq.group(1))
+        key = (alias.group(1), source.group(1), int(thread_id.group(1)))
+        if key in self.next_thread_seq and seq > self.next_thread_seq[key]:
+            self.gap_callback(key[0].decode('utf-8'), key[1].decode('utf-8'), key[2], self.next_thread_seq[key], seq)
+        self.next_thread_seq[key] = seq + 1
+
+def jsonLoads(json_line):
+    if USE_ORJSON is True:
+        return orjson.loads(json_line)
+    return json.loads(json_line, strict=True)
+
 class nDPIsrvdSocket:
-    def __init__(self):
+    def __init__(self, sequence_gap_callback=None):
         self.sock_family = None
         self.flow_mgr = FlowManager()
+        self.sequence_gap_callback = sequence_gap_callback
+        self.seq_tracker = None
 
     def connect(self, addr):
         if type(addr) is tuple:
@@ -174,46 +232,56 @@ class nDPIsrvdSocket:
 
         self.sock = socket.socket(self.sock_family, socket.SOCK_STREAM)
         self.sock.connect(addr)
-        self.buffer = bytes()
-        self.msglen = 0
-        self.digitlen = 0
+        # Received data is written into a fixed buffer with recv_into() and framed in place,
+        # only complete JSON lines are copied out of it.
+        self.buffer = bytearray(NETWORK_BUFFER_MAX_SIZE)
+        self.buffer_view = memoryview(self.buffer)
+        self.buffer_start = 0
+        self.buffer_used = 0
         self.lines = []
+        if self.sequence_gap_callback is not None:
+            self.seq_tracker = SequenceTracker(self.sequence_gap_callback)
 
     def receive(self):
-        if len(self.buffer) == NETWORK_BUFFER_MAX_SIZE:
-            raise BufferCapacityReached(len(self.buffer), NETWORK_BUFFER_MAX_SIZE)
+        if self.buffer_start > 0:
+            # Move an incomplete message to the front, at most once per received chunk.
+            pending = self.buffer_used - self.buffer_start
+            self.buffer_view[:pending] = self.buffer_view[self.buffer_start:self.buffer_used]
+            self.buffer_start = 0
+            self.buffer_used = pending
+
+        if self.buffer_used == NETWORK_BUFFER_MAX_SIZE:
+            raise BufferCapacityReached(self.buffer_used, NETWORK_BUFFER_MAX_SIZE)
 
         connection_finished = False
         try:
-            recvd = self.sock.recv(NETWORK_BUFFER_MAX_SIZE - len(self.buffer))
+            recvd = self.sock.recv_into(self.buffer_view[self.buffer_used:])
         except ConnectionResetError:
             connection_finished = True
-            recvd = bytes()
-        if len(recvd) == 0:
+            recvd = 0
+        if recvd == 0:
             connection_finished = True
 
-        self.buffer += recvd
+        self.buffer_used += recvd
 
         new_data_avail = False
-        while self.msglen + self.digitlen <= len(self.buffer):
-
-            if self.msglen == 0:
-                starts_with_digits = re.match(r'(^\d+){', self.buffer[:NETWORK_BUFFER_MIN_SIZE].decode(errors='strict'))
-                if starts_with_digits is None:
-                    if len(self.buffer) < NETWORK_BUFFER_MIN_SIZE:
-                        break
-                    raise InvalidLineReceived(self.buffer)
-                self.msglen = int(starts_with_digits.group(1))
-                self.digitlen = len(starts_with_digits.group(1))
-
-            if len(self.buffer) >= self.msglen + self.digitlen:
-                recvd = self.buffer[self.digitlen:self.msglen + self.digitlen]
-                self.buffer = self.buffer[self.msglen + self.digitlen:]
-                self.lines += [(recvd,self.msglen,self.digitlen)]
-                new_data_avail = True
-
-                self.msglen = 0
-                self.digitlen = 0
+        while self.buffer_used - self.buffer_start >= NETWORK_BUFFER_MIN_SIZE:
+            json_start = self.buffer.find(b'{', self.buffer_start, self.buffer_start + NETWORK_BUFFER_MIN_SIZE)
+            digits = self.buffer[self.buffer_start:json_start]
+            if json_start < 0 or digits.isdigit() is False:
+                raise InvalidLineReceived(bytes(self.buffer_view[self.buffer_start:self.buffer_used]))
+
+            json_end = json_start + int(digits)
+            if json_end > self.buffer_used:
+                break
+
+            self.lines.append(bytes(self.buffer_view[json_start:json_end]))
+            self.buffer_start = json_end
+            new_data_avail = True
+
+        if self.buffer_start == self.buffer_used:
+            self.buffer_start = 0
+            self.buffer_used = 0
 
         if connection_finished is True:
             raise SocketConnectionBroken()
@@ -224,7 +292,9 @@ class nDPIsrvdSocket:
         retval = True
         index = 0
         for received_json_line in self.lines:
-            json_dict = json.loads(received_json_line[0].decode('ascii', errors='replace'), strict=True)
+            if self.seq_tracker is not None:
+                self.seq_tracker.check(received_json_line)
+            json_dict = jsonLoads(received_json_line)
             if callback(json_dict, self.flow_mgr.getFlow(json_dict), global_user_data) is not True:
                 retval = False
                 break
@@ -250,6 +320,79 @@ class nDPIsrvdSocket:
             if throw_ex is not None:
                 raise throw_ex
 
+    def loopSharded(self, callback, global_user_data, worker_count=os.cpu_count()):
+        """
+        Like loop(), but the callback runs in worker_count processes, each with its own FlowManager.
+        This process only frames the received lines and dispatches them by flow id, so all events of a flow
+        are handled by the same worker. Lines without a flow id (e.g. daemon and error events) are handled by
+        all workers, so every FlowManager sees the init/reconnect/shutdown events of all instances.
+        Every worker gets its own copy of global_user_data. Sequence gaps are reported by this process.
+        """
+        workers = []
+        writers = []
+        for worker_index in range(worker_count):
+            reader, writer = multiprocessing.Pipe(duplex=False)
+            writers += [writer]
+            worker = multiprocessing.Process(target=nDPIsrvdShardWorker,
+                                             args=(reader, writers, callback, global_user_data))
+            worker.start()
+            reader.close()
+            workers += [worker]
+
+        throw_ex = None
+        try:
+            while throw_ex is None:
+                try:
+                    self.receive()
+                except Exception as err:
+                    throw_ex = err
+
+                batches = [[] for _ in range(worker_count)]
+                for received_json_line in self.lines:
+                    if self.seq_tracker is not None:
+                        self.seq_tracker.check(received_json_line)
+                    shard = nDPIsrvdSocket.getShard(received_json_line, worker_count)
+                    if shard is None:
+                        for batch in batches:
+                            batch += [received_json_line]
+                    else:
+                        batches[shard] += [received_json_line]
+                self.lines = []
+
+                for worker_index in range(worker_count):
+                    if len(batches[worker_index]) > 0:
+                        writers[worker_index].send(batches[worker_index])
+        except BrokenPipeError:
+            throw_ex = CallbackReturnedFalse()
+        finally:
+            for writer in writers:
+                writer.close()
+            for worker in workers:
+                worker.join()
+
+        raise throw_ex
+
+    @staticmethod
+    def getShard(json_line, shard_count):
+        flow_id = FLOW_ID_REGEX.search(json_line)
+        if flow_id is None:
+            return None
+        return int(flow_id.group(1)) % shard_count
+
+def nDPIsrvdShardWorker(reader, writers, callback, global_user_data):
+    for writer in writers:
+        writer.close()
+
+    flow_mgr = FlowManager()
+    try:
+        while True:
+            for received_json_line in reader.recv():
+                json_dict = jsonLoads(received_json_line)
+                if callback(json_dict, flow_mgr.getFlow(json_dict), global_user_data) is not True:
+                    return
+    except (EOFError, KeyboardInterrupt):
+        pass
+
 class PcapPacket:
     def __init__(self):
         self.pktdump = None
@@ -390,7 +533,8 @@ def validateAddress(args):
     return address
 
 global schema
-schema = {'packet_event_schema' : None, 'basic_event_schema' : None, 'daemon_event_schema' : None, 'flow_event_schema' : None}
+schema = {'packet_event_schema' : None, 'basic_event_schema' : None, 'daemon_event_schema' : None, 'flow_event_schema' : None,
+          'srvd_event_schema' : None}
 
 def initSchemaValidator(schema_dir='./schema'):
     for key in schema:
@@ -412,5 +556,8 @@ def validateAgainstSchema(json_dict):
     if 'flow_event_id' in json_dict:
         jsonschema.validate(instance=json_dict, schema=schema['flow_event_schema'])
         return True
+    if 'srvd_event_id' in json_dict:
+        jsonschema.validate(instance=json_dict, schema=schema['srvd_event_schema'])
+        return True
 
     return False
@@ -0,0 +1,229 @@
+/* Generated by scripts/gen-nDPIsrvd-keys.py from the files in schema/, do not edit. */
+#ifndef NDPISRVD_KEYS_H
+#define NDPISRVD_KEYS_H 1
+
+#include <stdint.h>
+#include <string.h>
+
+#define nDPIsrvd_KNOWN_KEYS 127
+#define nDPIsrvd_KNOWN_KEY_SLOTS 2048
+#define nDPIsrvd_KNOWN_KEY_SEED 0x811c9dcfu
+
+static char const * const nDPIsrvd_known_keys[nDPIsrvd_KNOWN_KEYS] = {
+    "alias",
+    "basic_event_id",
+    "basic_event_name",
+    "bittorrent",
+    "blocked-usec",
+    "bytes-dropped",
+    "bytes-pending",
+    "bytes-queued",
+    "bytes-sent",
+    "caplen",
+    "collectors-paused-usec",
+    "current_active",
+    "current_idle",
+    "daemon_event_id",
+    "daemon_event_name",
+    "datalink",
+    "dhcp",
+    "distributor_id",
+    "distributor_seq",
+    "dns",
+    "dpi-usec",
+    "dst_ip",
+    "dst_port",
+    "events-dropped",
+    "events-emitted",
+    "events-queued",
+    "events-sent",
+    "expected",
+    "flow-lookup-max-probes",
+    "flow-lookup-probes",
+    "flow-lookups",
+    "flow-table-buckets",
+    "flow-table-buckets-used",
+    "flow-table-load-factor",
+    "flow_avg_l4_payload_len",
+    "flow_datalink",
+    "flow_event_id",
+    "flow_event_name",
+    "flow_first_seen",
+    "flow_id",
+    "flow_last_seen",
+    "flow_max_l4_payload_len",
+    "flow_max_packets",
+    "flow_min_l4_payload_len",
+    "flow_packet_id",
+    "flow_tot_l4_payload_len",
+    "flows-active",
+    "flows-detected",
+    "flows-idle",
+    "flows-idle-total",
+    "flows-skipped",
+    "flows-total",
+    "ftp",
+    "generic-max-idle-time",
+    "header",
+    "header_len",
+    "http",
+    "icmp-max-idle-time",
+    "idle-scan-period",
+    "imap",
+    "init-custom-files-usec",
+    "init-flow-tables-usec",
+    "init-lock-wait-usec",
+    "init-ndpi-finalize-usec",
+    "init-ndpi-usec",
+    "init-pcap-usec",
+    "init-total-usec",
+    "init-workflow-usec",
+    "ip_size",
+    "kerberos",
+    "l3_proto",
+    "l4_data_len",
+    "l4_proto",
+    "len",
+    "max-blocked-usec",
+    "max-bytes-pending",
+    "max-flows-per-thread",
+    "max-idle-flows-per-thread",
+    "max-packets-per-flow-to-process",
+    "max-packets-per-flow-to-send",
+    "max_active",
+    "mdns",
+    "midstream",
+    "ndpi",
+    "packet_event_id",
+    "packet_event_name",
+    "packet_id",
+    "packets-captured",
+    "packets-processed",
+    "pcap-packets-dropped",
+    "pcap-packets-if-dropped",
+    "pcap-packets-received",
+    "peer",
+    "pkt",
+    "pkt_caplen",
+    "pkt_l3_offset",
+    "pkt_l4_len",
+    "pkt_l4_offset",
+    "pkt_len",
+    "pkt_oversize",
+    "pkt_ts_sec",
+    "pkt_ts_usec",
+    "pkt_type",
+    "pop",
+    "protocol",
+    "quic",
+    "reader-thread-count",
+    "send-usec",
+    "serialize-usec",
+    "size",
+    "smtp",
+    "source",
+    "src_ip",
+    "src_port",
+    "srvd_event_id",
+    "srvd_event_name",
+    "ssh",
+    "tcp-max-idle-time",
+    "tcp-max-post-end-flow-time",
+    "telnet",
+    "thread_id",
+    "thread_seq",
+    "tick-resolution",
+    "tls",
+    "type",
+    "ubntac2",
+    "udp-max-idle-time",
+};
+
+static uint8_t const nDPIsrvd_known_key_lengths[nDPIsrvd_KNOWN_KEYS] = {
+    5, 14, 16, 10, 12, 13, 13, 12, 10, 6, 22, 14, 12, 15, 17, 8, 4, 14, 15, 3, 8, 6, 8, 14, 14, 13, 11, 8, 22, 18, 12,
+    18, 23, 22, 23, 13, 13, 15, 15, 7, 14, 23, 16, 23, 14, 23, 12, 14, 10, 16, 13, 11, 3, 21, 6, 10, 4, 18, 16, 4, 22,
+    21, 19, 23, 14, 14, 15, 18, 7, 8, 8, 11, 8, 3, 16, 17, 20, 25, 31, 28, 10, 4, 9, 4, 15, 17, 9, 16, 17, 20, 23, 21,
+    4, 3, 10, 13, 10, 13, 7, 12, 10, 11, 8, 3, 8, 4, 19, 9, 14, 4, 4, 6, 6, 8, 13, 15, 3, 17, 26, 6, 9, 10, 15, 3, 4, 7,
+    17,
+};
+
+/* key index + 1, 0 marks an empty slot */
+static uint8_t const nDPIsrvd_known_key_slots[nDPIsrvd_KNOWN_KEY_SLOTS] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 112, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 113, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 116, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 119, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 21, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 58, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 77, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 104, 0, 0, 0, 0, 0, 18, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    95, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 82, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 97, 0, 0, 56, 123, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 49, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 43, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 5, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 14, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 33, 11, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 35, 0, 0, 0, 0, 0, 0, 0, 0, 115, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 15, 125, 0, 0, 0, 0, 60, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 127, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 98, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 31, 0, 0, 2,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 29, 0, 0, 0, 0, 50, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 106,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 89, 0, 0, 0, 0, 0, 0, 0, 0, 110, 0, 0, 0, 0, 0, 0, 0, 74, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 26, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 87, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 92, 0, 34, 0,
+    0, 0, 0, 0, 0, 86, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 63, 0, 0, 0, 20, 25, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 32, 0, 0, 0, 68, 0, 0, 0, 0, 0, 109, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 44, 0, 0, 0,
+    0, 0, 0, 0, 0, 47, 0, 0, 85, 0, 0, 0, 17, 0, 0, 0, 0, 0, 0, 103, 0, 0, 0, 0, 61, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 37, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 69, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 91, 0, 0, 0, 0, 0, 0, 0, 0, 9, 0, 0, 70, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 78, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 96, 0, 0, 0, 0, 0, 73, 0, 0, 0, 0, 83, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 41, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 81, 0, 72, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 118, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 114, 0, 0, 0, 0, 19, 0, 0, 52, 0, 0, 0, 0, 108, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 90, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 39, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 121, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 16, 0, 51, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 46, 0, 0, 100, 75, 0,
+    53, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 36, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 88, 0, 0, 7,
+    0, 0, 0, 0, 0, 0, 102, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 55, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 23, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 57, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 42, 0, 0, 0, 0, 0, 0, 40, 0, 0, 0, 0, 0, 0,
+    0, 67, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 13, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 80, 0, 0, 0, 0, 0, 107, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    38, 66, 0, 0, 0, 28, 0, 0, 0, 0, 65, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 71, 0, 0, 0, 0, 0, 62, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 10,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 12, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 54, 0, 0, 0, 0, 0, 0, 0, 3, 0, 0, 0,
+    22, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 48, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 30, 0, 99,
+    0, 0, 64, 0, 0, 0, 0, 0, 27, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 6, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 117, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 122, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 84, 0, 8, 0, 0, 0, 0, 0, 0, 105, 124, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 76, 0, 59, 0, 0, 126, 0, 0, 120, 0, 0, 0, 0, 0, 0, 0, 0, 101, 0, 0, 111, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 79, 0, 45, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 93, 0, 0, 94, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 4,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 24, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+static inline int nDPIsrvd_known_key_index(char const * const key, size_t key_length)
+{
+    uint32_t hash = nDPIsrvd_KNOWN_KEY_SEED;
+
+    for (size_t i = 0; i < key_length; ++i)
+    {
+        hash ^= (uint8_t)key[i];
+        hash *= 16777619u;
+    }
+
+    int const index = nDPIsrvd_known_key_slots[hash & (nDPIsrvd_KNOWN_KEY_SLOTS - 1)] - 1;
+    if (index < 0 || nDPIsrvd_known_key_lengths[index] != key_length ||
+        memcmp(nDPIsrvd_known_keys[index], key, key_length) != 0)
+    {
+        return -1;
+    }
+
+    return index;
+}
+
+#endif
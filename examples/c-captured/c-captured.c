@@ -1,5 +1,9 @@
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
+#ifdef ENABLE_LIBURING
+#include <liburing.h>
+#endif
 #include <linux/limits.h>
 #include <ndpi_api.h>
 #include <ndpi_typedefs.h>
@@ -7,6 +11,7 @@
 #include <netinet/tcp.h>
 #include <netinet/udp.h>
 #include <pcap/pcap.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,26 +20,28 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "nDPIsrvd.h"
-#include "utarray.h"
+#include "utlist.h"
 #include "utils.h"
 
 //#define VERBOSE
 #define DEFAULT_DATADIR "/tmp/nDPId-captured"
-
-struct packet_data
+#define MAX_OPEN_PCAP_FILES 64
+#define MAX_PCAP_FILE_IOVECS 64
+#define MAX_PENDING_WRITE_SIZE (64u * 1024u * 1024u)
+#define DEFAULT_MEMORY_BUDGET (32u * 1024u * 1024u)
+#define DEFAULT_MAX_FLOW_SIZE (1024u * 1024u)
+#define PCAP_RECORD_HEADER_SIZE (4 * sizeof(uint32_t))
+
+/* Records of a flow written to the spill file, see spill_flow_packets(). */
+struct spill_extent
 {
-    nDPIsrvd_ull packet_ts_sec;
-    nDPIsrvd_ull packet_ts_usec;
-    nDPIsrvd_ull packet_len;
-    int base64_packet_size;
-    union {
-        char * base64_packet;
-        char const * base64_packet_const;
-    };
+    off_t offset;
+    size_t length;
 };
 
 struct flow_user_data
@@ -48,12 +55,91 @@ struct flow_user_data
     nDPIsrvd_ull flow_datalink;
     nDPIsrvd_ull flow_max_packets;
     nDPIsrvd_ull flow_tot_l4_payload_len;
-    UT_array * packets;
+
+    /* Decoded pcap records; the oldest ones may have been spilled to the spill file of the pcap writer thread. */
+    uint8_t buffered;
+    uint8_t truncated;
+    size_t spill_extents_used;
+    size_t spill_extents_size;
+    struct spill_extent * spill_extents;
+    nDPIsrvd_ull packets_count;
+    size_t packets_total;
+    size_t packets_used;
+    size_t packets_size;
+    uint8_t * packets;
+    struct flow_user_data * lru_prev;
+    struct flow_user_data * lru_next;
+};
+
+enum pcap_write_job_type
+{
+    PCAP_WRITE_JOB_FILE = 0, // append the spilled and the buffered records of a flow to `filename'
+    PCAP_WRITE_JOB_SPILL,    // write the records to the spill file at `spill_offset'
+    PCAP_WRITE_JOB_RELEASE,  // the spilled records of a flow are not required anymore
+};
+
+/*
+ * Everything required to append the packets of a single flow to a pcap file.
+ * Jobs are built on the JSON read loop and written by the pcap writer thread.
+ */
+struct pcap_write_job
+{
+    struct pcap_write_job * next;
+    enum pcap_write_job_type type;
+    char * filename;
+    int datalink;
+    off_t spill_offset;
+    size_t spill_extents_used;
+    struct spill_extent * spill_extents;
+    size_t records_used;
+    uint8_t * records;
+};
+
+/* An open pcap file, kept in a small LRU and flushed in batches by the pcap writer thread. */
+struct pcap_open_file
+{
+    char filename[PATH_MAX];
+    int fd;
+    int header_pending;
+    uint64_t last_used;
+    struct pcap_file_header header;
+    int iovcnt;
+    size_t iov_size;
+    struct iovec iov[MAX_PCAP_FILE_IOVECS];
 };
 
+static struct
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int started;
+    int shutdown;
+    struct pcap_write_job * head;
+    struct pcap_write_job * tail;
+    size_t pending_size;
+    uint64_t use_counter;
+    struct pcap_open_file files[MAX_OPEN_PCAP_FILES];
+    /* All spilled records share a single unlinked file, created on first use. */
+    int spill_fd;
+    int spill_failed;
+    size_t spilled_size;
+#ifdef ENABLE_LIBURING
+    int ring_enabled;
+    struct io_uring ring;
+#endif
+} pcap_writer = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER, .spill_fd = -1};
+
 static struct nDPIsrvd_socket * sock = NULL;
 static int main_thread_shutdown = 0;
 
+/* Flows with packets in memory, least recently used first. */
+static struct flow_user_data * buffered_flows = NULL;
+static size_t buffered_size = 0;
+/* Spill file offsets are assigned by the JSON read loop, see spill_flow_packets(). */
+static off_t spill_offset = 0;
+static size_t spilled_size = 0;
+
 static char * pidfile = NULL;
 static char * serv_optarg = NULL;
 static nDPIsrvd_ull pcap_filename_rotation = 0;
@@ -67,35 +153,8 @@ static uint8_t process_undetected = 0;
 static ndpi_risk process_risky = NDPI_NO_RISK;
 static uint8_t process_midstream = 0;
 static uint8_t ignore_empty_flows = 0;
-
-static void packet_data_copy(void * dst, const void * src)
-{
-    struct packet_data * const pd_dst = (struct packet_data *)dst;
-    struct packet_data const * const pd_src = (struct packet_data *)src;
-    *pd_dst = *pd_src;
-    if (pd_src->base64_packet != NULL && pd_src->base64_packet_size > 0)
-    {
-        pd_dst->base64_packet = strndup(pd_src->base64_packet, pd_src->base64_packet_size);
-    }
-    else
-    {
-        pd_dst->base64_packet = NULL;
-        pd_dst->base64_packet_size = 0;
-    }
-}
-
-static void packet_data_dtor(void * elt)
-{
-    struct packet_data * const pd_elt = (struct packet_data *)elt;
-    if (pd_elt->base64_packet != NULL)
-    {
-        free(pd_elt->base64_packet);
-        pd_elt->base64_packet = NULL;
-        pd_elt->base64_packet_size = 0;
-    }
-}
-
-static const UT_icd packet_data_icd = {sizeof(struct packet_data), NULL, packet_data_copy, packet_data_dtor};
+static nDPIsrvd_ull memory_budget = DEFAULT_MEMORY_BUDGET;
+static nDPIsrvd_ull max_flow_size = DEFAULT_MAX_FLOW_SIZE;
 
 static void set_ndpi_risk(ndpi_risk * const risk, nDPIsrvd_ull risk_to_add)
 {
@@ -199,100 +258,750 @@ static char * generate_pcap_filename(struct nDPIsrvd_flow const * const flow,
     return dest;
 }
 
-static int packet_write_pcap_file(UT_array const * const pd_array, int pkt_datalink, char const * const filename)
+static int writev_all(int fd, struct iovec * iov, int iovcnt)
 {
-    size_t const max_packet_len = 65535;
-
-    if (pd_array->icd.copy != packet_data_copy || pd_array->icd.dtor != packet_data_dtor)
+    while (iovcnt > 0)
     {
-        return 1;
+        ssize_t written = writev(fd, iov, iovcnt);
+
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return 1;
+        }
+
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (uint8_t *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
     }
 
-    if (utarray_len(pd_array) == 0)
+    return 0;
+}
+
+static void pcap_file_written(struct pcap_open_file * const file, ssize_t written)
+{
+    if (written < 0)
     {
-        syslog(LOG_DAEMON, "no packets received via json, can not dump anything to pcap");
-        return 0;
+        syslog(LOG_DAEMON | LOG_ERR, "Could not write to pcap file %s: %s", file->filename, strerror(-written));
     }
+    else if ((size_t)written < file->iov_size)
+    {
+        /* Short write: advance the vector and let a blocking writev() write the remainder. */
+        int i = 0;
 
-    pcap_t * p = pcap_open_dead(pkt_datalink, max_packet_len);
-    if (p == NULL)
+        while (i < file->iovcnt && (size_t)written >= file->iov[i].iov_len)
+        {
+            written -= file->iov[i++].iov_len;
+        }
+        if (i < file->iovcnt)
+        {
+            file->iov[i].iov_base = (uint8_t *)file->iov[i].iov_base + written;
+            file->iov[i].iov_len -= written;
+        }
+        if (writev_all(file->fd, &file->iov[i], file->iovcnt - i) != 0)
+        {
+            syslog(LOG_DAEMON | LOG_ERR, "Could not write to pcap file %s: %s", file->filename, strerror(errno));
+        }
+    }
+
+    file->iovcnt = 0;
+    file->iov_size = 0;
+}
+
+static void flush_pcap_file(struct pcap_open_file * const file)
+{
+    if (file->iovcnt == 0)
     {
-        return 1;
+        return;
     }
 
-    pcap_dumper_t * pd;
-    if (access(filename, F_OK) == 0)
+    if (writev_all(file->fd, file->iov, file->iovcnt) != 0)
     {
-        pd = pcap_dump_open_append(p, filename);
+        pcap_file_written(file, -errno);
     }
     else
     {
-        pd = pcap_dump_open(p, filename);
+        pcap_file_written(file, file->iov_size);
     }
+}
 
-    if (pd == NULL)
+static void flush_pcap_files(void)
+{
+#ifdef ENABLE_LIBURING
+    if (pcap_writer.ring_enabled != 0)
     {
-        syslog(LOG_DAEMON | LOG_ERR, "pcap error %s", pcap_geterr(p));
-        pcap_close(p);
-        return 1;
+        unsigned int submitted = 0;
+
+        for (size_t i = 0; i < MAX_OPEN_PCAP_FILES; ++i)
+        {
+            struct pcap_open_file * const file = &pcap_writer.files[i];
+            struct io_uring_sqe * sqe;
+
+            if (file->iovcnt == 0 || (sqe = io_uring_get_sqe(&pcap_writer.ring)) == NULL)
+            {
+                continue;
+            }
+            /* All files are opened with O_APPEND, the offset is ignored. */
+            io_uring_prep_writev(sqe, file->fd, file->iov, file->iovcnt, -1);
+            io_uring_sqe_set_data(sqe, file);
+            submitted++;
+        }
+
+        if (submitted > 0 && io_uring_submit_and_wait(&pcap_writer.ring, submitted) < 0)
+        {
+            /* Nothing was submitted, do not touch the ring again and write everything with writev(). */
+            syslog(LOG_DAEMON | LOG_ERR, "io_uring submit failed, falling back to writev()");
+            pcap_writer.ring_enabled = 0;
+            submitted = 0;
+        }
+        while (submitted > 0)
+        {
+            struct io_uring_cqe * cqe;
+            int ret;
+
+            do
+            {
+                ret = io_uring_wait_cqe(&pcap_writer.ring, &cqe);
+            } while (ret == -EINTR);
+            if (ret == 0)
+            {
+                pcap_file_written((struct pcap_open_file *)io_uring_cqe_get_data(cqe), cqe->res);
+                io_uring_cqe_seen(&pcap_writer.ring, cqe);
+            }
+            submitted--;
+        }
+    }
+#endif
+
+    for (size_t i = 0; i < MAX_OPEN_PCAP_FILES; ++i)
+    {
+        flush_pcap_file(&pcap_writer.files[i]);
+    }
+}
+
+static void close_pcap_file(struct pcap_open_file * const file)
+{
+    if (file->fd < 0)
+    {
+        return;
     }
 
-    struct packet_data * pd_elt = (struct packet_data *)utarray_front(pd_array);
-    do
+    flush_pcap_file(file);
+    close(file->fd);
+    file->fd = -1;
+    file->filename[0] = '\0';
+}
+
+static struct pcap_open_file * get_pcap_file(char const * const filename, int datalink)
+{
+    struct pcap_open_file * lru_file = &pcap_writer.files[0];
+    struct stat st;
+
+    for (size_t i = 0; i < MAX_OPEN_PCAP_FILES; ++i)
     {
-        if (pd_elt == NULL)
+        struct pcap_open_file * const file = &pcap_writer.files[i];
+
+        if (file->fd >= 0 && strcmp(file->filename, filename) == 0)
         {
-            break;
+            file->last_used = ++pcap_writer.use_counter;
+            return file;
+        }
+        if (file->fd < 0 || (lru_file->fd >= 0 && file->last_used < lru_file->last_used))
+        {
+            lru_file = file;
+        }
+    }
+
+    close_pcap_file(lru_file);
+    lru_file->fd = open(filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (lru_file->fd < 0)
+    {
+        syslog(LOG_DAEMON | LOG_ERR, "Could not open pcap file %s: %s", filename, strerror(errno));
+        return NULL;
+    }
+    snprintf(lru_file->filename, sizeof(lru_file->filename), "%s", filename);
+    lru_file->last_used = ++pcap_writer.use_counter;
+    lru_file->header_pending = (fstat(lru_file->fd, &st) == 0 && st.st_size == 0);
+    lru_file->header = (struct pcap_file_header){.magic = 0xa1b2c3d4,
+                                                 .version_major = PCAP_VERSION_MAJOR,
+                                                 .version_minor = PCAP_VERSION_MINOR,
+                                                 .thiszone = 0,
+                                                 .sigfigs = 0,
+                                                 .snaplen = 65535,
+                                                 .linktype = datalink};
+
+    return lru_file;
+}
+
+static void add_pcap_file_iovec(struct pcap_open_file * const file, void * const base, size_t len)
+{
+    if (file->iovcnt == MAX_PCAP_FILE_IOVECS)
+    {
+        flush_pcap_file(file);
+    }
+
+    file->iov[file->iovcnt].iov_base = base;
+    file->iov[file->iovcnt].iov_len = len;
+    file->iovcnt++;
+    file->iov_size += len;
+}
+
+static int pwrite_all(int fd, uint8_t const * buf, size_t len, off_t offset)
+{
+    while (len > 0)
+    {
+        ssize_t const written = pwrite(fd, buf, len, offset);
+
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return 1;
         }
+        buf += written;
+        len -= written;
+        offset += written;
+    }
+
+    return 0;
+}
 
-        unsigned char pkt_buf[max_packet_len];
-        size_t pkt_buf_len = sizeof(pkt_buf);
-        if (nDPIsrvd_base64decode(pd_elt->base64_packet, pd_elt->base64_packet_size, pkt_buf, &pkt_buf_len) != 0 ||
-            pkt_buf_len == 0)
+static int get_spill_file(void)
+{
+    if (pcap_writer.spill_fd < 0 && pcap_writer.spill_failed == 0)
+    {
+        char spill_filename[PATH_MAX];
+
+        snprintf(spill_filename, sizeof(spill_filename), "%s/.spill-XXXXXX", datadir);
+        pcap_writer.spill_fd = mkstemp(spill_filename);
+        if (pcap_writer.spill_fd < 0)
         {
-            syslog(LOG_DAEMON | LOG_ERR,
-                   "packet base64 decode failed (%d bytes): %s",
-                   pd_elt->base64_packet_size,
-                   pd_elt->base64_packet);
+            syslog(LOG_DAEMON | LOG_ERR, "Could not create spill file %s: %s", spill_filename, strerror(errno));
+            pcap_writer.spill_failed = 1;
         }
         else
         {
-            struct pcap_pkthdr phdr;
-            phdr.ts.tv_sec = pd_elt->packet_ts_sec;
-            phdr.ts.tv_usec = pd_elt->packet_ts_usec;
-            phdr.caplen = pkt_buf_len;
-            phdr.len = pkt_buf_len;
-            pcap_dump((unsigned char *)pd, &phdr, pkt_buf);
+            unlink(spill_filename);
+        }
+    }
+
+    return pcap_writer.spill_fd;
+}
+
+static void spill_records(struct pcap_write_job const * const job)
+{
+    int const spill_fd = get_spill_file();
+
+    pcap_writer.spilled_size += job->records_used;
+    if (spill_fd >= 0 && pwrite_all(spill_fd, job->records, job->records_used, job->spill_offset) != 0)
+    {
+        syslog(LOG_DAEMON | LOG_ERR, "Could not spill packets: %s", strerror(errno));
+    }
+}
+
+static void copy_spilled_records(struct pcap_write_job const * const job, struct pcap_open_file * const file)
+{
+    static uint8_t buf[65536];
+
+    for (size_t i = 0; i < job->spill_extents_used; ++i)
+    {
+        off_t offset = job->spill_extents[i].offset;
+        size_t length = job->spill_extents[i].length;
+
+        while (length > 0)
+        {
+            ssize_t const bytes_read =
+                pread(pcap_writer.spill_fd, buf, (length < sizeof(buf) ? length : sizeof(buf)), offset);
+            struct iovec iov = {.iov_base = buf, .iov_len = 0};
+
+            if (bytes_read < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (bytes_read > 0)
+            {
+                iov.iov_len = bytes_read;
+            }
+            if (bytes_read <= 0 || writev_all(file->fd, &iov, 1) != 0)
+            {
+                syslog(LOG_DAEMON | LOG_ERR,
+                       "Could not copy spilled packets to %s: %s",
+                       file->filename,
+                       (bytes_read == 0 ? "Spill file truncated" : strerror(errno)));
+                return;
+            }
+            offset += bytes_read;
+            length -= bytes_read;
+        }
+    }
+}
+
+/* Frees the disk space of spilled records; the spill file is emptied once nothing spilled is left. */
+static void release_spilled_records(struct pcap_write_job const * const job)
+{
+    for (size_t i = 0; i < job->spill_extents_used; ++i)
+    {
+        pcap_writer.spilled_size -= job->spill_extents[i].length;
+#ifdef FALLOC_FL_PUNCH_HOLE
+        if (pcap_writer.spill_fd >= 0)
+        {
+            fallocate(pcap_writer.spill_fd,
+                      FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      job->spill_extents[i].offset,
+                      job->spill_extents[i].length);
+        }
+#endif
+    }
+
+    /* The JSON read loop starts again at offset 0 as well. */
+    if (pcap_writer.spilled_size == 0 && pcap_writer.spill_fd >= 0 && ftruncate(pcap_writer.spill_fd, 0) != 0)
+    {
+        syslog(LOG_DAEMON | LOG_ERR, "Could not truncate spill file: %s", strerror(errno));
+    }
+}
+
+static void write_pcap_jobs(struct pcap_write_job * jobs)
+{
+    struct pcap_write_job * job;
+
+    for (job = jobs; job != NULL; job = job->next)
+    {
+        switch (job->type)
+        {
+            case PCAP_WRITE_JOB_FILE:
+                break;
+            case PCAP_WRITE_JOB_SPILL:
+                spill_records(job);
+                continue;
+            case PCAP_WRITE_JOB_RELEASE:
+                release_spilled_records(job);
+                continue;
+        }
+
+        struct pcap_open_file * const file = get_pcap_file(job->filename, job->datalink);
+
+        if (file == NULL)
+        {
+            release_spilled_records(job);
+            continue;
+        }
+        if (file->header_pending != 0)
+        {
+            add_pcap_file_iovec(file, &file->header, sizeof(file->header));
+            file->header_pending = 0;
+        }
+        if (job->spill_extents_used > 0)
+        {
+            /* Spilled packets are older than the ones still in memory. */
+            flush_pcap_file(file);
+            copy_spilled_records(job, file);
+            release_spilled_records(job);
+        }
+        if (job->records_used > 0)
+        {
+            add_pcap_file_iovec(file, job->records, job->records_used);
+        }
+    }
+
+    /* The iovecs point into the job buffers, write everything before releasing them. */
+    flush_pcap_files();
+
+    while (jobs != NULL)
+    {
+        job = jobs;
+        jobs = jobs->next;
+        free(job->spill_extents);
+        free(job->filename);
+        free(job->records);
+        free(job);
+    }
+}
+
+static void * pcap_writer_thread(void * const arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&pcap_writer.lock);
+    while (pcap_writer.head != NULL || pcap_writer.shutdown == 0)
+    {
+        if (pcap_writer.head == NULL)
+        {
+            pthread_cond_wait(&pcap_writer.cond, &pcap_writer.lock);
+            continue;
         }
-    } while ((pd_elt = (struct packet_data *)utarray_next(pd_array, pd_elt)) != NULL);
 
-    pcap_dump_close(pd);
-    pcap_close(p);
+        struct pcap_write_job * const jobs = pcap_writer.head;
+        pcap_writer.head = NULL;
+        pcap_writer.tail = NULL;
+        pcap_writer.pending_size = 0;
+        pthread_mutex_unlock(&pcap_writer.lock);
+
+        write_pcap_jobs(jobs);
+
+        pthread_mutex_lock(&pcap_writer.lock);
+    }
+    pthread_mutex_unlock(&pcap_writer.lock);
+
+    for (size_t i = 0; i < MAX_OPEN_PCAP_FILES; ++i)
+    {
+        close_pcap_file(&pcap_writer.files[i]);
+    }
+    if (pcap_writer.spill_fd >= 0)
+    {
+        close(pcap_writer.spill_fd);
+        pcap_writer.spill_fd = -1;
+    }
+
+    return NULL;
+}
+
+static int start_pcap_writer(void)
+{
+    for (size_t i = 0; i < MAX_OPEN_PCAP_FILES; ++i)
+    {
+        pcap_writer.files[i].fd = -1;
+    }
+
+#ifdef ENABLE_LIBURING
+    int ret = io_uring_queue_init(MAX_OPEN_PCAP_FILES, &pcap_writer.ring, 0);
+    if (ret != 0)
+    {
+        syslog(LOG_DAEMON | LOG_ERR, "io_uring setup failed, falling back to writev(): %s", strerror(-ret));
+    }
+    else
+    {
+        pcap_writer.ring_enabled = 1;
+    }
+#endif
+
+    if (pthread_create(&pcap_writer.thread, NULL, pcap_writer_thread, NULL) != 0)
+    {
+        return 1;
+    }
+    pcap_writer.started = 1;
 
     return 0;
 }
 
-#ifdef VERBOSE
-static void packet_data_print(UT_array const * const pd_array)
+static void stop_pcap_writer(void)
 {
-    if (pd_array->icd.copy != packet_data_copy || pd_array->icd.dtor != packet_data_dtor)
+    if (pcap_writer.started == 0)
     {
         return;
     }
 
-    printf("packet-data array size(): %u\n", pd_array->n);
-    struct packet_data * pd_elt = (struct packet_data *)utarray_front(pd_array);
-    do
+    pthread_mutex_lock(&pcap_writer.lock);
+    pcap_writer.shutdown = 1;
+    pthread_cond_signal(&pcap_writer.cond);
+    pthread_mutex_unlock(&pcap_writer.lock);
+    pthread_join(pcap_writer.thread, NULL);
+    pcap_writer.started = 0;
+
+#ifdef ENABLE_LIBURING
+    if (pcap_writer.ring_enabled != 0)
+    {
+        io_uring_queue_exit(&pcap_writer.ring);
+        pcap_writer.ring_enabled = 0;
+    }
+#endif
+}
+
+/* Takes over `spill_extents' and `records' on success. */
+static int queue_pcap_write_job(enum pcap_write_job_type type,
+                                char const * const filename,
+                                int datalink,
+                                struct spill_extent * const spill_extents,
+                                size_t spill_extents_used,
+                                uint8_t * const records,
+                                size_t records_used)
+{
+    struct pcap_write_job * const job = (struct pcap_write_job *)malloc(sizeof(*job));
+
+    if (job == NULL)
+    {
+        return 1;
+    }
+    job->next = NULL;
+    job->type = type;
+    job->filename = NULL;
+    job->datalink = datalink;
+    job->spill_offset = spill_offset;
+    job->spill_extents_used = spill_extents_used;
+    job->spill_extents = spill_extents;
+    job->records_used = records_used;
+    job->records = records;
+    if (filename != NULL && (job->filename = strdup(filename)) == NULL)
+    {
+        free(job);
+        return 1;
+    }
+
+    pthread_mutex_lock(&pcap_writer.lock);
+    if (pcap_writer.pending_size + records_used > MAX_PENDING_WRITE_SIZE)
+    {
+        pthread_mutex_unlock(&pcap_writer.lock);
+        free(job->filename);
+        free(job);
+        return 1;
+    }
+    if (pcap_writer.tail != NULL)
+    {
+        pcap_writer.tail->next = job;
+    }
+    else
+    {
+        pcap_writer.head = job;
+    }
+    pcap_writer.tail = job;
+    pcap_writer.pending_size += records_used;
+    pthread_cond_signal(&pcap_writer.cond);
+    pthread_mutex_unlock(&pcap_writer.lock);
+
+    return 0;
+}
+
+static void unbuffer_flow_packets(struct flow_user_data * const flow_user)
+{
+    if (flow_user->buffered != 0)
+    {
+        DL_DELETE2(buffered_flows, flow_user, lru_prev, lru_next);
+        flow_user->buffered = 0;
+    }
+    buffered_size -= flow_user->packets_size;
+    flow_user->packets = NULL;
+    flow_user->packets_used = 0;
+    flow_user->packets_size = 0;
+}
+
+/* The spilled records of a flow were handed over to the pcap writer thread. */
+static void unspill_flow_packets(struct flow_user_data * const flow_user)
+{
+    for (size_t i = 0; i < flow_user->spill_extents_used; ++i)
+    {
+        spilled_size -= flow_user->spill_extents[i].length;
+    }
+    if (spilled_size == 0)
+    {
+        /* The pcap writer thread truncates the spill file at the same job. */
+        spill_offset = 0;
+    }
+    flow_user->spill_extents = NULL;
+    flow_user->spill_extents_used = 0;
+    flow_user->spill_extents_size = 0;
+}
+
+static void release_spilled_packets(struct flow_user_data * const flow_user)
+{
+    if (flow_user->spill_extents_used == 0 ||
+        queue_pcap_write_job(
+            PCAP_WRITE_JOB_RELEASE, NULL, 0, flow_user->spill_extents, flow_user->spill_extents_used, NULL, 0) != 0)
     {
-        if (pd_elt == NULL)
+        free(flow_user->spill_extents);
+    }
+    unspill_flow_packets(flow_user);
+}
+
+static void free_flow_packets(struct flow_user_data * const flow_user)
+{
+    free(flow_user->packets);
+    unbuffer_flow_packets(flow_user);
+    release_spilled_packets(flow_user);
+    flow_user->packets_count = 0;
+    flow_user->packets_total = 0;
+}
+
+/*
+ * Hands the in-memory packets of a flow over to the pcap writer thread, which writes them to the spill file.
+ * The JSON read loop assigns the offset, so a flow only has to remember where its records are.
+ */
+static void spill_flow_packets(struct flow_user_data * const flow_user)
+{
+    uint8_t * const packets = flow_user->packets;
+    size_t const packets_used = flow_user->packets_used;
+    /* records of a flow spilled one after another are merged into a single extent */
+    int const contiguous = (flow_user->spill_extents_used > 0 &&
+                            flow_user->spill_extents[flow_user->spill_extents_used - 1].offset +
+                                    (off_t)flow_user->spill_extents[flow_user->spill_extents_used - 1].length ==
+                                spill_offset);
+
+    unbuffer_flow_packets(flow_user);
+    if (packets_used == 0)
+    {
+        free(packets);
+        return;
+    }
+    if (contiguous == 0 && flow_user->spill_extents_used == flow_user->spill_extents_size)
+    {
+        size_t const new_size = (flow_user->spill_extents_size > 0 ? flow_user->spill_extents_size * 2 : 4);
+        struct spill_extent * const new_extents =
+            (struct spill_extent *)realloc(flow_user->spill_extents, new_size * sizeof(*new_extents));
+
+        if (new_extents == NULL)
         {
-            break;
+            free(packets);
+            flow_user->truncated = 1;
+            return;
+        }
+        flow_user->spill_extents = new_extents;
+        flow_user->spill_extents_size = new_size;
+    }
+    if (queue_pcap_write_job(PCAP_WRITE_JOB_SPILL, NULL, 0, NULL, 0, packets, packets_used) != 0)
+    {
+        syslog(LOG_DAEMON | LOG_ERR, "pcap writer queue full, dropping %zu bytes of buffered packets", packets_used);
+        free(packets);
+        flow_user->truncated = 1;
+        return;
+    }
+
+    if (contiguous != 0)
+    {
+        flow_user->spill_extents[flow_user->spill_extents_used - 1].length += packets_used;
+    }
+    else
+    {
+        flow_user->spill_extents[flow_user->spill_extents_used].offset = spill_offset;
+        flow_user->spill_extents[flow_user->spill_extents_used].length = packets_used;
+        flow_user->spill_extents_used++;
+    }
+    spill_offset += packets_used;
+    spilled_size += packets_used;
+}
+
+static int buffer_flow_packet(struct flow_user_data * const flow_user,
+                              nDPIsrvd_ull packet_ts_sec,
+                              nDPIsrvd_ull packet_ts_usec,
+                              struct nDPIsrvd_json_token const * const pkt)
+{
+    size_t const max_packet_len = 65535;
+    size_t const record_size = PCAP_RECORD_HEADER_SIZE + (pkt->value_length / 4 + 1) * 3;
+
+    if (flow_user->truncated != 0 || flow_user->packets_total + record_size > max_flow_size)
+    {
+        flow_user->truncated = 1;
+        return 0;
+    }
+
+    if (record_size > flow_user->packets_size - flow_user->packets_used)
+    {
+        size_t new_size = (flow_user->packets_size > 0 ? flow_user->packets_size * 2 : 4096);
+        if (new_size < flow_user->packets_used + record_size)
+        {
+            new_size = flow_user->packets_used + record_size;
         }
-        printf("\tpacket-data base64 length: %d\n", pd_elt->base64_packet_size);
-    } while ((pd_elt = (struct packet_data *)utarray_next(pd_array, pd_elt)) != NULL);
+        uint8_t * const new_packets = (uint8_t *)realloc(flow_user->packets, new_size);
+        if (new_packets == NULL)
+        {
+            return 1;
+        }
+        buffered_size += new_size - flow_user->packets_size;
+        flow_user->packets = new_packets;
+        flow_user->packets_size = new_size;
+    }
+
+    uint8_t * const record = flow_user->packets + flow_user->packets_used;
+    size_t pkt_buf_len = flow_user->packets_size - flow_user->packets_used - PCAP_RECORD_HEADER_SIZE;
+    if (pkt_buf_len > max_packet_len)
+    {
+        pkt_buf_len = max_packet_len;
+    }
+    if (nDPIsrvd_base64decode((char *)pkt->value, pkt->value_length, record + PCAP_RECORD_HEADER_SIZE, &pkt_buf_len) !=
+            0 ||
+        pkt_buf_len == 0)
+    {
+        syslog(LOG_DAEMON | LOG_ERR,
+               "packet base64 decode failed (%d bytes): %.*s",
+               pkt->value_length,
+               pkt->value_length,
+               pkt->value);
+    }
+    else
+    {
+        uint32_t const record_header[4] = {packet_ts_sec, packet_ts_usec, pkt_buf_len, pkt_buf_len};
+
+        memcpy(record, record_header, sizeof(record_header));
+        flow_user->packets_used += PCAP_RECORD_HEADER_SIZE + pkt_buf_len;
+        flow_user->packets_total += PCAP_RECORD_HEADER_SIZE + pkt_buf_len;
+        flow_user->packets_count++;
+    }
+
+    if (flow_user->buffered != 0)
+    {
+        DL_DELETE2(buffered_flows, flow_user, lru_prev, lru_next);
+    }
+    DL_APPEND2(buffered_flows, flow_user, lru_prev, lru_next);
+    flow_user->buffered = 1;
+
+    while (buffered_size > memory_budget && buffered_flows != NULL)
+    {
+        spill_flow_packets(buffered_flows);
+    }
+
+    return 0;
+}
+
+/*
+ * Hands the packets of a flow over to the pcap writer thread.
+ * Never blocks on disk I/O; if the writer falls too far behind, the flow is dropped.
+ */
+static int packet_write_pcap_file(struct flow_user_data * const flow_user, char const * const filename)
+{
+    uint8_t * const packets = flow_user->packets;
+    size_t const packets_used = flow_user->packets_used;
+
+    if (flow_user->packets_total == 0)
+    {
+        syslog(LOG_DAEMON, "no packets received via json, can not dump anything to pcap");
+        return 0;
+    }
+
+    unbuffer_flow_packets(flow_user);
+    if (queue_pcap_write_job(PCAP_WRITE_JOB_FILE,
+                             filename,
+                             flow_user->flow_datalink,
+                             flow_user->spill_extents,
+                             flow_user->spill_extents_used,
+                             packets,
+                             packets_used) != 0)
+    {
+        syslog(LOG_DAEMON | LOG_ERR, "pcap writer queue full, dropping %zu bytes for %s", packets_used, filename);
+        free(packets);
+        release_spilled_packets(flow_user);
+    }
+    else
+    {
+        unspill_flow_packets(flow_user);
+    }
+    flow_user->packets_count = 0;
+    flow_user->packets_total = 0;
+
+    return 0;
+}
+
+#ifdef VERBOSE
+static void packet_data_print(struct flow_user_data const * const flow_user)
+{
+    printf("packet-data: %llu packets, %zu bytes (%zu in memory)%s%s\n",
+           flow_user->packets_count,
+           flow_user->packets_total,
+           flow_user->packets_used,
+           (flow_user->spill_extents_used > 0 ? ", spilled" : ""),
+           (flow_user->truncated != 0 ? ", truncated" : ""));
 }
 #else
-#define packet_data_print(pd_array)
+#define packet_data_print(flow_user)
 #endif
 
 static enum nDPIsrvd_conversion_return perror_ull(enum nDPIsrvd_conversion_return retval, char const * const prefix)
@@ -342,36 +1051,23 @@ static enum nDPIsrvd_callback_return captured_json_callback(struct nDPIsrvd_sock
         {
             return CALLBACK_ERROR;
         }
-        if (flow_user->packets == NULL)
-        {
-            utarray_new(flow_user->packets, &packet_data_icd);
-        }
-        if (flow_user->packets == NULL)
-        {
-            return CALLBACK_ERROR;
-        }
 
         nDPIsrvd_ull pkt_ts_sec = 0ull;
-        perror_ull(TOKEN_VALUE_TO_ULL(TOKEN_GET_SZ(sock, "pkt_ts_sec"), &pkt_ts_sec), "pkt_ts_sec");
+        perror_ull(TOKEN_GET_ULL_SZ(sock, "pkt_ts_sec", &pkt_ts_sec), "pkt_ts_sec");
 
         nDPIsrvd_ull pkt_ts_usec = 0ull;
-        perror_ull(TOKEN_VALUE_TO_ULL(TOKEN_GET_SZ(sock, "pkt_ts_usec"), &pkt_ts_usec), "pkt_ts_usec");
-
-        nDPIsrvd_ull pkt_len = 0ull;
-        perror_ull(TOKEN_VALUE_TO_ULL(TOKEN_GET_SZ(sock, "pkt_len"), &pkt_len), "pkt_len");
+        perror_ull(TOKEN_GET_ULL_SZ(sock, "pkt_ts_usec", &pkt_ts_usec), "pkt_ts_usec");
 
         nDPIsrvd_ull pkt_l4_len = 0ull;
-        perror_ull(TOKEN_VALUE_TO_ULL(TOKEN_GET_SZ(sock, "pkt_l4_len"), &pkt_l4_len), "pkt_l4_len");
+        perror_ull(TOKEN_GET_ULL_SZ(sock, "pkt_l4_len", &pkt_l4_len), "pkt_l4_len");
 
         nDPIsrvd_ull pkt_l4_offset = 0ull;
-        perror_ull(TOKEN_VALUE_TO_ULL(TOKEN_GET_SZ(sock, "pkt_l4_offset"), &pkt_l4_offset), "pkt_l4_offset");
+        perror_ull(TOKEN_GET_ULL_SZ(sock, "pkt_l4_offset", &pkt_l4_offset), "pkt_l4_offset");
 
-        struct packet_data pd = {.packet_ts_sec = pkt_ts_sec,
-                                 .packet_ts_usec = pkt_ts_usec,
-                                 .packet_len = pkt_len,
-                                 .base64_packet_size = pkt->value_length,
-                                 .base64_packet_const = pkt->value};
-        utarray_push_back(flow_user->packets, &pd);
+        if (buffer_flow_packet(flow_user, pkt_ts_sec, pkt_ts_usec, pkt) != 0)
+        {
+            return CALLBACK_ERROR;
+        }
     }
 
     {
@@ -379,19 +1075,17 @@ static enum nDPIsrvd_callback_return captured_json_callback(struct nDPIsrvd_sock
 
         if (flow_event_name != NULL)
         {
-            perror_ull(TOKEN_VALUE_TO_ULL(TOKEN_GET_SZ(sock, "flow_tot_l4_payload_len"),
-                                          &flow_user->flow_tot_l4_payload_len),
+            perror_ull(TOKEN_GET_ULL_SZ(sock, "flow_tot_l4_payload_len", &flow_user->flow_tot_l4_payload_len),
                        "flow_tot_l4_payload_len");
         }
 
         if (TOKEN_VALUE_EQUALS_SZ(flow_event_name, "new") != 0)
         {
             flow_user->flow_new_seen = 1;
-            perror_ull(TOKEN_VALUE_TO_ULL(TOKEN_GET_SZ(sock, "flow_datalink"), &flow_user->flow_datalink),
-                       "flow_datalink");
-            perror_ull(TOKEN_VALUE_TO_ULL(TOKEN_GET_SZ(sock, "flow_max_packets"), &flow_user->flow_max_packets),
-                       "flow_max_packets");
-            if (TOKEN_VALUE_EQUALS_SZ(TOKEN_GET_SZ(sock, "midstream"), "1") != 0)
+            perror_ull(TOKEN_GET_ULL_SZ(sock, "flow_datalink", &flow_user->flow_datalink), "flow_datalink");
+            perror_ull(TOKEN_GET_ULL_SZ(sock, "flow_max_packets", &flow_user->flow_max_packets), "flow_max_packets");
+            int midstream = 0;
+            if (TOKEN_GET_BOOL_SZ(sock, "midstream", &midstream) == CONVERSION_OK && midstream != 0)
             {
                 flow_user->midstream = 1;
             }
@@ -438,7 +1132,7 @@ static enum nDPIsrvd_callback_return captured_json_callback(struct nDPIsrvd_sock
             return CALLBACK_OK;
         }
 
-        if (flow_user->packets == NULL || flow_user->flow_max_packets == 0 || utarray_len(flow_user->packets) == 0)
+        if (flow_user->flow_max_packets == 0 || flow_user->packets_total == 0)
         {
             syslog(LOG_DAEMON | LOG_ERR, "flow %llu: No packets captured.", flow->id_as_ull);
             return CALLBACK_OK;
@@ -449,7 +1143,7 @@ static enum nDPIsrvd_callback_return captured_json_callback(struct nDPIsrvd_sock
              (flow_user->detected == 0 && process_undetected != 0) || (flow_user->risky != 0 && process_risky != 0) ||
              (flow_user->midstream != 0 && process_midstream != 0)))
         {
-            packet_data_print(flow_user->packets);
+            packet_data_print(flow_user);
             if (ignore_empty_flows == 0 || flow_user->flow_tot_l4_payload_len > 0)
             {
                 char pcap_filename[PATH_MAX];
@@ -461,14 +1155,16 @@ static enum nDPIsrvd_callback_return captured_json_callback(struct nDPIsrvd_sock
 #ifdef VERBOSE
                 printf("flow %llu saved to %s\n", flow->id_as_ull, pcap_filename);
 #endif
-                if (packet_write_pcap_file(flow_user->packets, flow_user->flow_datalink, pcap_filename) != 0)
+                if (packet_write_pcap_file(flow_user, pcap_filename) != 0)
                 {
                     return CALLBACK_ERROR;
                 }
             }
+        }
 
-            utarray_free(flow_user->packets);
-            flow_user->packets = NULL;
+        if (flow_user->detection_finished != 0)
+        {
+            free_flow_packets(flow_user);
         }
     }
 
@@ -485,18 +1181,47 @@ static void sighandler(int signum)
     }
 }
 
-static void captured_flow_end_callback(struct nDPIsrvd_socket * const sock, struct nDPIsrvd_flow * const flow)
+static void captured_flow_end_callback(struct nDPIsrvd_socket * const sock,
+                                       struct nDPIsrvd_flow * const flow,
+                                       enum nDPIsrvd_cleanup_reason reason)
 {
     (void)sock;
+    (void)reason;
 
 #ifdef VERBOSE
-    printf("flow %llu end, remaining flows: %u\n", flow->id_as_ull, sock->flow_table->hh.tbl->num_items);
+    printf("flow %llu %s, remaining flows: %u\n",
+           flow->id_as_ull,
+           nDPIsrvd_cleanup_reason_to_string(reason),
+           sock->flow_table->hh.tbl->num_items);
 #endif
     struct flow_user_data * const ud = (struct flow_user_data *)flow->flow_user_data;
-    if (ud != NULL && ud->packets != NULL)
+    if (ud != NULL)
+    {
+        free_flow_packets(ud);
+    }
+}
+
+static void captured_sequence_gap_callback(struct nDPIsrvd_socket * const sock,
+                                           struct nDPIsrvd_instance const * const instance,
+                                           nDPIsrvd_ull thread_id,
+                                           nDPIsrvd_ull expected_seq,
+                                           nDPIsrvd_ull received_seq)
+{
+    (void)sock;
+
+    if (instance == NULL)
+    {
+        syslog(LOG_DAEMON | LOG_ERR,
+               "nDPIsrvd dropped %llu events, captured flows may be incomplete",
+               received_seq - expected_seq);
+    }
+    else
     {
-        utarray_free(ud->packets);
-        ud->packets = NULL;
+        syslog(LOG_DAEMON | LOG_ERR,
+               "nDPId `%s' thread %llu lost %llu events, captured flows may be incomplete",
+               instance->key,
+               thread_id,
+               received_seq - expected_seq);
     }
 }
 
@@ -505,7 +1230,8 @@ static void print_usage(char const * const arg0)
     static char const usage[] =
         "Usage: %s "
         "[-d] [-p pidfile] [-s host] [-r rotate-every-n-seconds]\n"
-        "\t  \t[-u user] [-g group] [-D dir] [-G] [-U] [-R risk] [-M]\n\n"
+        "\t  \t[-u user] [-g group] [-D dir] [-G] [-U] [-R risk] [-M]\n"
+        "\t  \t[-B memory-budget] [-F max-flow-size]\n\n"
         "\t-d\tForking into background after initialization.\n"
         "\t-p\tWrite the daemon PID to the given file path.\n"
         "\t-s\tDestination where nDPIsrvd is listening on.\n"
@@ -518,11 +1244,15 @@ static void print_usage(char const * const arg0)
         "\t-U\tUndetected - Dump undetected flows to a PCAP file.\n"
         "\t-R\tRisky - Dump risky flows to a PCAP file. See additional help below.\n"
         "\t-M\tMidstream - Dump midstream flows to a PCAP file.\n"
-        "\t-E\tEmpty - Ignore flows w/o any layer 4 payload\n\n"
+        "\t-E\tEmpty - Ignore flows w/o any layer 4 payload\n"
+        "\t-B\tMemory budget in bytes for buffered packets of all flows.\n"
+        "\t  \tPackets of the least recently active flows are spilled to disk if exceeded.\n"
+        "\t  \tDefault: %u\n"
+        "\t-F\tMaximum size in bytes of the packets buffered per flow. Default: %u\n\n"
         "\tPossible options for `-R' (can be specified multiple times, processed from left to right, ~ disables a risk):\n"
         "\t  \tExample: -R0 -R~15 would enable all risks except risk with id 15\n";
 
-    fprintf(stderr, usage, arg0);
+    fprintf(stderr, usage, arg0, DEFAULT_MEMORY_BUDGET, DEFAULT_MAX_FLOW_SIZE);
 #ifndef LIBNDPI_STATIC
     fprintf(stderr, "\t\t%d - %s\n", 0, "Capture all risks");
 #else
@@ -542,7 +1272,7 @@ static int parse_options(int argc, char ** argv)
 {
     int opt;
 
-    while ((opt = getopt(argc, argv, "hdp:s:r:u:g:D:GUR:ME")) != -1)
+    while ((opt = getopt(argc, argv, "hdp:s:r:u:g:D:GUR:MEB:F:")) != -1)
     {
         switch (opt)
         {
@@ -611,6 +1341,20 @@ static int parse_options(int argc, char ** argv)
             case 'E':
                 ignore_empty_flows = 1;
                 break;
+            case 'B':
+                if (perror_ull(str_value_to_ull(optarg, &memory_budget), "memory_budget") != CONVERSION_OK)
+                {
+                    fprintf(stderr, "%s: Argument for `-B' is not a number: %s\n", argv[0], optarg);
+                    return 1;
+                }
+                break;
+            case 'F':
+                if (perror_ull(str_value_to_ull(optarg, &max_flow_size), "max_flow_size") != CONVERSION_OK)
+                {
+                    fprintf(stderr, "%s: Argument for `-F' is not a number: %s\n", argv[0], optarg);
+                    return 1;
+                }
+                break;
             default:
                 print_usage(argv[0]);
                 return 1;
@@ -695,6 +1439,7 @@ int main(int argc, char ** argv)
         fprintf(stderr, "%s: nDPIsrvd socket memory allocation failed!\n", argv[0]);
         return 1;
     }
+    nDPIsrvd_set_sequence_gap_callback(sock, captured_sequence_gap_callback);
 
     if (parse_options(argc, argv) != 0)
     {
@@ -723,7 +1468,7 @@ int main(int argc, char ** argv)
     openlog("nDPIsrvd-captured", LOG_CONS, LOG_DAEMON);
 
     errno = 0;
-    if (user != NULL && change_user_group(user, group, pidfile, datadir /* :D */, NULL) != 0)
+    if (user != NULL && change_user_group(user, group, pidfile, datadir /* :D */, NULL, NULL) != 0)
     {
         if (errno != 0)
         {
@@ -737,8 +1482,15 @@ int main(int argc, char ** argv)
     }
     chmod(datadir, S_IRWXU);
 
+    if (start_pcap_writer() != 0)
+    {
+        syslog(LOG_DAEMON | LOG_ERR, "Could not start pcap writer thread: %s", strerror(errno));
+        return 1;
+    }
+
     int retval = mainloop();
 
+    stop_pcap_writer();
     nDPIsrvd_free(&sock);
     daemonize_shutdown(pidfile);
     closelog();
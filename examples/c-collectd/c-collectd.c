@@ -405,7 +405,7 @@ static uint64_t get_total_flow_bytes(struct nDPIsrvd_socket * const sock)
 {
     nDPIsrvd_ull total_bytes_ull = 0;
 
-    if (TOKEN_VALUE_TO_ULL(TOKEN_GET_SZ(sock, "flow_tot_l4_data_len"), &total_bytes_ull) == CONVERSION_OK)
+    if (TOKEN_GET_ULL_SZ(sock, "flow_tot_l4_data_len", &total_bytes_ull) == CONVERSION_OK)
     {
         return total_bytes_ull;
     }
@@ -19,7 +19,7 @@ var (
 	InfoLogger    *log.Logger
 	ErrorLogger   *log.Logger
 
-	NETWORK_BUFFER_MAX_SIZE uint16 = 12288
+	NETWORK_BUFFER_MAX_SIZE uint16 = 12328
 	NETWORK_BUFFER_LENGTH_DIGITS uint16 = 5
 )
 
@@ -1,8 +1,8 @@
 #!/usr/bin/env python3
 
-import multiprocessing
 import os
 import sys
+import time
 
 sys.path.append(os.path.dirname(sys.argv[0]) + '/../share/nDPId')
 sys.path.append(os.path.dirname(sys.argv[0]) + '/../usr/share/nDPId')
@@ -15,37 +15,37 @@ except ImportError:
     from nDPIsrvd import nDPIsrvdSocket
 
 
-def mp_worker(unused, shared_flow_dict):
-    import time
-    while True:
-        s = str()
-        for key in shared_flow_dict.keys():
-            s += '{}, '.format(str(key))
-        if len(s) == 0:
-            s = '-'
-        else:
-            s = s[:-2]
-        print('Flows: {}'.format(s))
-        time.sleep(1)
+class WorkerStats:
+    def __init__(self):
+        self.flows = set()
+        self.last_print = 0
 
 
 def nDPIsrvd_worker_onJsonLineRecvd(json_dict, current_flow, global_user_data):
-    shared_flow_dict = global_user_data
+    worker_stats = global_user_data
 
-    if 'flow_event_name' not in json_dict:
-        return True
+    if 'flow_event_name' in json_dict:
+        if json_dict['flow_event_name'] == 'new':
+            worker_stats.flows.add(json_dict['flow_id'])
+        elif json_dict['flow_event_name'] == 'idle' or \
+                json_dict['flow_event_name'] == 'end':
+            worker_stats.flows.discard(json_dict['flow_id'])
 
-    if json_dict['flow_event_name'] == 'new':
-        shared_flow_dict[json_dict['flow_id']] = current_flow
-    elif json_dict['flow_event_name'] == 'idle' or \
-            json_dict['flow_event_name'] == 'end':
-        if json_dict['flow_id'] in shared_flow_dict:
-            del shared_flow_dict[json_dict['flow_id']]
+    now = time.time()
+    if now - worker_stats.last_print >= 1:
+        s = ', '.join([str(flow_id) for flow_id in sorted(worker_stats.flows)])
+        print('Worker {} flows: {}'.format(os.getpid(), s if len(s) > 0 else '-'))
+        worker_stats.last_print = now
 
     return True
 
 
-def nDPIsrvd_worker(address, shared_flow_dict):
+if __name__ == '__main__':
+    argparser = nDPIsrvd.defaultArgumentParser()
+    argparser.add_argument('--workers', type=int, default=os.cpu_count(), help='number of worker processes')
+    args = argparser.parse_args()
+    address = nDPIsrvd.validateAddress(args)
+
     sys.stderr.write('Recv buffer size: {}\n'.format(
         nDPIsrvd.NETWORK_BUFFER_MAX_SIZE))
     sys.stderr.write('Connecting to {} ..\n'.format(
@@ -54,27 +54,9 @@ def nDPIsrvd_worker(address, shared_flow_dict):
 
     nsock = nDPIsrvdSocket()
     nsock.connect(address)
-    nsock.loop(nDPIsrvd_worker_onJsonLineRecvd, shared_flow_dict)
-
-
-if __name__ == '__main__':
-    argparser = nDPIsrvd.defaultArgumentParser()
-    args = argparser.parse_args()
-    address = nDPIsrvd.validateAddress(args)
-
-    mgr = multiprocessing.Manager()
-    shared_flow_dict = mgr.dict()
-
-    nDPIsrvd_job = multiprocessing.Process(
-            target=nDPIsrvd_worker,
-            args=(address, shared_flow_dict))
-    nDPIsrvd_job.start()
-
-    mp_job = multiprocessing.Process(
-            target=mp_worker,
-            args=(None, shared_flow_dict))
-    mp_job.start()
-
-    nDPIsrvd_job.join()
-    mp_job.terminate()
-    mp_job.join()
+    try:
+        nsock.loopSharded(nDPIsrvd_worker_onJsonLineRecvd, WorkerStats(), args.workers)
+    except nDPIsrvd.SocketConnectionBroken as err:
+        sys.stderr.write('\n{}\n'.format(err))
+    except KeyboardInterrupt:
+        print()
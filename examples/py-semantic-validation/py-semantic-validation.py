@@ -13,8 +13,9 @@ except ImportError:
     import nDPIsrvd
     from nDPIsrvd import nDPIsrvdSocket, TermColor
 
+# Flow IDs are only ordered per reader thread, see `flow_id' in README.md
 global lowest_flow_id_for_new_flow
-lowest_flow_id_for_new_flow = 0
+lowest_flow_id_for_new_flow = dict()
 
 class Stats:
     event_counter   = dict()
@@ -24,7 +25,7 @@ class Stats:
     print_nmb_every = print_dot_every * 5
 
     def resetEventCounter(self):
-        keys = ['init','reconnect','shutdown', \
+        keys = ['init','reconnect','shutdown','status', \
                 'new','end','idle','guessed','detected','detection-update','not-detected', \
                 'packet', 'packet-flow']
         for k in keys:
@@ -84,6 +85,7 @@ def onJsonLineRecvd(json_dict, current_flow, global_user_data):
     global lowest_flow_id_for_new_flow
     stats = global_user_data
     stats.incrementEventCounter(json_dict)
+    thread_key = (json_dict.get('alias'), json_dict.get('source'), json_dict.get('thread_id'))
 
     try:
         semdict = current_flow.semdict
@@ -121,13 +123,14 @@ def onJsonLineRecvd(json_dict, current_flow, global_user_data):
            json_dict['flow_event_name'] == 'idle':
             pass
         elif json_dict['flow_event_name'] == 'new':
-            if lowest_flow_id_for_new_flow > current_flow.flow_id:
+            if lowest_flow_id_for_new_flow.get(thread_key, 0) > current_flow.flow_id:
                 raise SemanticValidationException(current_flow,
                                                   'JSON dictionary lowest flow id for new flow > current flow id: ' \
-                                                  '{} != {}'.format(lowest_flow_id_for_new_flow, current_flow.flow_id))
+                                                  '{} != {}'.format(lowest_flow_id_for_new_flow[thread_key], current_flow.flow_id))
             current_flow.flow_new_seen = True
-            if lowest_flow_id_for_new_flow == 0:
-                lowest_flow_id_for_new_flow = current_flow.flow_id
+            current_flow.thread_key = thread_key
+            if thread_key not in lowest_flow_id_for_new_flow:
+                lowest_flow_id_for_new_flow[thread_key] = current_flow.flow_id
         elif json_dict['flow_event_name'] == 'detected' or \
              json_dict['flow_event_name'] == 'not-detected':
             try:
@@ -139,9 +142,11 @@ def onJsonLineRecvd(json_dict, current_flow, global_user_data):
             current_flow.flow_detection_finished = True
 
     try:
-        if current_flow.flow_new_seen is True and lowest_flow_id_for_new_flow > current_flow.flow_id:
+        if current_flow.flow_new_seen is True and \
+           lowest_flow_id_for_new_flow[current_flow.thread_key] > current_flow.flow_id:
             raise SemanticValidationException(current_flow, 'Lowest flow id for flow > current flow id: ' \
-                                              '{} > {}'.format(lowest_flow_id_for_new_flow, current_flow.flow_id))
+                                              '{} > {}'.format(lowest_flow_id_for_new_flow[current_flow.thread_key],
+                                                               current_flow.flow_id))
     except AttributeError:
         pass
 
@@ -156,6 +161,12 @@ def onJsonLineRecvd(json_dict, current_flow, global_user_data):
 
     return True
 
+def onSequenceGap(alias, source, thread_id, expected_seq, received_seq):
+    if thread_id is None:
+        raise RuntimeError('Semantic validation failed: nDPIsrvd dropped {} events'.format(received_seq - expected_seq))
+    raise RuntimeError('Semantic validation failed: nDPId {}/{} thread {} lost {} events'.format(
+                       alias, source, thread_id, received_seq - expected_seq))
+
 if __name__ == '__main__':
     argparser = nDPIsrvd.defaultArgumentParser()
     argparser.add_argument('--strict', action='store_true', default=False, help='Require and validate a full nDPId application lifecycle.')
@@ -165,7 +176,7 @@ if __name__ == '__main__':
     sys.stderr.write('Recv buffer size: {}\n'.format(nDPIsrvd.NETWORK_BUFFER_MAX_SIZE))
     sys.stderr.write('Connecting to {} ..\n'.format(address[0]+':'+str(address[1]) if type(address) is tuple else address))
 
-    nsock = nDPIsrvdSocket()
+    nsock = nDPIsrvdSocket(onSequenceGap)
     nsock.connect(address)
     stats = Stats()
     try:
@@ -0,0 +1,1950 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/perf_event.h>
+#include <math.h>
+#include <pthread.h>
+#include <strings.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAS_TSC 1
+#endif
+
+#define NO_MAIN 1
+#include "nDPIsrvd.c"
+#include "nDPId.c"
+
+enum bench_sink
+{
+    SINK_NULL = 0, /* write(2) to /dev/null, measures nDPId incl. serialization */
+    SINK_PIPE,     /* one pipe per reader thread, drained by a single thread */
+    SINK_NDPISRVD, /* one pipe per reader thread, consumed by an in-process nDPIsrvd */
+
+    SINK_COUNT
+};
+
+static char const * const bench_sink_name_table[SINK_COUNT] = {
+    [SINK_NULL] = "null", [SINK_PIPE] = "pipe", [SINK_NDPISRVD] = "nDPIsrvd"};
+
+/* Hardware cache events counted for every reader thread with perf_event_open(2), if the CPU/kernel expose them. */
+enum bench_cache_counter
+{
+    CACHE_COUNTER_L1D_READ_MISSES = 0,
+    CACHE_COUNTER_LLC_READ_MISSES,
+
+    CACHE_COUNTER_COUNT
+};
+
+static char const * const bench_cache_counter_name_table[CACHE_COUNTER_COUNT] = {
+    [CACHE_COUNTER_L1D_READ_MISSES] = "L1D read misses per packet...",
+    [CACHE_COUNTER_LLC_READ_MISSES] = "LLC read misses per packet..."};
+
+static uint64_t const bench_cache_counter_config_table[CACHE_COUNTER_COUNT] = {
+    [CACHE_COUNTER_L1D_READ_MISSES] = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+    [CACHE_COUNTER_LLC_READ_MISSES] = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)};
+
+struct bench_packet
+{
+    struct pcap_pkthdr header;
+    uint8_t const * data;
+    uint16_t l3_offset;
+    uint16_t l3_type; /* 0 if the packet could not be parsed, never rewritten */
+};
+
+struct bench_thread
+{
+    int started;
+    uint64_t cpu_nsec;
+    uint64_t tsc_cycles;
+    int cache_counter_fds[CACHE_COUNTER_COUNT];
+    int cache_counter_errno; // 0 if all cache counters were available
+    uint64_t cache_misses[CACHE_COUNTER_COUNT];
+    unsigned long long int packets;
+    unsigned long long int bytes;
+};
+
+static struct
+{
+    unsigned long long int reader_thread_count;
+    unsigned long long int loops;
+    int rewrite_flows;
+    enum bench_sink sink;
+    char * json_file;
+} bench_options = {.reader_thread_count = 1, .loops = 1, .rewrite_flows = 0, .sink = SINK_NULL, .json_file = NULL};
+
+/* All packets of the current pcap file, replayed by every reader thread. */
+static struct
+{
+    struct bench_packet * packets;
+    size_t packets_used;
+    size_t packets_size;
+    uint8_t * data;
+    size_t data_used;
+    size_t data_size;
+    uint32_t max_caplen;
+    time_t first_ts;
+    time_t last_ts;
+} bench_pcap = {};
+
+static struct
+{
+    unsigned long long int files;
+    unsigned long long int packets;
+    unsigned long long int bytes;
+    unsigned long long int flows;
+    unsigned long long int skipped_flows;
+    uint64_t wall_usec;
+    uint64_t cpu_nsec;
+    uint64_t tsc_cycles;
+    int cache_counter_errno;
+    uint64_t cache_misses[CACHE_COUNTER_COUNT];
+} bench_results = {};
+
+/* Parsing recorded nDPId output with the nDPIsrvd.h client API, see run_json_bench(). */
+static struct
+{
+    unsigned long long int messages;
+    unsigned long long int bytes;
+    unsigned long long int checksum;
+    uint64_t wall_usec;
+    uint64_t cpu_nsec;
+    uint64_t tsc_cycles;
+    uint64_t callback_tsc_cycles;
+} json_bench_results = {};
+
+static struct bench_thread bench_threads[nDPId_MAX_READER_THREADS] = {};
+static int sink_write_fds[nDPId_MAX_READER_THREADS] = {};
+static int sink_read_fds[nDPId_MAX_READER_THREADS] = {};
+static int distributor_fds[2] = {-1, -1};
+static pthread_t sink_thread;
+static pthread_t distributor_thread;
+
+static uint64_t get_thread_cpu_nsec(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+    {
+        return 0;
+    }
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t get_tsc_cycles(void)
+{
+#ifdef BENCH_HAS_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static void close_cache_counters(struct bench_thread * const bench_thread)
+{
+    for (size_t i = 0; i < CACHE_COUNTER_COUNT; ++i)
+    {
+        if (bench_thread->cache_counter_fds[i] >= 0)
+        {
+            close(bench_thread->cache_counter_fds[i]);
+        }
+        bench_thread->cache_counter_fds[i] = -1;
+    }
+}
+
+/*
+ * Counts the cache misses of the calling thread in user space only, so it works with perf_event_paranoid <= 2.
+ * VMs and containers often do not expose hardware cache events, the results then say why.
+ */
+static void start_cache_counters(struct bench_thread * const bench_thread)
+{
+    bench_thread->cache_counter_errno = 0;
+    for (size_t i = 0; i < CACHE_COUNTER_COUNT; ++i)
+    {
+        bench_thread->cache_counter_fds[i] = -1;
+        bench_thread->cache_misses[i] = 0;
+    }
+
+    for (size_t i = 0; i < CACHE_COUNTER_COUNT; ++i)
+    {
+        struct perf_event_attr attr = {};
+
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.size = sizeof(attr);
+        attr.config = bench_cache_counter_config_table[i];
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        bench_thread->cache_counter_fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (bench_thread->cache_counter_fds[i] < 0)
+        {
+            bench_thread->cache_counter_errno = errno;
+            close_cache_counters(bench_thread);
+            return;
+        }
+    }
+
+    for (size_t i = 0; i < CACHE_COUNTER_COUNT; ++i)
+    {
+        ioctl(bench_thread->cache_counter_fds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(bench_thread->cache_counter_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+static void stop_cache_counters(struct bench_thread * const bench_thread)
+{
+    if (bench_thread->cache_counter_errno != 0)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < CACHE_COUNTER_COUNT; ++i)
+    {
+        ioctl(bench_thread->cache_counter_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+    for (size_t i = 0; i < CACHE_COUNTER_COUNT; ++i)
+    {
+        uint64_t value;
+
+        if (read(bench_thread->cache_counter_fds[i], &value, sizeof(value)) != (ssize_t)sizeof(value))
+        {
+            bench_thread->cache_counter_errno = (errno != 0 ? errno : EIO);
+            break;
+        }
+        bench_thread->cache_misses[i] = value;
+    }
+    close_cache_counters(bench_thread);
+}
+
+static void free_bench_pcap(void)
+{
+    free(bench_pcap.packets);
+    free(bench_pcap.data);
+    memset(&bench_pcap, 0, sizeof(bench_pcap));
+}
+
+static int load_bench_pcap(char const * const pcap_file)
+{
+    char pcap_error_buffer[PCAP_ERRBUF_SIZE];
+    pcap_t * const pcap_handle =
+        pcap_open_offline_with_tstamp_precision(pcap_file, PCAP_TSTAMP_PRECISION_MICRO, pcap_error_buffer);
+    struct pcap_pkthdr * header;
+    uint8_t const * packet;
+    int ret;
+
+    if (pcap_handle == NULL)
+    {
+        fprintf(stderr, "%s: %.*s\n", pcap_file, (int)PCAP_ERRBUF_SIZE, pcap_error_buffer);
+        return 1;
+    }
+
+    while ((ret = pcap_next_ex(pcap_handle, &header, &packet)) == 1)
+    {
+        if (bench_pcap.packets_used == bench_pcap.packets_size)
+        {
+            size_t const new_size = (bench_pcap.packets_size == 0 ? 1024 : bench_pcap.packets_size * 2);
+            struct bench_packet * const new_packets =
+                (struct bench_packet *)realloc(bench_pcap.packets, new_size * sizeof(*new_packets));
+            if (new_packets == NULL)
+            {
+                break;
+            }
+            bench_pcap.packets = new_packets;
+            bench_pcap.packets_size = new_size;
+        }
+        if (header->caplen > bench_pcap.data_size - bench_pcap.data_used)
+        {
+            size_t new_size = (bench_pcap.data_size == 0 ? 1024 * 1024 : bench_pcap.data_size * 2);
+            if (new_size < bench_pcap.data_used + header->caplen)
+            {
+                new_size = bench_pcap.data_used + header->caplen;
+            }
+            uint8_t * const new_data = (uint8_t *)realloc(bench_pcap.data, new_size);
+            if (new_data == NULL)
+            {
+                break;
+            }
+            bench_pcap.data = new_data;
+            bench_pcap.data_size = new_size;
+        }
+
+        struct bench_packet * const bench_packet = &bench_pcap.packets[bench_pcap.packets_used++];
+        bench_packet->header = *header;
+        /* offset for now, the data arena may still move */
+        bench_packet->data = (uint8_t const *)(uintptr_t)bench_pcap.data_used;
+        memcpy(bench_pcap.data + bench_pcap.data_used, packet, header->caplen);
+        bench_pcap.data_used += header->caplen;
+
+        if (header->caplen > bench_pcap.max_caplen)
+        {
+            bench_pcap.max_caplen = header->caplen;
+        }
+        if (bench_pcap.packets_used == 1)
+        {
+            bench_pcap.first_ts = header->ts.tv_sec;
+        }
+        bench_pcap.last_ts = header->ts.tv_sec;
+    }
+    if (ret == PCAP_ERROR)
+    {
+        fprintf(stderr,
+                "%s: %s, replaying the first %zu packets\n",
+                pcap_file,
+                pcap_geterr(pcap_handle),
+                bench_pcap.packets_used);
+    }
+    pcap_close(pcap_handle);
+
+    for (size_t i = 0; i < bench_pcap.packets_used; ++i)
+    {
+        bench_pcap.packets[i].data = bench_pcap.data + (uintptr_t)bench_pcap.packets[i].data;
+    }
+
+    return 0;
+}
+
+/*
+ * Find the layer3 header of every packet once, so the reader threads can rewrite addresses cheaply.
+ * Events of invalid packets are suppressed here, they are emitted again while replaying.
+ */
+static void prepare_bench_packets(struct nDPId_reader_thread * const reader_thread)
+{
+    reader_thread->suppress_events = 1;
+    for (size_t i = 0; i < bench_pcap.packets_used; ++i)
+    {
+        struct bench_packet * const bench_packet = &bench_pcap.packets[i];
+        uint16_t ip_offset = 0;
+        uint16_t type = 0;
+
+        if (process_datalink_layer(reader_thread, &bench_packet->header, bench_packet->data, &ip_offset, &type) == 0)
+        {
+            bench_packet->l3_offset = ip_offset;
+            bench_packet->l3_type = type;
+        }
+    }
+    reader_thread->suppress_events = 0;
+    reader_thread->suppressed_events = 0;
+}
+
+static void xor_address(uint8_t * const address, uint32_t mask)
+{
+    uint32_t value;
+
+    memcpy(&value, address, sizeof(value));
+    value ^= mask;
+    memcpy(address, &value, sizeof(value));
+}
+
+/* Both directions of a flow get the same mask, so every loop creates the same number of new flows. */
+static void rewrite_addresses(uint8_t * const packet, struct bench_packet const * const bench_packet, uint32_t loop)
+{
+    uint32_t const mask = htonl(loop);
+    uint32_t const caplen = bench_packet->header.caplen;
+
+    switch (bench_packet->l3_type)
+    {
+        case ETH_P_IP:
+            if (caplen >= (uint32_t)bench_packet->l3_offset + 20)
+            {
+                xor_address(packet + bench_packet->l3_offset + 12, mask);
+                xor_address(packet + bench_packet->l3_offset + 16, mask);
+            }
+            break;
+        case ETH_P_IPV6:
+            if (caplen >= (uint32_t)bench_packet->l3_offset + 40)
+            {
+                xor_address(packet + bench_packet->l3_offset + 20, mask);
+                xor_address(packet + bench_packet->l3_offset + 36, mask);
+            }
+            break;
+    }
+}
+
+/*
+ * Synthetic traffic, see -g.
+ * Every reader thread runs its own generator with the same seed and therefore sees the same packets,
+ * as it would with a pcap file. Flows arrive as a poisson process and live for a configurable time.
+ */
+#define SYNTH_EPOCH_USEC (1600000000ull * 1000000ull)
+#define SYNTH_MAX_PAYLOAD 512
+#define SYNTH_MAX_PACKET (14 + 40 + 20 + SYNTH_MAX_PAYLOAD)
+
+enum synth_lifetime_distribution
+{
+    LIFETIME_FIXED = 0,
+    LIFETIME_UNIFORM,
+    LIFETIME_EXPONENTIAL,
+
+    LIFETIME_COUNT
+};
+
+static char const * const synth_lifetime_name_table[LIFETIME_COUNT] = {
+    [LIFETIME_FIXED] = "fixed", [LIFETIME_UNIFORM] = "uniform", [LIFETIME_EXPONENTIAL] = "exponential"};
+
+enum synth_flow_end
+{
+    FLOW_END_IDLE = 0, /* stops sending, nDPId has to expire it */
+    FLOW_END_FIN,
+    FLOW_END_RST
+};
+
+static struct
+{
+    int enabled;
+    unsigned long long int flows;
+    unsigned long long int arrival_rate;
+    unsigned long long int lifetime;
+    enum synth_lifetime_distribution lifetime_distribution;
+    unsigned long long int packet_interval;
+    unsigned long long int tcp_share;
+    unsigned long long int udp_share;
+    unsigned long long int icmp_share;
+    unsigned long long int fin_share;
+    unsigned long long int rst_share;
+    unsigned long long int ipv6_share;
+    unsigned long long int seed;
+    unsigned long long int report_interval;
+} synth_options = {.enabled = 0,
+                   .flows = 1000000,
+                   .arrival_rate = 10000,
+                   .lifetime = 30000,
+                   .lifetime_distribution = LIFETIME_EXPONENTIAL,
+                   .packet_interval = 1000,
+                   .tcp_share = 70,
+                   .udp_share = 25,
+                   .icmp_share = 4,
+                   .fin_share = 70,
+                   .rst_share = 10,
+                   .ipv6_share = 20,
+                   .seed = 1,
+                   .report_interval = 0};
+
+enum synth_subopts
+{
+    SYNTH_FLOWS = 0,
+    SYNTH_ARRIVAL_RATE,
+    SYNTH_LIFETIME,
+    SYNTH_LIFETIME_DISTRIBUTION,
+    SYNTH_PACKET_INTERVAL,
+    SYNTH_TCP,
+    SYNTH_UDP,
+    SYNTH_ICMP,
+    SYNTH_FIN,
+    SYNTH_RST,
+    SYNTH_IPV6,
+    SYNTH_SEED,
+    SYNTH_REPORT_INTERVAL,
+};
+static char * const synth_subopt_token[] = {[SYNTH_FLOWS] = "flows",
+                                            [SYNTH_ARRIVAL_RATE] = "arrival-rate",
+                                            [SYNTH_LIFETIME] = "lifetime",
+                                            [SYNTH_LIFETIME_DISTRIBUTION] = "lifetime-distribution",
+                                            [SYNTH_PACKET_INTERVAL] = "packet-interval",
+                                            [SYNTH_TCP] = "tcp",
+                                            [SYNTH_UDP] = "udp",
+                                            [SYNTH_ICMP] = "icmp",
+                                            [SYNTH_FIN] = "fin",
+                                            [SYNTH_RST] = "rst",
+                                            [SYNTH_IPV6] = "ipv6",
+                                            [SYNTH_SEED] = "seed",
+                                            [SYNTH_REPORT_INTERVAL] = "report-interval",
+                                            NULL};
+
+struct synth_flow
+{
+    uint64_t next_usec; /* heap key */
+    uint64_t end_usec;
+    uint64_t index;
+    uint32_t packets;
+    uint8_t protocol;
+    uint8_t ipv6;
+    uint8_t end;
+    uint8_t closing;
+};
+
+struct synth_generator
+{
+    uint64_t random_state;
+    uint64_t next_arrival_usec;
+    unsigned long long int flows_started;
+    struct synth_flow * heap;
+    size_t heap_used;
+    size_t heap_size;
+    uint8_t packet[SYNTH_MAX_PACKET];
+};
+
+static uint64_t synth_random(struct synth_generator * const gen)
+{
+    /* xorshift64* */
+    uint64_t x = gen->random_state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    gen->random_state = x;
+
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+static uint64_t synth_random_exponential(struct synth_generator * const gen, double mean)
+{
+    /* uniform in (0, 1], never 0, as log(0) is not defined */
+    double const u = (double)((synth_random(gen) >> 11) + 1) / 9007199254740992.0;
+
+    return (uint64_t)(-log(u) * mean);
+}
+
+static int synth_random_percent(struct synth_generator * const gen, unsigned long long int share)
+{
+    return synth_random(gen) % 100 < share;
+}
+
+static uint64_t synth_random_lifetime(struct synth_generator * const gen)
+{
+    uint64_t const mean_usec = synth_options.lifetime * 1000;
+
+    switch (synth_options.lifetime_distribution)
+    {
+        case LIFETIME_FIXED:
+        case LIFETIME_COUNT:
+            break;
+        case LIFETIME_UNIFORM:
+            return synth_random(gen) % (2 * mean_usec + 1);
+        case LIFETIME_EXPONENTIAL:
+            return synth_random_exponential(gen, (double)mean_usec);
+    }
+
+    return mean_usec;
+}
+
+static void synth_heap_sift_up(struct synth_generator * const gen, size_t i)
+{
+    struct synth_flow const flow = gen->heap[i];
+
+    while (i > 0 && gen->heap[(i - 1) / 2].next_usec > flow.next_usec)
+    {
+        gen->heap[i] = gen->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    gen->heap[i] = flow;
+}
+
+static void synth_heap_sift_down(struct synth_generator * const gen, size_t i)
+{
+    struct synth_flow const flow = gen->heap[i];
+
+    for (;;)
+    {
+        size_t child = 2 * i + 1;
+
+        if (child >= gen->heap_used)
+        {
+            break;
+        }
+        if (child + 1 < gen->heap_used && gen->heap[child + 1].next_usec < gen->heap[child].next_usec)
+        {
+            child++;
+        }
+        if (gen->heap[child].next_usec >= flow.next_usec)
+        {
+            break;
+        }
+        gen->heap[i] = gen->heap[child];
+        i = child;
+    }
+    gen->heap[i] = flow;
+}
+
+static void synth_heap_pop(struct synth_generator * const gen)
+{
+    gen->heap[0] = gen->heap[--gen->heap_used];
+    if (gen->heap_used > 0)
+    {
+        synth_heap_sift_down(gen, 0);
+    }
+}
+
+static int synth_start_flow(struct synth_generator * const gen)
+{
+    if (gen->heap_used == gen->heap_size)
+    {
+        size_t const new_size = (gen->heap_size == 0 ? 1024 : gen->heap_size * 2);
+        struct synth_flow * const new_heap = (struct synth_flow *)realloc(gen->heap, new_size * sizeof(*new_heap));
+
+        if (new_heap == NULL)
+        {
+            return 1;
+        }
+        gen->heap = new_heap;
+        gen->heap_size = new_size;
+    }
+
+    struct synth_flow * const flow = &gen->heap[gen->heap_used];
+    uint64_t const protocol_share = synth_random(gen) % 100;
+
+    flow->next_usec = gen->next_arrival_usec;
+    flow->end_usec = gen->next_arrival_usec + synth_random_lifetime(gen);
+    flow->index = gen->flows_started++;
+    flow->packets = 0;
+    flow->ipv6 = synth_random_percent(gen, synth_options.ipv6_share);
+    flow->end = FLOW_END_IDLE;
+    flow->closing = 0;
+    if (protocol_share < synth_options.tcp_share)
+    {
+        uint64_t const end_share = synth_random(gen) % 100;
+
+        flow->protocol = IPPROTO_TCP;
+        if (end_share < synth_options.fin_share)
+        {
+            flow->end = FLOW_END_FIN;
+        }
+        else if (end_share < synth_options.fin_share + synth_options.rst_share)
+        {
+            flow->end = FLOW_END_RST;
+        }
+    }
+    else if (protocol_share < synth_options.tcp_share + synth_options.udp_share)
+    {
+        flow->protocol = IPPROTO_UDP;
+    }
+    else if (protocol_share < synth_options.tcp_share + synth_options.udp_share + synth_options.icmp_share)
+    {
+        flow->protocol = (flow->ipv6 != 0 ? IPPROTO_ICMPV6 : IPPROTO_ICMP);
+    }
+    else
+    {
+        flow->protocol = IPPROTO_GRE;
+    }
+    synth_heap_sift_up(gen, gen->heap_used++);
+
+    gen->next_arrival_usec += synth_random_exponential(gen, 1000000.0 / synth_options.arrival_rate);
+
+    return 0;
+}
+
+static uint16_t synth_ipv4_checksum(uint8_t const * const iph)
+{
+    uint32_t sum = 0;
+
+    for (size_t i = 0; i < 20; i += 2)
+    {
+        sum += (uint32_t)(iph[i] << 8 | iph[i + 1]);
+    }
+    while ((sum >> 16) != 0)
+    {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+
+    return (uint16_t)~sum;
+}
+
+/* Client and server addresses are derived from the flow index, so every flow has a unique 5-tuple. */
+static size_t synth_build_packet(struct synth_generator * const gen,
+                                 struct synth_flow const * const flow,
+                                 int from_server,
+                                 uint8_t tcp_flags,
+                                 size_t payload_len)
+{
+    static uint16_t const tcp_ports[] = {80, 443, 22, 25, 993, 8080};
+    static uint16_t const udp_ports[] = {53, 123, 443, 5060, 1194, 3478};
+    uint8_t * const packet = gen->packet;
+    uint8_t * l4;
+    size_t l4_len;
+    uint32_t const client_v4 = 0x0A000000 | (uint32_t)(flow->index & 0x00FFFFFF);
+    uint32_t const server_v4 = 0xAC100001 + (uint32_t)((flow->index >> 24) & 0x000FFFFF);
+    uint16_t const client_port = (uint16_t)(1024 + (flow->index * 7919) % 64511);
+    uint16_t const server_port = (flow->protocol == IPPROTO_TCP ? tcp_ports[flow->index % 6] : udp_ports[flow->index % 6]);
+
+    /* ethernet */
+    memset(packet, 0, 12);
+    packet[5] = (from_server != 0 ? 2 : 1);
+    packet[11] = (from_server != 0 ? 1 : 2);
+
+    if (flow->ipv6 == 0)
+    {
+        uint8_t * const iph = packet + 14;
+        uint32_t const saddr = htonl(from_server != 0 ? server_v4 : client_v4);
+        uint32_t const daddr = htonl(from_server != 0 ? client_v4 : server_v4);
+
+        packet[12] = 0x08;
+        packet[13] = 0x00;
+        memset(iph, 0, 20);
+        iph[0] = 0x45;
+        iph[8] = 64;
+        iph[9] = flow->protocol;
+        memcpy(iph + 12, &saddr, sizeof(saddr));
+        memcpy(iph + 16, &daddr, sizeof(daddr));
+        l4 = iph + 20;
+    }
+    else
+    {
+        uint8_t * const ip6h = packet + 14;
+        uint64_t const client_id = htobe64(flow->index + 1);
+        uint64_t const server_id = htobe64((flow->index >> 24) + 1);
+
+        packet[12] = 0x86;
+        packet[13] = 0xDD;
+        memset(ip6h, 0, 40);
+        ip6h[0] = 0x60;
+        ip6h[6] = flow->protocol;
+        ip6h[7] = 64;
+        ip6h[8] = 0xFD;
+        ip6h[24] = 0xFD;
+        ip6h[15] = (from_server != 0 ? 2 : 1);
+        ip6h[31] = (from_server != 0 ? 1 : 2);
+        memcpy(ip6h + 16, (from_server != 0 ? &server_id : &client_id), sizeof(client_id));
+        memcpy(ip6h + 32, (from_server != 0 ? &client_id : &server_id), sizeof(client_id));
+        l4 = ip6h + 40;
+    }
+
+    switch (flow->protocol)
+    {
+        case IPPROTO_TCP:
+        {
+            uint32_t const seq = htonl(flow->packets * SYNTH_MAX_PAYLOAD);
+
+            memset(l4, 0, 20);
+            l4[0] = (from_server != 0 ? server_port : client_port) >> 8;
+            l4[1] = (from_server != 0 ? server_port : client_port) & 0xFF;
+            l4[2] = (from_server != 0 ? client_port : server_port) >> 8;
+            l4[3] = (from_server != 0 ? client_port : server_port) & 0xFF;
+            memcpy(l4 + 4, &seq, sizeof(seq));
+            l4[12] = 5 << 4;
+            l4[13] = tcp_flags;
+            l4[14] = 0xFF;
+            l4[15] = 0xFF;
+            l4_len = 20;
+            break;
+        }
+        case IPPROTO_UDP:
+            l4[0] = (from_server != 0 ? server_port : client_port) >> 8;
+            l4[1] = (from_server != 0 ? server_port : client_port) & 0xFF;
+            l4[2] = (from_server != 0 ? client_port : server_port) >> 8;
+            l4[3] = (from_server != 0 ? client_port : server_port) & 0xFF;
+            l4[4] = (uint8_t)((8 + payload_len) >> 8);
+            l4[5] = (uint8_t)((8 + payload_len) & 0xFF);
+            l4[6] = 0;
+            l4[7] = 0;
+            l4_len = 8;
+            break;
+        case IPPROTO_ICMP:
+        case IPPROTO_ICMPV6:
+            memset(l4, 0, 8);
+            if (flow->protocol == IPPROTO_ICMP)
+            {
+                l4[0] = (from_server != 0 ? 0 : 8); /* echo reply / request */
+            }
+            else
+            {
+                l4[0] = (from_server != 0 ? 129 : 128);
+            }
+            l4[4] = (uint8_t)(flow->index >> 8);
+            l4[5] = (uint8_t)(flow->index & 0xFF);
+            l4[7] = (uint8_t)(flow->packets / 2);
+            l4_len = 8;
+            break;
+        default:
+            memset(l4, 0, 4);
+            l4[2] = 0x88; /* GRE, transparent ethernet bridging */
+            l4[3] = 0x58;
+            l4_len = 4;
+            break;
+    }
+
+    for (size_t i = 0; i < payload_len; i += sizeof(uint64_t))
+    {
+        uint64_t const random = synth_random(gen);
+        memcpy(l4 + l4_len + i, &random, (payload_len - i < sizeof(random) ? payload_len - i : sizeof(random)));
+    }
+
+    size_t const l3_payload_len = l4_len + payload_len;
+    if (flow->ipv6 == 0)
+    {
+        uint8_t * const iph = packet + 14;
+
+        iph[2] = (uint8_t)((20 + l3_payload_len) >> 8);
+        iph[3] = (uint8_t)((20 + l3_payload_len) & 0xFF);
+        iph[4] = (uint8_t)(flow->packets >> 8);
+        iph[5] = (uint8_t)(flow->packets & 0xFF);
+        uint16_t const checksum = synth_ipv4_checksum(iph);
+        iph[10] = checksum >> 8;
+        iph[11] = checksum & 0xFF;
+
+        return 14 + 20 + l3_payload_len;
+    }
+
+    packet[14 + 4] = (uint8_t)(l3_payload_len >> 8);
+    packet[14 + 5] = (uint8_t)(l3_payload_len & 0xFF);
+
+    return 14 + 40 + l3_payload_len;
+}
+
+/*
+ * Produces the next packet in capture time order.
+ * TCP flows start with a three way handshake and end with a FIN exchange, a RST or just stop.
+ * Returns 1 if all flows have ended.
+ */
+static int synth_next_packet(struct synth_generator * const gen, struct pcap_pkthdr * const header)
+{
+    for (;;)
+    {
+        if (gen->flows_started < synth_options.flows &&
+            (gen->heap_used == 0 || gen->next_arrival_usec <= gen->heap[0].next_usec))
+        {
+            if (synth_start_flow(gen) != 0)
+            {
+                return 1;
+            }
+            continue;
+        }
+        if (gen->heap_used == 0)
+        {
+            return 1;
+        }
+
+        struct synth_flow * const flow = &gen->heap[0];
+        uint64_t const now_usec = flow->next_usec;
+        int from_server = flow->packets % 2;
+        uint8_t tcp_flags = 0x18; /* PSH, ACK */
+        size_t payload_len = 1 + synth_random(gen) % SYNTH_MAX_PAYLOAD;
+        int last_packet = 0;
+
+        if (now_usec >= flow->end_usec && flow->closing == 0)
+        {
+            if (flow->protocol != IPPROTO_TCP || flow->end == FLOW_END_IDLE)
+            {
+                synth_heap_pop(gen);
+                continue;
+            }
+            flow->closing = 1;
+            from_server = 0;
+            payload_len = 0;
+            tcp_flags = (flow->end == FLOW_END_RST ? 0x04 : 0x11); /* RST or FIN, ACK */
+            last_packet = (flow->end == FLOW_END_RST);
+        }
+        else if (flow->closing != 0)
+        {
+            from_server = 1;
+            payload_len = 0;
+            tcp_flags = 0x11;
+            last_packet = 1;
+        }
+        else if (flow->protocol == IPPROTO_TCP && flow->packets < 3)
+        {
+            static uint8_t const handshake_flags[] = {0x02, 0x12, 0x10}; /* SYN, SYN+ACK, ACK */
+
+            tcp_flags = handshake_flags[flow->packets];
+            payload_len = 0;
+        }
+
+        size_t const packet_len = synth_build_packet(gen, flow, from_server, tcp_flags, payload_len);
+        header->ts.tv_sec = (SYNTH_EPOCH_USEC + now_usec) / 1000000;
+        header->ts.tv_usec = (SYNTH_EPOCH_USEC + now_usec) % 1000000;
+        header->caplen = packet_len;
+        header->len = packet_len;
+
+        if (last_packet != 0)
+        {
+            synth_heap_pop(gen);
+        }
+        else
+        {
+            flow->packets++;
+            flow->next_usec +=
+                (flow->closing != 0 ? 1 : 1 + synth_random_exponential(gen, synth_options.packet_interval * 1000.0));
+            synth_heap_sift_down(gen, 0);
+        }
+
+        return 0;
+    }
+}
+
+static int setup_packet_batch(struct nDPId_reader_thread * const reader_thread, uint32_t max_caplen)
+{
+    if (nDPId_options.packet_batch_size <= 1)
+    {
+        return 0;
+    }
+
+    reader_thread->packet_batch_used = 0;
+    reader_thread->packet_batch_data_used = 0;
+    reader_thread->packet_batch_data_size = nDPId_options.packet_batch_size * (max_caplen + 63);
+    reader_thread->packet_batch_data = (uint8_t *)malloc(reader_thread->packet_batch_data_size);
+
+    return reader_thread->packet_batch_data == NULL;
+}
+
+static void finish_packet_batch(struct nDPId_reader_thread * const reader_thread)
+{
+    if (nDPId_options.packet_batch_size <= 1)
+    {
+        return;
+    }
+
+    process_packet_batch(reader_thread);
+    free(reader_thread->packet_batch_data);
+    reader_thread->packet_batch_data = NULL;
+}
+
+static void * bench_reader_thread(void * const arg)
+{
+    struct nDPId_reader_thread * const reader_thread = (struct nDPId_reader_thread *)arg;
+    struct bench_thread * const bench_thread = &bench_threads[reader_thread->array_index];
+    uint8_t * packet_copy = NULL;
+    int const batched = (nDPId_options.packet_batch_size > 1);
+
+    if (bench_options.rewrite_flows != 0)
+    {
+        packet_copy = (uint8_t *)malloc(bench_pcap.max_caplen);
+        if (packet_copy == NULL)
+        {
+            return NULL;
+        }
+    }
+    if (setup_packet_batch(reader_thread, bench_pcap.max_caplen) != 0)
+    {
+        free(packet_copy);
+        return NULL;
+    }
+
+    start_cache_counters(bench_thread);
+    uint64_t const cpu_start = get_thread_cpu_nsec();
+    uint64_t const tsc_start = get_tsc_cycles();
+    for (unsigned long long int loop = 0; loop < bench_options.loops; ++loop)
+    {
+        /* keep the capture time monotonic, otherwise flows would never time out */
+        time_t const ts_shift = (time_t)loop * (bench_pcap.last_ts - bench_pcap.first_ts + 1);
+
+        for (size_t i = 0; i < bench_pcap.packets_used; ++i)
+        {
+            struct bench_packet const * const bench_packet = &bench_pcap.packets[i];
+            struct pcap_pkthdr header = bench_packet->header;
+            uint8_t const * packet = bench_packet->data;
+
+            header.ts.tv_sec += ts_shift;
+            if (packet_copy != NULL && loop > 0 && bench_packet->l3_type != 0)
+            {
+                memcpy(packet_copy, packet, header.caplen);
+                rewrite_addresses(packet_copy, bench_packet, loop);
+                packet = packet_copy;
+            }
+
+            if (batched != 0)
+            {
+                ndpi_collect_packet((uint8_t *)reader_thread, &header, packet);
+            }
+            else
+            {
+                ndpi_process_packet((uint8_t *)reader_thread, &header, packet);
+            }
+        }
+    }
+    finish_packet_batch(reader_thread);
+    bench_thread->tsc_cycles = get_tsc_cycles() - tsc_start;
+    bench_thread->cpu_nsec = get_thread_cpu_nsec() - cpu_start;
+    stop_cache_counters(bench_thread);
+
+    free(packet_copy);
+    return NULL;
+}
+
+static void print_synth_report(struct nDPId_reader_thread const * const reader_thread,
+                               struct synth_generator const * const gen,
+                               uint64_t synthetic_usec)
+{
+    printf("~~ synthetic time %llus: flows started/active %llu/%zu, "
+           "reader thread 0 flows active/idle/skipped %llu/%llu/%llu, resident memory %zu KiB\n",
+           (unsigned long long int)(synthetic_usec / 1000000),
+           gen->flows_started,
+           gen->heap_used,
+           reader_thread->workflow->cur_active_flows,
+           reader_thread->workflow->cur_idle_flows,
+           reader_thread->workflow->total_skipped_flows,
+           get_resident_set_size() / 1024);
+    fflush(stdout);
+}
+
+static void * synth_reader_thread(void * const arg)
+{
+    struct nDPId_reader_thread * const reader_thread = (struct nDPId_reader_thread *)arg;
+    struct bench_thread * const bench_thread = &bench_threads[reader_thread->array_index];
+    struct synth_generator * const gen = (struct synth_generator *)calloc(1, sizeof(*gen));
+    int const batched = (nDPId_options.packet_batch_size > 1);
+    int const report = (synth_options.report_interval > 0 && reader_thread->array_index == 0);
+    uint64_t next_report_usec = synth_options.report_interval * 1000000;
+    struct pcap_pkthdr header;
+
+    if (gen == NULL)
+    {
+        return NULL;
+    }
+    gen->random_state = synth_options.seed ^ 0x9E3779B97F4A7C15ull;
+    if (gen->random_state == 0)
+    {
+        gen->random_state = 1;
+    }
+    if (setup_packet_batch(reader_thread, SYNTH_MAX_PACKET) != 0)
+    {
+        free(gen);
+        return NULL;
+    }
+
+    start_cache_counters(bench_thread);
+    uint64_t const cpu_start = get_thread_cpu_nsec();
+    uint64_t const tsc_start = get_tsc_cycles();
+    while (synth_next_packet(gen, &header) == 0)
+    {
+        if (batched != 0)
+        {
+            ndpi_collect_packet((uint8_t *)reader_thread, &header, gen->packet);
+        }
+        else
+        {
+            ndpi_process_packet((uint8_t *)reader_thread, &header, gen->packet);
+        }
+        bench_thread->packets++;
+        bench_thread->bytes += header.len;
+
+        if (report != 0)
+        {
+            uint64_t const synthetic_usec =
+                (uint64_t)header.ts.tv_sec * 1000000 + header.ts.tv_usec - SYNTH_EPOCH_USEC;
+
+            if (synthetic_usec >= next_report_usec)
+            {
+                print_synth_report(reader_thread, gen, synthetic_usec);
+                next_report_usec += synth_options.report_interval * 1000000;
+            }
+        }
+    }
+    finish_packet_batch(reader_thread);
+    bench_thread->tsc_cycles = get_tsc_cycles() - tsc_start;
+    bench_thread->cpu_nsec = get_thread_cpu_nsec() - cpu_start;
+    stop_cache_counters(bench_thread);
+
+    free(gen->heap);
+    free(gen);
+    return NULL;
+}
+
+static void * pipe_sink_thread(void * const arg)
+{
+    int const epollfd = epoll_create1(0);
+    size_t open_fds = 0;
+    struct epoll_event events[32];
+    char buf[NETWORK_BUFFER_MAX_SIZE];
+
+    (void)arg;
+    if (epollfd < 0)
+    {
+        return NULL;
+    }
+    for (unsigned long long int i = 0; i < bench_options.reader_thread_count; ++i)
+    {
+        if (add_event(epollfd, sink_read_fds[i], NULL) == 0)
+        {
+            open_fds++;
+        }
+    }
+
+    while (open_fds > 0)
+    {
+        int const nready = epoll_wait(epollfd, events, sizeof(events) / sizeof(events[0]), -1);
+
+        if (nready < 0 && errno != EINTR)
+        {
+            break;
+        }
+        for (int i = 0; i < nready; ++i)
+        {
+            if (read(events[i].data.fd, buf, sizeof(buf)) <= 0)
+            {
+                del_event(epollfd, events[i].data.fd);
+                open_fds--;
+            }
+        }
+    }
+
+    close(epollfd);
+    return NULL;
+}
+
+static void * distributor_drain_thread(void * const arg)
+{
+    char buf[NETWORK_BUFFER_MAX_SIZE];
+
+    (void)arg;
+    while (read(distributor_fds[0], buf, sizeof(buf)) > 0) {}
+
+    return NULL;
+}
+
+static void * nDPIsrvd_sink_thread(void * const arg)
+{
+    int const epollfd = create_evq();
+    size_t open_fds = 0;
+    struct epoll_event events[32];
+
+    (void)arg;
+    if (epollfd < 0)
+    {
+        return NULL;
+    }
+
+    struct remote_desc * const serv_desc = get_unused_remote_descriptor(SERV_SOCK, distributor_fds[1]);
+    if (serv_desc == NULL)
+    {
+        close(epollfd);
+        return NULL;
+    }
+    strncpy(serv_desc->event_serv.peer_addr, "0.0.0.0", sizeof(serv_desc->event_serv.peer_addr));
+    serv_desc->event_serv.peer.sin_port = 0;
+    if (ctl_event(epollfd, EPOLL_CTL_ADD, distributor_fds[1], serv_desc, EPOLLET) != 0)
+    {
+        disconnect_client(-1, serv_desc);
+        close(epollfd);
+        return NULL;
+    }
+
+    for (unsigned long long int i = 0; i < bench_options.reader_thread_count; ++i)
+    {
+        struct remote_desc * const json_desc = get_unused_remote_descriptor(JSON_SOCK, sink_read_fds[i]);
+
+        if (json_desc != NULL && add_event(epollfd, sink_read_fds[i], json_desc) == 0)
+        {
+            open_fds++;
+        }
+    }
+
+    while (open_fds > 0)
+    {
+        int const nready = epoll_wait(epollfd, events, sizeof(events) / sizeof(events[0]), -1);
+
+        if (nready < 0 && errno != EINTR)
+        {
+            break;
+        }
+        for (int i = 0; i < nready; ++i)
+        {
+            struct remote_desc * const current = (struct remote_desc *)events[i].data.ptr;
+
+            if (current == serv_desc)
+            {
+                handle_incoming_data_event(epollfd, &events[i]);
+                continue;
+            }
+            /*
+             * a drained pipe without writers reports EPOLLHUP only, which nDPIsrvd does not expect
+             * (a paused collector reports it as well, although there is unread data left)
+             */
+            if ((events[i].events & EPOLLIN) == 0 && collectors_paused == 0)
+            {
+                disconnect_client(epollfd, current);
+                open_fds--;
+                continue;
+            }
+            if (handle_incoming_data_event(epollfd, &events[i]) != 0 && current->fd < 0)
+            {
+                open_fds--;
+            }
+        }
+    }
+
+    close(epollfd);
+    disconnect_client(-1, serv_desc);
+    return NULL;
+}
+
+static int setup_sink(void)
+{
+    for (unsigned long long int i = 0; i < bench_options.reader_thread_count; ++i)
+    {
+        int pipefds[2];
+
+        switch (bench_options.sink)
+        {
+            case SINK_NULL:
+                sink_read_fds[i] = -1;
+                sink_write_fds[i] = open("/dev/null", O_WRONLY | O_CLOEXEC);
+                if (sink_write_fds[i] < 0)
+                {
+                    return 1;
+                }
+                break;
+            case SINK_PIPE:
+            case SINK_NDPISRVD:
+                if (pipe2(pipefds, O_CLOEXEC) != 0)
+                {
+                    return 1;
+                }
+                sink_read_fds[i] = pipefds[0];
+                sink_write_fds[i] = pipefds[1];
+                break;
+            case SINK_COUNT:
+                return 1;
+        }
+    }
+
+    switch (bench_options.sink)
+    {
+        case SINK_NULL:
+        case SINK_COUNT:
+            break;
+        case SINK_PIPE:
+            return pthread_create(&sink_thread, NULL, pipe_sink_thread, NULL) != 0;
+        case SINK_NDPISRVD:
+            /* We do not have any sockets, any socket operation must fail! */
+            json_sockfd = -1;
+            serv_sockfd = -1;
+            if (pipe2(distributor_fds, O_CLOEXEC) != 0 ||
+                setup_remote_descriptors(bench_options.reader_thread_count + 1) != 0 ||
+                pthread_create(&distributor_thread, NULL, distributor_drain_thread, NULL) != 0)
+            {
+                return 1;
+            }
+            return pthread_create(&sink_thread, NULL, nDPIsrvd_sink_thread, NULL) != 0;
+    }
+
+    return 0;
+}
+
+static void shutdown_sink(void)
+{
+    for (unsigned long long int i = 0; i < bench_options.reader_thread_count; ++i)
+    {
+        close(sink_write_fds[i]);
+    }
+
+    switch (bench_options.sink)
+    {
+        case SINK_NULL:
+        case SINK_COUNT:
+            break;
+        case SINK_PIPE:
+            pthread_join(sink_thread, NULL);
+            for (unsigned long long int i = 0; i < bench_options.reader_thread_count; ++i)
+            {
+                close(sink_read_fds[i]);
+            }
+            break;
+        case SINK_NDPISRVD:
+            /* nDPIsrvd closes the collector pipes and the distributor pipe itself */
+            pthread_join(sink_thread, NULL);
+            pthread_join(distributor_thread, NULL);
+            close(distributor_fds[0]);
+            break;
+    }
+}
+
+/* Runs all reader threads to completion and collects their results, the reader threads have to be set up already. */
+static void run_reader_threads(void * (*thread_fn)(void *))
+{
+    uint64_t wall_start;
+
+    for (unsigned long long int i = 0; i < nDPId_options.reader_thread_count; ++i)
+    {
+        /* process_remaining_flows() closes the sink fd of every reader thread */
+        reader_threads[i].json_sockfd = dup(sink_write_fds[i]);
+        reader_threads[i].json_sock_reconnect = 0;
+        jsonize_daemon(&reader_threads[i], DAEMON_EVENT_INIT);
+        bench_threads[i].packets = 0;
+        bench_threads[i].bytes = 0;
+    }
+
+    wall_start = get_monotonic_usec();
+    for (unsigned long long int i = 0; i < nDPId_options.reader_thread_count; ++i)
+    {
+        bench_threads[i].started = (create_reader_thread(&reader_threads[i], thread_fn) == 0);
+        if (bench_threads[i].started == 0)
+        {
+            syslog(LOG_DAEMON | LOG_ERR, "pthread_create: %s", strerror(errno));
+        }
+    }
+    for (unsigned long long int i = 0; i < nDPId_options.reader_thread_count; ++i)
+    {
+        if (bench_threads[i].started != 0)
+        {
+            pthread_join(reader_threads[i].thread_id, NULL);
+            bench_results.cpu_nsec += bench_threads[i].cpu_nsec;
+            bench_results.tsc_cycles += bench_threads[i].tsc_cycles;
+            if (bench_threads[i].cache_counter_errno != 0)
+            {
+                bench_results.cache_counter_errno = bench_threads[i].cache_counter_errno;
+            }
+            for (size_t j = 0; j < CACHE_COUNTER_COUNT; ++j)
+            {
+                bench_results.cache_misses[j] += bench_threads[i].cache_misses[j];
+            }
+        }
+    }
+    bench_results.wall_usec += get_monotonic_usec() - wall_start;
+
+    process_remaining_flows();
+    for (unsigned long long int i = 0; i < nDPId_options.reader_thread_count; ++i)
+    {
+        bench_results.flows += reader_threads[i].workflow->total_active_flows;
+        bench_results.skipped_flows += reader_threads[i].workflow->total_skipped_flows;
+    }
+
+    free_reader_threads();
+}
+
+static int run_bench_file(char const * const pcap_file)
+{
+    if (load_bench_pcap(pcap_file) != 0)
+    {
+        return 1;
+    }
+    if (bench_pcap.packets_used == 0)
+    {
+        free_bench_pcap();
+        return 0;
+    }
+
+    nDPId_options.pcap_file_or_interface = (char *)pcap_file;
+    if (setup_reader_threads() != 0)
+    {
+        free_bench_pcap();
+        return 1;
+    }
+
+    prepare_bench_packets(&reader_threads[0]);
+    run_reader_threads(bench_reader_thread);
+
+    bench_results.files++;
+    for (size_t i = 0; i < bench_pcap.packets_used; ++i)
+    {
+        bench_results.packets += bench_options.loops;
+        bench_results.bytes += bench_options.loops * bench_pcap.packets[i].header.len;
+    }
+    free_bench_pcap();
+
+    return 0;
+}
+
+/*
+ * The workflows need a capture handle for the datalink type only.
+ * An empty ethernet pcap file is created for it, which is removed as soon as the workflows are initialized.
+ */
+static int run_bench_synthetic(void)
+{
+    char pcap_file[] = "/tmp/nDPId-bench-XXXXXX";
+    int const pcap_fd = mkstemp(pcap_file);
+    FILE * pcap_fp;
+    pcap_t * pcap_handle;
+    pcap_dumper_t * pcap_dumper;
+    int retval;
+
+    if (pcap_fd < 0)
+    {
+        fprintf(stderr, "mkstemp: %s\n", strerror(errno));
+        return 1;
+    }
+    pcap_fp = fdopen(pcap_fd, "wb");
+    if (pcap_fp == NULL)
+    {
+        close(pcap_fd);
+        unlink(pcap_file);
+        return 1;
+    }
+    pcap_handle = pcap_open_dead(DLT_EN10MB, SYNTH_MAX_PACKET);
+    pcap_dumper = (pcap_handle != NULL ? pcap_dump_fopen(pcap_handle, pcap_fp) : NULL);
+    if (pcap_dumper == NULL)
+    {
+        fclose(pcap_fp);
+    }
+    else
+    {
+        pcap_dump_close(pcap_dumper);
+    }
+    if (pcap_handle != NULL)
+    {
+        pcap_close(pcap_handle);
+    }
+
+    nDPId_options.pcap_file_or_interface = pcap_file;
+    retval = (pcap_dumper == NULL || setup_reader_threads() != 0);
+    unlink(pcap_file);
+    if (retval != 0)
+    {
+        return 1;
+    }
+
+    run_reader_threads(synth_reader_thread);
+    bench_results.packets += bench_threads[0].packets;
+    bench_results.bytes += bench_threads[0].bytes;
+
+    return 0;
+}
+
+static int pcap_file_filter(struct dirent const * const entry)
+{
+    size_t const len = strlen(entry->d_name);
+    char const * const suffixes[] = {".pcap", ".pcapng", ".cap"};
+
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); ++i)
+    {
+        size_t const suffix_len = strlen(suffixes[i]);
+        if (len > suffix_len && strcmp(entry->d_name + len - suffix_len, suffixes[i]) == 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Replays a single pcap file or all pcap files of a directory (e.g. the nDPI test pcaps). */
+static int run_bench_path(char const * const path)
+{
+    struct dirent ** entries;
+    int entry_count;
+    int retval = 0;
+
+    entry_count = scandir(path, &entries, pcap_file_filter, alphasort);
+    if (entry_count < 0)
+    {
+        return run_bench_file(path);
+    }
+
+    for (int i = 0; i < entry_count; ++i)
+    {
+        char pcap_file[PATH_MAX];
+
+        if (snprintf(pcap_file, sizeof(pcap_file), "%s/%s", path, entries[i]->d_name) > 0 &&
+            run_bench_file(pcap_file) != 0)
+        {
+            retval = 1;
+        }
+        free(entries[i]);
+    }
+    free(entries);
+
+    return retval;
+}
+
+/* Reads the fields c-captured and c-collectd use, as a typical consumer would. */
+static enum nDPIsrvd_callback_return json_bench_callback(struct nDPIsrvd_socket * const sock,
+                                                         struct nDPIsrvd_flow * const flow)
+{
+    uint64_t const tsc_start = get_tsc_cycles();
+    nDPIsrvd_ull value = 0;
+    int midstream = 0;
+
+    json_bench_results.messages++;
+    if (flow != NULL)
+    {
+        json_bench_results.checksum += flow->id_as_ull;
+    }
+
+    if (TOKEN_VALUE_EQUALS_SZ(TOKEN_GET_SZ(sock, "packet_event_name"), "packet-flow") != 0)
+    {
+        TOKEN_GET_ULL_SZ(sock, "pkt_ts_sec", &value);
+        json_bench_results.checksum += value;
+        TOKEN_GET_ULL_SZ(sock, "pkt_ts_usec", &value);
+        json_bench_results.checksum += value;
+        TOKEN_GET_ULL_SZ(sock, "pkt_l4_len", &value);
+        json_bench_results.checksum += value;
+    }
+
+    if (TOKEN_GET_SZ(sock, "flow_event_name") != NULL)
+    {
+        TOKEN_GET_ULL_SZ(sock, "flow_id", &value);
+        json_bench_results.checksum += value;
+        TOKEN_GET_ULL_SZ(sock, "flow_tot_l4_payload_len", &value);
+        json_bench_results.checksum += value;
+        TOKEN_GET_ULL_SZ(sock, "flow_datalink", &value);
+        json_bench_results.checksum += value;
+        TOKEN_GET_BOOL_SZ(sock, "midstream", &midstream);
+        json_bench_results.checksum += midstream;
+    }
+
+    json_bench_results.callback_tsc_cycles += get_tsc_cycles() - tsc_start;
+    return CALLBACK_OK;
+}
+
+static int run_json_bench(char const * const json_file)
+{
+    struct stat st;
+    int const fd = open(json_file, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        fprintf(stderr, "Could not open %s: %s\n", json_file, strerror(errno));
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return 1;
+    }
+
+    uint8_t * const json_data =
+        (st.st_size > 0 ? (uint8_t *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED);
+    close(fd);
+    if (json_data == MAP_FAILED)
+    {
+        fprintf(stderr, "Could not map %s\n", json_file);
+        return 1;
+    }
+
+    struct timespec wall_start;
+    struct timespec wall_end;
+    uint64_t const cpu_start = get_thread_cpu_nsec();
+    uint64_t const tsc_start = get_tsc_cycles();
+    int retval = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
+    for (unsigned long long int loop = 0; loop < bench_options.loops && retval == 0; ++loop)
+    {
+        struct nDPIsrvd_socket * json_sock = nDPIsrvd_init(0, 0, json_bench_callback, NULL);
+        size_t offset = 0;
+
+        if (json_sock == NULL)
+        {
+            retval = 1;
+            break;
+        }
+        while (offset < (size_t)st.st_size)
+        {
+            size_t length = json_sock->buffer.max - json_sock->buffer.used;
+            enum nDPIsrvd_parse_return parse_ret;
+
+            if (length > (size_t)st.st_size - offset)
+            {
+                length = st.st_size - offset;
+            }
+            memcpy(json_sock->buffer.ptr.raw + json_sock->buffer.used, json_data + offset, length);
+            json_sock->buffer.used += length;
+            offset += length;
+
+            parse_ret = nDPIsrvd_parse_all(json_sock);
+            if (parse_ret != PARSE_NEED_MORE_DATA)
+            {
+                fprintf(stderr,
+                        "%s: parse failed at offset %zu: %s\n",
+                        json_file,
+                        offset,
+                        nDPIsrvd_enum_to_string(parse_ret));
+                retval = 1;
+                break;
+            }
+        }
+        nDPIsrvd_free(&json_sock);
+        json_bench_results.bytes += st.st_size;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+
+    json_bench_results.cpu_nsec = get_thread_cpu_nsec() - cpu_start;
+    json_bench_results.tsc_cycles = get_tsc_cycles() - tsc_start;
+    json_bench_results.wall_usec = (wall_end.tv_sec - wall_start.tv_sec) * 1000000ull +
+                                   (wall_end.tv_nsec - wall_start.tv_nsec) / 1000;
+    munmap(json_data, st.st_size);
+
+    return retval;
+}
+
+static void print_json_bench_results(void)
+{
+    double const wall_sec = (double)json_bench_results.wall_usec / 1000000.0;
+
+    printf(
+        "~~~~~~~~~~~~~~~~~~ JSON BENCHMARK ~~~~~~~~~~~~~~~~~\n"
+        "~~ file/loops..................: %s/%llu\n"
+        "~~ messages/bytes..............: %llu/%llu\n"
+        "~~ wall time...................: %.3f s\n"
+        "~~ messages per second.........: %.0f\n",
+        bench_options.json_file,
+        bench_options.loops,
+        json_bench_results.messages,
+        json_bench_results.bytes,
+        wall_sec,
+        (wall_sec > 0 ? json_bench_results.messages / wall_sec : 0));
+    if (json_bench_results.messages > 0)
+    {
+#ifdef BENCH_HAS_TSC
+        printf("~~ cycles per message (TSC).....: %.0f\n",
+               (double)json_bench_results.tsc_cycles / json_bench_results.messages);
+        printf("~~ field access cycles (TSC)....: %.0f\n",
+               (double)json_bench_results.callback_tsc_cycles / json_bench_results.messages);
+#endif
+        printf("~~ CPU time per message.........: %.0f ns\n",
+               (double)json_bench_results.cpu_nsec / json_bench_results.messages);
+    }
+    printf(
+        "~~ checksum....................: %llu\n"
+        "~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n",
+        json_bench_results.checksum);
+}
+
+static void print_bench_results(void)
+{
+    double const wall_sec = (double)bench_results.wall_usec / 1000000.0;
+    unsigned long long int events_emitted = 0;
+    unsigned long long int events_dropped = 0;
+    struct rusage usage;
+
+    for (unsigned long long int i = 0; i < nDPId_options.reader_thread_count; ++i)
+    {
+        events_emitted += reader_threads[i].stats.events_emitted;
+        events_dropped += reader_threads[i].stats.events_dropped;
+    }
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+    {
+        usage.ru_maxrss = 0;
+    }
+
+    printf(
+        "~~~~~~~~~~~~~~~~~~~~ BENCHMARK ~~~~~~~~~~~~~~~~~~~~\n"
+        "~~ sink........................: %s\n"
+        "~~ reader threads/loops........: %llu/%llu%s\n"
+        "~~ files/packets/bytes.........: %llu/%llu/%llu\n"
+        "~~ wall time...................: %.3f s\n"
+        "~~ packets per second..........: %.0f\n"
+        "~~ Mbit per second.............: %.2f\n",
+        bench_sink_name_table[bench_options.sink],
+        nDPId_options.reader_thread_count,
+        bench_options.loops,
+        (synth_options.enabled != 0 ? " (synthetic traffic)"
+                                    : (bench_options.rewrite_flows != 0 ? " (rewritten flows)" : "")),
+        bench_results.files,
+        bench_results.packets,
+        bench_results.bytes,
+        wall_sec,
+        (wall_sec > 0 ? bench_results.packets / wall_sec : 0),
+        (wall_sec > 0 ? bench_results.bytes * 8 / wall_sec / 1000000.0 : 0));
+    /* every reader thread sees every packet, see ndpi_process_packet() */
+    if (bench_results.packets > 0)
+    {
+#ifdef BENCH_HAS_TSC
+        printf("~~ cycles per packet (TSC)......: %.0f\n", (double)bench_results.tsc_cycles / bench_results.packets);
+#endif
+        printf("~~ CPU time per packet..........: %.0f ns\n", (double)bench_results.cpu_nsec / bench_results.packets);
+        for (size_t i = 0; i < CACHE_COUNTER_COUNT; ++i)
+        {
+            if (bench_results.cache_counter_errno != 0)
+            {
+                printf("~~ %s: not available (%s)\n",
+                       bench_cache_counter_name_table[i],
+                       strerror(bench_results.cache_counter_errno));
+            }
+            else
+            {
+                printf("~~ %s: %.2f\n",
+                       bench_cache_counter_name_table[i],
+                       (double)bench_results.cache_misses[i] / bench_results.packets);
+            }
+        }
+    }
+    printf(
+        "~~ flows total/skipped.........: %llu/%llu\n"
+        "~~ flows per second............: %.0f\n"
+        "~~ events emitted/dropped......: %llu/%llu\n"
+        "~~ peak resident memory........: %ld KiB\n"
+        "~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n",
+        bench_results.flows,
+        bench_results.skipped_flows,
+        (wall_sec > 0 ? bench_results.flows / wall_sec : 0),
+        events_emitted,
+        events_dropped,
+        usage.ru_maxrss);
+}
+
+static unsigned long long int * get_synth_subopt_value(enum synth_subopts subopt)
+{
+    switch (subopt)
+    {
+        case SYNTH_FLOWS:
+            return &synth_options.flows;
+        case SYNTH_ARRIVAL_RATE:
+            return &synth_options.arrival_rate;
+        case SYNTH_LIFETIME:
+            return &synth_options.lifetime;
+        case SYNTH_LIFETIME_DISTRIBUTION:
+            break;
+        case SYNTH_PACKET_INTERVAL:
+            return &synth_options.packet_interval;
+        case SYNTH_TCP:
+            return &synth_options.tcp_share;
+        case SYNTH_UDP:
+            return &synth_options.udp_share;
+        case SYNTH_ICMP:
+            return &synth_options.icmp_share;
+        case SYNTH_FIN:
+            return &synth_options.fin_share;
+        case SYNTH_RST:
+            return &synth_options.rst_share;
+        case SYNTH_IPV6:
+            return &synth_options.ipv6_share;
+        case SYNTH_SEED:
+            return &synth_options.seed;
+        case SYNTH_REPORT_INTERVAL:
+            return &synth_options.report_interval;
+    }
+
+    return NULL;
+}
+
+static void print_synth_subopt_usage(void)
+{
+    fprintf(stderr, "\tsynthetic traffic subopts:\n");
+    for (int i = SYNTH_FLOWS; synth_subopt_token[i] != NULL; ++i)
+    {
+        unsigned long long int const * const value = get_synth_subopt_value((enum synth_subopts)i);
+
+        if (value != NULL)
+        {
+            fprintf(stderr, "\t\t%s = %llu\n", synth_subopt_token[i], *value);
+        }
+        else
+        {
+            fprintf(stderr,
+                    "\t\t%s = %s\n",
+                    synth_subopt_token[i],
+                    synth_lifetime_name_table[synth_options.lifetime_distribution]);
+        }
+    }
+    fprintf(stderr,
+            "\t\tarrival-rate in new flows per second, lifetime and packet-interval are means in ms,\n"
+            "\t\ttcp/udp/icmp and ipv6 are percentages of all flows (the rest is GRE),\n"
+            "\t\tfin/rst are percentages of TCP flows (the rest stops sending and has to time out),\n"
+            "\t\treport-interval prints flow counters and memory usage every n seconds of capture time.\n");
+}
+
+static int parse_synth_subopts(char * subopts)
+{
+    while (*subopts != '\0')
+    {
+        char * value;
+        char * endptr;
+        int const subopt = getsubopt(&subopts, synth_subopt_token, &value);
+
+        if (subopt == -1 || value == NULL)
+        {
+            fprintf(stderr, "Invalid synthetic traffic subopt: %s\n\n", (value != NULL ? value : ""));
+            print_synth_subopt_usage();
+            return 1;
+        }
+
+        unsigned long long int * const subopt_value = get_synth_subopt_value((enum synth_subopts)subopt);
+        if (subopt_value == NULL)
+        {
+            for (synth_options.lifetime_distribution = LIFETIME_FIXED;
+                 synth_options.lifetime_distribution < LIFETIME_COUNT;
+                 ++synth_options.lifetime_distribution)
+            {
+                if (strcasecmp(value, synth_lifetime_name_table[synth_options.lifetime_distribution]) == 0)
+                {
+                    break;
+                }
+            }
+            if (synth_options.lifetime_distribution == LIFETIME_COUNT)
+            {
+                fprintf(stderr, "Subopt `%s': Unknown distribution `%s'.\n", synth_subopt_token[subopt], value);
+                return 1;
+            }
+            continue;
+        }
+
+        errno = 0;
+        *subopt_value = strtoull(value, &endptr, 10);
+        if (value == endptr || errno == ERANGE)
+        {
+            fprintf(stderr, "Subopt `%s': Value `%s' is not a valid number.\n", synth_subopt_token[subopt], value);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int validate_synth_options(void)
+{
+    if (synth_options.flows == 0 || synth_options.arrival_rate == 0 || synth_options.packet_interval == 0)
+    {
+        fprintf(stderr, "Synthetic traffic needs at least one flow, an arrival rate and a packet interval.\n");
+        return 1;
+    }
+    if (synth_options.tcp_share + synth_options.udp_share + synth_options.icmp_share > 100 ||
+        synth_options.fin_share + synth_options.rst_share > 100 || synth_options.ipv6_share > 100)
+    {
+        fprintf(stderr, "Synthetic traffic shares are percentages and may not exceed 100 in sum.\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+static void usage(char const * const arg0)
+{
+    fprintf(stderr,
+            "usage: %s [-t threads] [-n loops] [-r] [-s null|pipe|nDPIsrvd] [-A cpu-list] [-o subopt=value] [-l]\n"
+            "\t\t[-h] [-g subopt=value] [-j recorded-json] [path-to-pcap-file-or-directory...]\n\n"
+            "\t-t\tNumber of reader threads. Every thread sees every packet, as in nDPId.\n"
+            "\t-n\tReplay every pcap file n times from memory.\n"
+            "\t-r\tRewrite IP addresses on every loop, so each loop creates new flows.\n"
+            "\t-s\tJSON sink: write to /dev/null, to pipes which get drained or to an in-process nDPIsrvd.\n"
+            "\t-A\tPin reader threads to CPUs, see nDPId.\n"
+            "\t-o\tTune nDPId subopts, see nDPId.\n"
+            "\t-l\tLog all messages to stderr as well.\n"
+            "\t-g\tGenerate synthetic traffic instead of replaying pcap files.\n"
+            "\t-j\tParse recorded nDPIsrvd output (as read from the distributor socket) n times\n"
+            "\t  \twith the nDPIsrvd.h client API instead of running nDPId.\n"
+            "\t-h\tthis\n\n"
+            "\tDirectories are searched for *.pcap, *.pcapng and *.cap files, e.g. the nDPI test pcaps.\n",
+            arg0);
+    print_synth_subopt_usage();
+}
+
+static int parse_bench_options(int argc, char ** argv)
+{
+    char * nDPId_argv[2 * 32 + 1];
+    int nDPId_argc = 1;
+    int opt;
+
+    nDPId_argv[0] = argv[0];
+    while ((opt = getopt(argc, argv, "t:n:rs:A:o:lg:j:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 't':
+                bench_options.reader_thread_count = strtoull(optarg, NULL, 10);
+                break;
+            case 'n':
+                bench_options.loops = strtoull(optarg, NULL, 10);
+                break;
+            case 'r':
+                bench_options.rewrite_flows = 1;
+                break;
+            case 's':
+                for (bench_options.sink = SINK_NULL; bench_options.sink < SINK_COUNT; ++bench_options.sink)
+                {
+                    if (strcasecmp(optarg, bench_sink_name_table[bench_options.sink]) == 0)
+                    {
+                        break;
+                    }
+                }
+                if (bench_options.sink == SINK_COUNT)
+                {
+                    fprintf(stderr, "%s: Unknown sink `%s'\n", argv[0], optarg);
+                    return 1;
+                }
+                break;
+            case 'g':
+                synth_options.enabled = 1;
+                if (parse_synth_subopts(optarg) != 0)
+                {
+                    return 1;
+                }
+                break;
+            case 'j':
+                free(bench_options.json_file);
+                bench_options.json_file = strdup(optarg);
+                break;
+            case 'A':
+            case 'o':
+            case 'l':
+                /* passed to nDPId_parse_options() */
+                if (nDPId_argc + 2 > (int)(sizeof(nDPId_argv) / sizeof(nDPId_argv[0])))
+                {
+                    return 1;
+                }
+                nDPId_argv[nDPId_argc++] = (opt == 'A' ? "-A" : (opt == 'o' ? "-o" : "-l"));
+                if (opt != 'l')
+                {
+                    nDPId_argv[nDPId_argc++] = optarg;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if ((optind >= argc && synth_options.enabled == 0 && bench_options.json_file == NULL) || bench_options.loops == 0 ||
+        bench_options.reader_thread_count == 0 ||
+        bench_options.reader_thread_count > nDPId_MAX_READER_THREADS)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int const bench_optind = optind;
+    optind = 1;
+    if (nDPId_parse_options(nDPId_argc, nDPId_argv) != 0)
+    {
+        return 1;
+    }
+    optind = bench_optind;
+
+    return 0;
+}
+
+int main(int argc, char ** argv)
+{
+    int retval = 0;
+
+    if (argc == 0)
+    {
+        return 1;
+    }
+
+    if (parse_bench_options(argc, argv) != 0)
+    {
+        return 1;
+    }
+
+    if (bench_options.json_file != NULL)
+    {
+        retval = run_json_bench(bench_options.json_file);
+        print_json_bench_results();
+        free(bench_options.json_file);
+        return retval;
+    }
+
+    nDPId_options.reader_thread_count = bench_options.reader_thread_count;
+    nDPId_options.report_init_timings = 0;
+    if (nDPId_options.instance_alias == NULL)
+    {
+        nDPId_options.instance_alias = strdup("nDPId-bench");
+    }
+    if (validate_options(argv[0]) != 0 || (synth_options.enabled != 0 && validate_synth_options() != 0))
+    {
+        return 1;
+    }
+
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+    {
+        return 1;
+    }
+
+    openlog("nDPId-bench", LOG_CONS | (nDPId_options.log_to_stderr != 0 ? LOG_PERROR : 0), LOG_DAEMON);
+    if (setup_sink() != 0)
+    {
+        fprintf(stderr, "%s: Could not setup the %s sink\n", argv[0], bench_sink_name_table[bench_options.sink]);
+        return 1;
+    }
+
+    if (synth_options.enabled != 0 && run_bench_synthetic() != 0)
+    {
+        retval = 1;
+    }
+    for (int i = optind; i < argc; ++i)
+    {
+        if (run_bench_path(argv[i]) != 0)
+        {
+            retval = 1;
+        }
+    }
+
+    shutdown_sink();
+    print_bench_results();
+    closelog();
+
+    return retval;
+}
@@ -113,7 +113,8 @@ static void * nDPIsrvd_mainloop_thread(void * const arg)
         THREAD_ERROR_GOTO(arg);
     }
 
-    while (1)
+    /* keep going after the collector is gone until all events were sent to the distributor */
+    while (mock_json_desc->fd >= 0 || mock_serv_desc->buf.used > 0)
     {
         int nready = epoll_wait(epollfd, events, events_size, -1);
 
@@ -126,11 +127,18 @@ static void * nDPIsrvd_mainloop_thread(void * const arg)
         {
             if (events[i].data.ptr == mock_json_desc)
             {
-                if (handle_incoming_data_event(epollfd, &events[i]) != 0)
+                if (handle_incoming_data_event(epollfd, &events[i]) != 0 && mock_json_desc->fd >= 0)
                 {
                     goto error;
                 }
             }
+            else if (events[i].data.ptr == mock_serv_desc)
+            {
+                if (handle_incoming_data_event(epollfd, &events[i]) != 0)
+                {
+                    THREAD_ERROR_GOTO(arg);
+                }
+            }
             else
             {
                 THREAD_ERROR_GOTO(arg);
@@ -148,6 +156,65 @@ error:
     return NULL;
 }
 
+static int json_token_equals(char const * const json, jsmntok_t const * const token, char const * const str)
+{
+    return token->type == JSMN_STRING && (size_t)(token->end - token->start) == strlen(str) &&
+           strncmp(json + token->start, str, token->end - token->start) == 0;
+}
+
+/* Neither nDPId nor nDPIsrvd may lose an event, see `thread_seq' and `distributor_seq'. */
+static int check_sequence_numbers(struct nDPIsrvd_buffer const * const buffer, struct nDPIsrvd_jsmn const * const jsmn)
+{
+    static nDPIsrvd_ull next_distributor_seq = 0;
+    static nDPIsrvd_ull next_thread_seq[nDPId_MAX_READER_THREADS] = {};
+    char const * const json = buffer->ptr.text + buffer->json_string_start;
+    nDPIsrvd_ull distributor_seq = ULLONG_MAX;
+    nDPIsrvd_ull thread_id = ULLONG_MAX;
+    nDPIsrvd_ull thread_seq = ULLONG_MAX;
+
+    for (int i = 1; i + 1 < jsmn->tokens_found; ++i)
+    {
+        nDPIsrvd_ull * value;
+
+        if (jsmn->tokens[i].parent != 0)
+        {
+            continue;
+        }
+        if (json_token_equals(json, &jsmn->tokens[i], "distributor_seq") != 0)
+        {
+            value = &distributor_seq;
+        }
+        else if (json_token_equals(json, &jsmn->tokens[i], "thread_id") != 0)
+        {
+            value = &thread_id;
+        }
+        else if (json_token_equals(json, &jsmn->tokens[i], "thread_seq") != 0)
+        {
+            value = &thread_seq;
+        }
+        else
+        {
+            continue;
+        }
+        *value = strtoull(json + jsmn->tokens[i + 1].start, NULL, 10);
+    }
+
+    if (distributor_seq != next_distributor_seq)
+    {
+        fprintf(stderr, "Distributor sequence gap: expected %llu, got %llu\n", next_distributor_seq, distributor_seq);
+        return 1;
+    }
+    next_distributor_seq++;
+    if (thread_id >= nDPId_MAX_READER_THREADS || thread_seq != next_thread_seq[thread_id])
+    {
+        fprintf(stderr, "Reader thread %llu sequence gap: got %llu\n", thread_id, thread_seq);
+        return 1;
+    }
+    next_thread_seq[thread_id]++;
+
+    return 0;
+}
+
 static enum nDPIsrvd_parse_return parse_json_lines(struct nDPIsrvd_buffer * const buffer)
 {
     struct nDPIsrvd_jsmn jsmn = {};
@@ -165,6 +232,10 @@ static enum nDPIsrvd_parse_return parse_json_lines(struct nDPIsrvd_buffer * cons
         {
             return PARSE_JSMN_ERROR;
         }
+        if (check_sequence_numbers(buffer, &jsmn) != 0)
+        {
+            return PARSE_JSON_MGMT_ERROR;
+        }
         nDPIsrvd_drain_buffer(buffer);
     }
 
@@ -256,6 +327,12 @@ error:
     return NULL;
 }
 
+static void * nDPId_reader_thread(void * const arg)
+{
+    run_pcap_loop((struct nDPId_reader_thread *)arg);
+    return NULL;
+}
+
 static void * nDPId_mainloop_thread(void * const arg)
 {
     struct nDPId_return_value * const nrv = (struct nDPId_return_value *)arg;
@@ -267,22 +344,48 @@ static void * nDPId_mainloop_thread(void * const arg)
         return NULL;
     }
 
-    /* Replace nDPId JSON socket fd with the one in our pipe and hope that no socket specific code-path triggered. */
-    reader_threads[0].json_sockfd = mock_pipefds[PIPE_nDPId];
-    reader_threads[0].json_sock_reconnect = 0;
+    /*
+     * Replace nDPId JSON socket fd with the one in our pipe and hope that no socket specific code-path triggered.
+     * Additional reader threads only write to the pipe after all of them finished, see `ordered-replay'.
+     * Every reader thread closes its fd in process_remaining_flows(), so each one gets its own duplicate.
+     */
+    for (size_t i = 0; i < nDPId_options.reader_thread_count; ++i)
+    {
+        reader_threads[i].json_sockfd = dup(mock_pipefds[PIPE_nDPId]);
+        if (reader_threads[i].json_sockfd < 0)
+        {
+            THREAD_ERROR(trr);
+            return NULL;
+        }
+        reader_threads[i].json_sock_reconnect = 0;
+        jsonize_daemon(&reader_threads[i], DAEMON_EVENT_INIT);
+    }
 
-    jsonize_daemon(&reader_threads[0], DAEMON_EVENT_INIT);
+    for (size_t i = 1; i < nDPId_options.reader_thread_count; ++i)
+    {
+        if (pthread_create(&reader_threads[i].thread_id, NULL, nDPId_reader_thread, &reader_threads[i]) != 0)
+        {
+            /* The already started reader threads wait for the missing ones forever. */
+            THREAD_ERROR(trr);
+            return NULL;
+        }
+    }
     run_pcap_loop(&reader_threads[0]);
+    for (size_t i = 1; i < nDPId_options.reader_thread_count; ++i)
+    {
+        pthread_join(reader_threads[i].thread_id, NULL);
+    }
     process_remaining_flows();
+    /* Every reader thread sees every packet. */
+    nrv->packets_captured = reader_threads[0].workflow->packets_captured;
     for (size_t i = 0; i < nDPId_options.reader_thread_count; ++i)
     {
-        nrv->packets_captured = reader_threads[i].workflow->packets_captured;
-        nrv->packets_processed = reader_threads[i].workflow->packets_processed;
-        nrv->total_skipped_flows = reader_threads[i].workflow->total_skipped_flows;
-        nrv->total_l4_data_len = reader_threads[i].workflow->total_l4_data_len;
-        nrv->detected_flow_protocols = reader_threads[i].workflow->detected_flow_protocols;
-        nrv->total_active_flows = reader_threads[i].workflow->total_active_flows;
-        nrv->total_idle_flows = reader_threads[i].workflow->total_idle_flows;
+        nrv->packets_processed += reader_threads[i].workflow->packets_processed;
+        nrv->total_skipped_flows += reader_threads[i].workflow->total_skipped_flows;
+        nrv->total_l4_data_len += reader_threads[i].workflow->total_l4_data_len;
+        nrv->detected_flow_protocols += reader_threads[i].workflow->detected_flow_protocols;
+        nrv->total_active_flows += reader_threads[i].workflow->total_active_flows;
+        nrv->total_idle_flows += reader_threads[i].workflow->total_idle_flows;
     }
     free_reader_threads();
 
@@ -296,7 +399,8 @@ static void usage(char const * const arg0)
     fprintf(stderr,
             "usage: %s [path-to-pcap-file]\n"
             "\tinfluencial environment variable:\n"
-            "\t\tPRINT_SUMMARY - if set, print a summary after processing finished\n",
+            "\t\tPRINT_SUMMARY - if set, print a summary after processing finished\n"
+            "\t\tREADER_THREADS - if set, process the pcap file with this many reader threads (ordered replay)\n",
             arg0);
 }
 
@@ -346,8 +450,15 @@ int main(int argc, char ** argv)
     nDPId_options.enable_zlib_compression = 0;
 #endif
     nDPId_options.memory_profiling_print_every = (unsigned long long int)-1;
+    nDPId_options.report_init_timings = 0; /* Timings differ on every run. */
+    nDPId_options.status_interval = 0;     /* Same. */
     nDPId_options.reader_thread_count = 1; /* Please do not change this! Generating meaningful pcap diff's relies on a
-                                              single reader thread! */
+                                              single reader thread or an ordered replay! */
+    if (getenv("READER_THREADS") != NULL)
+    {
+        nDPId_options.reader_thread_count = strtoull(getenv("READER_THREADS"), NULL, 10);
+        nDPId_options.ordered_replay = 1;
+    }
     nDPId_options.instance_alias = strdup("nDPId-test");
     if (access(argv[1], R_OK) != 0)
     {
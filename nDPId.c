@@ -1,7 +1,10 @@
 #include <arpa/inet.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <glob.h>
 #include <ifaddrs.h>
+#include <limits.h>
 #include <linux/if_ether.h>
 #include <net/if.h>
 #include <netinet/in.h>
@@ -9,14 +12,19 @@
 #include <ndpi_main.h>
 #include <ndpi_typedefs.h>
 #include <pcap/pcap.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/un.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 #ifdef ENABLE_ZLIB
 #include <zlib.h>
@@ -67,31 +75,54 @@ enum nDPId_flow_type
 
 /*
  * Minimal per-flow information required for flow mgmt and timeout handling.
+ * This is the only part of a flow touched while searching the flow table,
+ * hence it is kept in a single cache line.
+ * Everything else lives in the workflow's cold arrays, see `cold_index'.
  */
 struct nDPId_flow_basic
 {
-    enum nDPId_flow_type type;
-    enum nDPId_l3_type l3_type;
     uint64_t hashval;
     union nDPId_ip src;
     union nDPId_ip dst;
+    uint16_t src_port;
+    uint16_t dst_port;
     uint8_t l4_protocol;
     uint8_t tcp_fin_rst_seen : 1;
     uint8_t tcp_is_midstream_flow : 1;
     uint8_t reserved_00 : 6;
-    uint8_t reserved_01[2];
-    uint16_t src_port;
-    uint16_t dst_port;
+    enum nDPId_flow_type type : 8;
+    enum nDPId_l3_type l3_type : 8;
+    uint32_t cold_index;
+    uint32_t hashed_index; /* flow table bucket, `hashval % max_active_flows' */
     uint64_t last_seen;
+} __attribute__((aligned(64)));
+
+_Static_assert(sizeof(struct nDPId_flow_basic) == 64, "struct nDPId_flow_basic should fit into a single cache line");
+
+/*
+ * Flow table entry, the table uses open addressing with linear probing and consists of
+ * FLOW_TABLE_SLOTS_PER_BUCKET slots per bucket, so it is never more than half full.
+ * A flow is searched starting at the first slot of its bucket, see find_flow().
+ * Deleting a flow shifts the following entries back (no tombstones), the flows of a bucket
+ * therefore stay in insertion order between its first slot and the next empty one.
+ */
+#define FLOW_TABLE_SLOTS_PER_BUCKET 2u
+#define FLOW_SLOT_EMPTY UINT32_MAX
+
+_Static_assert(FLOW_TABLE_SLOTS_PER_BUCKET > 1, "the flow table needs empty slots to terminate a probe sequence");
+
+struct nDPId_flow_slot
+{
+    uint32_t tag; /* see get_flow_tag(), compared before the hot record is touched */
+    uint32_t cold_index;
 };
 
 /*
  * Information required for a full detection cycle.
+ * Indexed by `cold_index'.
  */
 struct nDPId_flow_extended
 {
-    struct nDPId_flow_basic flow_basic;
-
     uint32_t flow_id;
 
     uint16_t min_l4_payload_len;
@@ -103,14 +134,6 @@ struct nDPId_flow_extended
     unsigned long long int total_l4_payload_len;
 };
 
-/*
- * Skipped flows need at least some information.
- */
-struct nDPId_flow_skipped
-{
-    struct nDPId_flow_basic flow_basic;
-};
-
 /*
  * Structure which is important for the detection process.
  * The structure is also a compression target, if activated.
@@ -125,10 +148,12 @@ struct nDPId_detection_data
     struct ndpi_id_struct dst;
 };
 
+/*
+ * Detection state, only valid for FT_INFO flows.
+ * Indexed by `cold_index'.
+ */
 struct nDPId_flow_info
 {
-    struct nDPId_flow_extended flow_extended;
-
     uint8_t detection_completed : 1;
     uint8_t reserved_00 : 7;
     uint8_t reserved_01[1];
@@ -140,11 +165,6 @@ struct nDPId_flow_info
     struct nDPId_detection_data * detection_data;
 };
 
-struct nDPId_flow_finished
-{
-    struct nDPId_flow_info flow_info;
-};
-
 struct nDPId_workflow
 {
     pcap_t * pcap_handle;
@@ -167,11 +187,22 @@ struct nDPId_workflow
     uint64_t last_idle_scan_time;
     uint64_t last_time;
 
-    void ** ndpi_flows_active;
+    struct nDPId_flow_slot * flow_table; /* `max_active_flows * FLOW_TABLE_SLOTS_PER_BUCKET' entries */
     unsigned long long int max_active_flows;
     unsigned long long int cur_active_flows;
     unsigned long long int total_active_flows;
 
+    /*
+     * Flow pool, `max_active_flows' entries each.
+     * The hot records are referenced by `flow_table'.
+     * `flows_free' is a stack of unused pool indices with `max_active_flows - cur_active_flows' entries.
+     */
+    void * flows_basic_unaligned;
+    struct nDPId_flow_basic * flows_basic;
+    struct nDPId_flow_extended * flows_extended;
+    struct nDPId_flow_info * flows_info;
+    uint32_t * flows_free;
+
     void ** ndpi_flows_idle;
     unsigned long long int max_idle_flows;
     unsigned long long int cur_idle_flows;
@@ -181,13 +212,261 @@ struct nDPId_workflow
     struct ndpi_detection_module_struct * ndpi_struct;
 };
 
+/*
+ * Result of the header processing stage, required by the flow processing stage.
+ * All pointers point into the captured packet.
+ */
+struct nDPId_packet_headers
+{
+    struct nDPId_flow_basic flow_basic;
+
+    struct ndpi_iphdr const * ip;
+    struct ndpi_ipv6hdr * ip6;
+    uint8_t const * l4_ptr;
+
+    uint16_t type;
+    uint16_t ip_offset;
+    uint16_t ip_size;
+    uint16_t l4_len;
+    uint16_t l4_payload_len;
+
+    /* reader thread the flow is distributed to, -1 if the packet is invalid */
+    int thread_index;
+};
+
+/*
+ * A packet collected for batch processing, either copied out of the pcap buffer or pointing into a replayed file.
+ * Entries without a packet only advance the clock of the reader thread, see `ordered-replay'.
+ */
+struct nDPId_packet_batch_entry
+{
+    struct nDPId_packet_headers headers;
+    struct pcap_pkthdr header;
+    uint8_t const * packet;
+    uint64_t ordered_seq;
+    uint64_t packets_skipped; /* packets of other reader threads since the previous entry, see replay_packets() */
+    int headers_parsed;       /* `headers' were already parsed by classify_pcap_replay_packets() */
+    int headers_result;
+    int replay_headers;
+};
+
+/*
+ * Time spent in the workflow initialization phases, see init_workflow().
+ */
+struct nDPId_workflow_init_time
+{
+    uint64_t pcap_usec;
+    uint64_t ndpi_init_usec;
+    uint64_t flow_tables_usec;
+    uint64_t custom_files_usec;
+    uint64_t ndpi_finalize_usec;
+    uint64_t lock_wait_usec;
+    uint64_t total_usec;
+};
+
+/*
+ * Runtime statistics of a reader thread, see `status-interval' and `-x'.
+ * Written and read by the reader thread only, the main thread reads a `struct nDPId_stats_snapshot' instead.
+ */
+struct nDPId_thread_stats
+{
+    unsigned long long int flow_lookups;
+    unsigned long long int flow_lookup_probes;
+    unsigned long long int flow_lookup_max_probes;
+    unsigned long long int events_emitted;
+    unsigned long long int events_dropped;
+    uint64_t dpi_usec;
+    uint64_t serialize_usec;
+    uint64_t send_usec;
+    uint64_t serialize_start_usec;
+    uint64_t last_status_time;
+    uint64_t last_pcap_stats_time;
+    int pcap_stats_valid;
+    struct pcap_stat pcap_stats;
+};
+
+#ifdef ENABLE_LATENCY_HISTOGRAMS
+/*
+ * Log-linear latency histogram in nanoseconds:
+ * values below 2^LATENCY_SUB_BUCKET_BITS are counted exactly,
+ * every following power of two is split into 2^LATENCY_SUB_BUCKET_BITS linear sub buckets (12.5% precision).
+ * Values above 2^(LATENCY_MAX_EXPONENT + 1) ns (~2 min) end up in the last bucket.
+ */
+#define LATENCY_SUB_BUCKET_BITS 3u
+#define LATENCY_SUB_BUCKETS (1u << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_MAX_EXPONENT 36u
+#define LATENCY_BUCKETS ((LATENCY_MAX_EXPONENT - LATENCY_SUB_BUCKET_BITS + 2u) * LATENCY_SUB_BUCKETS)
+
+enum latency_stage
+{
+    LATENCY_STAGE_DATALINK = 0,
+    LATENCY_STAGE_FLOW_LOOKUP,
+    LATENCY_STAGE_FLOW_INSERT,
+    LATENCY_STAGE_DPI,
+    LATENCY_STAGE_SERIALIZE,
+    LATENCY_STAGE_SEND,
+    LATENCY_STAGE_IDLE_SCAN,
+
+    LATENCY_STAGE_COUNT
+};
+
+struct nDPId_latency_histogram
+{
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[LATENCY_BUCKETS];
+};
+#endif
+
+/*
+ * Copy of the runtime statistics published by a reader thread every tick if `-x' is set.
+ * Copied word by word with __atomic builtins under a seqlock, so it must consist of uint64_t members only.
+ */
+struct nDPId_stats_snapshot
+{
+    uint64_t packets_captured;
+    uint64_t packets_processed;
+    uint64_t flows_active;
+    uint64_t flows_idle;
+    uint64_t flows_total;
+    uint64_t flows_idle_total;
+    uint64_t flows_skipped;
+    uint64_t flows_detected;
+    uint64_t flow_table_buckets;
+    uint64_t flow_table_buckets_used;
+    uint64_t flow_lookups;
+    uint64_t flow_lookup_probes;
+    uint64_t flow_lookup_max_probes;
+    uint64_t events_emitted;
+    uint64_t events_dropped;
+    uint64_t pcap_stats_valid;
+    uint64_t pcap_packets_received;
+    uint64_t pcap_packets_dropped;
+    uint64_t pcap_packets_if_dropped;
+    uint64_t dpi_usec;
+    uint64_t serialize_usec;
+    uint64_t send_usec;
+#ifdef ENABLE_LATENCY_HISTOGRAMS
+    /* all samples since the reader thread started, not reset by `status' events */
+    struct nDPId_latency_histogram latency_histograms[LATENCY_STAGE_COUNT];
+#endif
+};
+#define STATS_SNAPSHOT_WORDS (sizeof(struct nDPId_stats_snapshot) / sizeof(uint64_t))
+_Static_assert(sizeof(struct nDPId_stats_snapshot) % sizeof(uint64_t) == 0,
+               "struct nDPId_stats_snapshot should consist of uint64_t members only");
+
+
+/*
+ * Events of a reader thread buffered until the next merge, see `ordered-replay'.
+ * Every record consists of the sequence number of the packet which caused the event,
+ * the length of the framed JSON string and the framed JSON string itself.
+ */
+struct nDPId_ordered_events
+{
+    int enabled;
+    uint64_t seq;
+    uint8_t * buf;
+    size_t used;
+    size_t size;
+};
+
+enum capture_type
+{
+    CAPTURE_TYPE_MIDSTREAM = 0,
+    CAPTURE_TYPE_GUESSED,
+    CAPTURE_TYPE_UNDETECTED,
+    CAPTURE_TYPE_RISKY,
+    CAPTURE_TYPE_FILTER,
+
+    CAPTURE_TYPE_COUNT
+};
+
+/*
+ * Packets of a flow kept as pcap records until its detection finished, see `-w'.
+ */
+struct nDPId_capture_flow
+{
+    uint8_t * packets;
+    size_t packets_used;
+    size_t packets_size;
+    uint8_t midstream : 1;
+    uint8_t filter_matched : 1;
+    uint8_t finished : 1;
+    uint8_t reserved_00 : 5;
+};
+
+/*
+ * Captured flows of a reader thread, see `-w'.
+ * Only touched by its reader thread, so there is no locking required.
+ */
+struct nDPId_flow_capture
+{
+    struct nDPId_capture_flow * flows; /* `max_active_flows' entries, indexed by `cold_index' */
+};
+
+/*
+ * Everything required to append the packets of a finished flow to a pcap file.
+ * Jobs are queued by the reader threads and written by the flow capture writer thread.
+ */
+struct nDPId_capture_job
+{
+    struct nDPId_capture_job * next;
+    enum capture_type type;
+    int reader_thread_index;
+    uint32_t flow_id;
+    int datalink;
+    int snaplen;
+    size_t records_used;
+    uint8_t * records;
+};
+
 struct nDPId_reader_thread
 {
     struct nDPId_workflow * workflow;
+    struct nDPId_workflow_init_time workflow_init_time;
     pthread_t thread_id;
     int json_sockfd;
     int json_sock_reconnect;
     int array_index;
+    /* live captures only, -1 if pcap_dispatch() blocks, see dispatch_live_packets() */
+    int pcap_selectable_fd;
+    /* `thread_seq' of the next event, consumers detect lost events by gaps */
+    uint64_t thread_seq;
+
+    struct nDPId_thread_stats stats;
+    /* odd while the reader thread writes `stats_snapshot', zero if nothing was published yet */
+    uint64_t stats_snapshot_seq;
+    struct nDPId_stats_snapshot stats_snapshot;
+#ifdef ENABLE_LATENCY_HISTOGRAMS
+    /* reset every time they were sent with a `status' event, after being folded into `latency_histograms_total' */
+    uint64_t latency_serialize_start;
+    struct nDPId_latency_histogram latency_histograms[LATENCY_STAGE_COUNT];
+    struct nDPId_latency_histogram latency_histograms_total[LATENCY_STAGE_COUNT];
+#endif
+
+    /* see `ordered-replay' */
+    struct nDPId_ordered_events ordered_events;
+
+    /* see `-w' */
+    struct nDPId_flow_capture flow_capture;
+
+    /* flow ids leased from `global_flow_id', see get_next_flow_id() */
+    uint64_t flow_id_next;
+    uint64_t flow_id_end;
+
+    /* see `packet-batch-size' */
+    uint8_t suppress_events;
+    /* process_packet_headers() runs more than once for the current packet, sample its latency only once */
+    uint8_t skip_latency_samples;
+    /* process_packet_headers() parses packets of all reader threads, see classify_pcap_replay_packets() */
+    uint8_t classify_packets;
+    unsigned long long int suppressed_events;
+    size_t packet_batch_used;
+    size_t packet_batch_data_used;
+    size_t packet_batch_data_size;
+    uint8_t * packet_batch_data;
+    uint64_t packet_batch_clock_max; /* highest packet time of the collected replay packets, see tick_replay_clock() */
+    struct nDPId_packet_batch_entry packet_batch[nDPId_MAX_PACKET_BATCH_SIZE];
 };
 
 enum packet_event
@@ -248,6 +527,7 @@ enum daemon_event
     DAEMON_EVENT_INIT,
     DAEMON_EVENT_RECONNECT,
     DAEMON_EVENT_SHUTDOWN,
+    DAEMON_EVENT_STATUS,
 
     DAEMON_EVENT_COUNT
 };
@@ -256,6 +536,12 @@ static char const * const packet_event_name_table[PACKET_EVENT_COUNT] = {[PACKET
                                                                          [PACKET_EVENT_PAYLOAD] = "packet",
                                                                          [PACKET_EVENT_PAYLOAD_FLOW] = "packet-flow"};
 
+static char const * const capture_type_name_table[CAPTURE_TYPE_COUNT] = {[CAPTURE_TYPE_MIDSTREAM] = "midstream",
+                                                                       [CAPTURE_TYPE_GUESSED] = "guessed",
+                                                                       [CAPTURE_TYPE_UNDETECTED] = "undetected",
+                                                                       [CAPTURE_TYPE_RISKY] = "risky",
+                                                                       [CAPTURE_TYPE_FILTER] = "filter"};
+
 static char const * const flow_event_name_table[FLOW_EVENT_COUNT] = {[FLOW_EVENT_INVALID] = "invalid",
                                                                      [FLOW_EVENT_NEW] = "new",
                                                                      [FLOW_EVENT_END] = "end",
@@ -285,18 +571,152 @@ static char const * const basic_event_name_table[BASIC_EVENT_COUNT] = {
     [FLOW_MEMORY_ALLOCATION_FAILED] = "Flow memory allocation failed",
 };
 
+#ifdef ENABLE_LATENCY_HISTOGRAMS
+static char const * const latency_stage_name_table[LATENCY_STAGE_COUNT] = {
+    [LATENCY_STAGE_DATALINK] = "datalink",
+    [LATENCY_STAGE_FLOW_LOOKUP] = "flow-lookup",
+    [LATENCY_STAGE_FLOW_INSERT] = "flow-insert",
+    [LATENCY_STAGE_DPI] = "dpi",
+    [LATENCY_STAGE_SERIALIZE] = "serialize",
+    [LATENCY_STAGE_SEND] = "send",
+    [LATENCY_STAGE_IDLE_SCAN] = "idle-scan",
+};
+#endif
+
 static char const * const daemon_event_name_table[DAEMON_EVENT_COUNT] = {
     [DAEMON_EVENT_INVALID] = "invalid",
     [DAEMON_EVENT_INIT] = "init",
     [DAEMON_EVENT_RECONNECT] = "reconnect",
     [DAEMON_EVENT_SHUTDOWN] = "shutdown",
+    [DAEMON_EVENT_STATUS] = "status",
 };
 
 static struct nDPId_reader_thread reader_threads[nDPId_MAX_READER_THREADS] = {};
+static pthread_mutex_t workflow_init_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t workflows_init_usec = 0;
 static int nDPId_main_thread_shutdown = 0;
+static int stats_sockfd = -1;
 static uint64_t global_flow_id = 1;
 static int ip4_interface_avail = 0, ip6_interface_avail = 0;
 
+struct nDPId_replay_packet
+{
+    struct pcap_pkthdr header;
+    uint8_t const * data;
+    int thread_index;       /* -1 if the packet was filtered, see classify_pcap_replay_packets() */
+    int headers_result;     /* of process_packet_headers() on behalf of reader thread `thread_index' */
+    int replay_headers;     /* parsing the headers emitted events, the owning reader thread parses them again */
+    size_t captured_before; /* packets of the same slice which were not filtered */
+    uint64_t clock_max;     /* highest packet time of the same slice up to this packet */
+    struct nDPId_packet_headers headers;
+};
+
+/*
+ * Packets of the current replay file classified by one reader thread, see classify_pcap_replay_packets().
+ * `pcap_replay.order[owner_offsets[t]]' up to `pcap_replay.order[owner_offsets[t + 1]]' are the indices of the
+ * packets owned by reader thread `t' in capture order.
+ */
+struct nDPId_replay_slice
+{
+    size_t first;
+    size_t last;
+    size_t packets_accepted;
+    uint64_t clock_max;
+    size_t owner_offsets[nDPId_MAX_READER_THREADS + 1];
+};
+
+/* Position of a reader thread in the current replay file, see replay_packets(). */
+struct nDPId_replay_cursor
+{
+    unsigned long long int slice;
+    size_t pos;         /* in `pcap_replay.order' */
+    size_t captured;    /* packets of the current file already counted in `packets_captured' */
+    size_t next_packet; /* packets before this index were already processed or did not advance the clock */
+    /* packets which were not filtered and the highest packet time of all previous slices */
+    size_t slice_captured[nDPId_MAX_READER_THREADS];
+    uint64_t slice_clock_max[nDPId_MAX_READER_THREADS];
+};
+
+/*
+ * Offline replay of multiple pcap files, see `-F', a glob pattern for `-i' or `ordered-replay'.
+ * Reader thread 0 memory maps and indexes one file at a time. Every reader thread then parses one slice of it
+ * and sorts the packets by the reader thread owning their flow, so each reader thread only visits its own packets.
+ * Flow state is kept across file boundaries.
+ */
+static struct
+{
+    char ** files;
+    size_t file_count;
+    pthread_barrier_t barrier;
+    int barrier_initialized;
+    int stop;
+    int done; /* written by reader thread 0 before the barrier only */
+
+    /* current file */
+    uint8_t * map;
+    size_t map_size;
+    uint8_t * copy; /* used instead of `map' for files which are no classic pcap files e.g. pcapng */
+    size_t copy_used;
+    size_t copy_size;
+    int datalink_type;
+    int snaplen;
+    int bpf_valid;
+    struct bpf_program bpf;
+    struct nDPId_replay_packet * packets;
+    size_t * order; /* `packets_size' entries, see `struct nDPId_replay_slice' */
+    size_t packets_used;
+    size_t packets_size;
+    struct nDPId_replay_slice slices[nDPId_MAX_READER_THREADS];
+} pcap_replay = {};
+
+static int get_datalink_type(struct nDPId_reader_thread const * const reader_thread)
+{
+    if (pcap_replay.file_count > 0)
+    {
+        return pcap_replay.datalink_type;
+    }
+
+    return pcap_datalink(reader_thread->workflow->pcap_handle);
+}
+
+static int get_snaplen(struct nDPId_reader_thread const * const reader_thread)
+{
+    if (pcap_replay.file_count > 0)
+    {
+        return pcap_replay.snaplen;
+    }
+
+    return pcap_snapshot(reader_thread->workflow->pcap_handle);
+}
+
+/* Flows with a first packet matching `-W' are always captured, see `-w'. */
+static struct bpf_program capture_bpf;
+static int capture_bpf_valid = 0;
+
+/*
+ * All pcap file I/O of `-w' happens on this thread, so the reader threads never block on the file system.
+ * Everything below `pending_size' is only touched by the writer thread.
+ */
+static struct
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int started;
+    int shutdown;
+    struct nDPId_capture_job * head;
+    struct nDPId_capture_job * tail;
+    size_t pending_size;
+
+    int fds[nDPId_MAX_READER_THREADS][CAPTURE_TYPE_COUNT]; /* see `capture-rotation' */
+    time_t last_rotation;
+    char rotation_appendix[32];
+    time_t last_flush;
+    int buffer_fd;
+    size_t buffer_used;
+    uint8_t * buffer;
+} flow_capture_writer = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
 #ifdef ENABLE_MEMORY_PROFILING
 static uint64_t ndpi_memory_alloc_count = 0;
 static uint64_t ndpi_memory_alloc_bytes = 0;
@@ -313,6 +733,7 @@ static struct
 {
     /* opts */
     char * pcap_file_or_interface;
+    char * pcap_file_list;
     union nDPId_ip pcap_dev_ip4, pcap_dev_ip6;
     union nDPId_ip pcap_dev_netmask4, pcap_dev_netmask6;
     union nDPId_ip pcap_dev_subnet4, pcap_dev_subnet6;
@@ -328,9 +749,16 @@ static struct
     char * custom_ja3_file;
     char * custom_sha1_file;
     char json_sockpath[UNIX_PATH_MAX];
+    char * stats_sockpath;
+    char * capture_dir;
+    char * capture_bpf_str;
 #ifdef ENABLE_ZLIB
     uint8_t enable_zlib_compression;
 #endif
+    uint8_t report_init_timings;
+    char * cpu_affinity;
+    size_t reader_thread_cpu_count;
+    int reader_thread_cpus[nDPId_MAX_READER_THREADS];
     /* subopts */
     char * instance_alias;
     unsigned long long int max_flows_per_thread;
@@ -345,6 +773,8 @@ static struct
     unsigned long long int compression_flow_inactivity;
 #endif
     unsigned long long int idle_scan_period;
+    unsigned long long int status_interval;
+    unsigned long long int stage_timings;
     unsigned long long int generic_max_idle_time;
     unsigned long long int icmp_max_idle_time;
     unsigned long long int udp_max_idle_time;
@@ -352,9 +782,17 @@ static struct
     unsigned long long int tcp_max_post_end_flow_time;
     unsigned long long int max_packets_per_flow_to_send;
     unsigned long long int max_packets_per_flow_to_process;
+    unsigned long long int packet_batch_size;
+    unsigned long long int ordered_replay;
+    unsigned long long int capture_guessed;
+    unsigned long long int capture_undetected;
+    unsigned long long int capture_risky;
+    unsigned long long int capture_midstream;
+    unsigned long long int capture_rotation;
 } nDPId_options = {.pidfile = nDPId_PIDFILE,
                    .user = "nobody",
                    .json_sockpath = COLLECTOR_UNIX_SOCKET,
+                   .report_init_timings = 1,
                    .max_flows_per_thread = nDPId_MAX_FLOWS_PER_THREAD / 2,
                    .max_idle_flows_per_thread = nDPId_MAX_IDLE_FLOWS_PER_THREAD / 2,
                    .tick_resolution = nDPId_TICK_RESOLUTION,
@@ -367,13 +805,22 @@ static struct
                    .compression_flow_inactivity = nDPId_COMPRESSION_FLOW_INACTIVITY,
 #endif
                    .idle_scan_period = nDPId_IDLE_SCAN_PERIOD,
+                   .status_interval = nDPId_STATUS_INTERVAL,
+                   .stage_timings = nDPId_STAGE_TIMINGS,
                    .generic_max_idle_time = nDPId_GENERIC_IDLE_TIME,
                    .icmp_max_idle_time = nDPId_ICMP_IDLE_TIME,
                    .udp_max_idle_time = nDPId_UDP_IDLE_TIME,
                    .tcp_max_idle_time = nDPId_TCP_IDLE_TIME,
                    .tcp_max_post_end_flow_time = nDPId_TCP_POST_END_FLOW_TIME,
                    .max_packets_per_flow_to_send = nDPId_PACKETS_PER_FLOW_TO_SEND,
-                   .max_packets_per_flow_to_process = nDPId_PACKETS_PER_FLOW_TO_PROCESS};
+                   .max_packets_per_flow_to_process = nDPId_PACKETS_PER_FLOW_TO_PROCESS,
+                   .packet_batch_size = nDPId_PACKET_BATCH_SIZE,
+                   .ordered_replay = nDPId_ORDERED_REPLAY,
+                   .capture_guessed = nDPId_CAPTURE_GUESSED,
+                   .capture_undetected = nDPId_CAPTURE_UNDETECTED,
+                   .capture_risky = nDPId_CAPTURE_RISKY,
+                   .capture_midstream = nDPId_CAPTURE_MIDSTREAM,
+                   .capture_rotation = nDPId_CAPTURE_ROTATION};
 
 enum nDPId_subopts
 {
@@ -382,6 +829,8 @@ enum nDPId_subopts
     TICK_RESOLUTION,
     MAX_READER_THREADS,
     IDLE_SCAN_PERIOD,
+    STATUS_INTERVAL,
+    STAGE_TIMINGS,
 #ifdef ENABLE_MEMORY_PROFILING
     MEMORY_PROFILING_PRINT_EVERY,
 #endif
@@ -396,6 +845,13 @@ enum nDPId_subopts
     TCP_MAX_POST_END_FLOW_TIME,
     MAX_PACKETS_PER_FLOW_TO_SEND,
     MAX_PACKETS_PER_FLOW_TO_PROCESS,
+    PACKET_BATCH_SIZE,
+    ORDERED_REPLAY,
+    CAPTURE_GUESSED,
+    CAPTURE_UNDETECTED,
+    CAPTURE_RISKY,
+    CAPTURE_MIDSTREAM,
+    CAPTURE_ROTATION,
 };
 static char * const subopt_token[] = {[MAX_FLOWS_PER_THREAD] = "max-flows-per-thread",
                                       [MAX_IDLE_FLOWS_PER_THREAD] = "max-idle-flows-per-thread",
@@ -409,6 +865,8 @@ static char * const subopt_token[] = {[MAX_FLOWS_PER_THREAD] = "max-flows-per-th
                                       [COMPRESSION_FLOW_INACTIVITY] = "compression-flow-activity",
 #endif
                                       [IDLE_SCAN_PERIOD] = "idle-scan-period",
+                                      [STATUS_INTERVAL] = "status-interval",
+                                      [STAGE_TIMINGS] = "stage-timings",
                                       [GENERIC_MAX_IDLE_TIME] = "generic-max-idle-time",
                                       [ICMP_MAX_IDLE_TIME] = "icmp-max-idle-time",
                                       [UDP_MAX_IDLE_TIME] = "udp-max-idle-time",
@@ -416,14 +874,36 @@ static char * const subopt_token[] = {[MAX_FLOWS_PER_THREAD] = "max-flows-per-th
                                       [TCP_MAX_POST_END_FLOW_TIME] = "tcp-max-post-end-flow-time",
                                       [MAX_PACKETS_PER_FLOW_TO_SEND] = "max-packets-per-flow-to-send",
                                       [MAX_PACKETS_PER_FLOW_TO_PROCESS] = "max-packets-per-flow-to-process",
+                                      [PACKET_BATCH_SIZE] = "packet-batch-size",
+                                      [ORDERED_REPLAY] = "ordered-replay",
+                                      [CAPTURE_GUESSED] = "capture-guessed",
+                                      [CAPTURE_UNDETECTED] = "capture-undetected",
+                                      [CAPTURE_RISKY] = "capture-risky",
+                                      [CAPTURE_MIDSTREAM] = "capture-midstream",
+                                      [CAPTURE_ROTATION] = "capture-rotation",
                                       NULL};
 
 static void free_workflow(struct nDPId_workflow ** const workflow);
+static int start_flow_capture_writer(void);
+static void stop_flow_capture_writer(void);
+static int create_stats_socket(void);
 static void serialize_and_send(struct nDPId_reader_thread * const reader_thread);
 static void jsonize_flow_event(struct nDPId_reader_thread * const reader_thread,
-                               struct nDPId_flow_info * const flow,
+                               struct nDPId_flow_basic * const flow_basic,
                                enum flow_event event);
 
+static struct nDPId_flow_extended * get_flow_extended(struct nDPId_workflow * const workflow,
+                                                      struct nDPId_flow_basic const * const flow_basic)
+{
+    return &workflow->flows_extended[flow_basic->cold_index];
+}
+
+static struct nDPId_flow_info * get_flow_info(struct nDPId_workflow * const workflow,
+                                              struct nDPId_flow_basic const * const flow_basic)
+{
+    return &workflow->flows_info[flow_basic->cold_index];
+}
+
 #ifdef ENABLE_ZLIB
 static int zlib_deflate(const void * const src, int srcLen, void * dst, int dstLen)
 {
@@ -580,50 +1060,37 @@ static int detection_data_inflate(struct nDPId_flow_info * const flow_info)
     return ret;
 }
 
-static void ndpi_comp_scan_walker(void const * const A, ndpi_VISIT which, int depth, void * const user_data)
+static void compress_flow(struct nDPId_workflow * const workflow, struct nDPId_flow_basic const * const flow_basic)
 {
-    struct nDPId_workflow * const workflow = (struct nDPId_workflow *)user_data;
-    struct nDPId_flow_basic * const flow_basic = *(struct nDPId_flow_basic **)A;
-
-    (void)depth;
-
-    if (workflow == NULL || flow_basic == NULL)
+    switch (flow_basic->type)
     {
-        return;
-    }
+        case FT_UNKNOWN:
+        case FT_SKIPPED:
+        case FT_FINISHED:
+            break;
 
-    if (which == ndpi_preorder || which == ndpi_leaf)
-    {
-        switch (flow_basic->type)
+        case FT_INFO:
         {
-            case FT_UNKNOWN:
-            case FT_SKIPPED:
-            case FT_FINISHED:
-                break;
-
-            case FT_INFO:
+            if (flow_basic->last_seen + nDPId_options.compression_flow_inactivity < workflow->last_time)
             {
-                if (flow_basic->last_seen + nDPId_options.compression_flow_inactivity < workflow->last_time)
-                {
-                    struct nDPId_flow_info * const flow_info = (struct nDPId_flow_info *)flow_basic;
+                struct nDPId_flow_info * const flow_info = get_flow_info(workflow, flow_basic);
 
-                    if (flow_info->detection_data_compressed_size > 0)
-                    {
-                        break;
-                    }
+                if (flow_info->detection_data_compressed_size > 0)
+                {
+                    break;
+                }
 
-                    int ret = detection_data_deflate(flow_info);
+                int ret = detection_data_deflate(flow_info);
 
-                    if (ret <= 0)
-                    {
-                        syslog(LOG_DAEMON | LOG_ERR,
-                               "zLib compression failed for flow %u with error code: %d",
-                               flow_info->flow_extended.flow_id,
-                               ret);
-                    }
+                if (ret <= 0)
+                {
+                    syslog(LOG_DAEMON | LOG_ERR,
+                           "zLib compression failed for flow %u with error code: %d",
+                           get_flow_extended(workflow, flow_basic)->flow_id,
+                           ret);
                 }
-                break;
             }
+            break;
         }
     }
 }
@@ -634,9 +1101,10 @@ static void check_for_compressable_flows(struct nDPId_reader_thread * const read
 
     if (workflow->last_compression_scan_time + nDPId_options.compression_scan_period < workflow->last_time)
     {
+        /* unused pool entries are FT_UNKNOWN, the scan order does not matter here */
         for (size_t comp_scan_index = 0; comp_scan_index < workflow->max_active_flows; ++comp_scan_index)
         {
-            ndpi_twalk(workflow->ndpi_flows_active[comp_scan_index], ndpi_comp_scan_walker, workflow);
+            compress_flow(workflow, &workflow->flows_basic[comp_scan_index]);
         }
 
         workflow->last_compression_scan_time = workflow->last_time;
@@ -973,82 +1441,284 @@ static void log_memory_usage(struct nDPId_reader_thread * const reader_thread)
 }
 #endif
 
-static struct nDPId_workflow * init_workflow(char const * const file_or_device)
+static uint64_t get_monotonic_usec(void)
 {
-    int pcap_argument_is_file = 0;
-    char pcap_error_buffer[PCAP_ERRBUF_SIZE];
-    struct nDPId_workflow * workflow;
+    struct timespec ts;
 
-#ifdef ENABLE_MEMORY_PROFILING
-    set_ndpi_malloc(ndpi_malloc_wrapper);
-    set_ndpi_free(ndpi_free_wrapper);
-    set_ndpi_flow_malloc(NULL);
-    set_ndpi_flow_free(NULL);
-#endif
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+    {
+        return 0;
+    }
 
-    workflow = (struct nDPId_workflow *)ndpi_calloc(1, sizeof(*workflow));
-    if (workflow == NULL)
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Timestamps for the DPI/serialization/send timings, clock_gettime() is only called with `stage-timings'. */
+static uint64_t get_stats_usec(void)
+{
+    if (nDPId_options.stage_timings == 0)
     {
-        return NULL;
+        return 0;
     }
 
-    errno = 0;
-    if (access(file_or_device, R_OK) != 0 && errno == ENOENT)
+    return get_monotonic_usec();
+}
+
+#ifdef ENABLE_LATENCY_HISTOGRAMS
+static uint64_t get_latency_nsec(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC_RAW, &ts) != 0)
     {
-        workflow->pcap_handle = pcap_open_live(file_or_device, 65535, 1, 250, pcap_error_buffer);
+        return 0;
     }
-    else
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t latency_histogram_index(uint64_t nsec)
+{
+    unsigned int exponent;
+
+    if (nsec < LATENCY_SUB_BUCKETS)
     {
-        workflow->pcap_handle =
-            pcap_open_offline_with_tstamp_precision(file_or_device, PCAP_TSTAMP_PRECISION_MICRO, pcap_error_buffer);
-        pcap_argument_is_file = 1;
+        return nsec;
     }
 
-    if (workflow->pcap_handle == NULL)
+    exponent = 63 - __builtin_clzll(nsec);
+    if (exponent > LATENCY_MAX_EXPONENT)
     {
-        syslog(LOG_DAEMON | LOG_ERR,
-               (pcap_argument_is_file == 0 ? "pcap_open_live: %.*s" : "pcap_open_offline_with_tstamp_precision: %.*s"),
-               (int)PCAP_ERRBUF_SIZE,
-               pcap_error_buffer);
-        free_workflow(&workflow);
-        return NULL;
+        return LATENCY_BUCKETS - 1;
     }
 
-    if (nDPId_options.bpf_str != NULL)
+    return (exponent - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS +
+           ((nsec >> (exponent - LATENCY_SUB_BUCKET_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+/* highest value counted by a bucket */
+static uint64_t latency_histogram_bucket_max(size_t index)
+{
+    unsigned int exponent;
+
+    if (index < LATENCY_SUB_BUCKETS)
     {
-        struct bpf_program fp;
-        if (pcap_compile(workflow->pcap_handle, &fp, nDPId_options.bpf_str, 1, PCAP_NETMASK_UNKNOWN) != 0)
+        return index;
+    }
+
+    exponent = index / LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKET_BITS - 1;
+    return (1ull << exponent) + ((uint64_t)(index % LATENCY_SUB_BUCKETS + 1) << (exponent - LATENCY_SUB_BUCKET_BITS)) -
+           1;
+}
+
+static void latency_histogram_add(struct nDPId_latency_histogram * const histogram, uint64_t nsec)
+{
+    histogram->count++;
+    histogram->buckets[latency_histogram_index(nsec)]++;
+    if (nsec > histogram->max)
+    {
+        histogram->max = nsec;
+    }
+}
+
+static void latency_histograms_merge(struct nDPId_latency_histogram * const dst,
+                                     struct nDPId_latency_histogram const * const src)
+{
+    for (size_t stage = 0; stage < LATENCY_STAGE_COUNT; ++stage)
+    {
+        dst[stage].count += src[stage].count;
+        if (src[stage].max > dst[stage].max)
         {
-            syslog(LOG_DAEMON | LOG_ERR, "pcap_compile: %s", pcap_geterr(workflow->pcap_handle));
-            free_workflow(&workflow);
-            return NULL;
+            dst[stage].max = src[stage].max;
         }
-        if (pcap_setfilter(workflow->pcap_handle, &fp) != 0)
+        for (size_t i = 0; i < LATENCY_BUCKETS; ++i)
         {
-            syslog(LOG_DAEMON | LOG_ERR, "pcap_setfilter: %s", pcap_geterr(workflow->pcap_handle));
-            free_workflow(&workflow);
-            pcap_freecode(&fp);
-            return NULL;
+            dst[stage].buckets[i] += src[stage].buckets[i];
         }
-        pcap_freecode(&fp);
     }
+}
 
-    ndpi_init_prefs init_prefs = ndpi_no_prefs;
-    workflow->ndpi_struct = ndpi_init_detection_module(init_prefs);
-    if (workflow->ndpi_struct == NULL)
+static uint64_t latency_histogram_percentile(struct nDPId_latency_histogram const * const histogram,
+                                             uint64_t per_mille)
+{
+    uint64_t const rank = (histogram->count * per_mille + 999) / 1000;
+    uint64_t seen = 0;
+
+    if (histogram->count == 0)
     {
-        free_workflow(&workflow);
-        return NULL;
+        return 0;
     }
 
-    workflow->total_skipped_flows = 0;
-    workflow->total_active_flows = 0;
-    workflow->max_active_flows = nDPId_options.max_flows_per_thread;
-    workflow->ndpi_flows_active = (void **)ndpi_calloc(workflow->max_active_flows, sizeof(void *));
-    if (workflow->ndpi_flows_active == NULL)
+    for (size_t i = 0; i < LATENCY_BUCKETS; ++i)
     {
-        free_workflow(&workflow);
-        return NULL;
+        seen += histogram->buckets[i];
+        if (seen >= rank)
+        {
+            uint64_t const bucket_max = latency_histogram_bucket_max(i);
+            return (bucket_max < histogram->max ? bucket_max : histogram->max);
+        }
+    }
+
+    return histogram->max;
+}
+
+#define LATENCY_SAMPLE_BEGIN(name) uint64_t const name = get_latency_nsec()
+#define LATENCY_SAMPLE_END(reader_thread, stage, name)                                                                 \
+    latency_histogram_add(&(reader_thread)->latency_histograms[stage], get_latency_nsec() - (name))
+#else
+#define LATENCY_SAMPLE_BEGIN(name)
+#define LATENCY_SAMPLE_END(reader_thread, stage, name)
+#endif
+
+static size_t get_resident_set_size(void)
+{
+    long int pages = 0;
+    FILE * const fp = fopen("/proc/self/statm", "r");
+
+    if (fp == NULL)
+    {
+        return 0;
+    }
+    if (fscanf(fp, "%*s %ld", &pages) != 1)
+    {
+        pages = 0;
+    }
+    fclose(fp);
+
+    return (size_t)pages * sysconf(_SC_PAGESIZE);
+}
+
+/*
+ * Serializes the few setup calls which are not thread safe, see init_workflow().
+ * Time spent waiting for another reader thread is accounted separately and not part of any phase timing.
+ */
+static void workflow_init_lock(struct nDPId_workflow_init_time * const init_time)
+{
+    uint64_t const wait_start = get_monotonic_usec();
+
+    pthread_mutex_lock(&workflow_init_mutex);
+    init_time->lock_wait_usec += get_monotonic_usec() - wait_start;
+}
+
+static void workflow_init_unlock(void)
+{
+    pthread_mutex_unlock(&workflow_init_mutex);
+}
+
+static int init_workflow_pcap(struct nDPId_workflow * const workflow,
+                              char const * const file_or_device,
+                              struct nDPId_workflow_init_time * const init_time)
+{
+    int pcap_argument_is_file = 0;
+    char pcap_error_buffer[PCAP_ERRBUF_SIZE];
+
+    errno = 0;
+    if (access(file_or_device, R_OK) != 0 && errno == ENOENT)
+    {
+        workflow->pcap_handle = pcap_open_live(file_or_device, 65535, 1, 250, pcap_error_buffer);
+    }
+    else
+    {
+        workflow->pcap_handle =
+            pcap_open_offline_with_tstamp_precision(file_or_device, PCAP_TSTAMP_PRECISION_MICRO, pcap_error_buffer);
+        pcap_argument_is_file = 1;
+    }
+
+    if (workflow->pcap_handle == NULL)
+    {
+        syslog(LOG_DAEMON | LOG_ERR,
+               (pcap_argument_is_file == 0 ? "pcap_open_live: %.*s" : "pcap_open_offline_with_tstamp_precision: %.*s"),
+               (int)PCAP_ERRBUF_SIZE,
+               pcap_error_buffer);
+        return 1;
+    }
+
+    if (nDPId_options.bpf_str != NULL)
+    {
+        struct bpf_program fp;
+        int compile_failed;
+
+        /* The BPF grammar parser of older libpcap versions uses global state. */
+        workflow_init_lock(init_time);
+        compile_failed = pcap_compile(workflow->pcap_handle, &fp, nDPId_options.bpf_str, 1, PCAP_NETMASK_UNKNOWN);
+        workflow_init_unlock();
+        if (compile_failed != 0)
+        {
+            syslog(LOG_DAEMON | LOG_ERR, "pcap_compile: %s", pcap_geterr(workflow->pcap_handle));
+            return 1;
+        }
+        if (pcap_setfilter(workflow->pcap_handle, &fp) != 0)
+        {
+            syslog(LOG_DAEMON | LOG_ERR, "pcap_setfilter: %s", pcap_geterr(workflow->pcap_handle));
+            pcap_freecode(&fp);
+            return 1;
+        }
+        pcap_freecode(&fp);
+    }
+
+    return 0;
+}
+
+/*
+ * Workflows are initialized in parallel, see setup_reader_threads().
+ * Only pcap_compile() and ndpi_init_detection_module() (which sets up process wide libnDPI state on first use)
+ * are serialized. Loading the custom files and ndpi_finalize_initialization() only touch the
+ * `struct ndpi_detection_module_struct' of this workflow and run in parallel, as does the flow table allocation.
+ * Phase timings do not include the time spent waiting for the lock, see `lock_wait_usec'.
+ */
+static struct nDPId_workflow * init_workflow(char const * const file_or_device,
+                                             struct nDPId_workflow_init_time * const init_time)
+{
+    struct nDPId_workflow * workflow;
+    uint64_t const start_time = get_monotonic_usec();
+    uint64_t phase_time;
+    uint64_t lock_wait;
+    int pcap_failed;
+
+    workflow = (struct nDPId_workflow *)ndpi_calloc(1, sizeof(*workflow));
+    if (workflow == NULL)
+    {
+        return NULL;
+    }
+
+    phase_time = get_monotonic_usec();
+    workflow->total_skipped_flows = 0;
+    workflow->total_active_flows = 0;
+    workflow->max_active_flows = nDPId_options.max_flows_per_thread;
+    workflow->flow_table = (struct nDPId_flow_slot *)ndpi_calloc(
+        workflow->max_active_flows * FLOW_TABLE_SLOTS_PER_BUCKET, sizeof(*workflow->flow_table));
+    if (workflow->flow_table == NULL)
+    {
+        free_workflow(&workflow);
+        return NULL;
+    }
+    for (size_t i = 0; i < workflow->max_active_flows * FLOW_TABLE_SLOTS_PER_BUCKET; ++i)
+    {
+        workflow->flow_table[i].cold_index = FLOW_SLOT_EMPTY;
+    }
+
+    /* One additional entry to be able to align the hot records on a cache line boundary. */
+    workflow->flows_basic_unaligned =
+        ndpi_calloc(workflow->max_active_flows + 1, sizeof(*workflow->flows_basic));
+    workflow->flows_extended =
+        (struct nDPId_flow_extended *)ndpi_calloc(workflow->max_active_flows, sizeof(*workflow->flows_extended));
+    workflow->flows_info =
+        (struct nDPId_flow_info *)ndpi_calloc(workflow->max_active_flows, sizeof(*workflow->flows_info));
+    workflow->flows_free = (uint32_t *)ndpi_calloc(workflow->max_active_flows, sizeof(*workflow->flows_free));
+    if (workflow->flows_basic_unaligned == NULL || workflow->flows_extended == NULL || workflow->flows_info == NULL ||
+        workflow->flows_free == NULL)
+    {
+        free_workflow(&workflow);
+        return NULL;
+    }
+    workflow->flows_basic = (struct nDPId_flow_basic *)(((uintptr_t)workflow->flows_basic_unaligned +
+                                                         sizeof(*workflow->flows_basic) - 1) &
+                                                        ~(uintptr_t)(sizeof(*workflow->flows_basic) - 1));
+    for (size_t i = 0; i < workflow->max_active_flows; ++i)
+    {
+        workflow->flows_basic[i].cold_index = i;
+        /* lower indices are handed out first */
+        workflow->flows_free[i] = workflow->max_active_flows - 1 - i;
     }
 
     workflow->total_idle_flows = 0;
@@ -1059,7 +1729,31 @@ static struct nDPId_workflow * init_workflow(char const * const file_or_device)
         free_workflow(&workflow);
         return NULL;
     }
+    init_time->flow_tables_usec = get_monotonic_usec() - phase_time;
+
+    phase_time = get_monotonic_usec();
+    lock_wait = init_time->lock_wait_usec;
+    pcap_failed = init_workflow_pcap(workflow, file_or_device, init_time);
+    init_time->pcap_usec = get_monotonic_usec() - phase_time - (init_time->lock_wait_usec - lock_wait);
+    if (pcap_failed != 0)
+    {
+        free_workflow(&workflow);
+        return NULL;
+    }
+
+    ndpi_init_prefs init_prefs = ndpi_no_prefs;
+    workflow_init_lock(init_time);
+    phase_time = get_monotonic_usec();
+    workflow->ndpi_struct = ndpi_init_detection_module(init_prefs);
+    init_time->ndpi_init_usec = get_monotonic_usec() - phase_time;
+    workflow_init_unlock();
+    if (workflow->ndpi_struct == NULL)
+    {
+        free_workflow(&workflow);
+        return NULL;
+    }
 
+    phase_time = get_monotonic_usec();
     NDPI_PROTOCOL_BITMASK protos;
     NDPI_BITMASK_SET_ALL(protos);
     ndpi_set_protocol_detection_bitmask2(workflow->ndpi_struct, &protos);
@@ -1079,15 +1773,21 @@ static struct nDPId_workflow * init_workflow(char const * const file_or_device)
     {
         ndpi_load_malicious_sha1_file(workflow->ndpi_struct, nDPId_options.custom_sha1_file);
     }
+    init_time->custom_files_usec = get_monotonic_usec() - phase_time;
+
+    phase_time = get_monotonic_usec();
     ndpi_finalize_initialization(workflow->ndpi_struct);
+    init_time->ndpi_finalize_usec = get_monotonic_usec() - phase_time;
 
     ndpi_set_detection_preferences(workflow->ndpi_struct, ndpi_pref_enable_tls_block_dissection, 1);
 
-    if (ndpi_init_serializer_ll(&workflow->ndpi_serializer, ndpi_serialization_format_json, NETWORK_BUFFER_MAX_SIZE) !=
-        1)
+    if (ndpi_init_serializer_ll(&workflow->ndpi_serializer,
+                                ndpi_serialization_format_json,
+                                NETWORK_BUFFER_COLLECTOR_MAX_SIZE) != 1)
     {
         return NULL;
     }
+    init_time->total_usec = get_monotonic_usec() - start_time;
 
     return workflow;
 }
@@ -1116,25 +1816,24 @@ error:
     return 1;
 }
 
-static void ndpi_flow_info_freer(void * const node)
+static void free_flow(struct nDPId_workflow * const workflow, struct nDPId_flow_basic * const flow_basic)
 {
-    struct nDPId_flow_basic * const flow_basic = (struct nDPId_flow_basic *)node;
-
     switch (flow_basic->type)
     {
         case FT_UNKNOWN:
+            return;
+
         case FT_SKIPPED:
         case FT_FINISHED:
             break;
 
         case FT_INFO:
-        {
-            struct nDPId_flow_info * const flow_info = (struct nDPId_flow_info *)flow_basic;
-            free_detection_data(flow_info);
+            free_detection_data(get_flow_info(workflow, flow_basic));
             break;
-        }
     }
-    ndpi_free(flow_basic);
+    flow_basic->type = FT_UNKNOWN;
+    workflow->flows_free[workflow->max_active_flows - workflow->cur_active_flows] = flow_basic->cold_index;
+    workflow->cur_active_flows--;
 }
 
 static void free_workflow(struct nDPId_workflow ** const workflow)
@@ -1156,12 +1855,22 @@ static void free_workflow(struct nDPId_workflow ** const workflow)
     {
         ndpi_exit_detection_module(w->ndpi_struct);
     }
-    for (size_t i = 0; i < w->max_active_flows; i++)
+    if (w->flows_basic != NULL && w->flows_info != NULL)
     {
-        ndpi_tdestroy(w->ndpi_flows_active[i], ndpi_flow_info_freer);
+        for (size_t i = 0; i < w->max_active_flows; i++)
+        {
+            if (w->flows_basic[i].type == FT_INFO)
+            {
+                free_detection_data(&w->flows_info[w->flows_basic[i].cold_index]);
+            }
+        }
     }
-    ndpi_free(w->ndpi_flows_active);
+    ndpi_free(w->flow_table);
     ndpi_free(w->ndpi_flows_idle);
+    ndpi_free(w->flows_basic_unaligned);
+    ndpi_free(w->flows_extended);
+    ndpi_free(w->flows_info);
+    ndpi_free(w->flows_free);
     ndpi_term_serializer(&w->ndpi_serializer);
     ndpi_free(w);
     *workflow = NULL;
@@ -1183,1058 +1892,2561 @@ static char * get_default_pcapdev(char * errbuf)
     return ifname;
 }
 
-static int setup_reader_threads(void)
+static int parse_cpu_list(char const * const cpu_list, int * const cpus, size_t max_cpus, size_t * const cpu_count)
 {
-    char pcap_error_buffer[PCAP_ERRBUF_SIZE];
+    char const * p = cpu_list;
 
-    if (nDPId_options.reader_thread_count > nDPId_MAX_READER_THREADS)
+    *cpu_count = 0;
+    while (*p != '\0' && *p != '\n')
     {
-        return 1;
-    }
+        char * endptr;
+        unsigned long int first = strtoul(p, &endptr, 10);
+        unsigned long int last;
 
-    if (nDPId_options.pcap_file_or_interface == NULL)
-    {
-        nDPId_options.pcap_file_or_interface = get_default_pcapdev(pcap_error_buffer);
-        if (nDPId_options.pcap_file_or_interface == NULL)
+        if (endptr == p)
         {
-            syslog(LOG_DAEMON | LOG_ERR, "pcap_lookupdev: %.*s", (int)PCAP_ERRBUF_SIZE, pcap_error_buffer);
             return 1;
         }
-        syslog(LOG_DAEMON, "Capturing packets from default device: %s", nDPId_options.pcap_file_or_interface);
-    }
-
-    errno = 0;
-    if (access(nDPId_options.pcap_file_or_interface, R_OK) != 0 && errno == ENOENT)
-    {
-        errno = 0;
-        if (get_ip_netmask_from_pcap_dev(nDPId_options.pcap_file_or_interface) != 0)
+        p = endptr;
+        last = first;
+        if (*p == '-')
         {
-            if (errno != 0)
+            p++;
+            last = strtoul(p, &endptr, 10);
+            if (endptr == p || last < first)
             {
-                syslog(LOG_DAEMON | LOG_ERR,
-                       "Could not get netmask for pcap device %s: %s",
-                       nDPId_options.pcap_file_or_interface,
-                       strerror(errno));
+                return 1;
             }
-            return 1;
+            p = endptr;
         }
-    }
-    else
-    {
-        if (nDPId_options.process_internal_initial_direction != 0)
+        if (last >= CPU_SETSIZE)
         {
-            syslog(LOG_DAEMON | LOG_ERR, "You are processing a PCAP file, `-I' ignored");
-            nDPId_options.process_internal_initial_direction = 0;
+            return 1;
         }
-        if (nDPId_options.process_external_initial_direction != 0)
+
+        for (; first <= last && *cpu_count < max_cpus; ++first)
         {
-            syslog(LOG_DAEMON | LOG_ERR, "You are processing a PCAP file, `-E' ignored");
-            nDPId_options.process_external_initial_direction = 0;
+            cpus[(*cpu_count)++] = first;
         }
-    }
 
-    for (unsigned long long int i = 0; i < nDPId_options.reader_thread_count; ++i)
-    {
-        reader_threads[i].workflow = init_workflow(nDPId_options.pcap_file_or_interface);
-        if (reader_threads[i].workflow == NULL)
+        if (*p == ',')
+        {
+            p++;
+        }
+        else if (*p != '\0' && *p != '\n')
         {
             return 1;
         }
     }
 
-    return 0;
+    return (*cpu_count == 0);
 }
 
-static int ip_tuples_equal(struct nDPId_flow_basic const * const A, struct nDPId_flow_basic const * const B)
+static int irq_cmp(void const * const A, void const * const B)
 {
-    // generate a warning if the enum changes
-    switch (A->l3_type)
-    {
-        case L3_IP:
-        case L3_IP6:
-            break;
-    }
-    if (A->l3_type == L3_IP && B->l3_type == L3_IP6)
-    {
-        return A->src.v4.ip == B->src.v4.ip && A->dst.v4.ip == B->dst.v4.ip;
-    }
-    else if (A->l3_type == L3_IP6 && B->l3_type == L3_IP6)
-    {
-        return A->src.v6.ip[0] == B->src.v6.ip[0] && A->src.v6.ip[1] == B->src.v6.ip[1] &&
-               A->dst.v6.ip[0] == B->dst.v6.ip[0] && A->dst.v6.ip[1] == B->dst.v6.ip[1];
-    }
-    return 0;
+    unsigned long int const a = *(unsigned long int const *)A;
+    unsigned long int const b = *(unsigned long int const *)B;
+
+    return (a > b) - (a < b);
 }
 
-static int ip_tuples_compare(struct nDPId_flow_basic const * const A, struct nDPId_flow_basic const * const B)
+/*
+ * Retrieves the CPUs handling the MSI interrupts of a network interface, ordered by IRQ number.
+ * Each CPU is returned only once.
+ */
+static int get_irq_cpus(char const * const ifname, int * const cpus, size_t max_cpus, size_t * const cpu_count)
 {
-    // generate a warning if the enum changes
-    switch (A->l3_type)
+    char path[PATH_MAX];
+    DIR * dir;
+    struct dirent * entry;
+    unsigned long int irqs[CPU_SETSIZE];
+    size_t irq_count = 0;
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/msi_irqs", ifname);
+    dir = opendir(path);
+    if (dir == NULL)
     {
-        case L3_IP:
-        case L3_IP6:
-            break;
+        return 1;
     }
-    if (A->l3_type == L3_IP && B->l3_type == L3_IP6)
+    while ((entry = readdir(dir)) != NULL && irq_count < CPU_SETSIZE)
     {
-        if (A->src.v4.ip < B->src.v4.ip || A->dst.v4.ip < B->dst.v4.ip)
+        char * endptr;
+        unsigned long int irq = strtoul(entry->d_name, &endptr, 10);
+
+        if (endptr != entry->d_name && *endptr == '\0')
         {
-            return -1;
+            irqs[irq_count++] = irq;
         }
-        if (A->src.v4.ip > B->src.v4.ip || A->dst.v4.ip > B->dst.v4.ip)
+    }
+    closedir(dir);
+    qsort(irqs, irq_count, sizeof(irqs[0]), irq_cmp);
+
+    *cpu_count = 0;
+    for (size_t i = 0; i < irq_count && *cpu_count < max_cpus; ++i)
+    {
+        char const * const affinity_files[] = {"effective_affinity_list", "smp_affinity_list"};
+        char affinity[BUFSIZ];
+        int irq_cpu;
+        size_t irq_cpu_count = 0;
+
+        for (size_t j = 0; j < sizeof(affinity_files) / sizeof(affinity_files[0]) && irq_cpu_count == 0; ++j)
         {
-            return 1;
+            FILE * fp;
+
+            snprintf(path, sizeof(path), "/proc/irq/%lu/%s", irqs[i], affinity_files[j]);
+            fp = fopen(path, "r");
+            if (fp == NULL)
+            {
+                continue;
+            }
+            if (fgets(affinity, sizeof(affinity), fp) != NULL &&
+                parse_cpu_list(affinity, &irq_cpu, 1, &irq_cpu_count) != 0)
+            {
+                irq_cpu_count = 0;
+            }
+            fclose(fp);
+        }
+        if (irq_cpu_count == 0)
+        {
+            continue;
+        }
+
+        size_t k;
+        for (k = 0; k < *cpu_count; ++k)
+        {
+            if (cpus[k] == irq_cpu)
+            {
+                break;
+            }
+        }
+        if (k == *cpu_count)
+        {
+            cpus[(*cpu_count)++] = irq_cpu;
         }
     }
-    else if (A->l3_type == L3_IP6 && B->l3_type == L3_IP6)
+
+    return (*cpu_count == 0);
+}
+
+static int get_reader_thread_cpu(unsigned long long int thread_index)
+{
+    return nDPId_options.reader_thread_cpus[thread_index % nDPId_options.reader_thread_cpu_count];
+}
+
+/*
+ * Starts a thread for a reader thread slot on the CPU configured for it (if any).
+ * If the thread can not be pinned to that CPU (e.g. it is not part of the cpuset), it runs unpinned.
+ */
+static int create_reader_thread(struct nDPId_reader_thread * const reader_thread, void * (*start_routine)(void *))
+{
+    pthread_attr_t attr;
+    int pinned = 0;
+    int ret;
+
+    if (pthread_attr_init(&attr) != 0)
     {
-        if ((A->src.v6.ip[0] < B->src.v6.ip[0] && A->src.v6.ip[1] < B->src.v6.ip[1]) ||
-            (A->dst.v6.ip[0] < B->dst.v6.ip[0] && A->dst.v6.ip[1] < B->dst.v6.ip[1]))
+        return 1;
+    }
+    if (nDPId_options.reader_thread_cpu_count > 0)
+    {
+        int const cpu = get_reader_thread_cpu(reader_thread->array_index);
+        cpu_set_t cpuset;
+
+        CPU_ZERO(&cpuset);
+        CPU_SET(cpu, &cpuset);
+        ret = pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+        if (ret != 0)
         {
-            return -1;
+            syslog(LOG_DAEMON | LOG_ERR,
+                   "Could not pin reader thread %d to CPU %d: %s, running it unpinned",
+                   reader_thread->array_index,
+                   cpu,
+                   strerror(ret));
         }
-        if ((A->src.v6.ip[0] > B->src.v6.ip[0] && A->src.v6.ip[1] > B->src.v6.ip[1]) ||
-            (A->dst.v6.ip[0] > B->dst.v6.ip[0] && A->dst.v6.ip[1] > B->dst.v6.ip[1]))
+        else
         {
-            return 1;
+            pinned = 1;
         }
     }
-    if (A->src_port < B->src_port || A->dst_port < B->dst_port)
+
+    ret = pthread_create(&reader_thread->thread_id, &attr, start_routine, reader_thread);
+    pthread_attr_destroy(&attr);
+    if (ret == EINVAL && pinned != 0)
     {
-        return -1;
+        /* pthread_create() applies the affinity and fails if the CPU is offline or not allowed */
+        syslog(LOG_DAEMON | LOG_ERR,
+               "Could not pin reader thread %d to CPU %d: %s, running it unpinned",
+               reader_thread->array_index,
+               get_reader_thread_cpu(reader_thread->array_index),
+               strerror(ret));
+        ret = pthread_create(&reader_thread->thread_id, NULL, start_routine, reader_thread);
     }
-    else if (A->src_port > B->src_port || A->dst_port > B->dst_port)
+    if (ret != 0)
     {
+        errno = ret;
         return 1;
     }
+
     return 0;
 }
 
-static uint64_t get_l4_protocol_idle_time(uint8_t l4_protocol)
+static int uses_pcap_replay(void)
 {
-    switch (l4_protocol)
+    return nDPId_options.pcap_file_list != NULL || nDPId_options.ordered_replay != 0 ||
+           (nDPId_options.pcap_file_or_interface != NULL &&
+            strpbrk(nDPId_options.pcap_file_or_interface, "*?[") != NULL);
+}
+
+/* The workflows open the first file of a replay, which determines e.g. the snapshot length. */
+static char const * get_pcap_source(void)
+{
+    if (pcap_replay.file_count > 0)
     {
-        case IPPROTO_ICMP:
-        case IPPROTO_ICMPV6:
-            return nDPId_options.icmp_max_idle_time;
-        case IPPROTO_TCP:
-            return nDPId_options.tcp_max_idle_time;
-        case IPPROTO_UDP:
-            return nDPId_options.udp_max_idle_time;
-        default:
-            return nDPId_options.generic_max_idle_time;
+        return pcap_replay.files[0];
     }
-}
 
-static int is_l4_protocol_timed_out(struct nDPId_workflow const * const workflow,
-                                    struct nDPId_flow_basic const * const flow_basic)
-{
-    return flow_basic->last_seen + get_l4_protocol_idle_time(flow_basic->l4_protocol) < workflow->last_time ||
-           (flow_basic->tcp_fin_rst_seen == 1 &&
-            flow_basic->last_seen + nDPId_options.tcp_max_post_end_flow_time < workflow->last_time);
+    return nDPId_options.pcap_file_or_interface;
 }
 
-static void ndpi_idle_scan_walker(void const * const A, ndpi_VISIT which, int depth, void * const user_data)
+static int add_pcap_replay_file(char const * const path)
 {
-    struct nDPId_workflow * const workflow = (struct nDPId_workflow *)user_data;
-    struct nDPId_flow_basic * const flow_basic = *(struct nDPId_flow_basic **)A;
-
-    (void)depth;
+    char ** const new_files = (char **)realloc(pcap_replay.files, (pcap_replay.file_count + 1) * sizeof(*new_files));
 
-    if (workflow == NULL || flow_basic == NULL)
+    if (new_files == NULL)
     {
-        return;
+        return 1;
     }
+    pcap_replay.files = new_files;
+    pcap_replay.files[pcap_replay.file_count] = strdup(path);
+    if (pcap_replay.files[pcap_replay.file_count] == NULL)
+    {
+        return 1;
+    }
+    pcap_replay.file_count++;
 
-    if (workflow->cur_idle_flows == nDPId_options.max_idle_flows_per_thread)
+    return 0;
+}
+
+static int read_pcap_file_list(char const * const list_file)
+{
+    FILE * const fp = fopen(list_file, "r");
+    char * line = NULL;
+    size_t line_size = 0;
+    ssize_t line_length;
+    int retval = 0;
+
+    if (fp == NULL)
     {
-        return;
+        syslog(LOG_DAEMON | LOG_ERR, "Could not open pcap file list %s: %s", list_file, strerror(errno));
+        return 1;
     }
 
-    if (which == ndpi_preorder || which == ndpi_leaf)
+    while ((line_length = getline(&line, &line_size, fp)) >= 0)
     {
-        if (is_l4_protocol_timed_out(workflow, flow_basic) != 0)
+        while (line_length > 0 && (line[line_length - 1] == '\n' || line[line_length - 1] == '\r'))
         {
-            workflow->ndpi_flows_idle[workflow->cur_idle_flows++] = flow_basic;
-            switch (flow_basic->type)
-            {
-                case FT_UNKNOWN:
-                case FT_SKIPPED:
-                    break;
-
-                case FT_FINISHED:
-                case FT_INFO:
-                    workflow->total_idle_flows++;
-                    break;
-            }
+            line[--line_length] = '\0';
+        }
+        if (line_length == 0 || line[0] == '#')
+        {
+            continue;
+        }
+        if (add_pcap_replay_file(line) != 0)
+        {
+            retval = 1;
+            break;
         }
     }
+
+    free(line);
+    fclose(fp);
+    return retval;
 }
 
-static int ndpi_workflow_node_cmp(void const * const A, void const * const B)
+static void free_pcap_replay(void)
 {
-    struct nDPId_flow_basic const * const flow_basic_a = (struct nDPId_flow_basic *)A;
-    struct nDPId_flow_basic const * const flow_basic_b = (struct nDPId_flow_basic *)B;
-
-    if (flow_basic_a->hashval < flow_basic_b->hashval)
+    if (pcap_replay.barrier_initialized != 0)
     {
-        return -1;
+        pthread_barrier_destroy(&pcap_replay.barrier);
     }
-    else if (flow_basic_a->hashval > flow_basic_b->hashval)
+    for (size_t i = 0; i < pcap_replay.file_count; ++i)
     {
-        return 1;
+        free(pcap_replay.files[i]);
     }
+    free(pcap_replay.files);
+    free(pcap_replay.packets);
+    free(pcap_replay.order);
+    memset(&pcap_replay, 0, sizeof(pcap_replay));
+}
 
-    /* flows have the same hash */
-    if (flow_basic_a->l4_protocol < flow_basic_b->l4_protocol)
+static int setup_pcap_replay(void)
+{
+    if (nDPId_options.pcap_file_list != NULL)
     {
-        return -1;
+        if (read_pcap_file_list(nDPId_options.pcap_file_list) != 0)
+        {
+            free_pcap_replay();
+            return 1;
+        }
     }
-    else if (flow_basic_a->l4_protocol > flow_basic_b->l4_protocol)
+    else
+    {
+        glob_t glob_result;
+        int const ret = glob(nDPId_options.pcap_file_or_interface, 0, NULL, &glob_result);
+
+        if (ret != 0 && ret != GLOB_NOMATCH)
+        {
+            syslog(LOG_DAEMON | LOG_ERR, "glob %s failed with %d", nDPId_options.pcap_file_or_interface, ret);
+            return 1;
+        }
+        for (size_t i = 0; ret == 0 && i < glob_result.gl_pathc; ++i)
+        {
+            if (add_pcap_replay_file(glob_result.gl_pathv[i]) != 0)
+            {
+                globfree(&glob_result);
+                free_pcap_replay();
+                return 1;
+            }
+        }
+        if (ret == 0)
+        {
+            globfree(&glob_result);
+        }
+    }
+
+    if (pcap_replay.file_count == 0)
     {
+        syslog(LOG_DAEMON | LOG_ERR, "No pcap files to replay found: %s", nDPId_options.pcap_file_or_interface);
+        free_pcap_replay();
         return 1;
     }
 
-    if (ip_tuples_equal(flow_basic_a, flow_basic_b) != 0 && flow_basic_a->src_port == flow_basic_b->src_port &&
-        flow_basic_a->dst_port == flow_basic_b->dst_port)
+    errno = pthread_barrier_init(&pcap_replay.barrier, NULL, nDPId_options.reader_thread_count);
+    if (errno != 0)
     {
-        return 0;
+        syslog(LOG_DAEMON | LOG_ERR, "pthread_barrier_init: %s", strerror(errno));
+        free_pcap_replay();
+        return 1;
     }
+    pcap_replay.barrier_initialized = 1;
 
-    return ip_tuples_compare(flow_basic_a, flow_basic_b);
+    syslog(LOG_DAEMON,
+           "Replaying %zu pcap file(s) from %s",
+           pcap_replay.file_count,
+           nDPId_options.pcap_file_or_interface);
+    return 0;
 }
 
-static void process_idle_flow(struct nDPId_reader_thread * const reader_thread, size_t idle_scan_index)
+static void * init_workflow_thread(void * const arg)
 {
-    struct nDPId_workflow * const workflow = reader_thread->workflow;
-
-    while (workflow->cur_idle_flows > 0)
-    {
-        struct nDPId_flow_basic * const flow_basic =
-            (struct nDPId_flow_basic *)workflow->ndpi_flows_idle[--workflow->cur_idle_flows];
+    struct nDPId_reader_thread * const reader_thread = (struct nDPId_reader_thread *)arg;
 
-        switch (flow_basic->type)
-        {
-            case FT_UNKNOWN:
-            case FT_SKIPPED:
-                break;
+    reader_thread->workflow = init_workflow(get_pcap_source(), &reader_thread->workflow_init_time);
 
-            case FT_FINISHED:
-            {
-                struct nDPId_flow_finished * const flow_finished = (struct nDPId_flow_finished *)flow_basic;
+    return NULL;
+}
 
-                if (flow_basic->tcp_fin_rst_seen != 0)
-                {
-                    jsonize_flow_event(reader_thread, &flow_finished->flow_info, FLOW_EVENT_END);
-                }
-                else
-                {
-                    jsonize_flow_event(reader_thread, &flow_finished->flow_info, FLOW_EVENT_IDLE);
-                }
-                break;
-            }
+static int setup_flow_capture(void)
+{
+    if (nDPId_options.capture_bpf_str != NULL)
+    {
+        pcap_t * const pcap_handle = pcap_open_dead(pcap_datalink(reader_threads[0].workflow->pcap_handle), 65535);
 
-            case FT_INFO:
+        if (pcap_handle == NULL ||
+            pcap_compile(pcap_handle, &capture_bpf, nDPId_options.capture_bpf_str, 1, PCAP_NETMASK_UNKNOWN) != 0)
+        {
+            syslog(LOG_DAEMON | LOG_ERR,
+                   "pcap_compile: %s",
+                   (pcap_handle != NULL ? pcap_geterr(pcap_handle) : "Out of memory"));
+            if (pcap_handle != NULL)
             {
-                struct nDPId_flow_info * const flow_info = (struct nDPId_flow_info *)flow_basic;
-
-#ifdef ENABLE_ZLIB
-                if (nDPId_options.enable_zlib_compression != 0 && flow_info->detection_data_compressed_size > 0)
-                {
-                    int ret = detection_data_inflate(flow_info);
-                    if (ret <= 0)
-                    {
-                        syslog(LOG_DAEMON | LOG_ERR, "zLib decompression failed with error code: %d", ret);
-                        return;
-                    }
-                }
-#endif
-
-                if (flow_info->detection_completed == 0)
-                {
-                    uint8_t protocol_was_guessed = 0;
-
-                    if (ndpi_is_protocol_detected(workflow->ndpi_struct,
-                                                  flow_info->detection_data->guessed_l7_protocol) == 0)
-                    {
-                        flow_info->detection_data->guessed_l7_protocol = ndpi_detection_giveup(
-                            workflow->ndpi_struct, &flow_info->detection_data->flow, 1, &protocol_was_guessed);
-                    }
-                    else
-                    {
-                        protocol_was_guessed = 1;
-                    }
-
-                    if (protocol_was_guessed != 0)
-                    {
-                        jsonize_flow_event(reader_thread, flow_info, FLOW_EVENT_GUESSED);
-                    }
-                    else
-                    {
-                        jsonize_flow_event(reader_thread, flow_info, FLOW_EVENT_NOT_DETECTED);
-                    }
-                }
-                if (flow_basic->tcp_fin_rst_seen != 0)
-                {
-                    jsonize_flow_event(reader_thread, flow_info, FLOW_EVENT_END);
-                }
-                else
-                {
-                    jsonize_flow_event(reader_thread, flow_info, FLOW_EVENT_IDLE);
-                }
-                break;
+                pcap_close(pcap_handle);
             }
+            return 1;
         }
-
-        ndpi_tdelete(flow_basic, &workflow->ndpi_flows_active[idle_scan_index], ndpi_workflow_node_cmp);
-        ndpi_flow_info_freer(flow_basic);
-        workflow->cur_active_flows--;
+        capture_bpf_valid = 1;
+        pcap_close(pcap_handle);
     }
-}
-
-static void check_for_idle_flows(struct nDPId_reader_thread * const reader_thread)
-{
-    struct nDPId_workflow * const workflow = reader_thread->workflow;
 
-    if (workflow->last_idle_scan_time + nDPId_options.idle_scan_period < workflow->last_time)
+    for (unsigned long long int i = 0; i < nDPId_options.reader_thread_count; ++i)
     {
-        for (size_t idle_scan_index = 0; idle_scan_index < workflow->max_active_flows; ++idle_scan_index)
+        struct nDPId_flow_capture * const flow_capture = &reader_threads[i].flow_capture;
+
+        flow_capture->flows =
+            (struct nDPId_capture_flow *)calloc(nDPId_options.max_flows_per_thread, sizeof(*flow_capture->flows));
+        if (flow_capture->flows == NULL)
         {
-            ndpi_twalk(workflow->ndpi_flows_active[idle_scan_index], ndpi_idle_scan_walker, workflow);
-            process_idle_flow(reader_thread, idle_scan_index);
+            syslog(LOG_DAEMON | LOG_ERR, "Could not allocate the flow capture of reader thread %llu", i);
+            return 1;
         }
-
-        workflow->last_idle_scan_time = workflow->last_time;
     }
+    if (start_flow_capture_writer() != 0)
+    {
+        syslog(LOG_DAEMON | LOG_ERR, "Could not start the pcap writer thread");
+        return 1;
+    }
+
+    syslog(LOG_DAEMON, "Capturing selected flows to %s", nDPId_options.capture_dir);
+    return 0;
 }
 
-static void jsonize_l3_l4(struct nDPId_workflow * const workflow, struct nDPId_flow_basic const * const flow_basic)
+static int setup_reader_threads(void)
 {
-    ndpi_serializer * const serializer = &workflow->ndpi_serializer;
-    char src_name[48] = {};
-    char dst_name[48] = {};
+    char pcap_error_buffer[PCAP_ERRBUF_SIZE];
 
-    switch (flow_basic->l3_type)
+    if (nDPId_options.reader_thread_count > nDPId_MAX_READER_THREADS)
     {
-        case L3_IP:
-            ndpi_serialize_string_string(serializer, "l3_proto", "ip4");
-            if (inet_ntop(AF_INET, &flow_basic->src.v4.ip, src_name, sizeof(src_name)) == NULL)
-            {
-                syslog(LOG_DAEMON | LOG_ERR, "Could not convert IPv4 source ip to string: %s", strerror(errno));
-            }
-            if (inet_ntop(AF_INET, &flow_basic->dst.v4.ip, dst_name, sizeof(dst_name)) == NULL)
-            {
-                syslog(LOG_DAEMON | LOG_ERR, "Could not convert IPv4 destination ip to string: %s", strerror(errno));
-            }
-            break;
-        case L3_IP6:
-            ndpi_serialize_string_string(serializer, "l3_proto", "ip6");
-            if (inet_ntop(AF_INET6, &flow_basic->src.v6.ip[0], src_name, sizeof(src_name)) == NULL)
-            {
-                syslog(LOG_DAEMON | LOG_ERR, "Could not convert IPv6 source ip to string: %s", strerror(errno));
-            }
-            if (inet_ntop(AF_INET6, &flow_basic->dst.v6.ip[0], dst_name, sizeof(dst_name)) == NULL)
-            {
-                syslog(LOG_DAEMON | LOG_ERR, "Could not convert IPv6 destination ip to string: %s", strerror(errno));
-            }
-
-            /* For consistency across platforms replace :0: with :: */
-            ndpi_patchIPv6Address(src_name), ndpi_patchIPv6Address(dst_name);
-            break;
-        default:
-            ndpi_serialize_string_string(serializer, "l3_proto", "unknown");
+        return 1;
     }
 
-    ndpi_serialize_string_string(serializer, "src_ip", src_name);
-    ndpi_serialize_string_string(serializer, "dst_ip", dst_name);
-    if (flow_basic->src_port)
+    if (nDPId_options.pcap_file_or_interface == NULL)
     {
-        ndpi_serialize_string_uint32(serializer, "src_port", flow_basic->src_port);
+        nDPId_options.pcap_file_or_interface = get_default_pcapdev(pcap_error_buffer);
+        if (nDPId_options.pcap_file_or_interface == NULL)
+        {
+            syslog(LOG_DAEMON | LOG_ERR, "pcap_lookupdev: %.*s", (int)PCAP_ERRBUF_SIZE, pcap_error_buffer);
+            return 1;
+        }
+        syslog(LOG_DAEMON, "Capturing packets from default device: %s", nDPId_options.pcap_file_or_interface);
     }
-    if (flow_basic->dst_port)
+
+    if (uses_pcap_replay() != 0 && setup_pcap_replay() != 0)
     {
-        ndpi_serialize_string_uint32(serializer, "dst_port", flow_basic->dst_port);
+        return 1;
     }
 
-    switch (flow_basic->l4_protocol)
+    errno = 0;
+    if (access(get_pcap_source(), R_OK) != 0 && errno == ENOENT)
     {
-        case IPPROTO_TCP:
-            ndpi_serialize_string_string(serializer, "l4_proto", "tcp");
-            break;
-        case IPPROTO_UDP:
-            ndpi_serialize_string_string(serializer, "l4_proto", "udp");
-            break;
-        case IPPROTO_ICMP:
-            ndpi_serialize_string_string(serializer, "l4_proto", "icmp");
-            break;
-        case IPPROTO_ICMPV6:
-            ndpi_serialize_string_string(serializer, "l4_proto", "icmp6");
-            break;
-        default:
-            ndpi_serialize_string_uint32(serializer, "l4_proto", flow_basic->l4_protocol);
-            break;
-    }
-}
-
-static void jsonize_basic(struct nDPId_reader_thread * const reader_thread)
-{
-    struct nDPId_workflow * const workflow = reader_thread->workflow;
-
-    ndpi_serialize_string_int32(&workflow->ndpi_serializer, "thread_id", reader_thread->array_index);
-    ndpi_serialize_string_uint32(&workflow->ndpi_serializer, "packet_id", workflow->packets_captured);
-    ndpi_serialize_string_string(&workflow->ndpi_serializer, "source", nDPId_options.pcap_file_or_interface);
-    ndpi_serialize_string_string(&workflow->ndpi_serializer, "alias", nDPId_options.instance_alias);
-}
-
-static void jsonize_daemon(struct nDPId_reader_thread * const reader_thread, enum daemon_event event)
-{
-    char const ev[] = "daemon_event_name";
-    struct nDPId_workflow * const workflow = reader_thread->workflow;
-
-    ndpi_serialize_string_int32(&workflow->ndpi_serializer, "daemon_event_id", event);
-    if (event > DAEMON_EVENT_INVALID && event < DAEMON_EVENT_COUNT)
-    {
-        ndpi_serialize_string_string(&workflow->ndpi_serializer, ev, daemon_event_name_table[event]);
+        errno = 0;
+        if (get_ip_netmask_from_pcap_dev(nDPId_options.pcap_file_or_interface) != 0)
+        {
+            if (errno != 0)
+            {
+                syslog(LOG_DAEMON | LOG_ERR,
+                       "Could not get netmask for pcap device %s: %s",
+                       nDPId_options.pcap_file_or_interface,
+                       strerror(errno));
+            }
+            return 1;
+        }
+        if (nDPId_options.cpu_affinity != NULL && strcmp(nDPId_options.cpu_affinity, "irq") == 0 &&
+            get_irq_cpus(nDPId_options.pcap_file_or_interface,
+                         nDPId_options.reader_thread_cpus,
+                         nDPId_MAX_READER_THREADS,
+                         &nDPId_options.reader_thread_cpu_count) != 0)
+        {
+            syslog(LOG_DAEMON | LOG_ERR,
+                   "Could not get the IRQ CPU affinity of interface %s",
+                   nDPId_options.pcap_file_or_interface);
+            return 1;
+        }
     }
     else
     {
-        ndpi_serialize_string_string(&workflow->ndpi_serializer, ev, daemon_event_name_table[DAEMON_EVENT_INVALID]);
+        if (nDPId_options.process_internal_initial_direction != 0)
+        {
+            syslog(LOG_DAEMON | LOG_ERR, "You are processing a PCAP file, `-I' ignored");
+            nDPId_options.process_internal_initial_direction = 0;
+        }
+        if (nDPId_options.process_external_initial_direction != 0)
+        {
+            syslog(LOG_DAEMON | LOG_ERR, "You are processing a PCAP file, `-E' ignored");
+            nDPId_options.process_external_initial_direction = 0;
+        }
+        if (nDPId_options.cpu_affinity != NULL && strcmp(nDPId_options.cpu_affinity, "irq") == 0)
+        {
+            syslog(LOG_DAEMON | LOG_ERR, "You are processing a PCAP file, `-A irq' ignored");
+        }
     }
 
-    jsonize_basic(reader_thread);
-
-    if (event == DAEMON_EVENT_INIT)
-    {
-        ndpi_serialize_string_int64(&workflow->ndpi_serializer,
-                                    "max-flows-per-thread",
-                                    nDPId_options.max_flows_per_thread);
-        ndpi_serialize_string_int64(&workflow->ndpi_serializer,
-                                    "max-idle-flows-per-thread",
-                                    nDPId_options.max_idle_flows_per_thread);
-        ndpi_serialize_string_int64(&workflow->ndpi_serializer, "tick-resolution", nDPId_options.tick_resolution);
-        ndpi_serialize_string_int64(&workflow->ndpi_serializer,
-                                    "reader-thread-count",
-                                    nDPId_options.reader_thread_count);
-        ndpi_serialize_string_int64(&workflow->ndpi_serializer, "idle-scan-period", nDPId_options.idle_scan_period);
-        ndpi_serialize_string_int64(&workflow->ndpi_serializer,
-                                    "generic-max-idle-time",
-                                    nDPId_options.generic_max_idle_time);
-        ndpi_serialize_string_int64(&workflow->ndpi_serializer, "icmp-max-idle-time", nDPId_options.icmp_max_idle_time);
-        ndpi_serialize_string_int64(&workflow->ndpi_serializer, "udp-max-idle-time", nDPId_options.udp_max_idle_time);
-        ndpi_serialize_string_int64(&workflow->ndpi_serializer, "tcp-max-idle-time", nDPId_options.tcp_max_idle_time);
-        ndpi_serialize_string_int64(&workflow->ndpi_serializer,
-                                    "tcp-max-post-end-flow-time",
-                                    nDPId_options.tcp_max_post_end_flow_time);
-        ndpi_serialize_string_int64(&workflow->ndpi_serializer,
-                                    "max-packets-per-flow-to-send",
-                                    nDPId_options.max_packets_per_flow_to_send);
-        ndpi_serialize_string_int64(&workflow->ndpi_serializer,
-                                    "max-packets-per-flow-to-process",
-                                    nDPId_options.max_packets_per_flow_to_process);
-    }
-    serialize_and_send(reader_thread);
-}
+#ifdef ENABLE_MEMORY_PROFILING
+    set_ndpi_malloc(ndpi_malloc_wrapper);
+    set_ndpi_free(ndpi_free_wrapper);
+    set_ndpi_flow_malloc(NULL);
+    set_ndpi_flow_free(NULL);
+#endif
 
-static void jsonize_flow(struct nDPId_workflow * const workflow, struct nDPId_flow_extended const * const flow_ext)
-{
-    ndpi_serialize_string_uint32(&workflow->ndpi_serializer, "flow_id", flow_ext->flow_id);
-    ndpi_serialize_string_uint64(&workflow->ndpi_serializer, "flow_packet_id", flow_ext->packets_processed);
-    ndpi_serialize_string_uint64(&workflow->ndpi_serializer, "flow_first_seen", flow_ext->first_seen);
-    ndpi_serialize_string_uint64(&workflow->ndpi_serializer, "flow_last_seen", flow_ext->flow_basic.last_seen);
-    ndpi_serialize_string_uint64(&workflow->ndpi_serializer, "flow_min_l4_payload_len", flow_ext->min_l4_payload_len);
-    ndpi_serialize_string_uint64(&workflow->ndpi_serializer, "flow_max_l4_payload_len", flow_ext->max_l4_payload_len);
-    ndpi_serialize_string_uint64(&workflow->ndpi_serializer, "flow_tot_l4_payload_len", flow_ext->total_l4_payload_len);
-    ndpi_serialize_string_uint64(&workflow->ndpi_serializer,
-                                 "flow_avg_l4_payload_len",
-                                 (flow_ext->packets_processed > 0
-                                      ? flow_ext->total_l4_payload_len / flow_ext->packets_processed
-                                      : 0));
-    ndpi_serialize_string_uint32(&workflow->ndpi_serializer, "midstream", flow_ext->flow_basic.tcp_is_midstream_flow);
-}
+    uint64_t const startup_time = get_monotonic_usec();
+    size_t const startup_rss = get_resident_set_size();
+    unsigned long long int started = 0;
+    int retval = 0;
 
-static int connect_to_json_socket(struct nDPId_reader_thread * const reader_thread)
-{
-    struct sockaddr_un saddr;
+    /*
+     * Every workflow is initialized by a thread running on the CPU of its reader thread,
+     * so its memory gets (first-)touched on the local NUMA node.
+     */
+    for (unsigned long long int i = 0; i < nDPId_options.reader_thread_count; ++i)
+    {
+        reader_threads[i].array_index = i;
+        reader_threads[i].ordered_events.enabled = (pcap_replay.file_count > 0 && nDPId_options.ordered_replay != 0);
+        if (nDPId_options.reader_thread_cpu_count > 0)
+        {
+            syslog(LOG_DAEMON, "Reader thread %llu will run on CPU %d", i, get_reader_thread_cpu(i));
+        }
 
-    if (reader_thread->json_sockfd >= 0)
+        if (create_reader_thread(&reader_threads[i], init_workflow_thread) != 0)
+        {
+            syslog(LOG_DAEMON | LOG_ERR, "pthread_create: %s", strerror(errno));
+            retval = 1;
+            break;
+        }
+        started++;
+    }
+    for (unsigned long long int i = 0; i < started; ++i)
     {
-        close(reader_thread->json_sockfd);
+        pthread_join(reader_threads[i].thread_id, NULL);
+        reader_threads[i].thread_id = 0;
+        if (reader_threads[i].workflow == NULL)
+        {
+            retval = 1;
+        }
     }
-
-    reader_thread->json_sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
-    if (reader_thread->json_sockfd < 0)
+    if (retval != 0)
     {
-        reader_thread->json_sock_reconnect = 1;
         return 1;
     }
+    workflows_init_usec = get_monotonic_usec() - startup_time;
 
-    saddr.sun_family = AF_UNIX;
-    if (snprintf(saddr.sun_path, sizeof(saddr.sun_path), "%s", nDPId_options.json_sockpath) < 0 ||
-        connect(reader_thread->json_sockfd, (struct sockaddr *)&saddr, sizeof(saddr)) < 0)
+    size_t const rss = get_resident_set_size();
+    syslog(LOG_DAEMON,
+           "Initialized %llu workflow(s) in %llu ms, resident memory %zu KiB -> %zu KiB (%llu KiB per workflow)",
+           nDPId_options.reader_thread_count,
+           (unsigned long long int)workflows_init_usec / 1000,
+           startup_rss / 1024,
+           rss / 1024,
+           (unsigned long long int)(rss > startup_rss ? rss - startup_rss : 0) / 1024 /
+               nDPId_options.reader_thread_count);
+
+    if (nDPId_options.capture_dir != NULL && setup_flow_capture() != 0)
     {
-        reader_thread->json_sock_reconnect = 1;
         return 1;
     }
 
-    if (shutdown(reader_thread->json_sockfd, SHUT_RD) != 0)
+    return 0;
+}
+
+static int ip_tuples_equal(struct nDPId_flow_basic const * const A, struct nDPId_flow_basic const * const B)
+{
+    // generate a warning if the enum changes
+    switch (A->l3_type)
     {
-        return 1;
+        case L3_IP:
+        case L3_IP6:
+            break;
     }
-
-    if (fcntl(reader_thread->json_sockfd, F_SETFL, fcntl(reader_thread->json_sockfd, F_GETFL, 0) | O_NONBLOCK) == -1)
+    if (A->l3_type == L3_IP && B->l3_type == L3_IP6)
     {
-        reader_thread->json_sock_reconnect = 1;
-        return 1;
+        return A->src.v4.ip == B->src.v4.ip && A->dst.v4.ip == B->dst.v4.ip;
+    }
+    else if (A->l3_type == L3_IP6 && B->l3_type == L3_IP6)
+    {
+        return A->src.v6.ip[0] == B->src.v6.ip[0] && A->src.v6.ip[1] == B->src.v6.ip[1] &&
+               A->dst.v6.ip[0] == B->dst.v6.ip[0] && A->dst.v6.ip[1] == B->dst.v6.ip[1];
     }
-
-    reader_thread->json_sock_reconnect = 0;
-
     return 0;
 }
 
-static void send_to_json_sink(struct nDPId_reader_thread * const reader_thread,
-                              char const * const json_str,
-                              size_t json_str_len)
+static int ip_tuples_compare(struct nDPId_flow_basic const * const A, struct nDPId_flow_basic const * const B)
 {
-    struct nDPId_workflow * const workflow = reader_thread->workflow;
-    int saved_errno;
-    int s_ret;
-    char newline_json_str[NETWORK_BUFFER_MAX_SIZE];
-
-    s_ret = snprintf(newline_json_str,
-                     sizeof(newline_json_str),
-                     "%0" NETWORK_BUFFER_LENGTH_DIGITS_STR "zu%.*s\n",
-                     json_str_len + 1,
-                     (int)json_str_len,
-                     json_str);
-    if (s_ret < 0 || s_ret > (int)sizeof(newline_json_str))
+    // generate a warning if the enum changes
+    switch (A->l3_type)
     {
-        syslog(LOG_DAEMON | LOG_ERR,
-               "[%8llu, %d] JSON buffer prepare failed: snprintf returned %d, buffer size %zu",
-               workflow->packets_captured,
-               reader_thread->array_index,
-               s_ret,
-               sizeof(newline_json_str));
-        return;
+        case L3_IP:
+        case L3_IP6:
+            break;
     }
-
-    if (reader_thread->json_sock_reconnect != 0)
+    if (A->l3_type == L3_IP && B->l3_type == L3_IP6)
     {
-        if (connect_to_json_socket(reader_thread) == 0)
+        if (A->src.v4.ip < B->src.v4.ip || A->dst.v4.ip < B->dst.v4.ip)
         {
-            syslog(LOG_DAEMON | LOG_ERR,
-                   "[%8llu, %d] Reconnected to JSON sink",
-                   workflow->packets_captured,
-                   reader_thread->array_index);
-            jsonize_daemon(reader_thread, DAEMON_EVENT_RECONNECT);
+            return -1;
         }
-    }
-
-    errno = 0;
-    if (reader_thread->json_sock_reconnect == 0 && write(reader_thread->json_sockfd, newline_json_str, s_ret) != s_ret)
-    {
-        saved_errno = errno;
-        syslog(LOG_DAEMON | LOG_ERR,
-               "[%8llu, %d] send data to JSON sink failed: %s",
-               workflow->packets_captured,
-               reader_thread->array_index,
-               strerror(saved_errno));
-        if (saved_errno == EPIPE)
+        if (A->src.v4.ip > B->src.v4.ip || A->dst.v4.ip > B->dst.v4.ip)
         {
-            syslog(LOG_DAEMON | LOG_ERR,
-                   "[%8llu, %d] Lost connection to JSON sink",
-                   workflow->packets_captured,
-                   reader_thread->array_index);
+            return 1;
         }
-        if (saved_errno != EAGAIN)
+    }
+    else if (A->l3_type == L3_IP6 && B->l3_type == L3_IP6)
+    {
+        if ((A->src.v6.ip[0] < B->src.v6.ip[0] && A->src.v6.ip[1] < B->src.v6.ip[1]) ||
+            (A->dst.v6.ip[0] < B->dst.v6.ip[0] && A->dst.v6.ip[1] < B->dst.v6.ip[1]))
         {
-            reader_thread->json_sock_reconnect = 1;
+            return -1;
         }
-        else
+        if ((A->src.v6.ip[0] > B->src.v6.ip[0] && A->src.v6.ip[1] > B->src.v6.ip[1]) ||
+            (A->dst.v6.ip[0] > B->dst.v6.ip[0] && A->dst.v6.ip[1] > B->dst.v6.ip[1]))
         {
-            syslog(LOG_DAEMON | LOG_ERR,
-                   "[%8llu, %d] Possible data loss detected",
-                   workflow->packets_captured,
-                   reader_thread->array_index);
+            return 1;
         }
     }
-}
-
-static void serialize_and_send(struct nDPId_reader_thread * const reader_thread)
-{
-    char * json_str;
-    uint32_t json_str_len;
-
-    json_str = ndpi_serializer_get_buffer(&reader_thread->workflow->ndpi_serializer, &json_str_len);
-    if (json_str == NULL || json_str_len == 0)
+    if (A->src_port < B->src_port || A->dst_port < B->dst_port)
     {
-        syslog(LOG_DAEMON | LOG_ERR,
-               "[%8llu, %d] jsonize failed, buffer length: %u",
-               reader_thread->workflow->packets_captured,
-               reader_thread->array_index,
-               json_str_len);
+        return -1;
     }
-    else
+    else if (A->src_port > B->src_port || A->dst_port > B->dst_port)
     {
-        send_to_json_sink(reader_thread, json_str, json_str_len);
+        return 1;
     }
-    ndpi_reset_serializer(&reader_thread->workflow->ndpi_serializer);
+    return 0;
 }
 
-/* Slightly modified code from: https://en.wikibooks.org/wiki/Algorithm_Implementation/Miscellaneous/Base64 */
-static int base64encode(uint8_t const * const data_buf,
-                        size_t dataLength,
-                        char * const result,
-                        size_t * const resultSize)
+static uint64_t get_l4_protocol_idle_time(uint8_t l4_protocol)
 {
-    const char base64chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-    const uint8_t * data = (const uint8_t *)data_buf;
-    size_t resultIndex = 0;
-    size_t x;
-    uint32_t n = 0;
-    int padCount = dataLength % 3;
-    uint8_t n0, n1, n2, n3;
-
-    /* increment over the length of the string, three characters at a time */
-    for (x = 0; x < dataLength; x += 3)
+    switch (l4_protocol)
     {
-        /* these three 8-bit (ASCII) characters become one 24-bit number */
-        n = ((uint32_t)data[x]) << 16; // parenthesis needed, compiler depending on flags can do the shifting before
-                                       // conversion to uint32_t, resulting to 0
-
-        if ((x + 1) < dataLength)
-        {
-            n += ((uint32_t)data[x + 1]) << 8; // parenthesis needed, compiler depending on flags can do the shifting
-                                               // before conversion to uint32_t, resulting to 0
-        }
+        case IPPROTO_ICMP:
+        case IPPROTO_ICMPV6:
+            return nDPId_options.icmp_max_idle_time;
+        case IPPROTO_TCP:
+            return nDPId_options.tcp_max_idle_time;
+        case IPPROTO_UDP:
+            return nDPId_options.udp_max_idle_time;
+        default:
+            return nDPId_options.generic_max_idle_time;
+    }
+}
 
-        if ((x + 2) < dataLength)
-        {
-            n += data[x + 2];
-        }
+static int is_l4_protocol_timed_out(struct nDPId_workflow const * const workflow,
+                                    struct nDPId_flow_basic const * const flow_basic)
+{
+    return flow_basic->last_seen + get_l4_protocol_idle_time(flow_basic->l4_protocol) < workflow->last_time ||
+           (flow_basic->tcp_fin_rst_seen == 1 &&
+            flow_basic->last_seen + nDPId_options.tcp_max_post_end_flow_time < workflow->last_time);
+}
 
-        /* this 24-bit number gets separated into four 6-bit numbers */
-        n0 = (uint8_t)(n >> 18) & 63;
-        n1 = (uint8_t)(n >> 12) & 63;
-        n2 = (uint8_t)(n >> 6) & 63;
-        n3 = (uint8_t)n & 63;
+static void idle_scan_walker(struct nDPId_workflow * const workflow, struct nDPId_flow_basic * const flow_basic)
+{
+    if (workflow->cur_idle_flows == nDPId_options.max_idle_flows_per_thread)
+    {
+        return;
+    }
 
-        /*
-         * if we have one byte available, then its encoding is spread
-         * out over two characters
-         */
-        if (resultIndex >= *resultSize)
-        {
-            return 1; /* indicate failure: buffer too small */
-        }
-        result[resultIndex++] = base64chars[n0];
-        if (resultIndex >= *resultSize)
+    if (is_l4_protocol_timed_out(workflow, flow_basic) != 0)
+    {
+        workflow->ndpi_flows_idle[workflow->cur_idle_flows++] = flow_basic;
+        switch (flow_basic->type)
         {
-            return 1; /* indicate failure: buffer too small */
-        }
-        result[resultIndex++] = base64chars[n1];
+            case FT_UNKNOWN:
+            case FT_SKIPPED:
+                break;
 
-        /*
-         * if we have only two bytes available, then their encoding is
-         * spread out over three chars
-         */
-        if ((x + 1) < dataLength)
-        {
-            if (resultIndex >= *resultSize)
-            {
-                return 1; /* indicate failure: buffer too small */
-            }
-            result[resultIndex++] = base64chars[n2];
+            case FT_FINISHED:
+            case FT_INFO:
+                workflow->total_idle_flows++;
+                break;
         }
+    }
+}
 
-        /*
-         * if we have all three bytes available, then their encoding is spread
-         * out over four characters
-         */
-        if ((x + 2) < dataLength)
-        {
-            if (resultIndex >= *resultSize)
-            {
-                return 1; /* indicate failure: buffer too small */
-            }
-            result[resultIndex++] = base64chars[n3];
-        }
+static void count_flow_lookup(struct nDPId_reader_thread * const reader_thread, unsigned long long int probes)
+{
+    reader_thread->stats.flow_lookups++;
+    reader_thread->stats.flow_lookup_probes += probes;
+    if (probes > reader_thread->stats.flow_lookup_max_probes)
+    {
+        reader_thread->stats.flow_lookup_max_probes = probes;
     }
+}
 
-    /*
-     * create and add padding that is required if we did not have a multiple of 3
-     * number of characters available
-     */
-    if (padCount > 0)
+static int ndpi_workflow_node_cmp(void const * const A, void const * const B)
+{
+    struct nDPId_flow_basic const * const flow_basic_a = (struct nDPId_flow_basic *)A;
+    struct nDPId_flow_basic const * const flow_basic_b = (struct nDPId_flow_basic *)B;
+
+    if (flow_basic_a->hashval < flow_basic_b->hashval)
     {
-        for (; padCount < 3; padCount++)
-        {
-            if (resultIndex >= *resultSize)
-            {
-                return 1; /* indicate failure: buffer too small */
-            }
-            result[resultIndex++] = '=';
-        }
+        return -1;
     }
-    if (resultIndex >= *resultSize)
+    else if (flow_basic_a->hashval > flow_basic_b->hashval)
     {
-        return 1; /* indicate failure: buffer too small */
+        return 1;
     }
 
-    result[resultIndex] = 0;
-    *resultSize = resultIndex;
-    return 0; /* indicate success */
+    /* flows have the same hash */
+    if (flow_basic_a->l4_protocol < flow_basic_b->l4_protocol)
+    {
+        return -1;
+    }
+    else if (flow_basic_a->l4_protocol > flow_basic_b->l4_protocol)
+    {
+        return 1;
+    }
+
+    if (ip_tuples_equal(flow_basic_a, flow_basic_b) != 0 && flow_basic_a->src_port == flow_basic_b->src_port &&
+        flow_basic_a->dst_port == flow_basic_b->dst_port)
+    {
+        return 0;
+    }
+
+    return ip_tuples_compare(flow_basic_a, flow_basic_b);
 }
 
-static void jsonize_packet_event(struct nDPId_reader_thread * const reader_thread,
-                                 struct pcap_pkthdr const * const header,
-                                 uint8_t const * const packet,
-                                 uint16_t pkt_type,
-                                 uint16_t pkt_l3_offset,
-                                 uint16_t pkt_l4_offset,
-                                 uint16_t pkt_l4_len,
-                                 struct nDPId_flow_extended const * const flow_ext,
-                                 enum packet_event event)
+static uint32_t get_flow_tag(uint64_t hashval)
+{
+    return (uint32_t)(hashval >> 32) ^ (uint32_t)hashval;
+}
+
+static size_t get_next_flow_slot(struct nDPId_workflow const * const workflow, size_t slot)
+{
+    return (slot + 1 < workflow->max_active_flows * FLOW_TABLE_SLOTS_PER_BUCKET ? slot + 1 : 0);
+}
+
+/*
+ * Searches the flow in both directions, sets `direction_changed' if it was found with src and dst swapped.
+ * Returns NULL if the flow does not exist.
+ */
+static struct nDPId_flow_basic * find_flow(struct nDPId_reader_thread * const reader_thread,
+                                           struct nDPId_flow_basic const * const flow_basic,
+                                           uint8_t * const direction_changed)
 {
     struct nDPId_workflow * const workflow = reader_thread->workflow;
-    char const ev[] = "packet_event_name";
+    uint32_t const tag = get_flow_tag(flow_basic->hashval);
+    struct nDPId_flow_basic reversed_flow_basic = *flow_basic;
+    struct nDPId_flow_basic * reversed_match = NULL;
+    unsigned long long int probes = 0;
+    size_t slot = flow_basic->hashed_index * FLOW_TABLE_SLOTS_PER_BUCKET;
 
-    if (event == PACKET_EVENT_PAYLOAD_FLOW)
+    reversed_flow_basic.src = flow_basic->dst;
+    reversed_flow_basic.dst = flow_basic->src;
+    reversed_flow_basic.src_port = flow_basic->dst_port;
+    reversed_flow_basic.dst_port = flow_basic->src_port;
+
+    for (; workflow->flow_table[slot].cold_index != FLOW_SLOT_EMPTY; slot = get_next_flow_slot(workflow, slot))
     {
-        if (flow_ext == NULL)
+        struct nDPId_flow_basic * candidate;
+
+        probes++;
+        if (workflow->flow_table[slot].tag != tag)
         {
-            syslog(LOG_DAEMON | LOG_ERR,
-                   "[%8llu, %d] BUG: got a PACKET_EVENT_PAYLOAD_FLOW with a flow pointer equals NULL",
-                   reader_thread->workflow->packets_captured,
-                   reader_thread->array_index);
-            return;
+            continue;
         }
-        if (flow_ext->packets_processed > nDPId_options.max_packets_per_flow_to_send)
+
+        candidate = &workflow->flows_basic[workflow->flow_table[slot].cold_index];
+        if (ndpi_workflow_node_cmp(flow_basic, candidate) == 0)
         {
-            return;
+            count_flow_lookup(reader_thread, probes);
+            *direction_changed = 0;
+            return candidate;
+        }
+        /* a flow matching in the original direction takes precedence */
+        if (reversed_match == NULL && ndpi_workflow_node_cmp(&reversed_flow_basic, candidate) == 0)
+        {
+            reversed_match = candidate;
         }
-        ndpi_serialize_string_uint32(&workflow->ndpi_serializer, "flow_id", flow_ext->flow_id);
-        ndpi_serialize_string_uint64(&workflow->ndpi_serializer, "flow_packet_id", flow_ext->packets_processed);
     }
 
-    ndpi_serialize_string_int32(&workflow->ndpi_serializer, "packet_event_id", event);
-    if (event > PACKET_EVENT_INVALID && event < PACKET_EVENT_COUNT)
+    count_flow_lookup(reader_thread, probes);
+    *direction_changed = (reversed_match != NULL);
+    return reversed_match;
+}
+
+static void insert_flow(struct nDPId_workflow * const workflow, struct nDPId_flow_basic const * const flow_basic)
+{
+    size_t slot = flow_basic->hashed_index * FLOW_TABLE_SLOTS_PER_BUCKET;
+
+    while (workflow->flow_table[slot].cold_index != FLOW_SLOT_EMPTY)
     {
-        ndpi_serialize_string_string(&workflow->ndpi_serializer, ev, packet_event_name_table[event]);
+        slot = get_next_flow_slot(workflow, slot);
     }
-    else
+    workflow->flow_table[slot].tag = get_flow_tag(flow_basic->hashval);
+    workflow->flow_table[slot].cold_index = flow_basic->cold_index;
+}
+
+static void remove_flow(struct nDPId_workflow * const workflow, struct nDPId_flow_basic const * const flow_basic)
+{
+    size_t hole = flow_basic->hashed_index * FLOW_TABLE_SLOTS_PER_BUCKET;
+    size_t slot;
+
+    while (workflow->flow_table[hole].cold_index != flow_basic->cold_index)
     {
-        ndpi_serialize_string_string(&workflow->ndpi_serializer, ev, packet_event_name_table[PACKET_EVENT_INVALID]);
+        hole = get_next_flow_slot(workflow, hole);
     }
 
-    jsonize_basic(reader_thread);
+    /* Move every following entry of the probe sequence into the hole, unless that would put it before its bucket. */
+    for (slot = get_next_flow_slot(workflow, hole); workflow->flow_table[slot].cold_index != FLOW_SLOT_EMPTY;
+         slot = get_next_flow_slot(workflow, slot))
+    {
+        size_t const first_slot =
+            workflow->flows_basic[workflow->flow_table[slot].cold_index].hashed_index * FLOW_TABLE_SLOTS_PER_BUCKET;
+        int const can_move = (hole < slot ? first_slot <= hole || first_slot > slot
+                                          : first_slot <= hole && first_slot > slot);
 
-    char base64_data[NETWORK_BUFFER_MAX_SIZE];
-    size_t base64_data_len = sizeof(base64_data);
-    int base64_retval = base64encode(packet, header->caplen, base64_data, &base64_data_len);
+        if (can_move != 0)
+        {
+            workflow->flow_table[hole] = workflow->flow_table[slot];
+            hole = slot;
+        }
+    }
+    workflow->flow_table[hole].cold_index = FLOW_SLOT_EMPTY;
+}
 
-    ndpi_serialize_string_boolean(&workflow->ndpi_serializer, "pkt_oversize", base64_data_len > sizeof(base64_data));
-    ndpi_serialize_string_uint64(&workflow->ndpi_serializer, "pkt_ts_sec", header->ts.tv_sec);
-    ndpi_serialize_string_uint64(&workflow->ndpi_serializer, "pkt_ts_usec", header->ts.tv_usec);
-    ndpi_serialize_string_uint32(&workflow->ndpi_serializer, "pkt_caplen", header->caplen);
-    ndpi_serialize_string_uint32(&workflow->ndpi_serializer, "pkt_type", pkt_type);
-    ndpi_serialize_string_uint32(&workflow->ndpi_serializer, "pkt_l3_offset", pkt_l3_offset);
-    ndpi_serialize_string_uint32(&workflow->ndpi_serializer, "pkt_l4_offset", pkt_l4_offset);
-    ndpi_serialize_string_uint32(&workflow->ndpi_serializer, "pkt_len", header->len);
-    ndpi_serialize_string_uint32(&workflow->ndpi_serializer, "pkt_l4_len", pkt_l4_len);
+/* Calls `walker' for every flow of the bucket, in insertion order. */
+static void walk_flow_table_bucket(struct nDPId_workflow * const workflow,
+                                   size_t hashed_index,
+                                   void (*walker)(struct nDPId_workflow * const, struct nDPId_flow_basic * const))
+{
+    size_t slot = hashed_index * FLOW_TABLE_SLOTS_PER_BUCKET;
 
-    if (base64_retval == 0 && base64_data_len > 0 &&
-        ndpi_serialize_string_binary(&workflow->ndpi_serializer, "pkt", base64_data, base64_data_len) != 0)
+    for (; workflow->flow_table[slot].cold_index != FLOW_SLOT_EMPTY; slot = get_next_flow_slot(workflow, slot))
     {
-        syslog(LOG_DAEMON | LOG_ERR,
-               "[%8llu, %d] JSON serializing base64 packet buffer failed",
-               reader_thread->workflow->packets_captured,
-               reader_thread->array_index);
+        struct nDPId_flow_basic * const flow_basic = &workflow->flows_basic[workflow->flow_table[slot].cold_index];
+
+        if (flow_basic->hashed_index == hashed_index)
+        {
+            walker(workflow, flow_basic);
+        }
     }
-    serialize_and_send(reader_thread);
 }
 
-/* I decided against ndpi_flow2json as does not fulfill my needs. */
-static void jsonize_flow_event(struct nDPId_reader_thread * const reader_thread,
-                               struct nDPId_flow_info * const flow,
-                               enum flow_event event)
+static void process_idle_flow(struct nDPId_reader_thread * const reader_thread)
 {
     struct nDPId_workflow * const workflow = reader_thread->workflow;
-    char const ev[] = "flow_event_name";
-
-    ndpi_serialize_string_int32(&workflow->ndpi_serializer, "flow_event_id", event);
-    if (event > FLOW_EVENT_INVALID && event < FLOW_EVENT_COUNT)
-    {
-        ndpi_serialize_string_string(&workflow->ndpi_serializer, ev, flow_event_name_table[event]);
-    }
-    else
-    {
-        ndpi_serialize_string_string(&workflow->ndpi_serializer, ev, flow_event_name_table[FLOW_EVENT_INVALID]);
-    }
-    jsonize_basic(reader_thread);
-    jsonize_flow(workflow, &flow->flow_extended);
-    jsonize_l3_l4(workflow, &flow->flow_extended.flow_basic);
 
-    switch (event)
+    while (workflow->cur_idle_flows > 0)
     {
-        case FLOW_EVENT_INVALID:
-        case FLOW_EVENT_COUNT:
-            break;
+        struct nDPId_flow_basic * const flow_basic =
+            (struct nDPId_flow_basic *)workflow->ndpi_flows_idle[--workflow->cur_idle_flows];
 
-        case FLOW_EVENT_NEW:
-        case FLOW_EVENT_END:
-        case FLOW_EVENT_IDLE:
-            ndpi_serialize_string_int32(&workflow->ndpi_serializer,
-                                        "flow_datalink",
-                                        pcap_datalink(reader_thread->workflow->pcap_handle));
-            ndpi_serialize_string_uint32(&workflow->ndpi_serializer,
-                                         "flow_max_packets",
-                                         nDPId_options.max_packets_per_flow_to_send);
-            break;
+        switch (flow_basic->type)
+        {
+            case FT_UNKNOWN:
+            case FT_SKIPPED:
+                break;
 
-        case FLOW_EVENT_NOT_DETECTED:
-        case FLOW_EVENT_GUESSED:
-            if (ndpi_dpi2json(workflow->ndpi_struct,
-                              &flow->detection_data->flow,
-                              flow->detection_data->guessed_l7_protocol,
-                              &workflow->ndpi_serializer) != 0)
+            case FT_FINISHED:
             {
-                syslog(LOG_DAEMON | LOG_ERR,
-                       "[%8llu, %4u] ndpi_dpi2json failed for not-detected/guessed flow",
-                       workflow->packets_captured,
-                       flow->flow_extended.flow_id);
-            }
-            break;
-
-        case FLOW_EVENT_DETECTED:
-        case FLOW_EVENT_DETECTION_UPDATE:
-            if (ndpi_dpi2json(workflow->ndpi_struct,
-                              &flow->detection_data->flow,
-                              flow->detection_data->detected_l7_protocol,
-                              &workflow->ndpi_serializer) != 0)
-            {
-                syslog(LOG_DAEMON | LOG_ERR,
-                       "[%8llu, %4u] ndpi_dpi2json failed for detected/detection-update flow",
-                       workflow->packets_captured,
-                       flow->flow_extended.flow_id);
-            }
-            break;
-    }
-
-    serialize_and_send(reader_thread);
-}
-
-static void internal_format_error(ndpi_serializer * const serializer, char const * const format, uint32_t format_index)
-{
-    syslog(LOG_DAEMON | LOG_ERR,
-           "BUG: Internal error detected for format string `%s' at format index %u",
-           format,
-           format_index);
-    ndpi_reset_serializer(serializer);
-}
-
-static void vjsonize_basic_eventf(struct nDPId_reader_thread * const reader_thread, char const * format, va_list ap)
-{
-    uint8_t got_jsonkey = 0;
-    uint8_t is_long_long = 0;
-    char json_key[NETWORK_BUFFER_MAX_SIZE];
-    uint32_t format_index = 0;
-
-    while (*format)
-    {
-        if (got_jsonkey == 0)
-        {
-            json_key[0] = '\0';
-        }
-
-        switch (*format++)
-        {
-            case 's':
-            {
-                format_index++;
-                char * value = va_arg(ap, char *);
-                if (got_jsonkey == 0)
+                if (flow_basic->tcp_fin_rst_seen != 0)
                 {
-                    snprintf(json_key, sizeof(json_key), "%s", value);
-                    got_jsonkey = 1;
+                    jsonize_flow_event(reader_thread, flow_basic, FLOW_EVENT_END);
                 }
                 else
                 {
-                    ndpi_serialize_string_string(&reader_thread->workflow->ndpi_serializer, json_key, value);
-                    got_jsonkey = 0;
+                    jsonize_flow_event(reader_thread, flow_basic, FLOW_EVENT_IDLE);
                 }
                 break;
             }
-            case 'f':
+
+            case FT_INFO:
             {
-                format_index++;
-                if (got_jsonkey == 1)
-                {
-                    float value = va_arg(ap, double);
-                    ndpi_serialize_string_float(&reader_thread->workflow->ndpi_serializer, json_key, value, "%.2f");
-                    got_jsonkey = 0;
-                }
-                else
-                {
-                    internal_format_error(&reader_thread->workflow->ndpi_serializer, format, format_index);
-                    return;
-                }
-                break;
-            }
-            case 'z':
-            case 'l':
-                format_index++;
-                if (got_jsonkey != 1)
-                {
-                    internal_format_error(&reader_thread->workflow->ndpi_serializer, format, format_index);
-                    return;
-                }
-                if (*format == 'l')
-                {
-                    format++;
-                    is_long_long = 1;
-                }
-                else
+                struct nDPId_flow_info * const flow_info = get_flow_info(workflow, flow_basic);
+
+#ifdef ENABLE_ZLIB
+                if (nDPId_options.enable_zlib_compression != 0 && flow_info->detection_data_compressed_size > 0)
                 {
-                    is_long_long = 0;
+                    int ret = detection_data_inflate(flow_info);
+                    if (ret <= 0)
+                    {
+                        syslog(LOG_DAEMON | LOG_ERR, "zLib decompression failed with error code: %d", ret);
+                        return;
+                    }
                 }
-                if (*format == 'd')
+#endif
+
+                if (flow_info->detection_completed == 0)
                 {
-                    long long int value;
-                    if (is_long_long != 0)
+                    uint8_t protocol_was_guessed = 0;
+
+                    if (ndpi_is_protocol_detected(workflow->ndpi_struct,
+                                                  flow_info->detection_data->guessed_l7_protocol) == 0)
                     {
-                        value = va_arg(ap, long long int);
+                        flow_info->detection_data->guessed_l7_protocol = ndpi_detection_giveup(
+                            workflow->ndpi_struct, &flow_info->detection_data->flow, 1, &protocol_was_guessed);
                     }
                     else
                     {
-                        value = va_arg(ap, long int);
+                        protocol_was_guessed = 1;
                     }
-                    ndpi_serialize_string_int64(&reader_thread->workflow->ndpi_serializer, json_key, value);
-                    got_jsonkey = 0;
-                }
-                else if (*format == 'u')
-                {
-                    unsigned long long int value;
-                    if (is_long_long != 0)
+
+                    if (protocol_was_guessed != 0)
                     {
-                        value = va_arg(ap, unsigned long long int);
+                        jsonize_flow_event(reader_thread, flow_basic, FLOW_EVENT_GUESSED);
                     }
                     else
                     {
-                        value = va_arg(ap, unsigned long int);
+                        jsonize_flow_event(reader_thread, flow_basic, FLOW_EVENT_NOT_DETECTED);
                     }
-                    ndpi_serialize_string_uint64(&reader_thread->workflow->ndpi_serializer, json_key, value);
-                    got_jsonkey = 0;
-                }
-                else
-                {
-                    internal_format_error(&reader_thread->workflow->ndpi_serializer, format, format_index);
-                    return;
-                }
-                format++;
-                break;
-            case 'u':
-                format_index++;
-                if (got_jsonkey == 1)
-                {
-                    unsigned int value = va_arg(ap, unsigned int);
-                    ndpi_serialize_string_uint32(&reader_thread->workflow->ndpi_serializer, json_key, value);
-                    got_jsonkey = 0;
-                }
-                else
-                {
-                    internal_format_error(&reader_thread->workflow->ndpi_serializer, format, format_index);
-                    return;
                 }
-                break;
-            case 'd':
-                format_index++;
-                if (got_jsonkey == 1)
+                if (flow_basic->tcp_fin_rst_seen != 0)
                 {
-                    int value = va_arg(ap, int);
-                    ndpi_serialize_string_int32(&reader_thread->workflow->ndpi_serializer, json_key, value);
-                    got_jsonkey = 0;
+                    jsonize_flow_event(reader_thread, flow_basic, FLOW_EVENT_END);
                 }
                 else
                 {
-                    internal_format_error(&reader_thread->workflow->ndpi_serializer, format, format_index);
-                    return;
+                    jsonize_flow_event(reader_thread, flow_basic, FLOW_EVENT_IDLE);
                 }
                 break;
-            /* format string separators */
-            case ' ':
-            case ',':
-            case '%':
-                break;
-            default:
-                internal_format_error(&reader_thread->workflow->ndpi_serializer, format, format_index);
-                return;
+            }
         }
+
+        remove_flow(workflow, flow_basic);
+        free_flow(workflow, flow_basic);
     }
 }
 
-__attribute__((format(printf, 3, 4))) static void jsonize_basic_eventf(struct nDPId_reader_thread * const reader_thread,
-                                                                       enum basic_event event,
-                                                                       char const * format,
-                                                                       ...)
+static void check_for_idle_flows(struct nDPId_reader_thread * const reader_thread)
 {
     struct nDPId_workflow * const workflow = reader_thread->workflow;
-    va_list ap;
-    char const ev[] = "basic_event_name";
 
-    ndpi_serialize_string_int32(&reader_thread->workflow->ndpi_serializer, "basic_event_id", event);
-    if (event > BASIC_EVENT_INVALID && event < BASIC_EVENT_COUNT)
-    {
-        ndpi_serialize_string_string(&workflow->ndpi_serializer, ev, basic_event_name_table[event]);
-    }
-    else
+    if (workflow->last_idle_scan_time + nDPId_options.idle_scan_period < workflow->last_time)
     {
-        ndpi_serialize_string_string(&workflow->ndpi_serializer, ev, basic_event_name_table[BASIC_EVENT_INVALID]);
-    }
-    jsonize_basic(reader_thread);
+        LATENCY_SAMPLE_BEGIN(idle_scan_start);
+        for (size_t idle_scan_index = 0; idle_scan_index < workflow->max_active_flows; ++idle_scan_index)
+        {
+            walk_flow_table_bucket(workflow, idle_scan_index, idle_scan_walker);
+            process_idle_flow(reader_thread);
+        }
+        LATENCY_SAMPLE_END(reader_thread, LATENCY_STAGE_IDLE_SCAN, idle_scan_start);
 
-    if (format != NULL)
-    {
-        va_start(ap, format);
-        vjsonize_basic_eventf(reader_thread, format, ap);
-        va_end(ap);
+        workflow->last_idle_scan_time = workflow->last_time;
     }
-
-    serialize_and_send(reader_thread);
 }
 
-/* See: https://en.wikipedia.org/wiki/MurmurHash#MurmurHash3 */
-static inline uint32_t murmur_32_scramble(uint32_t k)
+static void jsonize_l3_l4(struct nDPId_workflow * const workflow, struct nDPId_flow_basic const * const flow_basic)
 {
-    k *= 0xcc9e2d51;
-    k = (k << 15) | (k >> 17);
-    k *= 0x1b873593;
-    return k;
-}
+    ndpi_serializer * const serializer = &workflow->ndpi_serializer;
+    char src_name[48] = {};
+    char dst_name[48] = {};
 
-/* See: https://en.wikipedia.org/wiki/MurmurHash#MurmurHash3 */
-static uint32_t murmur3_32(uint8_t const * key, size_t len, uint32_t seed)
-{
-    uint32_t h = seed;
-    uint32_t k;
-    /* Read in groups of 4. */
-    for (size_t i = len >> 2; i; i--)
+    switch (flow_basic->l3_type)
     {
-        k = htole32(*(uint32_t *)key);
-        key += sizeof(uint32_t);
-        h ^= murmur_32_scramble(k);
-        h = (h << 13) | (h >> 19);
-        h = h * 5 + 0xe6546b64;
+        case L3_IP:
+            ndpi_serialize_string_string(serializer, "l3_proto", "ip4");
+            if (inet_ntop(AF_INET, &flow_basic->src.v4.ip, src_name, sizeof(src_name)) == NULL)
+            {
+                syslog(LOG_DAEMON | LOG_ERR, "Could not convert IPv4 source ip to string: %s", strerror(errno));
+            }
+            if (inet_ntop(AF_INET, &flow_basic->dst.v4.ip, dst_name, sizeof(dst_name)) == NULL)
+            {
+                syslog(LOG_DAEMON | LOG_ERR, "Could not convert IPv4 destination ip to string: %s", strerror(errno));
+            }
+            break;
+        case L3_IP6:
+            ndpi_serialize_string_string(serializer, "l3_proto", "ip6");
+            if (inet_ntop(AF_INET6, &flow_basic->src.v6.ip[0], src_name, sizeof(src_name)) == NULL)
+            {
+                syslog(LOG_DAEMON | LOG_ERR, "Could not convert IPv6 source ip to string: %s", strerror(errno));
+            }
+            if (inet_ntop(AF_INET6, &flow_basic->dst.v6.ip[0], dst_name, sizeof(dst_name)) == NULL)
+            {
+                syslog(LOG_DAEMON | LOG_ERR, "Could not convert IPv6 destination ip to string: %s", strerror(errno));
+            }
+
+            /* For consistency across platforms replace :0: with :: */
+            ndpi_patchIPv6Address(src_name), ndpi_patchIPv6Address(dst_name);
+            break;
+        default:
+            ndpi_serialize_string_string(serializer, "l3_proto", "unknown");
     }
-    /* Read the rest. */
-    k = 0;
-    for (size_t i = len & 3; i; i--)
+
+    ndpi_serialize_string_string(serializer, "src_ip", src_name);
+    ndpi_serialize_string_string(serializer, "dst_ip", dst_name);
+    if (flow_basic->src_port)
     {
-        k <<= 8;
-        k |= key[i - 1];
+        ndpi_serialize_string_uint32(serializer, "src_port", flow_basic->src_port);
     }
-    // A swap is *not* necessary here because the preceding loop already
-    // places the low bytes in the low places according to whatever endianness
+    if (flow_basic->dst_port)
+    {
+        ndpi_serialize_string_uint32(serializer, "dst_port", flow_basic->dst_port);
+    }
+
+    switch (flow_basic->l4_protocol)
+    {
+        case IPPROTO_TCP:
+            ndpi_serialize_string_string(serializer, "l4_proto", "tcp");
+            break;
+        case IPPROTO_UDP:
+            ndpi_serialize_string_string(serializer, "l4_proto", "udp");
+            break;
+        case IPPROTO_ICMP:
+            ndpi_serialize_string_string(serializer, "l4_proto", "icmp");
+            break;
+        case IPPROTO_ICMPV6:
+            ndpi_serialize_string_string(serializer, "l4_proto", "icmp6");
+            break;
+        default:
+            ndpi_serialize_string_uint32(serializer, "l4_proto", flow_basic->l4_protocol);
+            break;
+    }
+}
+
+static void jsonize_basic(struct nDPId_reader_thread * const reader_thread)
+{
+    struct nDPId_workflow * const workflow = reader_thread->workflow;
+
+    /* every event serialization starts here, see serialize_and_send() */
+    reader_thread->stats.serialize_start_usec = get_stats_usec();
+#ifdef ENABLE_LATENCY_HISTOGRAMS
+    reader_thread->latency_serialize_start = get_latency_nsec();
+#endif
+
+    ndpi_serialize_string_int32(&workflow->ndpi_serializer, "thread_id", reader_thread->array_index);
+    ndpi_serialize_string_uint64(&workflow->ndpi_serializer, "thread_seq", reader_thread->thread_seq++);
+    ndpi_serialize_string_uint32(&workflow->ndpi_serializer, "packet_id", workflow->packets_captured);
+    ndpi_serialize_string_string(&workflow->ndpi_serializer, "source", nDPId_options.pcap_file_or_interface);
+    ndpi_serialize_string_string(&workflow->ndpi_serializer, "alias", nDPId_options.instance_alias);
+}
+
+static void update_pcap_stats(struct nDPId_reader_thread * const reader_thread)
+{
+    struct nDPId_workflow * const workflow = reader_thread->workflow;
+
+    reader_thread->stats.pcap_stats_valid =
+        (workflow->pcap_handle != NULL && pcap_stats(workflow->pcap_handle, &reader_thread->stats.pcap_stats) == 0);
+}
+
+static void take_stats_snapshot(struct nDPId_reader_thread const * const reader_thread,
+                                struct nDPId_stats_snapshot * const snapshot)
+{
+    struct nDPId_workflow const * const workflow = reader_thread->workflow;
+    struct nDPId_thread_stats const * const stats = &reader_thread->stats;
+
+    snapshot->packets_captured = workflow->packets_captured;
+    snapshot->packets_processed = workflow->packets_processed;
+    snapshot->flows_active = workflow->cur_active_flows;
+    snapshot->flows_idle = workflow->cur_idle_flows;
+    snapshot->flows_total = workflow->total_active_flows;
+    snapshot->flows_idle_total = workflow->total_idle_flows;
+    snapshot->flows_skipped = workflow->total_skipped_flows;
+    snapshot->flows_detected = workflow->detected_flow_protocols;
+    /* every flow occupies exactly one slot of the open addressing table */
+    snapshot->flow_table_buckets = workflow->max_active_flows * FLOW_TABLE_SLOTS_PER_BUCKET;
+    snapshot->flow_table_buckets_used = workflow->cur_active_flows;
+    snapshot->flow_lookups = stats->flow_lookups;
+    snapshot->flow_lookup_probes = stats->flow_lookup_probes;
+    snapshot->flow_lookup_max_probes = stats->flow_lookup_max_probes;
+    snapshot->events_emitted = stats->events_emitted;
+    snapshot->events_dropped = stats->events_dropped;
+    snapshot->pcap_stats_valid = (stats->pcap_stats_valid != 0);
+    snapshot->pcap_packets_received = stats->pcap_stats.ps_recv;
+    snapshot->pcap_packets_dropped = stats->pcap_stats.ps_drop;
+    snapshot->pcap_packets_if_dropped = stats->pcap_stats.ps_ifdrop;
+    snapshot->dpi_usec = stats->dpi_usec;
+    snapshot->serialize_usec = stats->serialize_usec;
+    snapshot->send_usec = stats->send_usec;
+}
+
+/* Reader thread only, it is the single writer of `stats_snapshot'. */
+static void publish_stats_snapshot(struct nDPId_reader_thread * const reader_thread)
+{
+    struct nDPId_stats_snapshot snapshot;
+    uint64_t const * const src = (uint64_t const *)&snapshot;
+    uint64_t * const dst = (uint64_t *)&reader_thread->stats_snapshot;
+    uint64_t const seq = __atomic_load_n(&reader_thread->stats_snapshot_seq, __ATOMIC_RELAXED);
+
+    take_stats_snapshot(reader_thread, &snapshot);
+#ifdef ENABLE_LATENCY_HISTOGRAMS
+    memcpy(snapshot.latency_histograms,
+           reader_thread->latency_histograms_total,
+           sizeof(snapshot.latency_histograms));
+    latency_histograms_merge(snapshot.latency_histograms, reader_thread->latency_histograms);
+#endif
+
+    __atomic_store_n(&reader_thread->stats_snapshot_seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (size_t i = 0; i < STATS_SNAPSHOT_WORDS; ++i)
+    {
+        __atomic_store_n(&dst[i], src[i], __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&reader_thread->stats_snapshot_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Returns 0 on success, 1 if the reader thread did not publish a snapshot yet. */
+static int read_stats_snapshot(struct nDPId_reader_thread * const reader_thread,
+                               struct nDPId_stats_snapshot * const snapshot)
+{
+    uint64_t const * const src = (uint64_t const *)&reader_thread->stats_snapshot;
+    uint64_t * const dst = (uint64_t *)snapshot;
+    uint64_t seq;
+
+    do
+    {
+        while (((seq = __atomic_load_n(&reader_thread->stats_snapshot_seq, __ATOMIC_ACQUIRE)) & 1) != 0)
+        {
+            sched_yield();
+        }
+        if (seq == 0)
+        {
+            return 1;
+        }
+        for (size_t i = 0; i < STATS_SNAPSHOT_WORDS; ++i)
+        {
+            dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&reader_thread->stats_snapshot_seq, __ATOMIC_RELAXED) != seq);
+
+    return 0;
+}
+
+static void jsonize_runtime_stats(ndpi_serializer * const serializer, struct nDPId_stats_snapshot const * const snapshot)
+{
+    ndpi_serialize_string_uint64(serializer, "packets-captured", snapshot->packets_captured);
+    ndpi_serialize_string_uint64(serializer, "packets-processed", snapshot->packets_processed);
+    ndpi_serialize_string_uint64(serializer, "flows-active", snapshot->flows_active);
+    ndpi_serialize_string_uint64(serializer, "flows-idle", snapshot->flows_idle);
+    ndpi_serialize_string_uint64(serializer, "flows-total", snapshot->flows_total);
+    ndpi_serialize_string_uint64(serializer, "flows-idle-total", snapshot->flows_idle_total);
+    ndpi_serialize_string_uint64(serializer, "flows-skipped", snapshot->flows_skipped);
+    ndpi_serialize_string_uint64(serializer, "flows-detected", snapshot->flows_detected);
+    ndpi_serialize_string_uint64(serializer, "flow-table-buckets", snapshot->flow_table_buckets);
+    ndpi_serialize_string_uint64(serializer, "flow-table-buckets-used", snapshot->flow_table_buckets_used);
+    ndpi_serialize_string_float(serializer,
+                                "flow-table-load-factor",
+                                (float)snapshot->flows_active / (float)snapshot->flow_table_buckets,
+                                "%.4f");
+    ndpi_serialize_string_uint64(serializer, "flow-lookups", snapshot->flow_lookups);
+    ndpi_serialize_string_uint64(serializer, "flow-lookup-probes", snapshot->flow_lookup_probes);
+    ndpi_serialize_string_uint64(serializer, "flow-lookup-max-probes", snapshot->flow_lookup_max_probes);
+    ndpi_serialize_string_uint64(serializer, "events-emitted", snapshot->events_emitted);
+    ndpi_serialize_string_uint64(serializer, "events-dropped", snapshot->events_dropped);
+    if (snapshot->pcap_stats_valid != 0)
+    {
+        ndpi_serialize_string_uint64(serializer, "pcap-packets-received", snapshot->pcap_packets_received);
+        ndpi_serialize_string_uint64(serializer, "pcap-packets-dropped", snapshot->pcap_packets_dropped);
+        ndpi_serialize_string_uint64(serializer, "pcap-packets-if-dropped", snapshot->pcap_packets_if_dropped);
+    }
+    if (nDPId_options.stage_timings != 0)
+    {
+        ndpi_serialize_string_uint64(serializer, "dpi-usec", snapshot->dpi_usec);
+        ndpi_serialize_string_uint64(serializer, "serialize-usec", snapshot->serialize_usec);
+        ndpi_serialize_string_uint64(serializer, "send-usec", snapshot->send_usec);
+    }
+}
+
+#ifdef ENABLE_LATENCY_HISTOGRAMS
+static void jsonize_latency_histograms(ndpi_serializer * const serializer,
+                                      struct nDPId_latency_histogram const * const histograms)
+{
+    static uint64_t const percentiles[] = {500, 900, 990, 999};
+    static char const * const percentile_names[] = {"p50", "p90", "p99", "p999"};
+    char json_key[64];
+
+    for (size_t stage = 0; stage < LATENCY_STAGE_COUNT; ++stage)
+    {
+        struct nDPId_latency_histogram const * const histogram = &histograms[stage];
+
+        snprintf(json_key, sizeof(json_key), "latency-%s-count", latency_stage_name_table[stage]);
+        ndpi_serialize_string_uint64(serializer, json_key, histogram->count);
+        for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); ++i)
+        {
+            snprintf(json_key,
+                     sizeof(json_key),
+                     "latency-%s-%s-nsec",
+                     latency_stage_name_table[stage],
+                     percentile_names[i]);
+            ndpi_serialize_string_uint64(serializer, json_key, latency_histogram_percentile(histogram, percentiles[i]));
+        }
+        snprintf(json_key, sizeof(json_key), "latency-%s-max-nsec", latency_stage_name_table[stage]);
+        ndpi_serialize_string_uint64(serializer, json_key, histogram->max);
+    }
+}
+
+/*
+ * Every `status' event covers the samples of its reader thread since the previous one.
+ * They are kept in `latency_histograms_total' for the `-x' snapshot and the summary on shutdown.
+ */
+static void jsonize_status_latency_histograms(struct nDPId_reader_thread * const reader_thread)
+{
+    jsonize_latency_histograms(&reader_thread->workflow->ndpi_serializer, reader_thread->latency_histograms);
+    latency_histograms_merge(reader_thread->latency_histograms_total, reader_thread->latency_histograms);
+    memset(reader_thread->latency_histograms, 0, sizeof(reader_thread->latency_histograms));
+}
+#endif
+
+static void jsonize_daemon(struct nDPId_reader_thread * const reader_thread, enum daemon_event event)
+{
+    char const ev[] = "daemon_event_name";
+    struct nDPId_workflow * const workflow = reader_thread->workflow;
+
+    ndpi_serialize_string_int32(&workflow->ndpi_serializer, "daemon_event_id", event);
+    if (event > DAEMON_EVENT_INVALID && event < DAEMON_EVENT_COUNT)
+    {
+        ndpi_serialize_string_string(&workflow->ndpi_serializer, ev, daemon_event_name_table[event]);
+    }
+    else
+    {
+        ndpi_serialize_string_string(&workflow->ndpi_serializer, ev, daemon_event_name_table[DAEMON_EVENT_INVALID]);
+    }
+
+    jsonize_basic(reader_thread);
+
+    if (event == DAEMON_EVENT_INIT)
+    {
+        ndpi_serialize_string_int64(&workflow->ndpi_serializer,
+                                    "max-flows-per-thread",
+                                    nDPId_options.max_flows_per_thread);
+        ndpi_serialize_string_int64(&workflow->ndpi_serializer,
+                                    "max-idle-flows-per-thread",
+                                    nDPId_options.max_idle_flows_per_thread);
+        ndpi_serialize_string_int64(&workflow->ndpi_serializer, "tick-resolution", nDPId_options.tick_resolution);
+        ndpi_serialize_string_int64(&workflow->ndpi_serializer,
+                                    "reader-thread-count",
+                                    nDPId_options.reader_thread_count);
+        ndpi_serialize_string_int64(&workflow->ndpi_serializer, "idle-scan-period", nDPId_options.idle_scan_period);
+        ndpi_serialize_string_int64(&workflow->ndpi_serializer,
+                                    "generic-max-idle-time",
+                                    nDPId_options.generic_max_idle_time);
+        ndpi_serialize_string_int64(&workflow->ndpi_serializer, "icmp-max-idle-time", nDPId_options.icmp_max_idle_time);
+        ndpi_serialize_string_int64(&workflow->ndpi_serializer, "udp-max-idle-time", nDPId_options.udp_max_idle_time);
+        ndpi_serialize_string_int64(&workflow->ndpi_serializer, "tcp-max-idle-time", nDPId_options.tcp_max_idle_time);
+        ndpi_serialize_string_int64(&workflow->ndpi_serializer,
+                                    "tcp-max-post-end-flow-time",
+                                    nDPId_options.tcp_max_post_end_flow_time);
+        ndpi_serialize_string_int64(&workflow->ndpi_serializer,
+                                    "max-packets-per-flow-to-send",
+                                    nDPId_options.max_packets_per_flow_to_send);
+        ndpi_serialize_string_int64(&workflow->ndpi_serializer,
+                                    "max-packets-per-flow-to-process",
+                                    nDPId_options.max_packets_per_flow_to_process);
+
+        if (nDPId_options.report_init_timings != 0)
+        {
+            struct nDPId_workflow_init_time const * const init_time = &reader_thread->workflow_init_time;
+
+            ndpi_serialize_string_uint64(&workflow->ndpi_serializer, "init-pcap-usec", init_time->pcap_usec);
+            ndpi_serialize_string_uint64(&workflow->ndpi_serializer, "init-ndpi-usec", init_time->ndpi_init_usec);
+            ndpi_serialize_string_uint64(&workflow->ndpi_serializer,
+                                         "init-flow-tables-usec",
+                                         init_time->flow_tables_usec);
+            ndpi_serialize_string_uint64(&workflow->ndpi_serializer,
+                                         "init-custom-files-usec",
+                                         init_time->custom_files_usec);
+            ndpi_serialize_string_uint64(&workflow->ndpi_serializer,
+                                         "init-ndpi-finalize-usec",
+                                         init_time->ndpi_finalize_usec);
+            ndpi_serialize_string_uint64(&workflow->ndpi_serializer,
+                                         "init-lock-wait-usec",
+                                         init_time->lock_wait_usec);
+            ndpi_serialize_string_uint64(&workflow->ndpi_serializer, "init-workflow-usec", init_time->total_usec);
+            ndpi_serialize_string_uint64(&workflow->ndpi_serializer, "init-total-usec", workflows_init_usec);
+        }
+    }
+    else if (event == DAEMON_EVENT_STATUS)
+    {
+        struct nDPId_stats_snapshot snapshot;
+
+        take_stats_snapshot(reader_thread, &snapshot);
+        jsonize_runtime_stats(&workflow->ndpi_serializer, &snapshot);
+#ifdef ENABLE_LATENCY_HISTOGRAMS
+        jsonize_status_latency_histograms(reader_thread);
+#endif
+    }
+    serialize_and_send(reader_thread);
+}
+
+/*
+ * `now' is the timestamp of the current packet, or the wall clock if a live capture is idle,
+ * see check_for_status_idle().
+ */
+static void check_for_status(struct nDPId_reader_thread * const reader_thread, uint64_t now)
+{
+    struct nDPId_thread_stats * const stats = &reader_thread->stats;
+
+    /* pcap_stats() and the workflow are not thread safe, the main thread serves the snapshot published here */
+    if (nDPId_options.stats_sockpath != NULL && stats->last_pcap_stats_time + nDPId_options.tick_resolution < now)
+    {
+        update_pcap_stats(reader_thread);
+        stats->last_pcap_stats_time = now;
+        publish_stats_snapshot(reader_thread);
+    }
+
+    if (nDPId_options.status_interval != 0 && stats->last_status_time + nDPId_options.status_interval < now)
+    {
+        update_pcap_stats(reader_thread);
+        stats->last_pcap_stats_time = now;
+        jsonize_daemon(reader_thread, DAEMON_EVENT_STATUS);
+        stats->last_status_time = now;
+    }
+}
+
+/*
+ * Packet timestamps do not advance while an interface is idle.
+ * Called by live captures if no packet arrived within nDPId_PCAP_POLL_TIMEOUT,
+ * so the `status' events and the `-x' snapshot keep being emitted based on the wall clock.
+ */
+static void check_for_status_idle(struct nDPId_reader_thread * const reader_thread)
+{
+    struct timespec ts;
+    uint64_t now;
+
+    if (clock_gettime(CLOCK_REALTIME, &ts) != 0)
+    {
+        return;
+    }
+    now = (uint64_t)ts.tv_sec * nDPId_options.tick_resolution +
+          (uint64_t)ts.tv_nsec / (1000000000 / nDPId_options.tick_resolution);
+    if (now > reader_thread->workflow->last_time)
+    {
+        check_for_status(reader_thread, now);
+    }
+}
+
+static void jsonize_flow(struct nDPId_workflow * const workflow, struct nDPId_flow_basic const * const flow_basic)
+{
+    struct nDPId_flow_extended const * const flow_ext = get_flow_extended(workflow, flow_basic);
+
+    ndpi_serialize_string_uint32(&workflow->ndpi_serializer, "flow_id", flow_ext->flow_id);
+    ndpi_serialize_string_uint64(&workflow->ndpi_serializer, "flow_packet_id", flow_ext->packets_processed);
+    ndpi_serialize_string_uint64(&workflow->ndpi_serializer, "flow_first_seen", flow_ext->first_seen);
+    ndpi_serialize_string_uint64(&workflow->ndpi_serializer, "flow_last_seen", flow_basic->last_seen);
+    ndpi_serialize_string_uint64(&workflow->ndpi_serializer, "flow_min_l4_payload_len", flow_ext->min_l4_payload_len);
+    ndpi_serialize_string_uint64(&workflow->ndpi_serializer, "flow_max_l4_payload_len", flow_ext->max_l4_payload_len);
+    ndpi_serialize_string_uint64(&workflow->ndpi_serializer, "flow_tot_l4_payload_len", flow_ext->total_l4_payload_len);
+    ndpi_serialize_string_uint64(&workflow->ndpi_serializer,
+                                 "flow_avg_l4_payload_len",
+                                 (flow_ext->packets_processed > 0
+                                      ? flow_ext->total_l4_payload_len / flow_ext->packets_processed
+                                      : 0));
+    ndpi_serialize_string_uint32(&workflow->ndpi_serializer, "midstream", flow_basic->tcp_is_midstream_flow);
+}
+
+static int connect_to_json_socket(struct nDPId_reader_thread * const reader_thread)
+{
+    struct sockaddr_un saddr;
+
+    if (reader_thread->json_sockfd >= 0)
+    {
+        close(reader_thread->json_sockfd);
+    }
+
+    reader_thread->json_sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (reader_thread->json_sockfd < 0)
+    {
+        reader_thread->json_sock_reconnect = 1;
+        return 1;
+    }
+
+    saddr.sun_family = AF_UNIX;
+    if (snprintf(saddr.sun_path, sizeof(saddr.sun_path), "%s", nDPId_options.json_sockpath) < 0 ||
+        connect(reader_thread->json_sockfd, (struct sockaddr *)&saddr, sizeof(saddr)) < 0)
+    {
+        reader_thread->json_sock_reconnect = 1;
+        return 1;
+    }
+
+    if (shutdown(reader_thread->json_sockfd, SHUT_RD) != 0)
+    {
+        return 1;
+    }
+
+    if (fcntl(reader_thread->json_sockfd, F_SETFL, fcntl(reader_thread->json_sockfd, F_GETFL, 0) | O_NONBLOCK) == -1)
+    {
+        reader_thread->json_sock_reconnect = 1;
+        return 1;
+    }
+
+    reader_thread->json_sock_reconnect = 0;
+
+    return 0;
+}
+
+/*
+ * Writes an already framed JSON string to the JSON sink of a reader thread.
+ * Returns 0 on success, 1 if the JSON string was dropped.
+ */
+static int write_to_json_sink(struct nDPId_reader_thread * const reader_thread,
+                              char const * const newline_json_str,
+                              size_t newline_json_str_len)
+{
+    struct nDPId_workflow * const workflow = reader_thread->workflow;
+    int saved_errno;
+
+    if (reader_thread->json_sock_reconnect != 0)
+    {
+        if (connect_to_json_socket(reader_thread) == 0)
+        {
+            syslog(LOG_DAEMON | LOG_ERR,
+                   "[%8llu, %d] Reconnected to JSON sink",
+                   workflow->packets_captured,
+                   reader_thread->array_index);
+            jsonize_daemon(reader_thread, DAEMON_EVENT_RECONNECT);
+        }
+    }
+
+    if (reader_thread->json_sock_reconnect != 0)
+    {
+        return 1;
+    }
+
+    errno = 0;
+    if (write(reader_thread->json_sockfd, newline_json_str, newline_json_str_len) != (ssize_t)newline_json_str_len)
+    {
+        saved_errno = errno;
+        syslog(LOG_DAEMON | LOG_ERR,
+               "[%8llu, %d] send data to JSON sink failed: %s",
+               workflow->packets_captured,
+               reader_thread->array_index,
+               strerror(saved_errno));
+        if (saved_errno == EPIPE)
+        {
+            syslog(LOG_DAEMON | LOG_ERR,
+                   "[%8llu, %d] Lost connection to JSON sink",
+                   workflow->packets_captured,
+                   reader_thread->array_index);
+        }
+        if (saved_errno != EAGAIN)
+        {
+            reader_thread->json_sock_reconnect = 1;
+        }
+        else
+        {
+            syslog(LOG_DAEMON | LOG_ERR,
+                   "[%8llu, %d] Possible data loss detected",
+                   workflow->packets_captured,
+                   reader_thread->array_index);
+        }
+        return 1;
+    }
+
+    return 0;
+}
+
+static int add_ordered_event(struct nDPId_reader_thread * const reader_thread,
+                             char const * const newline_json_str,
+                             size_t newline_json_str_len)
+{
+    struct nDPId_ordered_events * const ordered_events = &reader_thread->ordered_events;
+    uint32_t const len = newline_json_str_len;
+    size_t const record_size = sizeof(ordered_events->seq) + sizeof(len) + newline_json_str_len;
+
+    if (record_size > ordered_events->size - ordered_events->used)
+    {
+        size_t new_size = (ordered_events->size == 0 ? 65536 : ordered_events->size * 2);
+        uint8_t * new_buf;
+
+        while (new_size - ordered_events->used < record_size)
+        {
+            new_size *= 2;
+        }
+        new_buf = (uint8_t *)realloc(ordered_events->buf, new_size);
+        if (new_buf == NULL)
+        {
+            return 1;
+        }
+        ordered_events->buf = new_buf;
+        ordered_events->size = new_size;
+    }
+
+    memcpy(ordered_events->buf + ordered_events->used, &ordered_events->seq, sizeof(ordered_events->seq));
+    ordered_events->used += sizeof(ordered_events->seq);
+    memcpy(ordered_events->buf + ordered_events->used, &len, sizeof(len));
+    ordered_events->used += sizeof(len);
+    memcpy(ordered_events->buf + ordered_events->used, newline_json_str, newline_json_str_len);
+    ordered_events->used += newline_json_str_len;
+
+    return 0;
+}
+
+/*
+ * Sends the buffered events of all reader threads to the JSON sink of `sink_thread' in capture order.
+ * Events caused by the same packet are ordered by reader thread index.
+ * Has to be called while no other reader thread emits events.
+ */
+static void merge_ordered_events(struct nDPId_reader_thread * const sink_thread)
+{
+    size_t offsets[nDPId_MAX_READER_THREADS] = {};
+    int const sockfd = sink_thread->json_sockfd;
+    int const sockfd_flags = (sink_thread->json_sock_reconnect == 0 ? fcntl(sockfd, F_GETFL, 0) : -1);
+
+    /* events emitted while writing e.g. a reconnect event are sent immediately */
+    sink_thread->ordered_events.enabled = 0;
+    /* an offline replay can wait for the JSON sink instead of dropping events */
+    if (sockfd_flags >= 0)
+    {
+        fcntl(sockfd, F_SETFL, sockfd_flags & ~O_NONBLOCK);
+    }
+
+    while (1)
+    {
+        unsigned long long int next = nDPId_options.reader_thread_count;
+        uint64_t next_seq = 0;
+        uint32_t len;
+
+        for (unsigned long long int i = 0; i < nDPId_options.reader_thread_count; ++i)
+        {
+            struct nDPId_ordered_events const * const ordered_events = &reader_threads[i].ordered_events;
+            uint64_t seq;
+
+            if (offsets[i] == ordered_events->used)
+            {
+                continue;
+            }
+            memcpy(&seq, ordered_events->buf + offsets[i], sizeof(seq));
+            if (next == nDPId_options.reader_thread_count || seq < next_seq)
+            {
+                next = i;
+                next_seq = seq;
+            }
+        }
+        if (next == nDPId_options.reader_thread_count)
+        {
+            break;
+        }
+
+        struct nDPId_ordered_events const * const ordered_events = &reader_threads[next].ordered_events;
+        offsets[next] += sizeof(next_seq);
+        memcpy(&len, ordered_events->buf + offsets[next], sizeof(len));
+        offsets[next] += sizeof(len);
+        if (write_to_json_sink(sink_thread, (char const *)ordered_events->buf + offsets[next], len) == 0)
+        {
+            reader_threads[next].stats.events_emitted++;
+        }
+        else
+        {
+            reader_threads[next].stats.events_dropped++;
+        }
+        offsets[next] += len;
+    }
+
+    for (unsigned long long int i = 0; i < nDPId_options.reader_thread_count; ++i)
+    {
+        reader_threads[i].ordered_events.used = 0;
+    }
+    /* the sink may have been reconnected (and replaced) while merging */
+    if (sockfd_flags >= 0 && sink_thread->json_sockfd == sockfd)
+    {
+        fcntl(sockfd, F_SETFL, sockfd_flags);
+    }
+    sink_thread->ordered_events.enabled = 1;
+}
+
+static void send_to_json_sink(struct nDPId_reader_thread * const reader_thread,
+                              char const * const json_str,
+                              size_t json_str_len)
+{
+    struct nDPId_workflow * const workflow = reader_thread->workflow;
+    int s_ret;
+    /* nDPIsrvd needs NETWORK_BUFFER_SEQ_RESERVE bytes to add the `distributor_seq' */
+    char newline_json_str[NETWORK_BUFFER_COLLECTOR_MAX_SIZE];
+
+    s_ret = snprintf(newline_json_str,
+                     sizeof(newline_json_str),
+                     "%0" NETWORK_BUFFER_LENGTH_DIGITS_STR "zu%.*s\n",
+                     json_str_len + 1,
+                     (int)json_str_len,
+                     json_str);
+    if (s_ret < 0 || s_ret > (int)sizeof(newline_json_str))
+    {
+        syslog(LOG_DAEMON | LOG_ERR,
+               "[%8llu, %d] JSON buffer prepare failed: snprintf returned %d, buffer size %zu",
+               workflow->packets_captured,
+               reader_thread->array_index,
+               s_ret,
+               sizeof(newline_json_str));
+        reader_thread->stats.events_dropped++;
+        return;
+    }
+
+    if (reader_thread->ordered_events.enabled != 0)
+    {
+        if (add_ordered_event(reader_thread, newline_json_str, s_ret) != 0)
+        {
+            syslog(LOG_DAEMON | LOG_ERR,
+                   "[%8llu, %d] Could not buffer an ordered event: %s",
+                   workflow->packets_captured,
+                   reader_thread->array_index,
+                   strerror(ENOMEM));
+            reader_thread->stats.events_dropped++;
+        }
+        return;
+    }
+
+    if (write_to_json_sink(reader_thread, newline_json_str, s_ret) != 0)
+    {
+        reader_thread->stats.events_dropped++;
+    }
+    else
+    {
+        reader_thread->stats.events_emitted++;
+    }
+}
+
+static void serialize_and_send(struct nDPId_reader_thread * const reader_thread)
+{
+    char * json_str;
+    uint32_t json_str_len;
+
+    json_str = ndpi_serializer_get_buffer(&reader_thread->workflow->ndpi_serializer, &json_str_len);
+    if (json_str == NULL || json_str_len == 0)
+    {
+        syslog(LOG_DAEMON | LOG_ERR,
+               "[%8llu, %d] jsonize failed, buffer length: %u",
+               reader_thread->workflow->packets_captured,
+               reader_thread->array_index,
+               json_str_len);
+    }
+    else
+    {
+        uint64_t const send_start_usec = get_stats_usec();
+        LATENCY_SAMPLE_BEGIN(send_start);
+
+        reader_thread->stats.serialize_usec += send_start_usec - reader_thread->stats.serialize_start_usec;
+        LATENCY_SAMPLE_END(reader_thread, LATENCY_STAGE_SERIALIZE, reader_thread->latency_serialize_start);
+        send_to_json_sink(reader_thread, json_str, json_str_len);
+        reader_thread->stats.send_usec += get_stats_usec() - send_start_usec;
+        LATENCY_SAMPLE_END(reader_thread, LATENCY_STAGE_SEND, send_start);
+    }
+    ndpi_reset_serializer(&reader_thread->workflow->ndpi_serializer);
+}
+
+/* Slightly modified code from: https://en.wikibooks.org/wiki/Algorithm_Implementation/Miscellaneous/Base64 */
+static int base64encode(uint8_t const * const data_buf,
+                        size_t dataLength,
+                        char * const result,
+                        size_t * const resultSize)
+{
+    const char base64chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const uint8_t * data = (const uint8_t *)data_buf;
+    size_t resultIndex = 0;
+    size_t x;
+    uint32_t n = 0;
+    int padCount = dataLength % 3;
+    uint8_t n0, n1, n2, n3;
+
+    /* increment over the length of the string, three characters at a time */
+    for (x = 0; x < dataLength; x += 3)
+    {
+        /* these three 8-bit (ASCII) characters become one 24-bit number */
+        n = ((uint32_t)data[x]) << 16; // parenthesis needed, compiler depending on flags can do the shifting before
+                                       // conversion to uint32_t, resulting to 0
+
+        if ((x + 1) < dataLength)
+        {
+            n += ((uint32_t)data[x + 1]) << 8; // parenthesis needed, compiler depending on flags can do the shifting
+                                               // before conversion to uint32_t, resulting to 0
+        }
+
+        if ((x + 2) < dataLength)
+        {
+            n += data[x + 2];
+        }
+
+        /* this 24-bit number gets separated into four 6-bit numbers */
+        n0 = (uint8_t)(n >> 18) & 63;
+        n1 = (uint8_t)(n >> 12) & 63;
+        n2 = (uint8_t)(n >> 6) & 63;
+        n3 = (uint8_t)n & 63;
+
+        /*
+         * if we have one byte available, then its encoding is spread
+         * out over two characters
+         */
+        if (resultIndex >= *resultSize)
+        {
+            return 1; /* indicate failure: buffer too small */
+        }
+        result[resultIndex++] = base64chars[n0];
+        if (resultIndex >= *resultSize)
+        {
+            return 1; /* indicate failure: buffer too small */
+        }
+        result[resultIndex++] = base64chars[n1];
+
+        /*
+         * if we have only two bytes available, then their encoding is
+         * spread out over three chars
+         */
+        if ((x + 1) < dataLength)
+        {
+            if (resultIndex >= *resultSize)
+            {
+                return 1; /* indicate failure: buffer too small */
+            }
+            result[resultIndex++] = base64chars[n2];
+        }
+
+        /*
+         * if we have all three bytes available, then their encoding is spread
+         * out over four characters
+         */
+        if ((x + 2) < dataLength)
+        {
+            if (resultIndex >= *resultSize)
+            {
+                return 1; /* indicate failure: buffer too small */
+            }
+            result[resultIndex++] = base64chars[n3];
+        }
+    }
+
+    /*
+     * create and add padding that is required if we did not have a multiple of 3
+     * number of characters available
+     */
+    if (padCount > 0)
+    {
+        for (; padCount < 3; padCount++)
+        {
+            if (resultIndex >= *resultSize)
+            {
+                return 1; /* indicate failure: buffer too small */
+            }
+            result[resultIndex++] = '=';
+        }
+    }
+    if (resultIndex >= *resultSize)
+    {
+        return 1; /* indicate failure: buffer too small */
+    }
+
+    result[resultIndex] = 0;
+    *resultSize = resultIndex;
+    return 0; /* indicate success */
+}
+
+static void jsonize_packet_event(struct nDPId_reader_thread * const reader_thread,
+                                 struct pcap_pkthdr const * const header,
+                                 uint8_t const * const packet,
+                                 uint16_t pkt_type,
+                                 uint16_t pkt_l3_offset,
+                                 uint16_t pkt_l4_offset,
+                                 uint16_t pkt_l4_len,
+                                 struct nDPId_flow_extended const * const flow_ext,
+                                 enum packet_event event)
+{
+    struct nDPId_workflow * const workflow = reader_thread->workflow;
+    char const ev[] = "packet_event_name";
+
+    if (reader_thread->suppress_events != 0)
+    {
+        reader_thread->suppressed_events++;
+        return;
+    }
+
+    if (event == PACKET_EVENT_PAYLOAD_FLOW)
+    {
+        if (flow_ext == NULL)
+        {
+            syslog(LOG_DAEMON | LOG_ERR,
+                   "[%8llu, %d] BUG: got a PACKET_EVENT_PAYLOAD_FLOW with a flow pointer equals NULL",
+                   reader_thread->workflow->packets_captured,
+                   reader_thread->array_index);
+            return;
+        }
+        if (flow_ext->packets_processed > nDPId_options.max_packets_per_flow_to_send)
+        {
+            return;
+        }
+        ndpi_serialize_string_uint32(&workflow->ndpi_serializer, "flow_id", flow_ext->flow_id);
+        ndpi_serialize_string_uint64(&workflow->ndpi_serializer, "flow_packet_id", flow_ext->packets_processed);
+    }
+
+    ndpi_serialize_string_int32(&workflow->ndpi_serializer, "packet_event_id", event);
+    if (event > PACKET_EVENT_INVALID && event < PACKET_EVENT_COUNT)
+    {
+        ndpi_serialize_string_string(&workflow->ndpi_serializer, ev, packet_event_name_table[event]);
+    }
+    else
+    {
+        ndpi_serialize_string_string(&workflow->ndpi_serializer, ev, packet_event_name_table[PACKET_EVENT_INVALID]);
+    }
+
+    jsonize_basic(reader_thread);
+
+    char base64_data[NETWORK_BUFFER_MAX_SIZE];
+    size_t base64_data_len = sizeof(base64_data);
+    int base64_retval = base64encode(packet, header->caplen, base64_data, &base64_data_len);
+
+    ndpi_serialize_string_boolean(&workflow->ndpi_serializer, "pkt_oversize", base64_data_len > sizeof(base64_data));
+    ndpi_serialize_string_uint64(&workflow->ndpi_serializer, "pkt_ts_sec", header->ts.tv_sec);
+    ndpi_serialize_string_uint64(&workflow->ndpi_serializer, "pkt_ts_usec", header->ts.tv_usec);
+    ndpi_serialize_string_uint32(&workflow->ndpi_serializer, "pkt_caplen", header->caplen);
+    ndpi_serialize_string_uint32(&workflow->ndpi_serializer, "pkt_type", pkt_type);
+    ndpi_serialize_string_uint32(&workflow->ndpi_serializer, "pkt_l3_offset", pkt_l3_offset);
+    ndpi_serialize_string_uint32(&workflow->ndpi_serializer, "pkt_l4_offset", pkt_l4_offset);
+    ndpi_serialize_string_uint32(&workflow->ndpi_serializer, "pkt_len", header->len);
+    ndpi_serialize_string_uint32(&workflow->ndpi_serializer, "pkt_l4_len", pkt_l4_len);
+
+    if (base64_retval == 0 && base64_data_len > 0 &&
+        ndpi_serialize_string_binary(&workflow->ndpi_serializer, "pkt", base64_data, base64_data_len) != 0)
+    {
+        syslog(LOG_DAEMON | LOG_ERR,
+               "[%8llu, %d] JSON serializing base64 packet buffer failed",
+               reader_thread->workflow->packets_captured,
+               reader_thread->array_index);
+    }
+    serialize_and_send(reader_thread);
+}
+
+static void flush_flow_capture(void)
+{
+    if (flow_capture_writer.buffer_used > 0 &&
+        write(flow_capture_writer.buffer_fd, flow_capture_writer.buffer, flow_capture_writer.buffer_used) !=
+            (ssize_t)flow_capture_writer.buffer_used)
+    {
+        syslog(LOG_DAEMON | LOG_ERR, "Writing %zu bytes of captured flows failed", flow_capture_writer.buffer_used);
+    }
+    flow_capture_writer.buffer_used = 0;
+    flow_capture_writer.buffer_fd = -1;
+    flow_capture_writer.last_flush = time(NULL);
+}
+
+static void write_flow_capture(int fd, void const * const data, size_t data_len)
+{
+    if (flow_capture_writer.buffer_fd != fd || data_len > nDPId_CAPTURE_BUFFER_SIZE - flow_capture_writer.buffer_used)
+    {
+        flush_flow_capture();
+    }
+    if (data_len > nDPId_CAPTURE_BUFFER_SIZE)
+    {
+        if (write(fd, data, data_len) != (ssize_t)data_len)
+        {
+            syslog(LOG_DAEMON | LOG_ERR, "Writing %zu bytes of captured flows failed", data_len);
+        }
+        return;
+    }
+
+    memcpy(flow_capture_writer.buffer + flow_capture_writer.buffer_used, data, data_len);
+    flow_capture_writer.buffer_used += data_len;
+    flow_capture_writer.buffer_fd = fd;
+}
+
+static void close_flow_capture_files(void)
+{
+    flush_flow_capture();
+    for (size_t i = 0; i < nDPId_MAX_READER_THREADS; ++i)
+    {
+        for (size_t j = 0; j < CAPTURE_TYPE_COUNT; ++j)
+        {
+            if (flow_capture_writer.fds[i][j] >= 0)
+            {
+                close(flow_capture_writer.fds[i][j]);
+                flow_capture_writer.fds[i][j] = -1;
+            }
+        }
+    }
+}
+
+/* Closes all rotated files once the `capture-rotation' period is over, even if no flow was captured since. */
+static int rotate_flow_capture_files(void)
+{
+    time_t const current_time = time(NULL);
+    struct tm rotation_tm;
+
+    if (nDPId_options.capture_rotation == 0 ||
+        current_time < flow_capture_writer.last_rotation + (time_t)nDPId_options.capture_rotation)
+    {
+        return 0;
+    }
+
+    close_flow_capture_files();
+    flow_capture_writer.last_rotation = current_time;
+    if (localtime_r(&current_time, &rotation_tm) == NULL ||
+        strftime(flow_capture_writer.rotation_appendix,
+                 sizeof(flow_capture_writer.rotation_appendix),
+                 "%d_%m_%y-%H_%M_%S",
+                 &rotation_tm) == 0)
+    {
+        flow_capture_writer.rotation_appendix[0] = '\0';
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Uses the same file names as c-captured: one file per flow or, if rotated, one file per rotation period.
+ * Rotated files get the index of the capturing reader thread appended.
+ */
+static int open_flow_capture_file(struct nDPId_capture_job const * const job)
+{
+    char pcap_filename[PATH_MAX];
+    struct stat st;
+    int ret;
+
+    if (nDPId_options.capture_rotation > 0)
+    {
+        if (flow_capture_writer.rotation_appendix[0] == '\0')
+        {
+            return -1;
+        }
+        if (flow_capture_writer.fds[job->reader_thread_index][job->type] >= 0)
+        {
+            return flow_capture_writer.fds[job->reader_thread_index][job->type];
+        }
+        ret = snprintf(pcap_filename,
+                       sizeof(pcap_filename),
+                       "%s/flow-%s-%s-%d.pcap",
+                       nDPId_options.capture_dir,
+                       capture_type_name_table[job->type],
+                       flow_capture_writer.rotation_appendix,
+                       job->reader_thread_index);
+    }
+    else
+    {
+        ret = snprintf(pcap_filename,
+                       sizeof(pcap_filename),
+                       "%s/flow-%s-%u.pcap",
+                       nDPId_options.capture_dir,
+                       capture_type_name_table[job->type],
+                       job->flow_id);
+    }
+    if (ret <= 0 || (size_t)ret >= sizeof(pcap_filename))
+    {
+        return -1;
+    }
+
+    int const fd = open(pcap_filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        syslog(LOG_DAEMON | LOG_ERR, "Could not open pcap file %s: %s", pcap_filename, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &st) == 0 && st.st_size == 0)
+    {
+        struct pcap_file_header const file_header = {.magic = 0xa1b2c3d4,
+                                                     .version_major = PCAP_VERSION_MAJOR,
+                                                     .version_minor = PCAP_VERSION_MINOR,
+                                                     .thiszone = 0,
+                                                     .sigfigs = 0,
+                                                     .snaplen = job->snaplen,
+                                                     .linktype = job->datalink};
+
+        write_flow_capture(fd, &file_header, sizeof(file_header));
+    }
+    if (nDPId_options.capture_rotation > 0)
+    {
+        flow_capture_writer.fds[job->reader_thread_index][job->type] = fd;
+    }
+
+    return fd;
+}
+
+static void write_capture_jobs(struct nDPId_capture_job * jobs)
+{
+    while (jobs != NULL)
+    {
+        struct nDPId_capture_job * const job = jobs;
+        int const fd = open_flow_capture_file(job);
+
+        jobs = jobs->next;
+        if (fd >= 0)
+        {
+            write_flow_capture(fd, job->records, job->records_used);
+            if (nDPId_options.capture_rotation == 0)
+            {
+                flush_flow_capture();
+                close(fd);
+            }
+        }
+        free(job->records);
+        free(job);
+    }
+}
+
+/*
+ * Rotated files are written through `buffer', which is flushed at least every `nDPId_CAPTURE_FLUSH_INTERVAL',
+ * so captured flows show up in the files while nDPId runs.
+ */
+static void * flow_capture_writer_thread(void * const arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&flow_capture_writer.lock);
+    while (flow_capture_writer.head != NULL || flow_capture_writer.shutdown == 0)
+    {
+        if (flow_capture_writer.head == NULL)
+        {
+            struct timespec abstime;
+
+            if (nDPId_options.capture_rotation == 0)
+            {
+                pthread_cond_wait(&flow_capture_writer.cond, &flow_capture_writer.lock);
+                continue;
+            }
+
+            clock_gettime(CLOCK_REALTIME, &abstime);
+            abstime.tv_sec += nDPId_CAPTURE_FLUSH_INTERVAL;
+            if (pthread_cond_timedwait(&flow_capture_writer.cond, &flow_capture_writer.lock, &abstime) == ETIMEDOUT)
+            {
+                pthread_mutex_unlock(&flow_capture_writer.lock);
+                flush_flow_capture();
+                if (rotate_flow_capture_files() != 0)
+                {
+                    syslog(LOG_DAEMON | LOG_ERR, "Could not rotate the pcap files of captured flows");
+                }
+                pthread_mutex_lock(&flow_capture_writer.lock);
+            }
+            continue;
+        }
+
+        struct nDPId_capture_job * const jobs = flow_capture_writer.head;
+        flow_capture_writer.head = NULL;
+        flow_capture_writer.tail = NULL;
+        flow_capture_writer.pending_size = 0;
+        pthread_mutex_unlock(&flow_capture_writer.lock);
+
+        if (rotate_flow_capture_files() != 0)
+        {
+            syslog(LOG_DAEMON | LOG_ERR, "Could not rotate the pcap files of captured flows");
+        }
+        write_capture_jobs(jobs);
+        if (time(NULL) >= flow_capture_writer.last_flush + nDPId_CAPTURE_FLUSH_INTERVAL)
+        {
+            flush_flow_capture();
+        }
+
+        pthread_mutex_lock(&flow_capture_writer.lock);
+    }
+    pthread_mutex_unlock(&flow_capture_writer.lock);
+
+    close_flow_capture_files();
+
+    return NULL;
+}
+
+static int start_flow_capture_writer(void)
+{
+    for (size_t i = 0; i < nDPId_MAX_READER_THREADS; ++i)
+    {
+        for (size_t j = 0; j < CAPTURE_TYPE_COUNT; ++j)
+        {
+            flow_capture_writer.fds[i][j] = -1;
+        }
+    }
+    flow_capture_writer.buffer_fd = -1;
+    flow_capture_writer.buffer = (uint8_t *)malloc(nDPId_CAPTURE_BUFFER_SIZE);
+    if (flow_capture_writer.buffer == NULL)
+    {
+        return 1;
+    }
+
+    if (pthread_create(&flow_capture_writer.thread, NULL, flow_capture_writer_thread, NULL) != 0)
+    {
+        return 1;
+    }
+    flow_capture_writer.started = 1;
+
+    return 0;
+}
+
+/* Writes all queued flows before it returns. */
+static void stop_flow_capture_writer(void)
+{
+    if (flow_capture_writer.started != 0)
+    {
+        pthread_mutex_lock(&flow_capture_writer.lock);
+        flow_capture_writer.shutdown = 1;
+        pthread_cond_signal(&flow_capture_writer.cond);
+        pthread_mutex_unlock(&flow_capture_writer.lock);
+        pthread_join(flow_capture_writer.thread, NULL);
+        flow_capture_writer.started = 0;
+    }
+
+    free(flow_capture_writer.buffer);
+    flow_capture_writer.buffer = NULL;
+}
+
+/* Takes over `records' on success. Never blocks on the file system, but fails if the writer thread falls behind. */
+static int queue_capture_job(struct nDPId_reader_thread const * const reader_thread,
+                             enum capture_type type,
+                             uint32_t flow_id,
+                             uint8_t * const records,
+                             size_t records_used)
+{
+    struct nDPId_capture_job * const job = (struct nDPId_capture_job *)malloc(sizeof(*job));
+
+    if (job == NULL)
+    {
+        return 1;
+    }
+    job->next = NULL;
+    job->type = type;
+    job->reader_thread_index = reader_thread->array_index;
+    job->flow_id = flow_id;
+    job->datalink = get_datalink_type(reader_thread);
+    job->snaplen = get_snaplen(reader_thread);
+    job->records_used = records_used;
+    job->records = records;
+
+    pthread_mutex_lock(&flow_capture_writer.lock);
+    if (flow_capture_writer.pending_size + records_used > nDPId_CAPTURE_MAX_PENDING)
+    {
+        pthread_mutex_unlock(&flow_capture_writer.lock);
+        free(job);
+        return 1;
+    }
+    if (flow_capture_writer.tail != NULL)
+    {
+        flow_capture_writer.tail->next = job;
+    }
+    else
+    {
+        flow_capture_writer.head = job;
+    }
+    flow_capture_writer.tail = job;
+    flow_capture_writer.pending_size += records_used;
+    pthread_cond_signal(&flow_capture_writer.cond);
+    pthread_mutex_unlock(&flow_capture_writer.lock);
+
+    return 0;
+}
+
+static void release_capture_flow(struct nDPId_capture_flow * const capture_flow)
+{
+    free(capture_flow->packets);
+    capture_flow->packets = NULL;
+    capture_flow->packets_used = 0;
+    capture_flow->packets_size = 0;
+    capture_flow->finished = 1;
+}
+
+/*
+ * Keeps a copy of the first `max-packets-per-flow-to-send' packets of a flow,
+ * the same packets c-captured would receive as `packet-flow' events.
+ */
+static void capture_flow_packet(struct nDPId_reader_thread * const reader_thread,
+                                struct nDPId_flow_basic const * const flow_basic,
+                                struct nDPId_flow_extended const * const flow_ext,
+                                struct pcap_pkthdr const * const header,
+                                uint8_t const * const packet)
+{
+    struct nDPId_flow_capture * const flow_capture = &reader_thread->flow_capture;
+    struct nDPId_capture_flow * capture_flow;
+    uint32_t const record_header[4] = {header->ts.tv_sec, header->ts.tv_usec, header->caplen, header->len};
+    size_t const record_size = sizeof(record_header) + header->caplen;
+
+    if (flow_capture->flows == NULL || flow_ext->packets_processed > nDPId_options.max_packets_per_flow_to_send)
+    {
+        return;
+    }
+
+    capture_flow = &flow_capture->flows[flow_basic->cold_index];
+    if (flow_ext->packets_processed == 1)
+    {
+        capture_flow->packets_used = 0;
+        capture_flow->midstream = flow_basic->tcp_is_midstream_flow;
+        capture_flow->filter_matched =
+            (capture_bpf_valid != 0 && pcap_offline_filter(&capture_bpf, header, packet) != 0);
+        capture_flow->finished = 0;
+    }
+    if (capture_flow->finished != 0)
+    {
+        return;
+    }
+
+    if (record_size > capture_flow->packets_size - capture_flow->packets_used)
+    {
+        size_t const new_size = capture_flow->packets_used + record_size +
+                                (nDPId_options.max_packets_per_flow_to_send - flow_ext->packets_processed) * 128;
+        uint8_t * const new_packets = (uint8_t *)realloc(capture_flow->packets, new_size);
+
+        if (new_packets == NULL)
+        {
+            syslog(LOG_DAEMON | LOG_ERR,
+                   "[%8llu, %d, %4u] Could not capture packet, flow will not be captured",
+                   reader_thread->workflow->packets_captured,
+                   reader_thread->array_index,
+                   flow_ext->flow_id);
+            release_capture_flow(capture_flow);
+            return;
+        }
+        capture_flow->packets = new_packets;
+        capture_flow->packets_size = new_size;
+    }
+
+    memcpy(capture_flow->packets + capture_flow->packets_used, record_header, sizeof(record_header));
+    memcpy(capture_flow->packets + capture_flow->packets_used + sizeof(record_header), packet, header->caplen);
+    capture_flow->packets_used += record_size;
+}
+
+/* Same precedence as c-captured. */
+static enum capture_type get_capture_type(struct nDPId_reader_thread * const reader_thread,
+                                          struct nDPId_flow_basic const * const flow_basic,
+                                          struct nDPId_capture_flow const * const capture_flow,
+                                          enum flow_event event)
+{
+    if (capture_flow->midstream != 0 && nDPId_options.capture_midstream != 0)
+    {
+        return CAPTURE_TYPE_MIDSTREAM;
+    }
+    if (event == FLOW_EVENT_GUESSED && nDPId_options.capture_guessed != 0)
+    {
+        return CAPTURE_TYPE_GUESSED;
+    }
+    if (event == FLOW_EVENT_NOT_DETECTED && nDPId_options.capture_undetected != 0)
+    {
+        return CAPTURE_TYPE_UNDETECTED;
+    }
+    if (event == FLOW_EVENT_DETECTED && nDPId_options.capture_risky != 0 &&
+        get_flow_info(reader_thread->workflow, flow_basic)->detection_data->flow.risk != 0)
+    {
+        return CAPTURE_TYPE_RISKY;
+    }
+    if (capture_flow->filter_matched != 0)
+    {
+        return CAPTURE_TYPE_FILTER;
+    }
+
+    return CAPTURE_TYPE_COUNT;
+}
+
+/*
+ * The packets of a flow are handed over to the writer thread as soon as its detection finished, as c-captured does.
+ */
+static void capture_flow_event(struct nDPId_reader_thread * const reader_thread,
+                               struct nDPId_flow_basic const * const flow_basic,
+                               enum flow_event event)
+{
+    struct nDPId_flow_capture * const flow_capture = &reader_thread->flow_capture;
+    struct nDPId_capture_flow * capture_flow;
+    enum capture_type type;
+
+    if (flow_capture->flows == NULL)
+    {
+        return;
+    }
+    capture_flow = &flow_capture->flows[flow_basic->cold_index];
+
+    switch (event)
+    {
+        case FLOW_EVENT_GUESSED:
+        case FLOW_EVENT_DETECTED:
+        case FLOW_EVENT_NOT_DETECTED:
+            break;
+
+        case FLOW_EVENT_END:
+        case FLOW_EVENT_IDLE:
+            release_capture_flow(capture_flow);
+            return;
+
+        case FLOW_EVENT_INVALID:
+        case FLOW_EVENT_NEW:
+        case FLOW_EVENT_DETECTION_UPDATE:
+        case FLOW_EVENT_COUNT:
+            return;
+    }
+    if (capture_flow->finished != 0)
+    {
+        return;
+    }
+
+    type = get_capture_type(reader_thread, flow_basic, capture_flow, event);
+    if (type != CAPTURE_TYPE_COUNT && capture_flow->packets_used > 0)
+    {
+        uint32_t const flow_id = get_flow_extended(reader_thread->workflow, flow_basic)->flow_id;
+
+        if (queue_capture_job(reader_thread, type, flow_id, capture_flow->packets, capture_flow->packets_used) != 0)
+        {
+            syslog(LOG_DAEMON | LOG_ERR,
+                   "[%8llu, %d, %4u] Pcap writer falls behind, flow will not be captured",
+                   reader_thread->workflow->packets_captured,
+                   reader_thread->array_index,
+                   flow_id);
+        }
+        else
+        {
+            /* the writer thread owns the packets now */
+            capture_flow->packets = NULL;
+            capture_flow->packets_size = 0;
+        }
+    }
+    release_capture_flow(capture_flow);
+}
+
+static void free_flow_capture(struct nDPId_flow_capture * const flow_capture)
+{
+    if (flow_capture->flows != NULL)
+    {
+        for (unsigned long long int i = 0; i < nDPId_options.max_flows_per_thread; ++i)
+        {
+            free(flow_capture->flows[i].packets);
+        }
+    }
+    free(flow_capture->flows);
+    flow_capture->flows = NULL;
+}
+
+/* I decided against ndpi_flow2json as does not fulfill my needs. */
+static void jsonize_flow_event(struct nDPId_reader_thread * const reader_thread,
+                               struct nDPId_flow_basic * const flow_basic,
+                               enum flow_event event)
+{
+    struct nDPId_workflow * const workflow = reader_thread->workflow;
+    struct nDPId_flow_info * const flow = get_flow_info(workflow, flow_basic);
+    char const ev[] = "flow_event_name";
+
+    ndpi_serialize_string_int32(&workflow->ndpi_serializer, "flow_event_id", event);
+    if (event > FLOW_EVENT_INVALID && event < FLOW_EVENT_COUNT)
+    {
+        ndpi_serialize_string_string(&workflow->ndpi_serializer, ev, flow_event_name_table[event]);
+    }
+    else
+    {
+        ndpi_serialize_string_string(&workflow->ndpi_serializer, ev, flow_event_name_table[FLOW_EVENT_INVALID]);
+    }
+    jsonize_basic(reader_thread);
+    jsonize_flow(workflow, flow_basic);
+    jsonize_l3_l4(workflow, flow_basic);
+
+    switch (event)
+    {
+        case FLOW_EVENT_INVALID:
+        case FLOW_EVENT_COUNT:
+            break;
+
+        case FLOW_EVENT_NEW:
+        case FLOW_EVENT_END:
+        case FLOW_EVENT_IDLE:
+            ndpi_serialize_string_int32(&workflow->ndpi_serializer,
+                                        "flow_datalink",
+                                        get_datalink_type(reader_thread));
+            ndpi_serialize_string_uint32(&workflow->ndpi_serializer,
+                                         "flow_max_packets",
+                                         nDPId_options.max_packets_per_flow_to_send);
+            break;
+
+        case FLOW_EVENT_NOT_DETECTED:
+        case FLOW_EVENT_GUESSED:
+            if (ndpi_dpi2json(workflow->ndpi_struct,
+                              &flow->detection_data->flow,
+                              flow->detection_data->guessed_l7_protocol,
+                              &workflow->ndpi_serializer) != 0)
+            {
+                syslog(LOG_DAEMON | LOG_ERR,
+                       "[%8llu, %4u] ndpi_dpi2json failed for not-detected/guessed flow",
+                       workflow->packets_captured,
+                       get_flow_extended(workflow, flow_basic)->flow_id);
+            }
+            break;
+
+        case FLOW_EVENT_DETECTED:
+        case FLOW_EVENT_DETECTION_UPDATE:
+            if (ndpi_dpi2json(workflow->ndpi_struct,
+                              &flow->detection_data->flow,
+                              flow->detection_data->detected_l7_protocol,
+                              &workflow->ndpi_serializer) != 0)
+            {
+                syslog(LOG_DAEMON | LOG_ERR,
+                       "[%8llu, %4u] ndpi_dpi2json failed for detected/detection-update flow",
+                       workflow->packets_captured,
+                       get_flow_extended(workflow, flow_basic)->flow_id);
+            }
+            break;
+    }
+
+    serialize_and_send(reader_thread);
+    capture_flow_event(reader_thread, flow_basic, event);
+}
+
+static void internal_format_error(ndpi_serializer * const serializer, char const * const format, uint32_t format_index)
+{
+    syslog(LOG_DAEMON | LOG_ERR,
+           "BUG: Internal error detected for format string `%s' at format index %u",
+           format,
+           format_index);
+    ndpi_reset_serializer(serializer);
+}
+
+static void vjsonize_basic_eventf(struct nDPId_reader_thread * const reader_thread, char const * format, va_list ap)
+{
+    uint8_t got_jsonkey = 0;
+    uint8_t is_long_long = 0;
+    char json_key[NETWORK_BUFFER_MAX_SIZE];
+    uint32_t format_index = 0;
+
+    while (*format)
+    {
+        if (got_jsonkey == 0)
+        {
+            json_key[0] = '\0';
+        }
+
+        switch (*format++)
+        {
+            case 's':
+            {
+                format_index++;
+                char * value = va_arg(ap, char *);
+                if (got_jsonkey == 0)
+                {
+                    snprintf(json_key, sizeof(json_key), "%s", value);
+                    got_jsonkey = 1;
+                }
+                else
+                {
+                    ndpi_serialize_string_string(&reader_thread->workflow->ndpi_serializer, json_key, value);
+                    got_jsonkey = 0;
+                }
+                break;
+            }
+            case 'f':
+            {
+                format_index++;
+                if (got_jsonkey == 1)
+                {
+                    float value = va_arg(ap, double);
+                    ndpi_serialize_string_float(&reader_thread->workflow->ndpi_serializer, json_key, value, "%.2f");
+                    got_jsonkey = 0;
+                }
+                else
+                {
+                    internal_format_error(&reader_thread->workflow->ndpi_serializer, format, format_index);
+                    return;
+                }
+                break;
+            }
+            case 'z':
+            case 'l':
+                format_index++;
+                if (got_jsonkey != 1)
+                {
+                    internal_format_error(&reader_thread->workflow->ndpi_serializer, format, format_index);
+                    return;
+                }
+                if (*format == 'l')
+                {
+                    format++;
+                    is_long_long = 1;
+                }
+                else
+                {
+                    is_long_long = 0;
+                }
+                if (*format == 'd')
+                {
+                    long long int value;
+                    if (is_long_long != 0)
+                    {
+                        value = va_arg(ap, long long int);
+                    }
+                    else
+                    {
+                        value = va_arg(ap, long int);
+                    }
+                    ndpi_serialize_string_int64(&reader_thread->workflow->ndpi_serializer, json_key, value);
+                    got_jsonkey = 0;
+                }
+                else if (*format == 'u')
+                {
+                    unsigned long long int value;
+                    if (is_long_long != 0)
+                    {
+                        value = va_arg(ap, unsigned long long int);
+                    }
+                    else
+                    {
+                        value = va_arg(ap, unsigned long int);
+                    }
+                    ndpi_serialize_string_uint64(&reader_thread->workflow->ndpi_serializer, json_key, value);
+                    got_jsonkey = 0;
+                }
+                else
+                {
+                    internal_format_error(&reader_thread->workflow->ndpi_serializer, format, format_index);
+                    return;
+                }
+                format++;
+                break;
+            case 'u':
+                format_index++;
+                if (got_jsonkey == 1)
+                {
+                    unsigned int value = va_arg(ap, unsigned int);
+                    ndpi_serialize_string_uint32(&reader_thread->workflow->ndpi_serializer, json_key, value);
+                    got_jsonkey = 0;
+                }
+                else
+                {
+                    internal_format_error(&reader_thread->workflow->ndpi_serializer, format, format_index);
+                    return;
+                }
+                break;
+            case 'd':
+                format_index++;
+                if (got_jsonkey == 1)
+                {
+                    int value = va_arg(ap, int);
+                    ndpi_serialize_string_int32(&reader_thread->workflow->ndpi_serializer, json_key, value);
+                    got_jsonkey = 0;
+                }
+                else
+                {
+                    internal_format_error(&reader_thread->workflow->ndpi_serializer, format, format_index);
+                    return;
+                }
+                break;
+            /* format string separators */
+            case ' ':
+            case ',':
+            case '%':
+                break;
+            default:
+                internal_format_error(&reader_thread->workflow->ndpi_serializer, format, format_index);
+                return;
+        }
+    }
+}
+
+__attribute__((format(printf, 3, 4))) static void jsonize_basic_eventf(struct nDPId_reader_thread * const reader_thread,
+                                                                       enum basic_event event,
+                                                                       char const * format,
+                                                                       ...)
+{
+    struct nDPId_workflow * const workflow = reader_thread->workflow;
+    va_list ap;
+    char const ev[] = "basic_event_name";
+
+    if (reader_thread->suppress_events != 0)
+    {
+        reader_thread->suppressed_events++;
+        return;
+    }
+
+    ndpi_serialize_string_int32(&reader_thread->workflow->ndpi_serializer, "basic_event_id", event);
+    if (event > BASIC_EVENT_INVALID && event < BASIC_EVENT_COUNT)
+    {
+        ndpi_serialize_string_string(&workflow->ndpi_serializer, ev, basic_event_name_table[event]);
+    }
+    else
+    {
+        ndpi_serialize_string_string(&workflow->ndpi_serializer, ev, basic_event_name_table[BASIC_EVENT_INVALID]);
+    }
+    jsonize_basic(reader_thread);
+
+    if (format != NULL)
+    {
+        va_start(ap, format);
+        vjsonize_basic_eventf(reader_thread, format, ap);
+        va_end(ap);
+    }
+
+    serialize_and_send(reader_thread);
+}
+
+/* See: https://en.wikipedia.org/wiki/MurmurHash#MurmurHash3 */
+static inline uint32_t murmur_32_scramble(uint32_t k)
+{
+    k *= 0xcc9e2d51;
+    k = (k << 15) | (k >> 17);
+    k *= 0x1b873593;
+    return k;
+}
+
+/* See: https://en.wikipedia.org/wiki/MurmurHash#MurmurHash3 */
+static uint32_t murmur3_32(uint8_t const * key, size_t len, uint32_t seed)
+{
+    uint32_t h = seed;
+    uint32_t k;
+    /* Read in groups of 4. */
+    for (size_t i = len >> 2; i; i--)
+    {
+        k = htole32(*(uint32_t *)key);
+        key += sizeof(uint32_t);
+        h ^= murmur_32_scramble(k);
+        h = (h << 13) | (h >> 19);
+        h = h * 5 + 0xe6546b64;
+    }
+    /* Read the rest. */
+    k = 0;
+    for (size_t i = len & 3; i; i--)
+    {
+        k <<= 8;
+        k |= key[i - 1];
+    }
+    // A swap is *not* necessary here because the preceding loop already
+    // places the low bytes in the low places according to whatever endianness
     // we use. Swaps only apply when the memory is copied in a chunk.
     h ^= murmur_32_scramble(k);
     /* Finalize. */
@@ -2247,850 +4459,1866 @@ static uint32_t murmur3_32(uint8_t const * key, size_t len, uint32_t seed)
     return h;
 }
 
-static uint32_t calculate_ndpi_flow_struct_hash(struct ndpi_flow_struct const * const ndpi_flow)
+static uint32_t calculate_ndpi_flow_struct_hash(struct ndpi_flow_struct const * const ndpi_flow)
+{
+    /*
+     * This is a kludge, but necessary for now as I do not want to spam nDPIsrvd and clients
+     * with the same detection json string over and over again.
+     * So we are building a hash over the more "stable" parts of the ndpi flow struct.
+     * Stable in terms of they should only change if the detection changes for whatever reason.
+     * At the time of writing, nDPI has no API function to check if the detection changed
+     * or has some new information available. This is far from perfect.
+     */
+    uint32_t hash = murmur3_32((uint8_t const *)&ndpi_flow->protos, sizeof(ndpi_flow->protos), nDPId_FLOW_STRUCT_SEED);
+    hash += ndpi_flow->category;
+    hash += ndpi_flow->risk;
+
+    const size_t protocol_bitmask_size = sizeof(ndpi_flow->src->detected_protocol_bitmask.fds_bits) /
+                                         sizeof(ndpi_flow->src->detected_protocol_bitmask.fds_bits[0]);
+    for (size_t i = 0; i < protocol_bitmask_size; ++i)
+    {
+        hash += ndpi_flow->src->detected_protocol_bitmask.fds_bits[i];
+        hash += ndpi_flow->dst->detected_protocol_bitmask.fds_bits[i];
+    }
+
+    /* FIXME: Adding the first character and the length of the host/server name is not stable, but seems to work. */
+    hash += ndpi_flow->host_server_name[0];
+    hash += strnlen((const char *)ndpi_flow->host_server_name, sizeof(ndpi_flow->host_server_name));
+
+    return hash;
+}
+
+#define SNAP 0xaa
+/* mask for FCF */
+#define WIFI_DATA 0x2                    /* 0000 0010 */
+#define FCF_TYPE(fc) (((fc) >> 2) & 0x3) /* 0000 0011 = 0x3 */
+#define FCF_TO_DS(fc) ((fc)&0x0100)
+#define FCF_FROM_DS(fc) ((fc)&0x0200)
+/* mask for Bad FCF presence */
+#define BAD_FCS 0x50 /* 0101 0000 */
+static int process_datalink_layer(struct nDPId_reader_thread * const reader_thread,
+                                  struct pcap_pkthdr const * const header,
+                                  uint8_t const * const packet,
+                                  uint16_t * ip_offset,
+                                  uint16_t * layer3_type)
+{
+    const uint16_t eth_offset = 0;
+    const int datalink_type = get_datalink_type(reader_thread);
+    const struct ndpi_ethhdr * ethernet;
+
+    switch (datalink_type)
+    {
+        case DLT_NULL:
+        {
+            uint32_t dlt_hdr = ntohl(*((uint32_t *)&packet[eth_offset]));
+
+            if (dlt_hdr == 0x00000002)
+            {
+                *layer3_type = ETH_P_IP;
+            }
+            else if (dlt_hdr == 0x00000024 || dlt_hdr == 0x00000028 || dlt_hdr == 0x00000030)
+            {
+                *layer3_type = ETH_P_IPV6;
+            }
+            else
+            {
+                jsonize_packet_event(reader_thread, header, packet, 0, 0, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
+                jsonize_basic_eventf(reader_thread,
+                                     UNKNOWN_DATALINK_LAYER,
+                                     "%s%u%s%u",
+                                     "datalink",
+                                     datalink_type,
+                                     "header",
+                                     ntohl(*((uint32_t *)&packet[eth_offset])));
+                return 1;
+            }
+            *ip_offset = sizeof(dlt_hdr) + eth_offset;
+            break;
+        }
+        case DLT_PPP_SERIAL:
+        {
+            if (header->len < sizeof(struct ndpi_chdlc))
+            {
+                jsonize_packet_event(reader_thread, header, packet, 0, 0, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
+                jsonize_basic_eventf(reader_thread, PACKET_TOO_SHORT, NULL);
+                return 1;
+            }
+
+            struct ndpi_chdlc const * const chdlc = (struct ndpi_chdlc const * const) & packet[eth_offset];
+            *ip_offset = sizeof(struct ndpi_chdlc);
+            *layer3_type = ntohs(chdlc->proto_code);
+            break;
+        }
+        case DLT_C_HDLC:
+        case DLT_PPP:
+            if (header->len < sizeof(struct ndpi_chdlc))
+            {
+                jsonize_packet_event(reader_thread, header, packet, 0, 0, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
+                jsonize_basic_eventf(reader_thread, PACKET_TOO_SHORT, NULL);
+                return 1;
+            }
+
+            if (packet[0] == 0x0f || packet[0] == 0x8f)
+            {
+                struct ndpi_chdlc const * const chdlc = (struct ndpi_chdlc const * const) & packet[eth_offset];
+                *ip_offset = sizeof(struct ndpi_chdlc); /* CHDLC_OFF = 4 */
+                *layer3_type = ntohs(chdlc->proto_code);
+            }
+            else
+            {
+                *ip_offset = 2;
+                *layer3_type = ntohs(*((u_int16_t *)&packet[eth_offset]));
+            }
+            break;
+        case DLT_LINUX_SLL:
+            if (header->len < 16)
+            {
+                jsonize_packet_event(reader_thread, header, packet, 0, 0, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
+                jsonize_basic_eventf(reader_thread, PACKET_TOO_SHORT, NULL);
+                return 1;
+            }
+
+            *layer3_type = (packet[eth_offset + 14] << 8) + packet[eth_offset + 15];
+            *ip_offset = 16 + eth_offset;
+            break;
+        case DLT_IEEE802_11_RADIO:
+        {
+            if (header->len < sizeof(struct ndpi_radiotap_header))
+            {
+                jsonize_packet_event(reader_thread, header, packet, 0, 0, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
+                jsonize_basic_eventf(reader_thread, PACKET_TOO_SHORT, NULL);
+                return 1;
+            }
+
+            struct ndpi_radiotap_header const * const radiotap =
+                (struct ndpi_radiotap_header const * const) & packet[eth_offset];
+            uint16_t radio_len = radiotap->len;
+
+            /* Check Bad FCS presence */
+            if ((radiotap->flags & BAD_FCS) == BAD_FCS)
+            {
+                jsonize_packet_event(reader_thread, header, packet, 0, 0, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
+                jsonize_basic_eventf(reader_thread, PACKET_HEADER_INVALID, NULL);
+                return 1;
+            }
+
+            if (header->caplen < (eth_offset + radio_len + sizeof(struct ndpi_wifi_header)))
+            {
+                jsonize_packet_event(reader_thread, header, packet, 0, 0, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
+                jsonize_basic_eventf(reader_thread, PACKET_TOO_SHORT, NULL);
+                return 1;
+            }
+
+            /* Calculate 802.11 header length (variable) */
+            struct ndpi_wifi_header const * const wifi =
+                (struct ndpi_wifi_header const * const)(packet + eth_offset + radio_len);
+            uint16_t fc = wifi->fc;
+            int wifi_len = 0;
+
+            /* check wifi data presence */
+            if (FCF_TYPE(fc) == WIFI_DATA)
+            {
+                if ((FCF_TO_DS(fc) && FCF_FROM_DS(fc) == 0x0) || (FCF_TO_DS(fc) == 0x0 && FCF_FROM_DS(fc)))
+                {
+                    wifi_len = 26; /* + 4 byte fcs */
+                }
+            }
+            else
+            {
+                /* no data frames */
+                break;
+            }
+
+            /* Check ether_type from LLC */
+            if (header->caplen < (eth_offset + wifi_len + radio_len + sizeof(struct ndpi_llc_header_snap)))
+            {
+                return 1;
+            }
+
+            struct ndpi_llc_header_snap const * const llc =
+                (struct ndpi_llc_header_snap const * const)(packet + eth_offset + wifi_len + radio_len);
+            if (llc->dsap == SNAP)
+            {
+                *layer3_type = ntohs(llc->snap.proto_ID);
+            }
+
+            /* Set IP header offset */
+            *ip_offset = wifi_len + radio_len + sizeof(struct ndpi_llc_header_snap) + eth_offset;
+            break;
+        }
+        case DLT_RAW:
+            jsonize_packet_event(reader_thread, header, packet, 0, 0, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
+            jsonize_basic_eventf(reader_thread, PACKET_TYPE_UNKNOWN, "%s%u", "type", DLT_RAW);
+            return 1;
+        case DLT_EN10MB:
+            if (header->len < sizeof(struct ndpi_ethhdr))
+            {
+                jsonize_packet_event(reader_thread, header, packet, 0, 0, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
+                jsonize_basic_eventf(reader_thread, PACKET_TOO_SHORT, NULL);
+                return 1;
+            }
+
+            ethernet = (struct ndpi_ethhdr *)&packet[eth_offset];
+            *ip_offset = sizeof(struct ndpi_ethhdr) + eth_offset;
+            *layer3_type = ntohs(ethernet->h_proto);
+            switch (*layer3_type)
+            {
+                case ETH_P_IP: /* IPv4 */
+                    if (header->len < sizeof(struct ndpi_ethhdr) + sizeof(struct ndpi_iphdr))
+                    {
+                        jsonize_packet_event(
+                            reader_thread, header, packet, *layer3_type, *ip_offset, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
+                        jsonize_basic_eventf(reader_thread, IP4_PACKET_TOO_SHORT, NULL);
+                        return 1;
+                    }
+                    break;
+                case ETH_P_IPV6: /* IPV6 */
+                    if (header->len < sizeof(struct ndpi_ethhdr) + sizeof(struct ndpi_ipv6hdr))
+                    {
+                        jsonize_packet_event(
+                            reader_thread, header, packet, *layer3_type, *ip_offset, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
+                        jsonize_basic_eventf(reader_thread, IP6_PACKET_TOO_SHORT, NULL);
+                        return 1;
+                    }
+                    break;
+                case ETH_P_ARP: /* ARP */
+                    return 1;
+                default:
+                    jsonize_packet_event(
+                        reader_thread, header, packet, *layer3_type, *ip_offset, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
+                    jsonize_basic_eventf(reader_thread, PACKET_TYPE_UNKNOWN, "%s%u", "type", *layer3_type);
+                    return 1;
+            }
+            break;
+        case DLT_IPV4:
+            *layer3_type = ETH_P_IP;
+            *ip_offset = 0;
+            break;
+        case DLT_IPV6:
+            *layer3_type = ETH_P_IPV6;
+            *ip_offset = 0;
+            break;
+        default:
+            jsonize_packet_event(reader_thread, header, packet, 0, 0, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
+            jsonize_basic_eventf(reader_thread, UNKNOWN_DATALINK_LAYER, "%s%u", "datalink", datalink_type);
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Flow ids are leased from `global_flow_id' in blocks, so reader threads do not contend on it for every new flow.
+ * Ids are unique per nDPId instance and increase within a reader thread, but are not ordered across threads.
+ * An ordered replay interleaves the ids of all reader threads instead, so they do not depend on thread scheduling.
+ */
+static uint64_t get_next_flow_id(struct nDPId_reader_thread * const reader_thread)
+{
+    if (nDPId_options.ordered_replay != 0)
+    {
+        if (reader_thread->flow_id_next == 0)
+        {
+            reader_thread->flow_id_next = reader_thread->array_index + 1;
+        }
+        reader_thread->flow_id_next += nDPId_options.reader_thread_count;
+        return reader_thread->flow_id_next - nDPId_options.reader_thread_count;
+    }
+
+    if (reader_thread->flow_id_next == reader_thread->flow_id_end)
+    {
+        reader_thread->flow_id_next = __sync_fetch_and_add(&global_flow_id, nDPId_FLOW_ID_BLOCK_SIZE);
+        reader_thread->flow_id_end = reader_thread->flow_id_next + nDPId_FLOW_ID_BLOCK_SIZE;
+    }
+
+    return reader_thread->flow_id_next++;
+}
+
+static struct nDPId_flow_basic * add_new_flow(struct nDPId_workflow * const workflow,
+                                              struct nDPId_flow_basic * orig_flow_basic,
+                                              enum nDPId_flow_type type)
+{
+    switch (type)
+    {
+        case FT_UNKNOWN:
+        case FT_FINISHED: // do not allocate something for FT_FINISHED as we are re-using memory allocated by FT_INFO
+            return NULL;
+
+        case FT_SKIPPED:
+        case FT_INFO:
+            break;
+    }
+
+    if (workflow->cur_active_flows == workflow->max_active_flows)
+    {
+        return NULL;
+    }
+
+    uint32_t const cold_index = workflow->flows_free[workflow->max_active_flows - workflow->cur_active_flows - 1];
+    struct nDPId_flow_basic * const flow_basic = &workflow->flows_basic[cold_index];
+
+    *flow_basic = *orig_flow_basic;
+    flow_basic->type = type;
+    flow_basic->cold_index = cold_index;
+    memset(&workflow->flows_extended[cold_index], 0, sizeof(workflow->flows_extended[cold_index]));
+    memset(&workflow->flows_info[cold_index], 0, sizeof(workflow->flows_info[cold_index]));
+    insert_flow(workflow, flow_basic);
+
+    workflow->cur_active_flows++;
+    if (type == FT_SKIPPED)
+    {
+        workflow->total_skipped_flows++;
+    }
+
+    return flow_basic;
+}
+
+static uint64_t get_packet_time(struct pcap_pkthdr const * const header)
+{
+    return ((uint64_t)header->ts.tv_sec) * nDPId_options.tick_resolution +
+           header->ts.tv_usec / (1000000 / nDPId_options.tick_resolution);
+}
+
+/*
+ * advance_clock() does nothing but updating `last_time' for packets up to this time.
+ * Has to be kept in sync with the checks called by advance_clock(), see tick_replay_clock().
+ */
+static uint64_t get_clock_deadline(struct nDPId_reader_thread const * const reader_thread)
+{
+    struct nDPId_workflow const * const workflow = reader_thread->workflow;
+    struct nDPId_thread_stats const * const stats = &reader_thread->stats;
+    uint64_t deadline = workflow->last_idle_scan_time + nDPId_options.idle_scan_period;
+
+    if (nDPId_options.stats_sockpath != NULL && stats->last_pcap_stats_time + nDPId_options.tick_resolution < deadline)
+    {
+        deadline = stats->last_pcap_stats_time + nDPId_options.tick_resolution;
+    }
+    if (nDPId_options.status_interval != 0 && stats->last_status_time + nDPId_options.status_interval < deadline)
+    {
+        deadline = stats->last_status_time + nDPId_options.status_interval;
+    }
+#ifdef ENABLE_MEMORY_PROFILING
+    if (workflow->last_memory_usage_log_time + nDPId_options.memory_profiling_print_every < deadline)
+    {
+        deadline = workflow->last_memory_usage_log_time + nDPId_options.memory_profiling_print_every;
+    }
+#endif
+
+    return deadline;
+}
+
+/*
+ * Runs the idle flow scan and the status checks with the timestamp of a captured packet.
+ * Called without counting the packet for packets of other reader threads during a replay, see tick_replay_clock().
+ */
+static void advance_clock(struct nDPId_reader_thread * const reader_thread, struct pcap_pkthdr const * const header)
+{
+    struct nDPId_workflow * const workflow = reader_thread->workflow;
+
+    workflow->last_time = get_packet_time(header);
+
+    check_for_idle_flows(reader_thread);
+    check_for_status(reader_thread, workflow->last_time);
+#ifdef ENABLE_MEMORY_PROFILING
+    log_memory_usage(reader_thread);
+#endif
+}
+
+/*
+ * Has to be called for every captured packet before any other processing is done.
+ */
+static void begin_packet_processing(struct nDPId_reader_thread * const reader_thread,
+                                    struct pcap_pkthdr const * const header)
+{
+    reader_thread->workflow->packets_captured++;
+    advance_clock(reader_thread, header);
+}
+
+/*
+ * Parses all packet headers up to layer4 and calculates the flow hash.
+ * Returns 0 if the packet belongs to a flow handled by this thread.
+ */
+static int process_packet_headers(struct nDPId_reader_thread * const reader_thread,
+                                  struct pcap_pkthdr const * const header,
+                                  uint8_t const * const packet,
+                                  struct nDPId_packet_headers * const hdrs)
+{
+    struct nDPId_flow_basic * const flow_basic = &hdrs->flow_basic;
+
+    const struct ndpi_iphdr * ip;
+    struct ndpi_ipv6hdr * ip6;
+
+    uint16_t ip_offset = 0;
+    uint16_t ip_size;
+
+    const uint8_t * l4_ptr = NULL;
+    uint16_t l4_len = 0;
+    uint16_t l4_payload_len = 0;
+
+    uint16_t type = 0;
+    int thread_index = nDPId_THREAD_DISTRIBUTION_SEED; // generated with `dd if=/dev/random bs=1024 count=1 |& hd'
+
+    memset(flow_basic, 0, sizeof(*flow_basic));
+    hdrs->thread_index = -1;
+
+    LATENCY_SAMPLE_BEGIN(datalink_start);
+    int const datalink_result = process_datalink_layer(reader_thread, header, packet, &ip_offset, &type);
+    if (reader_thread->skip_latency_samples == 0)
+    {
+        LATENCY_SAMPLE_END(reader_thread, LATENCY_STAGE_DATALINK, datalink_start);
+    }
+    if (datalink_result != 0)
+    {
+        return 1;
+    }
+
+    if (type == ETH_P_IP)
+    {
+        ip = (struct ndpi_iphdr *)&packet[ip_offset];
+        ip6 = NULL;
+    }
+    else if (type == ETH_P_IPV6)
+    {
+        ip = NULL;
+        ip6 = (struct ndpi_ipv6hdr *)&packet[ip_offset];
+    }
+    else
+    {
+        jsonize_packet_event(reader_thread, header, packet, type, ip_offset, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
+        jsonize_basic_eventf(reader_thread, UNKNOWN_L3_PROTOCOL, "%s%u", "protocol", type);
+        return 1;
+    }
+    ip_size = header->len - ip_offset;
+
+    if (type == ETH_P_IP && header->len >= ip_offset)
+    {
+        if (header->caplen < header->len)
+        {
+            jsonize_packet_event(reader_thread, header, packet, type, ip_offset, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
+            jsonize_basic_eventf(reader_thread,
+                                 CAPTURE_SIZE_SMALLER_THAN_PACKET_SIZE,
+                                 "%s%u %s%u",
+                                 "caplen",
+                                 header->caplen,
+                                 "len",
+                                 header->len);
+        }
+    }
+
+    /* process layer3 e.g. IPv4 / IPv6 */
+    if (ip != NULL && ip->version == 4)
+    {
+        if (ip_size < sizeof(*ip))
+        {
+            jsonize_packet_event(reader_thread, header, packet, type, ip_offset, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
+            jsonize_basic_eventf(
+                reader_thread, IP4_SIZE_SMALLER_THAN_HEADER, "%s%u %s%zu", "ip_size", ip_size, "expected", sizeof(*ip));
+            return 1;
+        }
+
+        flow_basic->l3_type = L3_IP;
+
+        if (ndpi_detection_get_l4(
+                (uint8_t *)ip, ip_size, &l4_ptr, &l4_len, &flow_basic->l4_protocol, NDPI_DETECTION_ONLY_IPV4) != 0)
+        {
+            jsonize_packet_event(reader_thread, header, packet, type, ip_offset, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
+            jsonize_basic_eventf(
+                reader_thread, IP4_L4_PAYLOAD_DETECTION_FAILED, "%s%zu", "l4_data_len", ip_size - sizeof(*ip));
+            return 1;
+        }
+
+        flow_basic->src.v4.ip = ip->saddr;
+        flow_basic->dst.v4.ip = ip->daddr;
+        uint32_t min_addr = (flow_basic->src.v4.ip > flow_basic->dst.v4.ip ? flow_basic->dst.v4.ip : flow_basic->src.v4.ip);
+        thread_index = min_addr + ip->protocol;
+    }
+    else if (ip6 != NULL)
+    {
+        if (ip_size < sizeof(ip6->ip6_hdr))
+        {
+            jsonize_packet_event(reader_thread, header, packet, type, ip_offset, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
+            jsonize_basic_eventf(reader_thread,
+                                 IP6_SIZE_SMALLER_THAN_HEADER,
+                                 "%s%u %s%zu",
+                                 "ip_size",
+                                 ip_size,
+                                 "expected",
+                                 sizeof(ip6->ip6_hdr));
+            return 1;
+        }
+
+        flow_basic->l3_type = L3_IP6;
+        if (ndpi_detection_get_l4(
+                (uint8_t *)ip6, ip_size, &l4_ptr, &l4_len, &flow_basic->l4_protocol, NDPI_DETECTION_ONLY_IPV6) != 0)
+        {
+            jsonize_packet_event(reader_thread, header, packet, type, ip_offset, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
+            jsonize_basic_eventf(
+                reader_thread, IP6_L4_PAYLOAD_DETECTION_FAILED, "%s%zu", "l4_data_len", ip_size - sizeof(*ip));
+            return 1;
+        }
+
+        flow_basic->src.v6.ip[0] = ip6->ip6_src.u6_addr.u6_addr64[0];
+        flow_basic->src.v6.ip[1] = ip6->ip6_src.u6_addr.u6_addr64[1];
+        flow_basic->dst.v6.ip[0] = ip6->ip6_dst.u6_addr.u6_addr64[0];
+        flow_basic->dst.v6.ip[1] = ip6->ip6_dst.u6_addr.u6_addr64[1];
+        uint64_t min_addr[2];
+        if (flow_basic->src.v6.ip[0] > flow_basic->dst.v6.ip[0] && flow_basic->src.v6.ip[1] > flow_basic->dst.v6.ip[1])
+        {
+            min_addr[0] = flow_basic->dst.v6.ip[0];
+            min_addr[1] = flow_basic->dst.v6.ip[0];
+        }
+        else
+        {
+            min_addr[0] = flow_basic->src.v6.ip[0];
+            min_addr[1] = flow_basic->src.v6.ip[0];
+        }
+        thread_index = min_addr[0] + min_addr[1] + ip6->ip6_hdr.ip6_un1_nxt;
+    }
+    else
+    {
+        jsonize_packet_event(reader_thread, header, packet, type, ip_offset, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
+        jsonize_basic_eventf(reader_thread, UNKNOWN_L3_PROTOCOL, "%s%u", "protocol", type);
+        return 1;
+    }
+
+    /* process layer4 e.g. TCP / UDP */
+    if (flow_basic->l4_protocol == IPPROTO_TCP)
+    {
+        const struct ndpi_tcphdr * tcp;
+
+        if (header->len < (l4_ptr - packet) + sizeof(struct ndpi_tcphdr))
+        {
+            jsonize_packet_event(
+                reader_thread, header, packet, type, ip_offset, (l4_ptr - packet), l4_len, NULL, PACKET_EVENT_PAYLOAD);
+            jsonize_basic_eventf(reader_thread,
+                                 TCP_PACKET_TOO_SHORT,
+                                 "%s%u %s%zu",
+                                 "header_len",
+                                 header->len,
+                                 "expected",
+                                 (l4_ptr - packet) + sizeof(struct ndpi_tcphdr));
+            return 1;
+        }
+        tcp = (struct ndpi_tcphdr *)l4_ptr;
+        l4_payload_len = ndpi_max(0, l4_len - 4 * tcp->doff);
+        flow_basic->tcp_fin_rst_seen = (tcp->fin == 1 || tcp->rst == 1 ? 1 : 0);
+        flow_basic->tcp_is_midstream_flow = (tcp->syn == 0 ? 1 : 0);
+        flow_basic->src_port = ntohs(tcp->source);
+        flow_basic->dst_port = ntohs(tcp->dest);
+    }
+    else if (flow_basic->l4_protocol == IPPROTO_UDP)
+    {
+        const struct ndpi_udphdr * udp;
+
+        if (header->len < (l4_ptr - packet) + sizeof(struct ndpi_udphdr))
+        {
+            jsonize_packet_event(
+                reader_thread, header, packet, type, ip_offset, (l4_ptr - packet), l4_len, NULL, PACKET_EVENT_PAYLOAD);
+            jsonize_basic_eventf(reader_thread,
+                                 UDP_PACKET_TOO_SHORT,
+                                 "%s%u %s%zu",
+                                 "header_len",
+                                 header->len,
+                                 "expected",
+                                 (l4_ptr - packet) + sizeof(struct ndpi_udphdr));
+            return 1;
+        }
+        udp = (struct ndpi_udphdr *)l4_ptr;
+        l4_payload_len = (l4_len > sizeof(struct ndpi_udphdr)) ? l4_len - sizeof(struct ndpi_udphdr) : 0;
+        flow_basic->src_port = ntohs(udp->source);
+        flow_basic->dst_port = ntohs(udp->dest);
+    }
+
+    /* distribute flows to threads while keeping stability (same flow goes always to same thread) */
+    thread_index += (flow_basic->src_port < flow_basic->dst_port ? flow_basic->dst_port : flow_basic->src_port);
+    thread_index %= nDPId_options.reader_thread_count;
+    hdrs->thread_index = thread_index;
+    if (thread_index != reader_thread->array_index && reader_thread->classify_packets == 0)
+    {
+        return 1;
+    }
+
+    /* calculate flow hash for the flow table lookup/insert */
+    switch (flow_basic->l3_type)
+    {
+        case L3_IP:
+            if (ndpi_flowv4_flow_hash(flow_basic->l4_protocol,
+                                      flow_basic->src.v4.ip,
+                                      flow_basic->dst.v4.ip,
+                                      flow_basic->src_port,
+                                      flow_basic->dst_port,
+                                      0,
+                                      0,
+                                      (uint8_t *)&flow_basic->hashval,
+                                      sizeof(flow_basic->hashval)) != 0)
+            {
+                flow_basic->hashval = flow_basic->src.v4.ip + flow_basic->dst.v4.ip; // fallback
+            }
+            break;
+        case L3_IP6:
+            if (ndpi_flowv6_flow_hash(flow_basic->l4_protocol,
+                                      &ip6->ip6_src,
+                                      &ip6->ip6_dst,
+                                      flow_basic->src_port,
+                                      flow_basic->dst_port,
+                                      0,
+                                      0,
+                                      (uint8_t *)&flow_basic->hashval,
+                                      sizeof(flow_basic->hashval)) != 0)
+            {
+                flow_basic->hashval = flow_basic->src.v6.ip[0] + flow_basic->src.v6.ip[1];
+                flow_basic->hashval += flow_basic->dst.v6.ip[0] + flow_basic->dst.v6.ip[1];
+            }
+            break;
+    }
+    flow_basic->hashval += flow_basic->l4_protocol + flow_basic->src_port + flow_basic->dst_port;
+
+    flow_basic->hashed_index = flow_basic->hashval % reader_thread->workflow->max_active_flows;
+    hdrs->ip = ip;
+    hdrs->ip6 = ip6;
+    hdrs->l4_ptr = l4_ptr;
+    hdrs->type = type;
+    hdrs->ip_offset = ip_offset;
+    hdrs->ip_size = ip_size;
+    hdrs->l4_len = l4_len;
+    hdrs->l4_payload_len = l4_payload_len;
+
+    return 0;
+}
+
+static void process_packet_flow(struct nDPId_reader_thread * const reader_thread,
+                                struct pcap_pkthdr const * const header,
+                                uint8_t const * const packet,
+                                struct nDPId_packet_headers * const hdrs)
+{
+    struct nDPId_workflow * const workflow = reader_thread->workflow;
+    struct nDPId_flow_basic * const flow_basic = &hdrs->flow_basic;
+    uint64_t const time_ms = workflow->last_time;
+
+    struct nDPId_flow_basic * flow_basic_to_process;
+    struct nDPId_flow_extended * flow_ext;
+    struct nDPId_flow_info * flow_to_process;
+
+    uint8_t direction_changed = 0;
+    uint8_t is_new_flow = 0;
+    struct ndpi_id_struct * ndpi_src;
+    struct ndpi_id_struct * ndpi_dst;
+
+    const struct ndpi_iphdr * const ip = hdrs->ip;
+    struct ndpi_ipv6hdr * const ip6 = hdrs->ip6;
+    uint16_t const ip_offset = hdrs->ip_offset;
+    uint16_t const ip_size = hdrs->ip_size;
+
+    const uint8_t * const l4_ptr = hdrs->l4_ptr;
+    uint16_t const l4_len = hdrs->l4_len;
+    uint16_t const l4_payload_len = hdrs->l4_payload_len;
+
+    uint16_t const type = hdrs->type;
+
+    workflow->packets_processed++;
+    workflow->total_l4_data_len += l4_len;
+
+    LATENCY_SAMPLE_BEGIN(flow_lookup_start);
+    flow_basic_to_process = find_flow(reader_thread, flow_basic, &direction_changed);
+    LATENCY_SAMPLE_END(reader_thread, LATENCY_STAGE_FLOW_LOOKUP, flow_lookup_start);
+
+    if (flow_basic_to_process == NULL)
+    {
+        /* flow not found in either direction, must be new or midstream */
+
+        union nDPId_ip const * netmask = NULL;
+        union nDPId_ip const * subnet = NULL;
+        switch (flow_basic->l3_type)
+        {
+            case L3_IP:
+                netmask = &nDPId_options.pcap_dev_netmask4;
+                subnet = &nDPId_options.pcap_dev_subnet4;
+                break;
+            case L3_IP6:
+                netmask = &nDPId_options.pcap_dev_netmask6;
+                subnet = &nDPId_options.pcap_dev_subnet6;
+                break;
+        }
+        if (nDPId_options.process_internal_initial_direction != 0 && flow_basic->tcp_is_midstream_flow == 0)
+        {
+            if (is_ip_in_subnet(&flow_basic->src, netmask, subnet, flow_basic->l3_type) == 0)
+            {
+                if (add_new_flow(workflow, flow_basic, FT_SKIPPED) == NULL)
+                {
+                    jsonize_packet_event(reader_thread,
+                                         header,
+                                         packet,
+                                         type,
+                                         ip_offset,
+                                         (l4_ptr - packet),
+                                         l4_len,
+                                         NULL,
+                                         PACKET_EVENT_PAYLOAD);
+                    jsonize_basic_eventf(reader_thread,
+                                         FLOW_MEMORY_ALLOCATION_FAILED,
+                                         "%s%zu",
+                                         "size",
+                                         sizeof(struct nDPId_flow_basic));
+                }
+                return;
+            }
+        }
+        else if (nDPId_options.process_external_initial_direction != 0 && flow_basic->tcp_is_midstream_flow == 0)
+        {
+            if (is_ip_in_subnet(&flow_basic->src, netmask, subnet, flow_basic->l3_type) != 0)
+            {
+                if (add_new_flow(workflow, flow_basic, FT_SKIPPED) == NULL)
+                {
+                    jsonize_packet_event(reader_thread,
+                                         header,
+                                         packet,
+                                         type,
+                                         ip_offset,
+                                         (l4_ptr - packet),
+                                         l4_len,
+                                         NULL,
+                                         PACKET_EVENT_PAYLOAD);
+                    jsonize_basic_eventf(reader_thread,
+                                         FLOW_MEMORY_ALLOCATION_FAILED,
+                                         "%s%zu",
+                                         "size",
+                                         sizeof(struct nDPId_flow_basic));
+                }
+                return;
+            }
+        }
+
+        if (workflow->cur_active_flows == workflow->max_active_flows)
+        {
+            jsonize_packet_event(
+                reader_thread, header, packet, type, ip_offset, (l4_ptr - packet), l4_len, NULL, PACKET_EVENT_PAYLOAD);
+            jsonize_basic_eventf(reader_thread,
+                                 MAX_FLOW_TO_TRACK,
+                                 "%s%llu %s%llu %s%llu",
+                                 "current_active",
+                                 workflow->max_active_flows,
+                                 "current_idle",
+                                 workflow->cur_idle_flows,
+                                 "max_active",
+                                 workflow->max_active_flows);
+            return;
+        }
+
+        LATENCY_SAMPLE_BEGIN(flow_insert_start);
+        flow_basic_to_process = add_new_flow(workflow, flow_basic, FT_INFO);
+        LATENCY_SAMPLE_END(reader_thread, LATENCY_STAGE_FLOW_INSERT, flow_insert_start);
+        if (flow_basic_to_process == NULL)
+        {
+            jsonize_packet_event(
+                reader_thread, header, packet, type, ip_offset, (l4_ptr - packet), l4_len, NULL, PACKET_EVENT_PAYLOAD);
+            jsonize_basic_eventf(
+                reader_thread, FLOW_MEMORY_ALLOCATION_FAILED, "%s%zu", "size", sizeof(*flow_basic_to_process));
+            return;
+        }
+        flow_ext = get_flow_extended(workflow, flow_basic_to_process);
+        flow_to_process = get_flow_info(workflow, flow_basic_to_process);
+
+        workflow->total_active_flows++;
+        flow_ext->flow_id = get_next_flow_id(reader_thread);
+
+        if (alloc_detection_data(flow_to_process) != 0)
+        {
+            jsonize_packet_event(
+                reader_thread, header, packet, type, ip_offset, (l4_ptr - packet), l4_len, NULL, PACKET_EVENT_PAYLOAD);
+            jsonize_basic_eventf(reader_thread,
+                                 FLOW_MEMORY_ALLOCATION_FAILED,
+                                 "%s%zu",
+                                 "size",
+                                 sizeof(*flow_to_process->detection_data));
+            return;
+        }
+
+        ndpi_src = &flow_to_process->detection_data->src;
+        ndpi_dst = &flow_to_process->detection_data->dst;
+
+        is_new_flow = 1;
+    }
+    else
+    {
+        /* flow already exists in the flow table */
+
+        /* Update last seen timestamp for timeout handling. */
+        flow_basic_to_process->last_seen = time_ms;
+        /* TCP-FIN: indicates that at least one side wants to end the connection (timeout handling as well) */
+        if (flow_basic->tcp_fin_rst_seen != 0)
+        {
+            flow_basic_to_process->tcp_fin_rst_seen = 1;
+        }
+
+        switch (flow_basic_to_process->type)
+        {
+            case FT_UNKNOWN:
+                return;
+            case FT_SKIPPED:
+                return;
+            case FT_FINISHED:
+                return;
+            case FT_INFO:
+                break;
+        }
+        flow_ext = get_flow_extended(workflow, flow_basic_to_process);
+        flow_to_process = get_flow_info(workflow, flow_basic_to_process);
+
+#ifdef ENABLE_ZLIB
+        if (nDPId_options.enable_zlib_compression != 0 && flow_to_process->detection_data_compressed_size > 0)
+        {
+            int ret = detection_data_inflate(flow_to_process);
+            if (ret <= 0)
+            {
+                syslog(LOG_DAEMON | LOG_ERR,
+                       "zLib decompression failed for existing flow %u with error code: %d",
+                       flow_ext->flow_id,
+                       ret);
+                return;
+            }
+        }
+#endif
+
+        if (direction_changed != 0)
+        {
+            ndpi_src = &flow_to_process->detection_data->dst;
+            ndpi_dst = &flow_to_process->detection_data->src;
+        }
+        else
+        {
+            ndpi_src = &flow_to_process->detection_data->src;
+            ndpi_dst = &flow_to_process->detection_data->dst;
+        }
+    }
+
+    flow_ext->packets_processed++;
+    flow_ext->total_l4_payload_len += l4_payload_len;
+    if (flow_ext->first_seen == 0)
+    {
+        flow_ext->first_seen = time_ms;
+    }
+    if (l4_payload_len > flow_ext->max_l4_payload_len)
+    {
+        flow_ext->max_l4_payload_len = l4_payload_len;
+    }
+    if (l4_payload_len < flow_ext->min_l4_payload_len)
+    {
+        flow_ext->min_l4_payload_len = l4_payload_len;
+    }
+
+    if (is_new_flow != 0)
+    {
+        flow_ext->max_l4_payload_len = l4_payload_len;
+        flow_ext->min_l4_payload_len = l4_payload_len;
+        jsonize_flow_event(reader_thread, flow_basic_to_process, FLOW_EVENT_NEW);
+    }
+
+    jsonize_packet_event(reader_thread,
+                         header,
+                         packet,
+                         type,
+                         ip_offset,
+                         (l4_ptr - packet),
+                         l4_len,
+                         flow_ext,
+                         PACKET_EVENT_PAYLOAD_FLOW);
+    capture_flow_packet(reader_thread, flow_basic_to_process, flow_ext, header, packet);
+
+    if (flow_to_process->detection_data->flow.num_processed_pkts == nDPId_options.max_packets_per_flow_to_process - 1)
+    {
+        if (flow_to_process->detection_completed != 0)
+        {
+            jsonize_flow_event(reader_thread, flow_basic_to_process, FLOW_EVENT_DETECTION_UPDATE);
+        }
+        else
+        {
+            /* last chance to guess something, better then nothing */
+            uint8_t protocol_was_guessed = 0;
+            flow_to_process->detection_data->guessed_l7_protocol = ndpi_detection_giveup(
+                workflow->ndpi_struct, &flow_to_process->detection_data->flow, 1, &protocol_was_guessed);
+            if (protocol_was_guessed != 0)
+            {
+                jsonize_flow_event(reader_thread, flow_basic_to_process, FLOW_EVENT_GUESSED);
+            }
+            else
+            {
+                jsonize_flow_event(reader_thread, flow_basic_to_process, FLOW_EVENT_NOT_DETECTED);
+            }
+        }
+    }
+
+    uint64_t const dpi_start_usec = get_stats_usec();
+    LATENCY_SAMPLE_BEGIN(dpi_start);
+    flow_to_process->detection_data->detected_l7_protocol =
+        ndpi_detection_process_packet(workflow->ndpi_struct,
+                                      &flow_to_process->detection_data->flow,
+                                      ip != NULL ? (uint8_t *)ip : (uint8_t *)ip6,
+                                      ip_size,
+                                      time_ms,
+                                      ndpi_src,
+                                      ndpi_dst);
+    LATENCY_SAMPLE_END(reader_thread, LATENCY_STAGE_DPI, dpi_start);
+    reader_thread->stats.dpi_usec += get_stats_usec() - dpi_start_usec;
+
+    if (ndpi_is_protocol_detected(workflow->ndpi_struct, flow_to_process->detection_data->detected_l7_protocol) != 0 &&
+        flow_to_process->detection_completed == 0)
+    {
+        flow_to_process->detection_completed = 1;
+        workflow->detected_flow_protocols++;
+        jsonize_flow_event(reader_thread, flow_basic_to_process, FLOW_EVENT_DETECTED);
+        flow_to_process->detection_data->last_ndpi_flow_struct_hash =
+            calculate_ndpi_flow_struct_hash(&flow_to_process->detection_data->flow);
+    }
+    else if (flow_to_process->detection_completed == 1)
+    {
+        uint32_t hash = calculate_ndpi_flow_struct_hash(&flow_to_process->detection_data->flow);
+        if (hash != flow_to_process->detection_data->last_ndpi_flow_struct_hash)
+        {
+            jsonize_flow_event(reader_thread, flow_basic_to_process, FLOW_EVENT_DETECTION_UPDATE);
+            flow_to_process->detection_data->last_ndpi_flow_struct_hash = hash;
+        }
+    }
+
+    if (flow_to_process->detection_data->flow.num_processed_pkts == nDPId_options.max_packets_per_flow_to_process)
+    {
+        free_detection_data(flow_to_process);
+        flow_basic_to_process->type = FT_FINISHED;
+    }
+#ifdef ENABLE_ZLIB
+    else if (nDPId_options.enable_zlib_compression != 0)
+    {
+        check_for_compressable_flows(reader_thread);
+    }
+#endif
+}
+
+static void ndpi_process_packet(uint8_t * const args,
+                                struct pcap_pkthdr const * const header,
+                                uint8_t const * const packet)
 {
-    /*
-     * This is a kludge, but necessary for now as I do not want to spam nDPIsrvd and clients
-     * with the same detection json string over and over again.
-     * So we are building a hash over the more "stable" parts of the ndpi flow struct.
-     * Stable in terms of they should only change if the detection changes for whatever reason.
-     * At the time of writing, nDPI has no API function to check if the detection changed
-     * or has some new information available. This is far from perfect.
-     */
-    uint32_t hash = murmur3_32((uint8_t const *)&ndpi_flow->protos, sizeof(ndpi_flow->protos), nDPId_FLOW_STRUCT_SEED);
-    hash += ndpi_flow->category;
-    hash += ndpi_flow->risk;
+    struct nDPId_reader_thread * const reader_thread = (struct nDPId_reader_thread *)args;
+    struct nDPId_packet_headers hdrs;
 
-    const size_t protocol_bitmask_size = sizeof(ndpi_flow->src->detected_protocol_bitmask.fds_bits) /
-                                         sizeof(ndpi_flow->src->detected_protocol_bitmask.fds_bits[0]);
-    for (size_t i = 0; i < protocol_bitmask_size; ++i)
+    if (reader_thread == NULL || reader_thread->workflow == NULL)
     {
-        hash += ndpi_flow->src->detected_protocol_bitmask.fds_bits[i];
-        hash += ndpi_flow->dst->detected_protocol_bitmask.fds_bits[i];
+        return;
     }
 
-    /* FIXME: Adding the first character and the length of the host/server name is not stable, but seems to work. */
-    hash += ndpi_flow->host_server_name[0];
-    hash += strnlen((const char *)ndpi_flow->host_server_name, sizeof(ndpi_flow->host_server_name));
-
-    return hash;
+    begin_packet_processing(reader_thread, header);
+    if (process_packet_headers(reader_thread, header, packet, &hdrs) != 0)
+    {
+        return;
+    }
+    process_packet_flow(reader_thread, header, packet, &hdrs);
 }
 
-#define SNAP 0xaa
-/* mask for FCF */
-#define WIFI_DATA 0x2                    /* 0000 0010 */
-#define FCF_TYPE(fc) (((fc) >> 2) & 0x3) /* 0000 0011 = 0x3 */
-#define FCF_TO_DS(fc) ((fc)&0x0100)
-#define FCF_FROM_DS(fc) ((fc)&0x0200)
-/* mask for Bad FCF presence */
-#define BAD_FCS 0x50 /* 0101 0000 */
-static int process_datalink_layer(struct nDPId_reader_thread * const reader_thread,
-                                  struct pcap_pkthdr const * const header,
-                                  uint8_t const * const packet,
-                                  uint16_t * ip_offset,
-                                  uint16_t * layer3_type)
+static void process_packet_batch(struct nDPId_reader_thread * const reader_thread)
 {
-    const uint16_t eth_offset = 0;
-    const int datalink_type = pcap_datalink(reader_thread->workflow->pcap_handle);
-    const struct ndpi_ethhdr * ethernet;
+    struct nDPId_workflow * const workflow = reader_thread->workflow;
+    size_t const used = reader_thread->packet_batch_used;
+    /* the packet which ended the batch early is not part of it, see `ordered-replay' */
+    uint64_t const ordered_seq = reader_thread->ordered_events.seq;
+    size_t i;
 
-    switch (datalink_type)
+    /*
+     * Parse all headers and calculate all flow hashes first, so the flow table buckets can be prefetched.
+     * Events are suppressed here and emitted later by replaying the header stage to keep them in capture order.
+     */
+    reader_thread->suppress_events = 1;
+    for (i = 0; i < used; ++i)
     {
-        case DLT_NULL:
-        {
-            uint32_t dlt_hdr = ntohl(*((uint32_t *)&packet[eth_offset]));
+        struct nDPId_packet_batch_entry * const entry = &reader_thread->packet_batch[i];
+        unsigned long long int const suppressed_events = reader_thread->suppressed_events;
 
-            if (dlt_hdr == 0x00000002)
-            {
-                *layer3_type = ETH_P_IP;
-            }
-            else if (dlt_hdr == 0x00000024 || dlt_hdr == 0x00000028 || dlt_hdr == 0x00000030)
-            {
-                *layer3_type = ETH_P_IPV6;
-            }
-            else
-            {
-                jsonize_packet_event(reader_thread, header, packet, 0, 0, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
-                jsonize_basic_eventf(reader_thread,
-                                     UNKNOWN_DATALINK_LAYER,
-                                     "%s%u%s%u",
-                                     "datalink",
-                                     datalink_type,
-                                     "header",
-                                     ntohl(*((uint32_t *)&packet[eth_offset])));
-                return 1;
-            }
-            *ip_offset = sizeof(dlt_hdr) + eth_offset;
-            break;
+        if (entry->packet == NULL)
+        {
+            entry->headers_result = 1;
+            entry->replay_headers = 0;
+            continue;
         }
-        case DLT_PPP_SERIAL:
+        if (entry->headers_parsed == 0)
         {
-            if (header->len < sizeof(struct ndpi_chdlc))
-            {
-                jsonize_packet_event(reader_thread, header, packet, 0, 0, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
-                jsonize_basic_eventf(reader_thread, PACKET_TOO_SHORT, NULL);
-                return 1;
-            }
-
-            struct ndpi_chdlc const * const chdlc = (struct ndpi_chdlc const * const) & packet[eth_offset];
-            *ip_offset = sizeof(struct ndpi_chdlc);
-            *layer3_type = ntohs(chdlc->proto_code);
-            break;
+            entry->headers_result =
+                process_packet_headers(reader_thread, &entry->header, entry->packet, &entry->headers);
+            entry->replay_headers = (suppressed_events != reader_thread->suppressed_events);
         }
-        case DLT_C_HDLC:
-        case DLT_PPP:
-            if (header->len < sizeof(struct ndpi_chdlc))
-            {
-                jsonize_packet_event(reader_thread, header, packet, 0, 0, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
-                jsonize_basic_eventf(reader_thread, PACKET_TOO_SHORT, NULL);
-                return 1;
-            }
+        if (entry->headers_result == 0)
+        {
+            __builtin_prefetch(
+                &workflow->flow_table[entry->headers.flow_basic.hashed_index * FLOW_TABLE_SLOTS_PER_BUCKET]);
+        }
+    }
+    reader_thread->suppress_events = 0;
 
-            if (packet[0] == 0x0f || packet[0] == 0x8f)
-            {
-                struct ndpi_chdlc const * const chdlc = (struct ndpi_chdlc const * const) & packet[eth_offset];
-                *ip_offset = sizeof(struct ndpi_chdlc); /* CHDLC_OFF = 4 */
-                *layer3_type = ntohs(chdlc->proto_code);
-            }
-            else
-            {
-                *ip_offset = 2;
-                *layer3_type = ntohs(*((u_int16_t *)&packet[eth_offset]));
-            }
-            break;
-        case DLT_LINUX_SLL:
-            if (header->len < 16)
-            {
-                jsonize_packet_event(reader_thread, header, packet, 0, 0, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
-                jsonize_basic_eventf(reader_thread, PACKET_TOO_SHORT, NULL);
-                return 1;
-            }
+    for (i = 0; i < used; ++i)
+    {
+        struct nDPId_packet_batch_entry const * const entry = &reader_thread->packet_batch[i];
 
-            *layer3_type = (packet[eth_offset + 14] << 8) + packet[eth_offset + 15];
-            *ip_offset = 16 + eth_offset;
-            break;
-        case DLT_IEEE802_11_RADIO:
+        if (entry->headers_result == 0)
         {
-            if (header->len < sizeof(struct ndpi_radiotap_header))
+            struct nDPId_flow_slot const * const slot =
+                &workflow->flow_table[entry->headers.flow_basic.hashed_index * FLOW_TABLE_SLOTS_PER_BUCKET];
+
+            /* the hot record of the first flow in the bucket, most buckets hold at most one flow */
+            if (slot->cold_index != FLOW_SLOT_EMPTY)
             {
-                jsonize_packet_event(reader_thread, header, packet, 0, 0, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
-                jsonize_basic_eventf(reader_thread, PACKET_TOO_SHORT, NULL);
-                return 1;
+                __builtin_prefetch(&workflow->flows_basic[slot->cold_index]);
             }
+        }
+    }
 
-            struct ndpi_radiotap_header const * const radiotap =
-                (struct ndpi_radiotap_header const * const) & packet[eth_offset];
-            uint16_t radio_len = radiotap->len;
+    for (i = 0; i < used; ++i)
+    {
+        struct nDPId_packet_batch_entry * const entry = &reader_thread->packet_batch[i];
 
-            /* Check Bad FCS presence */
-            if ((radiotap->flags & BAD_FCS) == BAD_FCS)
-            {
-                jsonize_packet_event(reader_thread, header, packet, 0, 0, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
-                jsonize_basic_eventf(reader_thread, PACKET_HEADER_INVALID, NULL);
-                return 1;
-            }
+        reader_thread->ordered_events.seq = entry->ordered_seq;
+        workflow->packets_captured += entry->packets_skipped;
+        if (entry->packet == NULL)
+        {
+            advance_clock(reader_thread, &entry->header);
+            continue;
+        }
+        begin_packet_processing(reader_thread, &entry->header);
+        if (entry->replay_headers != 0)
+        {
+            reader_thread->skip_latency_samples = 1;
+            entry->headers_result =
+                process_packet_headers(reader_thread, &entry->header, entry->packet, &entry->headers);
+            reader_thread->skip_latency_samples = 0;
+        }
+        if (entry->headers_result == 0)
+        {
+            process_packet_flow(reader_thread, &entry->header, entry->packet, &entry->headers);
+        }
+    }
 
-            if (header->caplen < (eth_offset + radio_len + sizeof(struct ndpi_wifi_header)))
-            {
-                jsonize_packet_event(reader_thread, header, packet, 0, 0, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
-                jsonize_basic_eventf(reader_thread, PACKET_TOO_SHORT, NULL);
-                return 1;
-            }
+    reader_thread->packet_batch_used = 0;
+    reader_thread->packet_batch_data_used = 0;
+    reader_thread->packet_batch_clock_max = 0;
+    reader_thread->ordered_events.seq = ordered_seq;
+}
 
-            /* Calculate 802.11 header length (variable) */
-            struct ndpi_wifi_header const * const wifi =
-                (struct ndpi_wifi_header const * const)(packet + eth_offset + radio_len);
-            uint16_t fc = wifi->fc;
-            int wifi_len = 0;
+/* Adds a packet which stays valid until the batch was processed. */
+static void collect_packet(struct nDPId_reader_thread * const reader_thread,
+                           struct pcap_pkthdr const * const header,
+                           uint8_t const * const packet)
+{
+    struct nDPId_packet_batch_entry * entry;
 
-            /* check wifi data presence */
-            if (FCF_TYPE(fc) == WIFI_DATA)
-            {
-                if ((FCF_TO_DS(fc) && FCF_FROM_DS(fc) == 0x0) || (FCF_TO_DS(fc) == 0x0 && FCF_FROM_DS(fc)))
-                {
-                    wifi_len = 26; /* + 4 byte fcs */
-                }
-            }
-            else
-            {
-                /* no data frames */
-                break;
-            }
+    if (reader_thread->packet_batch_used == nDPId_options.packet_batch_size)
+    {
+        process_packet_batch(reader_thread);
+    }
 
-            /* Check ether_type from LLC */
-            if (header->caplen < (eth_offset + wifi_len + radio_len + sizeof(struct ndpi_llc_header_snap)))
-            {
-                return 1;
-            }
+    entry = &reader_thread->packet_batch[reader_thread->packet_batch_used++];
+    entry->header = *header;
+    entry->packet = packet;
+    entry->ordered_seq = reader_thread->ordered_events.seq;
+    entry->packets_skipped = 0;
+    entry->headers_parsed = 0;
+}
 
-            struct ndpi_llc_header_snap const * const llc =
-                (struct ndpi_llc_header_snap const * const)(packet + eth_offset + wifi_len + radio_len);
-            if (llc->dsap == SNAP)
-            {
-                *layer3_type = ntohs(llc->snap.proto_ID);
-            }
+/*
+ * libpcap reuses its buffer (or hands the ring buffer frame back to the kernel) after the callback returned,
+ * so the packet is copied into `packet_batch_data'.
+ * Packets which do not fit into the remaining space end the batch early.
+ */
+static void ndpi_collect_packet(uint8_t * const args,
+                                struct pcap_pkthdr const * const header,
+                                uint8_t const * const packet)
+{
+    struct nDPId_reader_thread * const reader_thread = (struct nDPId_reader_thread *)args;
+    /* keep the next packet cache line aligned */
+    size_t const slot_size = (header->caplen + 63) & ~(size_t)63;
+    uint8_t * packet_copy;
 
-            /* Set IP header offset */
-            *ip_offset = wifi_len + radio_len + sizeof(struct ndpi_llc_header_snap) + eth_offset;
-            break;
+    if (reader_thread->packet_batch_used == nDPId_options.packet_batch_size ||
+        slot_size > reader_thread->packet_batch_data_size - reader_thread->packet_batch_data_used)
+    {
+        process_packet_batch(reader_thread);
+        if (slot_size > reader_thread->packet_batch_data_size)
+        {
+            ndpi_process_packet(args, header, packet);
+            return;
         }
-        case DLT_RAW:
-            jsonize_packet_event(reader_thread, header, packet, 0, 0, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
-            jsonize_basic_eventf(reader_thread, PACKET_TYPE_UNKNOWN, "%s%u", "type", DLT_RAW);
-            return 1;
-        case DLT_EN10MB:
-            if (header->len < sizeof(struct ndpi_ethhdr))
-            {
-                jsonize_packet_event(reader_thread, header, packet, 0, 0, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
-                jsonize_basic_eventf(reader_thread, PACKET_TOO_SHORT, NULL);
-                return 1;
-            }
+    }
 
-            ethernet = (struct ndpi_ethhdr *)&packet[eth_offset];
-            *ip_offset = sizeof(struct ndpi_ethhdr) + eth_offset;
-            *layer3_type = ntohs(ethernet->h_proto);
-            switch (*layer3_type)
-            {
-                case ETH_P_IP: /* IPv4 */
-                    if (header->len < sizeof(struct ndpi_ethhdr) + sizeof(struct ndpi_iphdr))
-                    {
-                        jsonize_packet_event(
-                            reader_thread, header, packet, *layer3_type, *ip_offset, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
-                        jsonize_basic_eventf(reader_thread, IP4_PACKET_TOO_SHORT, NULL);
-                        return 1;
-                    }
-                    break;
-                case ETH_P_IPV6: /* IPV6 */
-                    if (header->len < sizeof(struct ndpi_ethhdr) + sizeof(struct ndpi_ipv6hdr))
-                    {
-                        jsonize_packet_event(
-                            reader_thread, header, packet, *layer3_type, *ip_offset, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
-                        jsonize_basic_eventf(reader_thread, IP6_PACKET_TOO_SHORT, NULL);
-                        return 1;
-                    }
-                    break;
-                case ETH_P_ARP: /* ARP */
-                    return 1;
-                default:
-                    jsonize_packet_event(
-                        reader_thread, header, packet, *layer3_type, *ip_offset, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
-                    jsonize_basic_eventf(reader_thread, PACKET_TYPE_UNKNOWN, "%s%u", "type", *layer3_type);
-                    return 1;
-            }
-            break;
-        case DLT_IPV4:
-            *layer3_type = ETH_P_IP;
-            *ip_offset = 0;
-            break;
-        case DLT_IPV6:
-            *layer3_type = ETH_P_IPV6;
-            *ip_offset = 0;
-            break;
-        default:
-            jsonize_packet_event(reader_thread, header, packet, 0, 0, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
-            jsonize_basic_eventf(reader_thread, UNKNOWN_DATALINK_LAYER, "%s%u", "datalink", datalink_type);
-            return 1;
+    packet_copy = &reader_thread->packet_batch_data[reader_thread->packet_batch_data_used];
+    memcpy(packet_copy, packet, header->caplen);
+    reader_thread->packet_batch_data_used += slot_size;
+    collect_packet(reader_thread, header, packet_copy);
+}
+
+/*
+ * Adds a replayed packet, its headers were already parsed by classify_pcap_replay_packets().
+ * The replayed file stays loaded until all reader threads are done with it, so the packet is not copied.
+ */
+static void collect_replay_packet(struct nDPId_reader_thread * const reader_thread,
+                                  struct nDPId_replay_packet const * const packet,
+                                  uint64_t packets_skipped)
+{
+    struct nDPId_packet_batch_entry * entry;
+
+    uint64_t const packet_time = get_packet_time(&packet->header);
+
+    collect_packet(reader_thread, &packet->header, packet->data);
+    entry = &reader_thread->packet_batch[reader_thread->packet_batch_used - 1];
+    if (packet_time > reader_thread->packet_batch_clock_max)
+    {
+        reader_thread->packet_batch_clock_max = packet_time;
     }
+    entry->packets_skipped = packets_skipped;
+    entry->headers_parsed = 1;
+    entry->headers = packet->headers;
+    entry->headers_result = packet->headers_result;
+    entry->replay_headers = packet->replay_headers;
+}
 
-    return 0;
+/* Adds a batch entry which only advances the clock of the reader thread, see tick_replay_clock(). */
+static void collect_clock_tick(struct nDPId_reader_thread * const reader_thread,
+                               struct pcap_pkthdr const * const header,
+                               uint64_t packets_skipped)
+{
+    uint64_t const packet_time = get_packet_time(header);
+
+    collect_packet(reader_thread, header, NULL);
+    reader_thread->packet_batch[reader_thread->packet_batch_used - 1].packets_skipped = packets_skipped;
+    if (packet_time > reader_thread->packet_batch_clock_max)
+    {
+        reader_thread->packet_batch_clock_max = packet_time;
+    }
 }
 
-static struct nDPId_flow_basic * add_new_flow(struct nDPId_workflow * const workflow,
-                                              struct nDPId_flow_basic * orig_flow_basic,
-                                              enum nDPId_flow_type type,
-                                              size_t hashed_index)
+/*
+ * Waits up to nDPId_PCAP_POLL_TIMEOUT for packets of a live capture, see setup_live_capture_polling().
+ * Otherwise, an idle interface would block the reader thread in pcap_dispatch() forever.
+ */
+static int dispatch_live_packets(struct nDPId_reader_thread * const reader_thread, int cnt, pcap_handler callback)
 {
-    size_t s;
+    pcap_t * const pcap_handle = reader_thread->workflow->pcap_handle;
+    struct pollfd pfd = {.fd = reader_thread->pcap_selectable_fd, .events = POLLIN, .revents = 0};
+    int ret;
 
-    switch (type)
+    if (pfd.fd < 0)
     {
-        case FT_UNKNOWN:
-        case FT_FINISHED: // do not allocate something for FT_FINISHED as we are re-using memory allocated by FT_INFO
-            return NULL;
+        return pcap_dispatch(pcap_handle, cnt, callback, (uint8_t *)reader_thread);
+    }
 
-        case FT_SKIPPED:
-            workflow->total_skipped_flows++;
-            s = sizeof(struct nDPId_flow_skipped);
-            break;
+    if (poll(&pfd, 1, nDPId_PCAP_POLL_TIMEOUT) < 0 && errno != EINTR)
+    {
+        syslog(LOG_DAEMON | LOG_ERR, "Thread %d: poll: %s", reader_thread->array_index, strerror(errno));
+        return PCAP_ERROR;
+    }
 
-        case FT_INFO:
-            s = sizeof(struct nDPId_flow_info);
-            break;
+    ret = pcap_dispatch(pcap_handle, cnt, callback, (uint8_t *)reader_thread);
+    if (ret == 0)
+    {
+        check_for_status_idle(reader_thread);
     }
 
-    struct nDPId_flow_basic * flow_basic = (struct nDPId_flow_basic *)ndpi_malloc(s);
-    if (flow_basic == NULL)
+    return ret;
+}
+
+static void setup_live_capture_polling(struct nDPId_reader_thread * const reader_thread)
+{
+    pcap_t * const pcap_handle = reader_thread->workflow->pcap_handle;
+    char pcap_error_buffer[PCAP_ERRBUF_SIZE];
+    int const fd = pcap_get_selectable_fd(pcap_handle);
+
+    reader_thread->pcap_selectable_fd = -1;
+    if (fd < 0)
     {
-        return NULL;
+        syslog(LOG_DAEMON | LOG_ERR,
+               "Thread %d: No selectable pcap fd, status events are only sent while packets arrive",
+               reader_thread->array_index);
+        return;
     }
-    memset(flow_basic, 0, s);
-    *flow_basic = *orig_flow_basic;
-    flow_basic->type = type;
-    if (ndpi_tsearch(flow_basic, &workflow->ndpi_flows_active[hashed_index], ndpi_workflow_node_cmp) == NULL)
+    if (pcap_setnonblock(pcap_handle, 1, pcap_error_buffer) != 0)
     {
-        ndpi_free(flow_basic);
-        return NULL;
+        syslog(LOG_DAEMON | LOG_ERR,
+               "Thread %d: pcap_setnonblock: %.*s",
+               reader_thread->array_index,
+               (int)PCAP_ERRBUF_SIZE,
+               pcap_error_buffer);
+        return;
     }
+    reader_thread->pcap_selectable_fd = fd;
+}
 
-    return flow_basic;
+static int run_pcap_batch_loop(struct nDPId_reader_thread * const reader_thread)
+{
+    pcap_t * const pcap_handle = reader_thread->workflow->pcap_handle;
+    int const is_file = (pcap_file(pcap_handle) != NULL);
+    int ret;
+
+    reader_thread->packet_batch_used = 0;
+    reader_thread->packet_batch_data_used = 0;
+    reader_thread->packet_batch_data_size = nDPId_options.packet_batch_size * nDPId_PACKET_BATCH_SLOT_SIZE;
+    reader_thread->packet_batch_data = (uint8_t *)malloc(reader_thread->packet_batch_data_size);
+    if (reader_thread->packet_batch_data == NULL)
+    {
+        syslog(LOG_DAEMON | LOG_ERR,
+               "Thread %d: Could not allocate %zu bytes for packet batching, processing packets one by one",
+               reader_thread->array_index,
+               reader_thread->packet_batch_data_size);
+        return pcap_loop(pcap_handle, -1, &ndpi_process_packet, (uint8_t *)reader_thread);
+    }
+
+    do
+    {
+        if (is_file != 0)
+        {
+            ret = pcap_dispatch(
+                pcap_handle, nDPId_options.packet_batch_size, &ndpi_collect_packet, (uint8_t *)reader_thread);
+        }
+        else
+        {
+            ret = dispatch_live_packets(reader_thread, nDPId_options.packet_batch_size, &ndpi_collect_packet);
+        }
+        process_packet_batch(reader_thread);
+    } while (ret > 0 || (ret == 0 && is_file == 0));
+
+    free(reader_thread->packet_batch_data);
+    reader_thread->packet_batch_data = NULL;
+
+    return ret;
 }
 
-static void ndpi_process_packet(uint8_t * const args,
-                                struct pcap_pkthdr const * const header,
-                                uint8_t const * const packet)
+static struct nDPId_replay_packet * add_pcap_replay_packet(void)
 {
-    struct nDPId_reader_thread * const reader_thread = (struct nDPId_reader_thread *)args;
-    struct nDPId_workflow * workflow;
-    struct nDPId_flow_basic flow_basic = {};
+    if (pcap_replay.packets_used == pcap_replay.packets_size)
+    {
+        size_t const new_size = (pcap_replay.packets_size == 0 ? 4096 : pcap_replay.packets_size * 2);
+        struct nDPId_replay_packet * const new_packets =
+            (struct nDPId_replay_packet *)realloc(pcap_replay.packets, new_size * sizeof(*new_packets));
 
-    size_t hashed_index;
-    void * tree_result;
-    struct nDPId_flow_info * flow_to_process;
+        if (new_packets == NULL)
+        {
+            return NULL;
+        }
+        pcap_replay.packets = new_packets;
 
-    uint8_t direction_changed = 0;
-    uint8_t is_new_flow = 0;
-    struct ndpi_id_struct * ndpi_src;
-    struct ndpi_id_struct * ndpi_dst;
+        size_t * const new_order = (size_t *)realloc(pcap_replay.order, new_size * sizeof(*new_order));
+        if (new_order == NULL)
+        {
+            return NULL;
+        }
+        pcap_replay.order = new_order;
+        pcap_replay.packets_size = new_size;
+    }
 
-    const struct ndpi_iphdr * ip;
-    struct ndpi_ipv6hdr * ip6;
+    return &pcap_replay.packets[pcap_replay.packets_used++];
+}
 
-    uint64_t time_ms;
-    uint16_t ip_offset;
-    uint16_t ip_size;
+static uint32_t get_pcap_u32(uint8_t const * const data, int swapped)
+{
+    uint32_t value;
 
-    const uint8_t * l4_ptr = NULL;
-    uint16_t l4_len = 0;
-    uint16_t l4_payload_len = 0;
+    memcpy(&value, data, sizeof(value));
+    return (swapped != 0 ? __builtin_bswap32(value) : value);
+}
 
-    uint16_t type;
-    int thread_index = nDPId_THREAD_DISTRIBUTION_SEED; // generated with `dd if=/dev/random bs=1024 count=1 |& hd'
+/*
+ * Indexes the records of a memory mapped classic pcap file, packet data is not copied.
+ * Returns -1 if it is no classic pcap file.
+ */
+static int index_pcap_replay_map(char const * const pcap_file)
+{
+    uint8_t const * const map = pcap_replay.map;
+    uint32_t magic;
+    int swapped;
+    int nsec;
+    size_t offset = 24;
 
-    if (reader_thread == NULL)
+    if (pcap_replay.map_size < 24)
     {
-        return;
+        return -1;
+    }
+    memcpy(&magic, map, sizeof(magic));
+    switch (magic)
+    {
+        case 0xA1B2C3D4:
+        case 0xA1B23C4D:
+            swapped = 0;
+            break;
+        case 0xD4C3B2A1:
+        case 0x4D3CB2A1:
+            swapped = 1;
+            break;
+        default:
+            return -1;
     }
-    workflow = reader_thread->workflow;
+    nsec = (magic == 0xA1B23C4D || magic == 0x4D3CB2A1);
+    /* the upper bits may contain the FCS length */
+    pcap_replay.datalink_type = (int)(get_pcap_u32(map + 20, swapped) & 0x0FFFFFFF);
+    pcap_replay.snaplen = (int)get_pcap_u32(map + 16, swapped);
 
-    if (workflow == NULL)
+    while (pcap_replay.map_size - offset >= 16)
     {
-        return;
+        uint8_t const * const record = map + offset;
+        uint32_t const caplen = get_pcap_u32(record + 8, swapped);
+
+        if (caplen > pcap_replay.map_size - offset - 16)
+        {
+            syslog(LOG_DAEMON | LOG_ERR, "Truncated pcap file: '%s'", pcap_file);
+            break;
+        }
+
+        struct nDPId_replay_packet * const packet = add_pcap_replay_packet();
+        if (packet == NULL)
+        {
+            syslog(LOG_DAEMON | LOG_ERR, "Could not index all packets of pcap file: '%s'", pcap_file);
+            break;
+        }
+        packet->header.ts.tv_sec = get_pcap_u32(record, swapped);
+        packet->header.ts.tv_usec = get_pcap_u32(record + 4, swapped) / (nsec != 0 ? 1000 : 1);
+        packet->header.caplen = caplen;
+        packet->header.len = get_pcap_u32(record + 12, swapped);
+        packet->data = record + 16;
+
+        offset += 16 + caplen;
     }
 
-    workflow->packets_captured++;
-    time_ms = ((uint64_t)header->ts.tv_sec) * nDPId_options.tick_resolution +
-              header->ts.tv_usec / (1000000 / nDPId_options.tick_resolution);
-    workflow->last_time = time_ms;
+    return 0;
+}
 
-    check_for_idle_flows(reader_thread);
-#ifdef ENABLE_MEMORY_PROFILING
-    log_memory_usage(reader_thread);
-#endif
+/* Any other format libpcap knows (e.g. pcapng) is read with libpcap and copied. */
+static int copy_pcap_replay_file(char const * const pcap_file)
+{
+    char pcap_error_buffer[PCAP_ERRBUF_SIZE];
+    pcap_t * const pcap_handle =
+        pcap_open_offline_with_tstamp_precision(pcap_file, PCAP_TSTAMP_PRECISION_MICRO, pcap_error_buffer);
+    struct pcap_pkthdr * header;
+    uint8_t const * data;
+    int ret;
 
-    if (process_datalink_layer(reader_thread, header, packet, &ip_offset, &type) != 0)
+    if (pcap_handle == NULL)
     {
-        return;
+        syslog(LOG_DAEMON | LOG_ERR, "pcap_open_offline: %.*s", (int)PCAP_ERRBUF_SIZE, pcap_error_buffer);
+        return 1;
     }
+    pcap_replay.datalink_type = pcap_datalink(pcap_handle);
+    pcap_replay.snaplen = pcap_snapshot(pcap_handle);
 
-    if (type == ETH_P_IP)
+    while ((ret = pcap_next_ex(pcap_handle, &header, &data)) == 1)
     {
-        ip = (struct ndpi_iphdr *)&packet[ip_offset];
-        ip6 = NULL;
+        if (header->caplen > pcap_replay.copy_size - pcap_replay.copy_used)
+        {
+            size_t new_size = (pcap_replay.copy_size == 0 ? 1024 * 1024 : pcap_replay.copy_size * 2);
+            if (new_size < pcap_replay.copy_used + header->caplen)
+            {
+                new_size = pcap_replay.copy_used + header->caplen;
+            }
+            uint8_t * const new_copy = (uint8_t *)realloc(pcap_replay.copy, new_size);
+            if (new_copy == NULL)
+            {
+                break;
+            }
+            pcap_replay.copy = new_copy;
+            pcap_replay.copy_size = new_size;
+        }
+
+        struct nDPId_replay_packet * const packet = add_pcap_replay_packet();
+        if (packet == NULL)
+        {
+            break;
+        }
+        packet->header = *header;
+        /* an offset until all packets are read, the copy may still move */
+        packet->data = (uint8_t const *)(uintptr_t)pcap_replay.copy_used;
+        memcpy(pcap_replay.copy + pcap_replay.copy_used, data, header->caplen);
+        pcap_replay.copy_used += header->caplen;
     }
-    else if (type == ETH_P_IPV6)
+    if (ret == PCAP_ERROR)
     {
-        ip = NULL;
-        ip6 = (struct ndpi_ipv6hdr *)&packet[ip_offset];
+        syslog(LOG_DAEMON | LOG_ERR, "Error while reading pcap file: '%s'", pcap_geterr(pcap_handle));
     }
-    else
+    pcap_close(pcap_handle);
+
+    for (size_t i = 0; i < pcap_replay.packets_used; ++i)
     {
-        jsonize_packet_event(reader_thread, header, packet, type, ip_offset, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
-        jsonize_basic_eventf(reader_thread, UNKNOWN_L3_PROTOCOL, "%s%u", "protocol", type);
-        return;
+        pcap_replay.packets[i].data = pcap_replay.copy + (uintptr_t)pcap_replay.packets[i].data;
     }
-    ip_size = header->len - ip_offset;
 
-    if (type == ETH_P_IP && header->len >= ip_offset)
+    return 0;
+}
+
+static void unload_pcap_replay_file(void)
+{
+    if (pcap_replay.map != NULL)
     {
-        if (header->caplen < header->len)
-        {
-            jsonize_packet_event(reader_thread, header, packet, type, ip_offset, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
-            jsonize_basic_eventf(reader_thread,
-                                 CAPTURE_SIZE_SMALLER_THAN_PACKET_SIZE,
-                                 "%s%u %s%u",
-                                 "caplen",
-                                 header->caplen,
-                                 "len",
-                                 header->len);
-        }
+        munmap(pcap_replay.map, pcap_replay.map_size);
+        pcap_replay.map = NULL;
+        pcap_replay.map_size = 0;
     }
-
-    /* process layer3 e.g. IPv4 / IPv6 */
-    if (ip != NULL && ip->version == 4)
+    free(pcap_replay.copy);
+    pcap_replay.copy = NULL;
+    pcap_replay.copy_used = 0;
+    pcap_replay.copy_size = 0;
+    if (pcap_replay.bpf_valid != 0)
     {
-        if (ip_size < sizeof(*ip))
-        {
-            jsonize_packet_event(reader_thread, header, packet, type, ip_offset, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
-            jsonize_basic_eventf(
-                reader_thread, IP4_SIZE_SMALLER_THAN_HEADER, "%s%u %s%zu", "ip_size", ip_size, "expected", sizeof(*ip));
-            return;
-        }
+        pcap_freecode(&pcap_replay.bpf);
+        pcap_replay.bpf_valid = 0;
+    }
+    pcap_replay.packets_used = 0;
+}
 
-        flow_basic.l3_type = L3_IP;
+static int load_pcap_replay_file(size_t index)
+{
+    char const * const pcap_file = pcap_replay.files[index];
+    int const fd = open(pcap_file, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    int ret = -1;
 
-        if (ndpi_detection_get_l4(
-                (uint8_t *)ip, ip_size, &l4_ptr, &l4_len, &flow_basic.l4_protocol, NDPI_DETECTION_ONLY_IPV4) != 0)
+    if (fd < 0)
+    {
+        syslog(LOG_DAEMON | LOG_ERR, "Could not open pcap file %s: %s", pcap_file, strerror(errno));
+        return 1;
+    }
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        void * const map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (map != MAP_FAILED)
         {
-            jsonize_packet_event(reader_thread, header, packet, type, ip_offset, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
-            jsonize_basic_eventf(
-                reader_thread, IP4_L4_PAYLOAD_DETECTION_FAILED, "%s%zu", "l4_data_len", ip_size - sizeof(*ip));
-            return;
+            pcap_replay.map = (uint8_t *)map;
+            pcap_replay.map_size = st.st_size;
+            madvise(map, st.st_size, MADV_WILLNEED);
+            ret = index_pcap_replay_map(pcap_file);
         }
-
-        flow_basic.src.v4.ip = ip->saddr;
-        flow_basic.dst.v4.ip = ip->daddr;
-        uint32_t min_addr = (flow_basic.src.v4.ip > flow_basic.dst.v4.ip ? flow_basic.dst.v4.ip : flow_basic.src.v4.ip);
-        thread_index = min_addr + ip->protocol;
     }
-    else if (ip6 != NULL)
+    close(fd);
+    if (ret < 0)
     {
-        if (ip_size < sizeof(ip6->ip6_hdr))
+        unload_pcap_replay_file();
+        ret = copy_pcap_replay_file(pcap_file);
+    }
+
+    if (ret == 0 && nDPId_options.bpf_str != NULL)
+    {
+        pcap_t * const pcap_handle = pcap_open_dead(pcap_replay.datalink_type, 65535);
+
+        if (pcap_handle == NULL ||
+            pcap_compile(pcap_handle, &pcap_replay.bpf, nDPId_options.bpf_str, 1, PCAP_NETMASK_UNKNOWN) != 0)
         {
-            jsonize_packet_event(reader_thread, header, packet, type, ip_offset, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
-            jsonize_basic_eventf(reader_thread,
-                                 IP6_SIZE_SMALLER_THAN_HEADER,
-                                 "%s%u %s%zu",
-                                 "ip_size",
-                                 ip_size,
-                                 "expected",
-                                 sizeof(ip6->ip6_hdr));
-            return;
+            syslog(LOG_DAEMON | LOG_ERR,
+                   "pcap_compile: %s",
+                   (pcap_handle != NULL ? pcap_geterr(pcap_handle) : "Out of memory"));
+            ret = 1;
         }
-
-        flow_basic.l3_type = L3_IP6;
-        if (ndpi_detection_get_l4(
-                (uint8_t *)ip6, ip_size, &l4_ptr, &l4_len, &flow_basic.l4_protocol, NDPI_DETECTION_ONLY_IPV6) != 0)
+        else
         {
-            jsonize_packet_event(reader_thread, header, packet, type, ip_offset, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
-            jsonize_basic_eventf(
-                reader_thread, IP6_L4_PAYLOAD_DETECTION_FAILED, "%s%zu", "l4_data_len", ip_size - sizeof(*ip));
-            return;
+            pcap_replay.bpf_valid = 1;
         }
-
-        flow_basic.src.v6.ip[0] = ip6->ip6_src.u6_addr.u6_addr64[0];
-        flow_basic.src.v6.ip[1] = ip6->ip6_src.u6_addr.u6_addr64[1];
-        flow_basic.dst.v6.ip[0] = ip6->ip6_dst.u6_addr.u6_addr64[0];
-        flow_basic.dst.v6.ip[1] = ip6->ip6_dst.u6_addr.u6_addr64[1];
-        uint64_t min_addr[2];
-        if (flow_basic.src.v6.ip[0] > flow_basic.dst.v6.ip[0] && flow_basic.src.v6.ip[1] > flow_basic.dst.v6.ip[1])
+        if (pcap_handle != NULL)
         {
-            min_addr[0] = flow_basic.dst.v6.ip[0];
-            min_addr[1] = flow_basic.dst.v6.ip[0];
+            pcap_close(pcap_handle);
         }
-        else
+    }
+
+    /* let the kernel read ahead the next file while this one gets processed */
+    if (index + 1 < pcap_replay.file_count)
+    {
+        int const next_fd = open(pcap_replay.files[index + 1], O_RDONLY | O_CLOEXEC);
+
+        if (next_fd >= 0)
         {
-            min_addr[0] = flow_basic.src.v6.ip[0];
-            min_addr[1] = flow_basic.src.v6.ip[0];
+            posix_fadvise(next_fd, 0, 0, POSIX_FADV_WILLNEED);
+            close(next_fd);
         }
-        thread_index = min_addr[0] + min_addr[1] + ip6->ip6_hdr.ip6_un1_nxt;
     }
-    else
+
+    if (ret != 0)
     {
-        jsonize_packet_event(reader_thread, header, packet, type, ip_offset, 0, 0, NULL, PACKET_EVENT_PAYLOAD);
-        jsonize_basic_eventf(reader_thread, UNKNOWN_L3_PROTOCOL, "%s%u", "protocol", type);
-        return;
+        unload_pcap_replay_file();
     }
+    return ret;
+}
 
-    /* process layer4 e.g. TCP / UDP */
-    if (flow_basic.l4_protocol == IPPROTO_TCP)
+/*
+ * Every reader thread parses one slice of the current file on behalf of the reader thread owning the flow,
+ * with the same flow hash used for live captures, and sorts it by owning reader thread.
+ * Invalid packets are dispatched to reader thread 0, so their events are emitted only once.
+ */
+static void classify_pcap_replay_packets(struct nDPId_reader_thread * const reader_thread)
+{
+    unsigned long long int const thread_count = nDPId_options.reader_thread_count;
+    unsigned long long int const suppressed_events = reader_thread->suppressed_events;
+    struct nDPId_replay_slice * const slice = &pcap_replay.slices[reader_thread->array_index];
+    size_t next[nDPId_MAX_READER_THREADS];
+
+    slice->first = pcap_replay.packets_used * reader_thread->array_index / thread_count;
+    slice->last = pcap_replay.packets_used * (reader_thread->array_index + 1) / thread_count;
+    slice->packets_accepted = 0;
+    memset(slice->owner_offsets, 0, sizeof(slice->owner_offsets));
+
+    slice->clock_max = 0;
+
+    reader_thread->suppress_events = 1;
+    reader_thread->classify_packets = 1;
+    for (size_t i = slice->first; i < slice->last; ++i)
     {
-        const struct ndpi_tcphdr * tcp;
+        struct nDPId_replay_packet * const packet = &pcap_replay.packets[i];
+        unsigned long long int const suppressed_before = reader_thread->suppressed_events;
 
-        if (header->len < (l4_ptr - packet) + sizeof(struct ndpi_tcphdr))
+        if (pcap_replay.bpf_valid != 0 && pcap_offline_filter(&pcap_replay.bpf, &packet->header, packet->data) == 0)
         {
-            jsonize_packet_event(
-                reader_thread, header, packet, type, ip_offset, (l4_ptr - packet), l4_len, NULL, PACKET_EVENT_PAYLOAD);
-            jsonize_basic_eventf(reader_thread,
-                                 TCP_PACKET_TOO_SHORT,
-                                 "%s%u %s%zu",
-                                 "header_len",
-                                 header->len,
-                                 "expected",
-                                 (l4_ptr - packet) + sizeof(struct ndpi_tcphdr));
-            return;
+            packet->thread_index = -1;
+            packet->clock_max = slice->clock_max;
+            continue;
         }
-        tcp = (struct ndpi_tcphdr *)l4_ptr;
-        l4_payload_len = ndpi_max(0, l4_len - 4 * tcp->doff);
-        flow_basic.tcp_fin_rst_seen = (tcp->fin == 1 || tcp->rst == 1 ? 1 : 0);
-        flow_basic.tcp_is_midstream_flow = (tcp->syn == 0 ? 1 : 0);
-        flow_basic.src_port = ntohs(tcp->source);
-        flow_basic.dst_port = ntohs(tcp->dest);
+        if (get_packet_time(&packet->header) > slice->clock_max)
+        {
+            slice->clock_max = get_packet_time(&packet->header);
+        }
+        packet->clock_max = slice->clock_max;
+
+        packet->headers_result = process_packet_headers(reader_thread, &packet->header, packet->data, &packet->headers);
+        packet->replay_headers = (suppressed_before != reader_thread->suppressed_events);
+        packet->thread_index = (packet->headers.thread_index < 0 ? 0 : packet->headers.thread_index);
+        packet->captured_before = slice->packets_accepted++;
+        slice->owner_offsets[packet->thread_index + 1]++;
     }
-    else if (flow_basic.l4_protocol == IPPROTO_UDP)
-    {
-        const struct ndpi_udphdr * udp;
+    reader_thread->suppress_events = 0;
+    reader_thread->classify_packets = 0;
+    reader_thread->suppressed_events = suppressed_events;
 
-        if (header->len < (l4_ptr - packet) + sizeof(struct ndpi_udphdr))
+    slice->owner_offsets[0] = slice->first;
+    for (unsigned long long int t = 0; t < thread_count; ++t)
+    {
+        slice->owner_offsets[t + 1] += slice->owner_offsets[t];
+        next[t] = slice->owner_offsets[t];
+    }
+    for (size_t i = slice->first; i < slice->last; ++i)
+    {
+        if (pcap_replay.packets[i].thread_index >= 0)
         {
-            jsonize_packet_event(
-                reader_thread, header, packet, type, ip_offset, (l4_ptr - packet), l4_len, NULL, PACKET_EVENT_PAYLOAD);
-            jsonize_basic_eventf(reader_thread,
-                                 UDP_PACKET_TOO_SHORT,
-                                 "%s%u %s%zu",
-                                 "header_len",
-                                 header->len,
-                                 "expected",
-                                 (l4_ptr - packet) + sizeof(struct ndpi_udphdr));
-            return;
+            pcap_replay.order[next[pcap_replay.packets[i].thread_index]++] = i;
         }
-        udp = (struct ndpi_udphdr *)l4_ptr;
-        l4_payload_len = (l4_len > sizeof(struct ndpi_udphdr)) ? l4_len - sizeof(struct ndpi_udphdr) : 0;
-        flow_basic.src_port = ntohs(udp->source);
-        flow_basic.dst_port = ntohs(udp->dest);
     }
+}
 
-    /* distribute flows to threads while keeping stability (same flow goes always to same thread) */
-    thread_index += (flow_basic.src_port < flow_basic.dst_port ? flow_basic.dst_port : flow_basic.src_port);
-    thread_index %= nDPId_options.reader_thread_count;
-    if (thread_index != reader_thread->array_index)
+static void process_replay_packet(struct nDPId_reader_thread * const reader_thread,
+                                  struct nDPId_replay_packet const * const packet)
+{
+    struct nDPId_packet_headers hdrs = packet->headers;
+    int headers_result = packet->headers_result;
+
+    begin_packet_processing(reader_thread, &packet->header);
+    if (packet->replay_headers != 0)
     {
-        return;
+        reader_thread->skip_latency_samples = 1;
+        headers_result = process_packet_headers(reader_thread, &packet->header, packet->data, &hdrs);
+        reader_thread->skip_latency_samples = 0;
     }
-    workflow->packets_processed++;
-    workflow->total_l4_data_len += l4_len;
-
-    /* calculate flow hash for btree find, search(insert) */
-    switch (flow_basic.l3_type)
+    if (headers_result == 0)
     {
-        case L3_IP:
-            if (ndpi_flowv4_flow_hash(flow_basic.l4_protocol,
-                                      flow_basic.src.v4.ip,
-                                      flow_basic.dst.v4.ip,
-                                      flow_basic.src_port,
-                                      flow_basic.dst_port,
-                                      0,
-                                      0,
-                                      (uint8_t *)&flow_basic.hashval,
-                                      sizeof(flow_basic.hashval)) != 0)
-            {
-                flow_basic.hashval = flow_basic.src.v4.ip + flow_basic.dst.v4.ip; // fallback
-            }
-            break;
-        case L3_IP6:
-            if (ndpi_flowv6_flow_hash(flow_basic.l4_protocol,
-                                      &ip6->ip6_src,
-                                      &ip6->ip6_dst,
-                                      flow_basic.src_port,
-                                      flow_basic.dst_port,
-                                      0,
-                                      0,
-                                      (uint8_t *)&flow_basic.hashval,
-                                      sizeof(flow_basic.hashval)) != 0)
-            {
-                flow_basic.hashval = flow_basic.src.v6.ip[0] + flow_basic.src.v6.ip[1];
-                flow_basic.hashval += flow_basic.dst.v6.ip[0] + flow_basic.dst.v6.ip[1];
-            }
-            break;
+        process_packet_flow(reader_thread, &packet->header, packet->data, &hdrs);
     }
-    flow_basic.hashval += flow_basic.l4_protocol + flow_basic.src_port + flow_basic.dst_port;
+}
+
+/* Highest packet time of all packets of the current file up to `index'. */
+static uint64_t get_replay_clock_max(struct nDPId_replay_cursor const * const cursor,
+                                     unsigned long long int slice,
+                                     size_t index)
+{
+    uint64_t const clock_max = pcap_replay.packets[index].clock_max;
+
+    return (cursor->slice_clock_max[slice] > clock_max ? cursor->slice_clock_max[slice] : clock_max);
+}
+
+static unsigned long long int get_replay_slice(size_t index)
+{
+    unsigned long long int slice = 0;
 
-    hashed_index = flow_basic.hashval % workflow->max_active_flows;
-    tree_result = ndpi_tfind(&flow_basic, &workflow->ndpi_flows_active[hashed_index], ndpi_workflow_node_cmp);
-    if (tree_result == NULL)
+    while (index >= pcap_replay.slices[slice].last)
     {
-        /* flow not found in btree: switch src <-> dst and try to find it again */
-        uint64_t orig_src_ip[2] = {flow_basic.src.v6.ip[0], flow_basic.src.v6.ip[1]};
-        uint64_t orig_dst_ip[2] = {flow_basic.dst.v6.ip[0], flow_basic.dst.v6.ip[1]};
-        uint16_t orig_src_port = flow_basic.src_port;
-        uint16_t orig_dst_port = flow_basic.dst_port;
+        slice++;
+    }
 
-        flow_basic.src.v6.ip[0] = orig_dst_ip[0];
-        flow_basic.src.v6.ip[1] = orig_dst_ip[1];
-        flow_basic.dst.v6.ip[0] = orig_src_ip[0];
-        flow_basic.dst.v6.ip[1] = orig_src_ip[1];
-        flow_basic.src_port = orig_dst_port;
-        flow_basic.dst_port = orig_src_port;
+    return slice;
+}
 
-        tree_result = ndpi_tfind(&flow_basic, &workflow->ndpi_flows_active[hashed_index], ndpi_workflow_node_cmp);
-        if (tree_result != NULL)
-        {
-            direction_changed = 1;
-        }
+/*
+ * Advances the clock with a packet of another reader thread, see tick_replay_clock().
+ * Counts all packets up to and including this one, as every reader thread of a live capture sees every packet.
+ */
+static void tick_replay_packet(struct nDPId_reader_thread * const reader_thread,
+                               struct nDPId_replay_cursor * const cursor,
+                               size_t index,
+                               uint64_t seq_base,
+                               int batched)
+{
+    struct nDPId_replay_packet const * const packet = &pcap_replay.packets[index];
+    unsigned long long int const slice = get_replay_slice(index);
+    size_t const captured = cursor->slice_captured[slice] + packet->captured_before + 1;
 
-        flow_basic.src.v6.ip[0] = orig_src_ip[0];
-        flow_basic.src.v6.ip[1] = orig_src_ip[1];
-        flow_basic.dst.v6.ip[0] = orig_dst_ip[0];
-        flow_basic.dst.v6.ip[1] = orig_dst_ip[1];
-        flow_basic.src_port = orig_src_port;
-        flow_basic.dst_port = orig_dst_port;
+    reader_thread->ordered_events.seq = seq_base + index + 1;
+    if (batched != 0)
+    {
+        collect_clock_tick(reader_thread, &packet->header, captured - cursor->captured);
+    }
+    else
+    {
+        reader_thread->workflow->packets_captured += captured - cursor->captured;
+        advance_clock(reader_thread, &packet->header);
     }
+    cursor->captured = captured;
+    cursor->next_packet = index + 1;
+}
 
-    if (tree_result == NULL)
+/*
+ * Packets of other reader threads only advance the clock if advance_clock() would do more than updating `last_time'
+ * i.e. at the first packet newer than get_clock_deadline(). Packets before `next_packet' are never newer,
+ * so it is the first packet raising the highest packet time of the file above the deadline (binary search).
+ * With `end_of_round' set, the clock is finally set to the last packet before `last', so idle flow scans and status
+ * events happen at the same packets and time as if the reader thread had seen every packet.
+ */
+static void tick_replay_clock(struct nDPId_reader_thread * const reader_thread,
+                              struct nDPId_replay_cursor * const cursor,
+                              size_t last,
+                              uint64_t seq_base,
+                              int batched,
+                              int end_of_round)
+{
+    while (cursor->next_packet < last)
     {
-        /* flow still not found, must be new or midstream */
+        uint64_t deadline = get_clock_deadline(reader_thread);
+        unsigned long long int slice = get_replay_slice(cursor->next_packet);
+        size_t first;
+        size_t count;
 
-        union nDPId_ip const * netmask = NULL;
-        union nDPId_ip const * subnet = NULL;
-        switch (flow_basic.l3_type)
+        /* collected packets which advance the clock change the deadline */
+        if (batched != 0 && reader_thread->packet_batch_used > 0 && reader_thread->packet_batch_clock_max > deadline)
         {
-            case L3_IP:
-                netmask = &nDPId_options.pcap_dev_netmask4;
-                subnet = &nDPId_options.pcap_dev_subnet4;
-                break;
-            case L3_IP6:
-                netmask = &nDPId_options.pcap_dev_netmask6;
-                subnet = &nDPId_options.pcap_dev_subnet6;
-                break;
+            process_packet_batch(reader_thread);
+            deadline = get_clock_deadline(reader_thread);
         }
-        if (nDPId_options.process_internal_initial_direction != 0 && flow_basic.tcp_is_midstream_flow == 0)
+
+        while (slice + 1 < nDPId_options.reader_thread_count && pcap_replay.slices[slice].last < last &&
+               get_replay_clock_max(cursor, slice, pcap_replay.slices[slice].last - 1) <= deadline)
         {
-            if (is_ip_in_subnet(&flow_basic.src, netmask, subnet, flow_basic.l3_type) == 0)
-            {
-                if (add_new_flow(workflow, &flow_basic, FT_SKIPPED, hashed_index) == NULL)
-                {
-                    jsonize_packet_event(reader_thread,
-                                         header,
-                                         packet,
-                                         type,
-                                         ip_offset,
-                                         (l4_ptr - packet),
-                                         l4_len,
-                                         NULL,
-                                         PACKET_EVENT_PAYLOAD);
-                    jsonize_basic_eventf(reader_thread,
-                                         FLOW_MEMORY_ALLOCATION_FAILED,
-                                         "%s%zu",
-                                         "size",
-                                         sizeof(struct nDPId_flow_skipped));
-                }
-                return;
-            }
+            slice++;
         }
-        else if (nDPId_options.process_external_initial_direction != 0 && flow_basic.tcp_is_midstream_flow == 0)
+        first = (cursor->next_packet > pcap_replay.slices[slice].first ? cursor->next_packet
+                                                                       : pcap_replay.slices[slice].first);
+        count = (pcap_replay.slices[slice].last < last ? pcap_replay.slices[slice].last : last) - first;
+        while (count > 0)
         {
-            if (is_ip_in_subnet(&flow_basic.src, netmask, subnet, flow_basic.l3_type) != 0)
+            size_t const step = count / 2;
+
+            if (get_replay_clock_max(cursor, slice, first + step) <= deadline)
             {
-                if (add_new_flow(workflow, &flow_basic, FT_SKIPPED, hashed_index) == NULL)
-                {
-                    jsonize_packet_event(reader_thread,
-                                         header,
-                                         packet,
-                                         type,
-                                         ip_offset,
-                                         (l4_ptr - packet),
-                                         l4_len,
-                                         NULL,
-                                         PACKET_EVENT_PAYLOAD);
-                    jsonize_basic_eventf(reader_thread,
-                                         FLOW_MEMORY_ALLOCATION_FAILED,
-                                         "%s%zu",
-                                         "size",
-                                         sizeof(struct nDPId_flow_skipped));
-                }
-                return;
+                first += step + 1;
+                count -= step + 1;
+            }
+            else
+            {
+                count = step;
             }
         }
-
-        if (workflow->cur_active_flows == workflow->max_active_flows)
+        if (first >= last || first >= pcap_replay.slices[slice].last)
         {
-            jsonize_packet_event(
-                reader_thread, header, packet, type, ip_offset, (l4_ptr - packet), l4_len, NULL, PACKET_EVENT_PAYLOAD);
-            jsonize_basic_eventf(reader_thread,
-                                 MAX_FLOW_TO_TRACK,
-                                 "%s%llu %s%llu %s%llu",
-                                 "current_active",
-                                 workflow->max_active_flows,
-                                 "current_idle",
-                                 workflow->cur_idle_flows,
-                                 "max_active",
-                                 workflow->max_active_flows);
-            return;
+            break;
         }
+        tick_replay_packet(reader_thread, cursor, first, seq_base, batched);
+    }
+
+    if (end_of_round != 0)
+    {
+        size_t index = last;
 
-        flow_to_process = (struct nDPId_flow_info *)add_new_flow(workflow, &flow_basic, FT_INFO, hashed_index);
-        if (flow_to_process == NULL)
+        while (index > cursor->next_packet && pcap_replay.packets[index - 1].thread_index < 0)
         {
-            jsonize_packet_event(
-                reader_thread, header, packet, type, ip_offset, (l4_ptr - packet), l4_len, NULL, PACKET_EVENT_PAYLOAD);
-            jsonize_basic_eventf(
-                reader_thread, FLOW_MEMORY_ALLOCATION_FAILED, "%s%zu", "size", sizeof(*flow_to_process));
-            return;
+            index--;
         }
-
-        workflow->cur_active_flows++;
-        workflow->total_active_flows++;
-        flow_to_process->flow_extended.flow_id = __sync_fetch_and_add(&global_flow_id, 1);
-
-        if (alloc_detection_data(flow_to_process) != 0)
+        if (index > cursor->next_packet)
         {
-            jsonize_packet_event(
-                reader_thread, header, packet, type, ip_offset, (l4_ptr - packet), l4_len, NULL, PACKET_EVENT_PAYLOAD);
-            jsonize_basic_eventf(
-                reader_thread, FLOW_MEMORY_ALLOCATION_FAILED, "%s%zu", "size", sizeof(*flow_to_process));
-            return;
+            tick_replay_packet(reader_thread, cursor, index - 1, seq_base, batched);
         }
+    }
+    if (cursor->next_packet < last)
+    {
+        cursor->next_packet = last;
+    }
+}
 
-        ndpi_src = &flow_to_process->detection_data->src;
-        ndpi_dst = &flow_to_process->detection_data->dst;
+/*
+ * Processes the packets up to `last' owned by this reader thread.
+ * Packets of other reader threads are not visited one by one, see tick_replay_clock().
+ */
+static void replay_packets(struct nDPId_reader_thread * const reader_thread,
+                           struct nDPId_replay_cursor * const cursor,
+                           size_t last,
+                           uint64_t seq_base,
+                           int batched)
+{
+    unsigned long long int const owner = reader_thread->array_index;
+    size_t replayed = 0;
 
-        is_new_flow = 1;
-    }
-    else
+    while (cursor->slice < nDPId_options.reader_thread_count)
     {
-        /* flow already exists in the tree */
+        struct nDPId_replay_slice const * const slice = &pcap_replay.slices[cursor->slice];
 
-        struct nDPId_flow_basic * const flow_basic_to_process = *(struct nDPId_flow_basic **)tree_result;
-        /* Update last seen timestamp for timeout handling. */
-        flow_basic_to_process->last_seen = time_ms;
-        /* TCP-FIN: indicates that at least one side wants to end the connection (timeout handling as well) */
-        if (flow_basic.tcp_fin_rst_seen != 0)
+        if (cursor->pos == slice->owner_offsets[owner + 1])
         {
-            flow_basic_to_process->tcp_fin_rst_seen = 1;
+            if (++cursor->slice < nDPId_options.reader_thread_count)
+            {
+                cursor->pos = pcap_replay.slices[cursor->slice].owner_offsets[owner];
+            }
+            continue;
         }
 
-        switch (flow_basic_to_process->type)
+        size_t const j = pcap_replay.order[cursor->pos];
+        if (j >= last)
         {
-            case FT_UNKNOWN:
-                return;
-            case FT_SKIPPED:
-                return;
-            case FT_FINISHED:
-                return;
-            case FT_INFO:
-                break;
+            break;
         }
-        flow_to_process = (struct nDPId_flow_info *)flow_basic_to_process;
-
-#ifdef ENABLE_ZLIB
-        if (nDPId_options.enable_zlib_compression != 0 && flow_to_process->detection_data_compressed_size > 0)
+        if (replayed++ % 1024 == 0 && __sync_fetch_and_add(&pcap_replay.stop, 0) != 0)
         {
-            int ret = detection_data_inflate(flow_to_process);
-            if (ret <= 0)
-            {
-                syslog(LOG_DAEMON | LOG_ERR,
-                       "zLib decompression failed for existing flow %u with error code: %d",
-                       flow_to_process->flow_extended.flow_id,
-                       ret);
-                return;
-            }
+            break;
         }
-#endif
 
-        if (direction_changed != 0)
+        struct nDPId_replay_packet const * const packet = &pcap_replay.packets[j];
+        size_t const captured = cursor->slice_captured[cursor->slice] + packet->captured_before;
+
+        tick_replay_clock(reader_thread, cursor, j, seq_base, batched, 0);
+        reader_thread->ordered_events.seq = seq_base + j + 1;
+        if (batched != 0)
         {
-            ndpi_src = &flow_to_process->detection_data->dst;
-            ndpi_dst = &flow_to_process->detection_data->src;
+            collect_replay_packet(reader_thread, packet, captured - cursor->captured);
         }
         else
         {
-            ndpi_src = &flow_to_process->detection_data->src;
-            ndpi_dst = &flow_to_process->detection_data->dst;
+            reader_thread->workflow->packets_captured += captured - cursor->captured;
+            process_replay_packet(reader_thread, packet);
         }
+        cursor->pos++;
+        cursor->captured = captured + 1;
+        cursor->next_packet = j + 1;
     }
 
-    flow_to_process->flow_extended.packets_processed++;
-    flow_to_process->flow_extended.total_l4_payload_len += l4_payload_len;
-    if (flow_to_process->flow_extended.first_seen == 0)
-    {
-        flow_to_process->flow_extended.first_seen = time_ms;
-    }
-    if (l4_payload_len > flow_to_process->flow_extended.max_l4_payload_len)
-    {
-        flow_to_process->flow_extended.max_l4_payload_len = l4_payload_len;
-    }
-    if (l4_payload_len < flow_to_process->flow_extended.min_l4_payload_len)
+    tick_replay_clock(reader_thread, cursor, last, seq_base, batched, 1);
+    if (batched != 0)
     {
-        flow_to_process->flow_extended.min_l4_payload_len = l4_payload_len;
+        process_packet_batch(reader_thread);
     }
+}
 
-    if (is_new_flow != 0)
-    {
-        flow_to_process->flow_extended.max_l4_payload_len = l4_payload_len;
-        flow_to_process->flow_extended.min_l4_payload_len = l4_payload_len;
-        jsonize_flow_event(reader_thread, flow_to_process, FLOW_EVENT_NEW);
-    }
+/*
+ * All reader threads walk through the files in lockstep.
+ * Reader thread 0 loads the next file, while the barriers guarantee that no other thread still uses the last one.
+ * An ordered replay additionally stops all reader threads every nDPId_ORDERED_REPLAY_ROUND packets,
+ * so reader thread 0 can merge their buffered events.
+ */
+static void run_pcap_replay(struct nDPId_reader_thread * const reader_thread)
+{
+    int const batched = (nDPId_options.packet_batch_size > 1);
+    uint64_t seq_base = 0;
 
-    jsonize_packet_event(reader_thread,
-                         header,
-                         packet,
-                         type,
-                         ip_offset,
-                         (l4_ptr - packet),
-                         l4_len,
-                         &flow_to_process->flow_extended,
-                         PACKET_EVENT_PAYLOAD_FLOW);
+    reader_thread->packet_batch_used = 0;
 
-    if (flow_to_process->detection_data->flow.num_processed_pkts == nDPId_options.max_packets_per_flow_to_process - 1)
+    for (size_t i = 0; i < pcap_replay.file_count; ++i)
     {
-        if (flow_to_process->detection_completed != 0)
-        {
-            jsonize_flow_event(reader_thread, flow_to_process, FLOW_EVENT_DETECTION_UPDATE);
-        }
-        else
+        struct nDPId_replay_cursor cursor = {};
+        size_t round_size;
+
+        if (reader_thread->array_index == 0)
         {
-            /* last chance to guess something, better then nothing */
-            uint8_t protocol_was_guessed = 0;
-            flow_to_process->detection_data->guessed_l7_protocol = ndpi_detection_giveup(
-                workflow->ndpi_struct, &flow_to_process->detection_data->flow, 1, &protocol_was_guessed);
-            if (protocol_was_guessed != 0)
-            {
-                jsonize_flow_event(reader_thread, flow_to_process, FLOW_EVENT_GUESSED);
-            }
-            else
+            pcap_replay.done = (__sync_fetch_and_add(&pcap_replay.stop, 0) != 0);
+            if (pcap_replay.done == 0 && load_pcap_replay_file(i) != 0)
             {
-                jsonize_flow_event(reader_thread, flow_to_process, FLOW_EVENT_NOT_DETECTED);
+                syslog(LOG_DAEMON | LOG_ERR, "Skipping pcap file: '%s'", pcap_replay.files[i]);
             }
         }
-    }
+        pthread_barrier_wait(&pcap_replay.barrier);
+        if (pcap_replay.done != 0)
+        {
+            break;
+        }
 
-    flow_to_process->detection_data->detected_l7_protocol =
-        ndpi_detection_process_packet(workflow->ndpi_struct,
-                                      &flow_to_process->detection_data->flow,
-                                      ip != NULL ? (uint8_t *)ip : (uint8_t *)ip6,
-                                      ip_size,
-                                      time_ms,
-                                      ndpi_src,
-                                      ndpi_dst);
+        classify_pcap_replay_packets(reader_thread);
+        pthread_barrier_wait(&pcap_replay.barrier);
 
-    if (ndpi_is_protocol_detected(workflow->ndpi_struct, flow_to_process->detection_data->detected_l7_protocol) != 0 &&
-        flow_to_process->detection_completed == 0)
-    {
-        flow_to_process->detection_completed = 1;
-        workflow->detected_flow_protocols++;
-        jsonize_flow_event(reader_thread, flow_to_process, FLOW_EVENT_DETECTED);
-        flow_to_process->detection_data->last_ndpi_flow_struct_hash =
-            calculate_ndpi_flow_struct_hash(&flow_to_process->detection_data->flow);
-    }
-    else if (flow_to_process->detection_completed == 1)
-    {
-        uint32_t hash = calculate_ndpi_flow_struct_hash(&flow_to_process->detection_data->flow);
-        if (hash != flow_to_process->detection_data->last_ndpi_flow_struct_hash)
+        cursor.pos = pcap_replay.slices[0].owner_offsets[reader_thread->array_index];
+        for (unsigned long long int t = 1; t < nDPId_options.reader_thread_count; ++t)
+        {
+            struct nDPId_replay_slice const * const slice = &pcap_replay.slices[t - 1];
+
+            cursor.slice_captured[t] = cursor.slice_captured[t - 1] + slice->packets_accepted;
+            cursor.slice_clock_max[t] =
+                (cursor.slice_clock_max[t - 1] > slice->clock_max ? cursor.slice_clock_max[t - 1] : slice->clock_max);
+        }
+        round_size = (nDPId_options.ordered_replay != 0 ? nDPId_ORDERED_REPLAY_ROUND : pcap_replay.packets_used);
+        for (size_t first = 0; first < pcap_replay.packets_used; first += round_size)
+        {
+            size_t const last =
+                (pcap_replay.packets_used - first > round_size ? first + round_size : pcap_replay.packets_used);
+
+            replay_packets(reader_thread, &cursor, last, seq_base, batched);
+            if (nDPId_options.ordered_replay != 0)
+            {
+                pthread_barrier_wait(&pcap_replay.barrier);
+                if (reader_thread->array_index == 0)
+                {
+                    merge_ordered_events(reader_thread);
+                }
+                pthread_barrier_wait(&pcap_replay.barrier);
+            }
+        }
+        seq_base += pcap_replay.packets_used;
+
+        pthread_barrier_wait(&pcap_replay.barrier);
+        if (reader_thread->array_index == 0)
         {
-            jsonize_flow_event(reader_thread, flow_to_process, FLOW_EVENT_DETECTION_UPDATE);
-            flow_to_process->detection_data->last_ndpi_flow_struct_hash = hash;
+            unload_pcap_replay_file();
         }
     }
 
-    if (flow_to_process->detection_data->flow.num_processed_pkts == nDPId_options.max_packets_per_flow_to_process)
-    {
-        free_detection_data(flow_to_process);
-        flow_to_process->flow_extended.flow_basic.type = FT_FINISHED;
-    }
-#ifdef ENABLE_ZLIB
-    else if (nDPId_options.enable_zlib_compression != 0)
+    if (nDPId_options.ordered_replay != 0)
     {
-        check_for_compressable_flows(reader_thread);
+        /* events emitted before the first or after the last round e.g. the daemon init events */
+        pthread_barrier_wait(&pcap_replay.barrier);
+        if (reader_thread->array_index == 0)
+        {
+            merge_ordered_events(reader_thread);
+        }
+        pthread_barrier_wait(&pcap_replay.barrier);
+        reader_thread->ordered_events.enabled = 0;
     }
-#endif
 }
 
-static void run_pcap_loop(struct nDPId_reader_thread const * const reader_thread)
+static void run_pcap_loop(struct nDPId_reader_thread * const reader_thread)
 {
     if (reader_thread->workflow != NULL && reader_thread->workflow->pcap_handle != NULL)
     {
+        int ret;
+
+        if (pcap_replay.file_count > 0)
+        {
+            run_pcap_replay(reader_thread);
+            return;
+        }
+        if (pcap_file(reader_thread->workflow->pcap_handle) == NULL)
+        {
+            setup_live_capture_polling(reader_thread);
+        }
+        if (nDPId_options.packet_batch_size > 1)
+        {
+            ret = run_pcap_batch_loop(reader_thread);
+        }
+        else if (pcap_file(reader_thread->workflow->pcap_handle) == NULL)
+        {
+            do
+            {
+                ret = dispatch_live_packets(reader_thread, -1, &ndpi_process_packet);
+            } while (ret >= 0);
+        }
+        else
+        {
+            ret = pcap_loop(reader_thread->workflow->pcap_handle, -1, &ndpi_process_packet, (uint8_t *)reader_thread);
+        }
 
-        if (pcap_loop(reader_thread->workflow->pcap_handle, -1, &ndpi_process_packet, (uint8_t *)reader_thread) ==
-            PCAP_ERROR)
+        if (ret == PCAP_ERROR)
         {
 
             syslog(LOG_DAEMON | LOG_ERR,
@@ -3103,6 +6331,7 @@ static void run_pcap_loop(struct nDPId_reader_thread const * const reader_thread
 
 static void break_pcap_loop(struct nDPId_reader_thread * const reader_thread)
 {
+    __sync_fetch_and_or(&pcap_replay.stop, 1);
     if (reader_thread->workflow != NULL && reader_thread->workflow->pcap_handle != NULL)
     {
         pcap_breakloop(reader_thread->workflow->pcap_handle);
@@ -3168,8 +6397,18 @@ static int start_reader_threads(void)
     closelog();
     openlog("nDPId", LOG_CONS | (nDPId_options.log_to_stderr != 0 ? LOG_PERROR : 0), LOG_DAEMON);
 
+    if (create_stats_socket() != 0)
+    {
+        return 1;
+    }
+
     errno = 0;
-    if (change_user_group(nDPId_options.user, nDPId_options.group, nDPId_options.pidfile, NULL, NULL) != 0)
+    if (change_user_group(nDPId_options.user,
+                          nDPId_options.group,
+                          nDPId_options.pidfile,
+                          NULL,
+                          NULL,
+                          nDPId_options.stats_sockpath) != 0)
     {
         if (errno != 0)
         {
@@ -3192,7 +6431,7 @@ static int start_reader_threads(void)
             break;
         }
 
-        if (pthread_create(&reader_threads[i].thread_id, NULL, processing_thread, &reader_threads[i]) != 0)
+        if (create_reader_thread(&reader_threads[i], processing_thread) != 0)
         {
             syslog(LOG_DAEMON | LOG_ERR, "pthread_create: %s", strerror(errno));
             return 1;
@@ -3208,36 +6447,23 @@ static int start_reader_threads(void)
     return 0;
 }
 
-static void ndpi_shutdown_walker(void const * const A, ndpi_VISIT which, int depth, void * const user_data)
+static void shutdown_walker(struct nDPId_workflow * const workflow, struct nDPId_flow_basic * const flow_basic)
 {
-    struct nDPId_workflow * const workflow = (struct nDPId_workflow *)user_data;
-    struct nDPId_flow_basic * const flow_basic = *(struct nDPId_flow_basic **)A;
-
-    (void)depth;
-
-    if (workflow == NULL || flow_basic == NULL)
-    {
-        return;
-    }
-
     if (workflow->cur_idle_flows == nDPId_options.max_idle_flows_per_thread)
     {
         return;
     }
 
-    if (which == ndpi_preorder || which == ndpi_leaf)
+    workflow->ndpi_flows_idle[workflow->cur_idle_flows++] = flow_basic;
+    switch (flow_basic->type)
     {
-        workflow->ndpi_flows_idle[workflow->cur_idle_flows++] = flow_basic;
-        switch (flow_basic->type)
-        {
-            case FT_UNKNOWN:
-            case FT_SKIPPED:
-                break;
-            case FT_INFO:
-            case FT_FINISHED:
-                workflow->total_idle_flows++;
-                break;
-        }
+        case FT_UNKNOWN:
+        case FT_SKIPPED:
+            break;
+        case FT_INFO:
+        case FT_FINISHED:
+            workflow->total_idle_flows++;
+            break;
     }
 }
 
@@ -3248,17 +6474,56 @@ static void process_remaining_flows(void)
         for (size_t idle_scan_index = 0; idle_scan_index < reader_threads[i].workflow->max_active_flows;
              ++idle_scan_index)
         {
-            ndpi_twalk(reader_threads[i].workflow->ndpi_flows_active[idle_scan_index],
-                       ndpi_shutdown_walker,
-                       reader_threads[i].workflow);
-            process_idle_flow(&reader_threads[i], idle_scan_index);
+            walk_flow_table_bucket(reader_threads[i].workflow, idle_scan_index, shutdown_walker);
+            process_idle_flow(&reader_threads[i]);
         }
 
+        if (nDPId_options.status_interval != 0)
+        {
+            update_pcap_stats(&reader_threads[i]);
+            jsonize_daemon(&reader_threads[i], DAEMON_EVENT_STATUS);
+        }
         jsonize_daemon(&reader_threads[i], DAEMON_EVENT_SHUTDOWN);
         close(reader_threads[i].json_sockfd);
         reader_threads[i].json_sockfd = -1;
     }
 }
+#ifdef ENABLE_LATENCY_HISTOGRAMS
+/*
+ * The reader threads were either joined or reached EOF (set after their last sample),
+ * so their histograms can be merged without a snapshot.
+ */
+static void print_latency_summary(void)
+{
+    static struct nDPId_latency_histogram merged_latency_histograms[LATENCY_STAGE_COUNT];
+
+    memset(merged_latency_histograms, 0, sizeof(merged_latency_histograms));
+    for (unsigned long long int i = 0; i < nDPId_options.reader_thread_count; ++i)
+    {
+        if (reader_threads[i].workflow == NULL)
+        {
+            continue;
+        }
+
+        latency_histograms_merge(merged_latency_histograms, reader_threads[i].latency_histograms_total);
+        latency_histograms_merge(merged_latency_histograms, reader_threads[i].latency_histograms);
+    }
+
+    for (size_t stage = 0; stage < LATENCY_STAGE_COUNT; ++stage)
+    {
+        struct nDPId_latency_histogram const * const histogram = &merged_latency_histograms[stage];
+
+        printf("Latency %-15s: %llu samples, p50 %llu ns, p90 %llu ns, p99 %llu ns, p99.9 %llu ns, max %llu ns\n",
+               latency_stage_name_table[stage],
+               (unsigned long long int)histogram->count,
+               (unsigned long long int)latency_histogram_percentile(histogram, 500),
+               (unsigned long long int)latency_histogram_percentile(histogram, 900),
+               (unsigned long long int)latency_histogram_percentile(histogram, 990),
+               (unsigned long long int)latency_histogram_percentile(histogram, 999),
+               (unsigned long long int)histogram->max);
+    }
+}
+#endif
 
 static int stop_reader_threads(void)
 {
@@ -3329,10 +6594,184 @@ static int stop_reader_threads(void)
     return 0;
 }
 
+static int create_stats_socket(void)
+{
+    struct sockaddr_un saddr;
+
+    if (nDPId_options.stats_sockpath == NULL)
+    {
+        return 0;
+    }
+
+    stats_sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (stats_sockfd < 0)
+    {
+        syslog(LOG_DAEMON | LOG_ERR, "Error opening statistics socket: %s", strerror(errno));
+        return 1;
+    }
+
+    saddr.sun_family = AF_UNIX;
+    if (snprintf(saddr.sun_path, sizeof(saddr.sun_path), "%s", nDPId_options.stats_sockpath) <= 0 ||
+        bind(stats_sockfd, (struct sockaddr *)&saddr, sizeof(saddr)) < 0)
+    {
+        syslog(LOG_DAEMON | LOG_ERR,
+               "Error on binding UNIX socket (statistics) to %s: %s",
+               nDPId_options.stats_sockpath,
+               strerror(errno));
+        close(stats_sockfd);
+        stats_sockfd = -1;
+        return 1;
+    }
+
+    if (listen(stats_sockfd, 16) < 0)
+    {
+        syslog(LOG_DAEMON | LOG_ERR, "Error on listen: %s", strerror(errno));
+        close(stats_sockfd);
+        stats_sockfd = -1;
+        unlink(nDPId_options.stats_sockpath);
+        return 1;
+    }
+
+    syslog(LOG_DAEMON, "statistics listen on %s", nDPId_options.stats_sockpath);
+
+    return 0;
+}
+
+static void close_stats_socket(void)
+{
+    if (stats_sockfd < 0)
+    {
+        return;
+    }
+
+    close(stats_sockfd);
+    stats_sockfd = -1;
+    unlink(nDPId_options.stats_sockpath);
+}
+
+/* Returns 0 on success, 1 if the serialized JSON string could not be sent. */
+static int send_runtime_stats_line(int client_fd, ndpi_serializer * const serializer)
+{
+    char newline_json_str[NETWORK_BUFFER_MAX_SIZE];
+    char * json_str;
+    uint32_t json_str_len;
+    int s_ret;
+
+    json_str = ndpi_serializer_get_buffer(serializer, &json_str_len);
+    s_ret = snprintf(newline_json_str,
+                     sizeof(newline_json_str),
+                     "%0" NETWORK_BUFFER_LENGTH_DIGITS_STR "u%.*s\n",
+                     json_str_len + 1,
+                     (int)json_str_len,
+                     json_str);
+    ndpi_reset_serializer(serializer);
+    if (s_ret < 0 || s_ret > (int)sizeof(newline_json_str) || write(client_fd, newline_json_str, s_ret) != s_ret)
+    {
+        return 1;
+    }
+
+    return 0;
+}
+
+static void send_runtime_stats(int client_fd)
+{
+    ndpi_serializer serializer;
+#ifdef ENABLE_LATENCY_HISTOGRAMS
+    static struct nDPId_latency_histogram merged_latency_histograms[LATENCY_STAGE_COUNT];
+    int reader_threads_merged = 0;
+
+    memset(merged_latency_histograms, 0, sizeof(merged_latency_histograms));
+#endif
+
+    if (ndpi_init_serializer_ll(&serializer, ndpi_serialization_format_json, NETWORK_BUFFER_MAX_SIZE) != 1)
+    {
+        return;
+    }
+
+    for (unsigned long long int i = 0; i < nDPId_options.reader_thread_count; ++i)
+    {
+        struct nDPId_stats_snapshot snapshot;
+
+        if (read_stats_snapshot(&reader_threads[i], &snapshot) != 0)
+        {
+            continue;
+        }
+
+        ndpi_serialize_string_int32(&serializer, "thread_id", reader_threads[i].array_index);
+        ndpi_serialize_string_string(&serializer, "source", nDPId_options.pcap_file_or_interface);
+        ndpi_serialize_string_string(&serializer, "alias", nDPId_options.instance_alias);
+        jsonize_runtime_stats(&serializer, &snapshot);
+#ifdef ENABLE_LATENCY_HISTOGRAMS
+        jsonize_latency_histograms(&serializer, snapshot.latency_histograms);
+        latency_histograms_merge(merged_latency_histograms, snapshot.latency_histograms);
+        reader_threads_merged++;
+#endif
+
+        if (send_runtime_stats_line(client_fd, &serializer) != 0)
+        {
+            ndpi_term_serializer(&serializer);
+            return;
+        }
+    }
+
+#ifdef ENABLE_LATENCY_HISTOGRAMS
+    /* percentiles can not be combined, so the summary over all reader threads is built from the merged histograms */
+    if (reader_threads_merged > 0)
+    {
+        ndpi_serialize_string_int32(&serializer, "reader_threads", reader_threads_merged);
+        ndpi_serialize_string_string(&serializer, "source", nDPId_options.pcap_file_or_interface);
+        ndpi_serialize_string_string(&serializer, "alias", nDPId_options.instance_alias);
+        jsonize_latency_histograms(&serializer, merged_latency_histograms);
+        send_runtime_stats_line(client_fd, &serializer);
+    }
+#endif
+
+    ndpi_term_serializer(&serializer);
+}
+
+/*
+ * Waits up to one second for a statistics client.
+ * Clients are served sequentially by the main thread, so a slow reader gets dropped after a send timeout.
+ */
+static void serve_stats_socket(void)
+{
+    struct pollfd pfd = {.fd = stats_sockfd, .events = POLLIN, .revents = 0};
+    struct timeval const send_timeout = {.tv_sec = 1, .tv_usec = 0};
+    int client_fd;
+
+    if (stats_sockfd < 0)
+    {
+        sleep(1);
+        return;
+    }
+
+    if (poll(&pfd, 1, 1000) <= 0 || (pfd.revents & POLLIN) == 0)
+    {
+        return;
+    }
+
+    client_fd = accept4(stats_sockfd, NULL, NULL, SOCK_CLOEXEC);
+    if (client_fd < 0)
+    {
+        return;
+    }
+
+    if (setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout)) == 0)
+    {
+        send_runtime_stats(client_fd);
+    }
+    close(client_fd);
+}
+
 static void free_reader_threads(void)
 {
+    stop_flow_capture_writer();
     for (unsigned long long int i = 0; i < nDPId_options.reader_thread_count; ++i)
     {
+        free(reader_threads[i].ordered_events.buf);
+        reader_threads[i].ordered_events.buf = NULL;
+        free_flow_capture(&reader_threads[i].flow_capture);
+
         if (reader_threads[i].workflow == NULL)
         {
             continue;
@@ -3340,6 +6779,12 @@ static void free_reader_threads(void)
 
         free_workflow(&reader_threads[i].workflow);
     }
+    if (capture_bpf_valid != 0)
+    {
+        pcap_freecode(&capture_bpf);
+        capture_bpf_valid = 0;
+    }
+    free_pcap_replay();
 }
 
 static void sighandler(int signum)
@@ -3381,6 +6826,12 @@ static void print_subopt_usage(void)
                 case IDLE_SCAN_PERIOD:
                     fprintf(stderr, "%llu\n", nDPId_options.idle_scan_period);
                     break;
+                case STATUS_INTERVAL:
+                    fprintf(stderr, "%llu\n", nDPId_options.status_interval);
+                    break;
+                case STAGE_TIMINGS:
+                    fprintf(stderr, "%llu\n", nDPId_options.stage_timings);
+                    break;
 #ifdef ENABLE_MEMORY_PROFILING
                 case MEMORY_PROFILING_PRINT_EVERY:
                     fprintf(stderr, "%llu\n", nDPId_options.memory_profiling_print_every);
@@ -3415,6 +6866,27 @@ static void print_subopt_usage(void)
                 case MAX_PACKETS_PER_FLOW_TO_PROCESS:
                     fprintf(stderr, "%llu\n", nDPId_options.max_packets_per_flow_to_process);
                     break;
+                case PACKET_BATCH_SIZE:
+                    fprintf(stderr, "%llu\n", nDPId_options.packet_batch_size);
+                    break;
+                case ORDERED_REPLAY:
+                    fprintf(stderr, "%llu\n", nDPId_options.ordered_replay);
+                    break;
+                case CAPTURE_GUESSED:
+                    fprintf(stderr, "%llu\n", nDPId_options.capture_guessed);
+                    break;
+                case CAPTURE_UNDETECTED:
+                    fprintf(stderr, "%llu\n", nDPId_options.capture_undetected);
+                    break;
+                case CAPTURE_RISKY:
+                    fprintf(stderr, "%llu\n", nDPId_options.capture_risky);
+                    break;
+                case CAPTURE_MIDSTREAM:
+                    fprintf(stderr, "%llu\n", nDPId_options.capture_midstream);
+                    break;
+                case CAPTURE_ROTATION:
+                    fprintf(stderr, "%llu\n", nDPId_options.capture_rotation);
+                    break;
             }
         }
         else
@@ -3431,7 +6903,7 @@ static int nDPId_parse_options(int argc, char ** argv)
 
     static char const usage[] =
         "Usage: %s "
-        "[-i pcap-file/interface] [-I] [-E] [-B bpf-filter]\n"
+        "[-i pcap-file/interface] [-F pcap-file-list] [-I] [-E] [-B bpf-filter]\n"
         "\t  \t"
         "[-l] [-c path-to-unix-sock] "
         "[-d] [-p pidfile]\n"
@@ -3439,10 +6911,18 @@ static int nDPId_parse_options(int argc, char ** argv)
         "[-u user] [-g group] "
         "[-P path] [-C path] [-J path]\n"
         "\t  \t"
-        "[-a instance-alias] [-o subopt=value]\n"
+        "[-a instance-alias] [-A cpu-list|irq] [-x path-to-unix-sock]\n"
+        "\t  \t"
+        "[-w capture-dir] [-W bpf-filter]\n"
+        "\t  \t"
+        "[-o subopt=value]\n"
         "\t  \t"
         "[-v] [-h]\n\n"
         "\t-i\tInterface or file from where to read packets from.\n"
+        "\t  \tA glob pattern e.g. '/var/log/pcap/*.pcap' replays all matching files back-to-back.\n"
+        "\t-F\tReplay all pcap files listed in a file (one per line) back-to-back.\n"
+        "\t  \tWith `-o ordered-replay=1' the flows of the replayed files are processed by all reader threads\n"
+        "\t  \tin parallel, while the events are merged in capture order (deterministic output).\n"
         "\t-I\tProcess only packets where the source address of the first packet\n"
         "\t  \tis part of the interface subnet. (Internal mode)\n"
         "\t-E\tProcess only packets where the source address of the first packet\n"
@@ -3465,6 +6945,14 @@ static int nDPId_parse_options(int argc, char ** argv)
         "\t  \tThis value is required for correct flow handling of\n"
         "\t  \tmultiple instances and should be unique.\n"
         "\t  \tDefaults to your hostname.\n"
+        "\t-A\tPin reader threads to CPUs e.g. `0-3,8'. Thread N runs on the Nth listed CPU.\n"
+        "\t  \tUse `irq' to run on the CPUs handling the interrupts of the capture interface.\n"
+        "\t  \tThe workflow memory of a thread is allocated on the NUMA node of its CPU.\n"
+        "\t-x\tPath to a UNIX socket which provides the runtime statistics of all reader threads.\n"
+        "\t  \tEvery connecting client receives one JSON object per thread, then the socket gets closed.\n"
+        "\t-w\tWrite the first packets of selected flows to pcap files in this directory.\n"
+        "\t  \tFlows are selected after their detection finished, see the `capture-*' subopts.\n"
+        "\t-W\tAlso capture all flows with a first packet matching this PCAP filter string. (BPF format)\n"
 #ifdef ENABLE_ZLIB
         "\t-z\tEnable flow memory zLib compression. (Experimental!)\n"
 #endif
@@ -3472,13 +6960,16 @@ static int nDPId_parse_options(int argc, char ** argv)
         "\t-v\tversion\n"
         "\t-h\tthis\n\n";
 
-    while ((opt = getopt(argc, argv, "hi:IEB:lc:dp:u:g:P:C:J:S:a:zo:vh")) != -1)
+    while ((opt = getopt(argc, argv, "hi:F:IEB:lc:dp:u:g:P:C:J:S:a:A:x:w:W:zo:vh")) != -1)
     {
         switch (opt)
         {
             case 'i':
                 nDPId_options.pcap_file_or_interface = strdup(optarg);
                 break;
+            case 'F':
+                nDPId_options.pcap_file_list = strdup(optarg);
+                break;
             case 'I':
                 nDPId_options.process_internal_initial_direction = 1;
                 break;
@@ -3530,6 +7021,18 @@ static int nDPId_parse_options(int argc, char ** argv)
             case 'a':
                 nDPId_options.instance_alias = strdup(optarg);
                 break;
+            case 'A':
+                nDPId_options.cpu_affinity = strdup(optarg);
+                break;
+            case 'x':
+                nDPId_options.stats_sockpath = strdup(optarg);
+                break;
+            case 'w':
+                nDPId_options.capture_dir = strdup(optarg);
+                break;
+            case 'W':
+                nDPId_options.capture_bpf_str = strdup(optarg);
+                break;
             case 'z':
 #ifdef ENABLE_ZLIB
                 nDPId_options.enable_zlib_compression = 1;
@@ -3588,6 +7091,12 @@ static int nDPId_parse_options(int argc, char ** argv)
                         case IDLE_SCAN_PERIOD:
                             nDPId_options.idle_scan_period = value_llu;
                             break;
+                        case STATUS_INTERVAL:
+                            nDPId_options.status_interval = value_llu;
+                            break;
+                        case STAGE_TIMINGS:
+                            nDPId_options.stage_timings = value_llu;
+                            break;
 #ifdef ENABLE_MEMORY_PROFILING
                         case MEMORY_PROFILING_PRINT_EVERY:
                             nDPId_options.memory_profiling_print_every = value_llu;
@@ -3621,6 +7130,28 @@ static int nDPId_parse_options(int argc, char ** argv)
                             break;
                         case MAX_PACKETS_PER_FLOW_TO_PROCESS:
                             nDPId_options.max_packets_per_flow_to_process = value_llu;
+                            break;
+                        case PACKET_BATCH_SIZE:
+                            nDPId_options.packet_batch_size = value_llu;
+                            break;
+                        case ORDERED_REPLAY:
+                            nDPId_options.ordered_replay = value_llu;
+                            break;
+                        case CAPTURE_GUESSED:
+                            nDPId_options.capture_guessed = value_llu;
+                            break;
+                        case CAPTURE_UNDETECTED:
+                            nDPId_options.capture_undetected = value_llu;
+                            break;
+                        case CAPTURE_RISKY:
+                            nDPId_options.capture_risky = value_llu;
+                            break;
+                        case CAPTURE_MIDSTREAM:
+                            nDPId_options.capture_midstream = value_llu;
+                            break;
+                        case CAPTURE_ROTATION:
+                            nDPId_options.capture_rotation = value_llu;
+                            break;
                     }
                 }
                 break;
@@ -3662,6 +7193,18 @@ static int validate_options(char const * const arg0)
     {
         retval = 1;
     }
+    if (nDPId_options.pcap_file_list != NULL)
+    {
+        if (nDPId_options.pcap_file_or_interface != NULL)
+        {
+            fprintf(stderr, "%s: `-i' and `-F' can not be used together\n", arg0);
+            retval = 1;
+        }
+        else
+        {
+            nDPId_options.pcap_file_or_interface = strdup(nDPId_options.pcap_file_list);
+        }
+    }
     if (nDPId_options.instance_alias == NULL)
     {
         char hname[256];
@@ -3685,6 +7228,15 @@ static int validate_options(char const * const arg0)
             }
         }
     }
+    if (nDPId_options.cpu_affinity != NULL && strcmp(nDPId_options.cpu_affinity, "irq") != 0 &&
+        parse_cpu_list(nDPId_options.cpu_affinity,
+                       nDPId_options.reader_thread_cpus,
+                       nDPId_MAX_READER_THREADS,
+                       &nDPId_options.reader_thread_cpu_count) != 0)
+    {
+        fprintf(stderr, "%s: Invalid CPU list: %s\n", arg0, nDPId_options.cpu_affinity);
+        retval = 1;
+    }
     if (nDPId_options.max_flows_per_thread < 128 || nDPId_options.max_flows_per_thread > nDPId_MAX_FLOWS_PER_THREAD)
     {
         fprintf(stderr,
@@ -3726,6 +7278,20 @@ static int validate_options(char const * const arg0)
                 nDPId_options.idle_scan_period);
         retval = 1;
     }
+    if (nDPId_options.status_interval != 0 && nDPId_options.status_interval < 1000)
+    {
+        fprintf(stderr,
+                "%s: Value not in range: status-interval[%llu] > 1000 or 0 (disabled)\n",
+                arg0,
+                nDPId_options.status_interval);
+        retval = 1;
+    }
+    if (nDPId_options.stats_sockpath != NULL &&
+        strlen(nDPId_options.stats_sockpath) >= sizeof(((struct sockaddr_un *)0)->sun_path))
+    {
+        fprintf(stderr, "%s: Path to the statistics UNIX socket too long: %s\n", arg0, nDPId_options.stats_sockpath);
+        retval = 1;
+    }
     if (nDPId_options.tcp_max_post_end_flow_time > nDPId_options.tcp_max_idle_time)
     {
         fprintf(stderr,
@@ -3757,6 +7323,57 @@ static int validate_options(char const * const arg0)
                 nDPId_options.max_packets_per_flow_to_process);
         retval = 1;
     }
+    if (nDPId_options.packet_batch_size < 1 || nDPId_options.packet_batch_size > nDPId_MAX_PACKET_BATCH_SIZE)
+    {
+        fprintf(stderr,
+                "%s: Value not in range: 1 =< packet-batch-size[%llu] =< %u\n",
+                arg0,
+                nDPId_options.packet_batch_size,
+                nDPId_MAX_PACKET_BATCH_SIZE);
+        retval = 1;
+    }
+    if (nDPId_options.stage_timings > 1)
+    {
+        fprintf(stderr, "%s: Value not in range: stage-timings[%llu] 0 or 1\n", arg0, nDPId_options.stage_timings);
+        retval = 1;
+    }
+    if (nDPId_options.ordered_replay > 1)
+    {
+        fprintf(stderr, "%s: Value not in range: ordered-replay[%llu] 0 or 1\n", arg0, nDPId_options.ordered_replay);
+        retval = 1;
+    }
+    if (nDPId_options.ordered_replay != 0 && nDPId_options.pcap_file_or_interface == NULL)
+    {
+        fprintf(stderr, "%s: An ordered replay requires pcap files, see `-i' and `-F'.\n", arg0);
+        retval = 1;
+    }
+    if (nDPId_options.capture_guessed > 1 || nDPId_options.capture_undetected > 1 ||
+        nDPId_options.capture_risky > 1 || nDPId_options.capture_midstream > 1)
+    {
+        fprintf(stderr,
+                "%s: Value not in range: capture-guessed[%llu], capture-undetected[%llu], capture-risky[%llu] and "
+                "capture-midstream[%llu] 0 or 1\n",
+                arg0,
+                nDPId_options.capture_guessed,
+                nDPId_options.capture_undetected,
+                nDPId_options.capture_risky,
+                nDPId_options.capture_midstream);
+        retval = 1;
+    }
+    if (nDPId_options.capture_bpf_str != NULL && nDPId_options.capture_dir == NULL)
+    {
+        fprintf(stderr, "%s: `-W' requires a capture directory, see `-w'.\n", arg0);
+        retval = 1;
+    }
+    if (nDPId_options.capture_dir != NULL && access(nDPId_options.capture_dir, W_OK) != 0)
+    {
+        fprintf(stderr,
+                "%s: Capture directory `%s' is not writable: %s\n",
+                arg0,
+                nDPId_options.capture_dir,
+                strerror(errno));
+        retval = 1;
+    }
 
     return retval;
 }
@@ -3798,7 +7415,10 @@ int main(int argc, char ** argv)
 
     openlog("nDPId", LOG_CONS | LOG_PERROR, LOG_DAEMON);
 #ifdef ENABLE_MEMORY_PROFILING
-    syslog(LOG_DAEMON, "size/flow: %zu bytes\n", sizeof(struct nDPId_flow_info) + sizeof(struct nDPId_detection_data));
+    syslog(LOG_DAEMON,
+           "size/flow: %zu bytes\n",
+           sizeof(struct nDPId_flow_basic) + sizeof(struct nDPId_flow_extended) + sizeof(struct nDPId_flow_info) +
+               sizeof(struct nDPId_detection_data));
 #endif
 
     if (setup_reader_threads() != 0)
@@ -3817,13 +7437,17 @@ int main(int argc, char ** argv)
 
     while (nDPId_main_thread_shutdown == 0 && processing_threads_error_or_eof() == 0)
     {
-        sleep(1);
+        serve_stats_socket();
     }
+    close_stats_socket();
 
     if (nDPId_main_thread_shutdown == 1 && stop_reader_threads() != 0)
     {
         return 1;
     }
+#ifdef ENABLE_LATENCY_HISTOGRAMS
+    print_latency_summary();
+#endif
     free_reader_threads();
 
     daemonize_shutdown(nDPId_options.pidfile);
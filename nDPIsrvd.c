@@ -2,6 +2,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,9 +10,11 @@
 #include <string.h>
 #include <syslog.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "config.h"
@@ -21,13 +24,51 @@
 enum sock_type
 {
     JSON_SOCK,
-    SERV_SOCK
+    SERV_SOCK,
+    WORKER_SOCK
+};
+
+struct remote_descs;
+struct collector_worker;
+
+/*
+ * Events generated by nDPIsrvd itself, see schema/srvd_event_schema.json.
+ * Keep in sync with the schema and dependencies/nDPIsrvd.py.
+ */
+enum srvd_event
+{
+    SRVD_EVENT_INVALID = 0,
+
+    SRVD_EVENT_DISTRIBUTOR_STATS,
+
+    SRVD_EVENT_COUNT
+};
+
+static char const * const srvd_event_name_table[SRVD_EVENT_COUNT] = {
+    [SRVD_EVENT_INVALID] = "invalid",
+    [SRVD_EVENT_DISTRIBUTOR_STATS] = "distributor-stats",
+};
+
+/* Per distributor client counters, served by the statistics socket (-x) and injected into the streams on SIGUSR1. */
+struct distributor_stats
+{
+    unsigned long long int bytes_queued;
+    unsigned long long int events_queued;
+    unsigned long long int bytes_sent;
+    unsigned long long int events_sent;
+    unsigned long long int bytes_dropped;
+    unsigned long long int events_dropped;
+    size_t max_bytes_pending;
+    unsigned long long int blocked_usec; // time spent with pending bytes the socket did not take
+    unsigned long long int max_blocked_usec;
+    unsigned long long int blocked_since;
 };
 
 struct remote_desc
 {
     enum sock_type sock_type;
     int fd;
+    struct remote_descs * owner;
     struct nDPIsrvd_buffer buf;
     union {
         struct
@@ -41,18 +82,64 @@ struct remote_desc
             int serv_sockfd;
             struct sockaddr_in peer;
             char peer_addr[INET_ADDRSTRLEN];
+            int epollout_armed;
+            int dropping;
+            unsigned long long int next_seq; // `distributor_seq' of the next event, see queue_json_message()
+            struct distributor_stats stats;
         } event_serv;
+        struct
+        {
+            struct collector_worker * worker;
+        } event_worker;
     };
 };
 
-static struct
+struct remote_descs
 {
     struct remote_desc * desc;
     size_t desc_size;
     size_t desc_used;
-} remotes = {NULL, 0, 0};
+};
+
+static struct remote_descs remotes = {NULL, 0, 0};
+
+/*
+ * Optional collector worker threads (-w): Collector connections are distributed round-robin across the workers.
+ * A worker reads and frames the JSON lines of its collectors and appends them to a single producer / single consumer
+ * ring, which the main thread drains to the distributors. All lines of a collector pass the same ring,
+ * so their order is preserved.
+ */
+struct collector_worker
+{
+    pthread_t thread;
+    int epollfd;
+    int collector_pipefds[2]; // main thread -> worker: accepted collector fds
+    int data_eventfd;         // worker -> main thread: new JSON lines in the ring
+    int space_eventfd;        // main thread -> worker: ring space available
+    int waiting_for_space;
+    struct remote_desc event_desc; // registered for `data_eventfd' in the main thread epoll
+    struct remote_descs collectors;
+    struct
+    {
+        uint8_t * data;
+        size_t size;
+        size_t head; // advanced by the worker only
+        size_t tail; // advanced by the main thread only
+    } ring;
+};
+
+static struct
+{
+    struct collector_worker * workers;
+    size_t worker_count;
+    size_t next_worker;
+} collector_workers = {NULL, 0, 0};
 
 static int nDPIsrvd_main_thread_shutdown = 0;
+static int collectors_paused = 0;
+static unsigned long long int collectors_paused_since = 0;
+static unsigned long long int collectors_paused_usec = 0;
+static int distributor_stats_sockfd = -1;
 static int json_sockfd;
 static int serv_sockfd;
 static struct nDPIsrvd_address serv_address = {
@@ -67,6 +154,9 @@ static struct
     char * serv_optarg;
     char * user;
     char * group;
+    size_t collector_workers;
+    int drop_slow_distributors;
+    char * stats_sockpath;
 } nDPIsrvd_options = {};
 
 static int fcntl_add_flags(int fd, int flags)
@@ -81,18 +171,6 @@ static int fcntl_add_flags(int fd, int flags)
     return fcntl(fd, F_SETFL, cur_flags | flags);
 }
 
-static int fcntl_del_flags(int fd, int flags)
-{
-    int cur_flags = fcntl(fd, F_GETFL, 0);
-
-    if (cur_flags == -1)
-    {
-        return 1;
-    }
-
-    return fcntl(fd, F_SETFL, cur_flags & ~flags);
-}
-
 static int create_listen_sockets(void)
 {
     json_sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
@@ -162,32 +240,105 @@ static int create_listen_sockets(void)
     return 0;
 }
 
-static struct remote_desc * get_unused_remote_descriptor(enum sock_type type, int remote_fd)
+static int create_distributor_stats_socket(void)
+{
+    struct sockaddr_un stats_addr;
+
+    if (nDPIsrvd_options.stats_sockpath == NULL)
+    {
+        return 0;
+    }
+
+    distributor_stats_sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (distributor_stats_sockfd < 0)
+    {
+        syslog(LOG_DAEMON | LOG_ERR, "Error opening statistics socket: %s", strerror(errno));
+        return 1;
+    }
+
+    stats_addr.sun_family = AF_UNIX;
+    if (snprintf(stats_addr.sun_path, sizeof(stats_addr.sun_path), "%s", nDPIsrvd_options.stats_sockpath) <= 0 ||
+        bind(distributor_stats_sockfd, (struct sockaddr *)&stats_addr, sizeof(stats_addr)) < 0)
+    {
+        syslog(LOG_DAEMON | LOG_ERR,
+               "Error on binding UNIX socket (statistics) to %s: %s",
+               nDPIsrvd_options.stats_sockpath,
+               strerror(errno));
+        close(distributor_stats_sockfd);
+        distributor_stats_sockfd = -1;
+        return 1;
+    }
+
+    if (listen(distributor_stats_sockfd, 16) < 0 || fcntl_add_flags(distributor_stats_sockfd, O_NONBLOCK) != 0)
+    {
+        syslog(LOG_DAEMON | LOG_ERR, "Error on listen: %s", strerror(errno));
+        close(distributor_stats_sockfd);
+        distributor_stats_sockfd = -1;
+        unlink(nDPIsrvd_options.stats_sockpath);
+        return 1;
+    }
+
+    syslog(LOG_DAEMON, "statistics listen on %s", nDPIsrvd_options.stats_sockpath);
+
+    return 0;
+}
+
+static void close_distributor_stats_socket(void)
+{
+    if (distributor_stats_sockfd < 0)
+    {
+        return;
+    }
+
+    close(distributor_stats_sockfd);
+    distributor_stats_sockfd = -1;
+    unlink(nDPIsrvd_options.stats_sockpath);
+}
+
+static struct remote_desc * get_unused_descriptor(struct remote_descs * const descs,
+                                                  enum sock_type type,
+                                                  int remote_fd)
 {
-    if (remotes.desc_used == remotes.desc_size)
+    if (descs->desc_used == descs->desc_size)
     {
         return NULL;
     }
 
-    for (size_t i = 0; i < remotes.desc_size; ++i)
+    for (size_t i = 0; i < descs->desc_size; ++i)
     {
-        if (remotes.desc[i].fd == -1)
+        if (descs->desc[i].fd == -1)
         {
-            remotes.desc_used++;
-            if (nDPIsrvd_buffer_init(&remotes.desc[i].buf, NETWORK_BUFFER_MAX_SIZE) != 0)
+            size_t const buffer_size =
+                (type == SERV_SOCK ? nDPIsrvd_DISTRIBUTOR_BUFFER_SIZE : NETWORK_BUFFER_COLLECTOR_MAX_SIZE);
+
+            descs->desc_used++;
+            if (nDPIsrvd_buffer_init(&descs->desc[i].buf, buffer_size) != 0)
             {
                 return NULL;
             }
-            remotes.desc[i].sock_type = type;
-            remotes.desc[i].fd = remote_fd;
-            return &remotes.desc[i];
+            if (type == SERV_SOCK)
+            {
+                descs->desc[i].event_serv.epollout_armed = 0;
+                descs->desc[i].event_serv.dropping = 0;
+                descs->desc[i].event_serv.next_seq = 0;
+                memset(&descs->desc[i].event_serv.stats, 0, sizeof(descs->desc[i].event_serv.stats));
+            }
+            descs->desc[i].sock_type = type;
+            descs->desc[i].fd = remote_fd;
+            descs->desc[i].owner = descs;
+            return &descs->desc[i];
         }
     }
 
     return NULL;
 }
 
-static int add_event(int epollfd, int fd, void * ptr)
+static struct remote_desc * get_unused_remote_descriptor(enum sock_type type, int remote_fd)
+{
+    return get_unused_descriptor(&remotes, type, remote_fd);
+}
+
+static int ctl_event(int epollfd, int op, int fd, void * ptr, uint32_t event_mask)
 {
     struct epoll_event event = {};
 
@@ -199,8 +350,18 @@ static int add_event(int epollfd, int fd, void * ptr)
     {
         event.data.fd = fd;
     }
-    event.events = EPOLLIN;
-    return epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
+    event.events = event_mask;
+    return epoll_ctl(epollfd, op, fd, &event);
+}
+
+static int add_event(int epollfd, int fd, void * ptr)
+{
+    return ctl_event(epollfd, EPOLL_CTL_ADD, fd, ptr, EPOLLIN);
+}
+
+static int mod_event(int epollfd, int fd, void * ptr, uint32_t event_mask)
+{
+    return ctl_event(epollfd, EPOLL_CTL_MOD, fd, ptr, event_mask);
 }
 
 static int del_event(int epollfd, int fd)
@@ -218,7 +379,7 @@ static void disconnect_client(int epollfd, struct remote_desc * const current)
             syslog(LOG_DAEMON | LOG_ERR, "Error closing fd: %s", strerror(errno));
         }
         current->fd = -1;
-        remotes.desc_used--;
+        current->owner->desc_used--;
     }
     nDPIsrvd_buffer_free(&current->buf);
 }
@@ -227,7 +388,7 @@ static int nDPIsrvd_parse_options(int argc, char ** argv)
 {
     int opt;
 
-    while ((opt = getopt(argc, argv, "lc:dp:s:u:g:vh")) != -1)
+    while ((opt = getopt(argc, argv, "lc:dDp:s:u:g:w:x:vh")) != -1)
     {
         switch (opt)
         {
@@ -241,6 +402,9 @@ static int nDPIsrvd_parse_options(int argc, char ** argv)
             case 'd':
                 daemonize_enable();
                 break;
+            case 'D':
+                nDPIsrvd_options.drop_slow_distributors = 1;
+                break;
             case 'p':
                 free(nDPIsrvd_options.pidfile);
                 nDPIsrvd_options.pidfile = strdup(optarg);
@@ -257,6 +421,27 @@ static int nDPIsrvd_parse_options(int argc, char ** argv)
                 free(nDPIsrvd_options.group);
                 nDPIsrvd_options.group = strdup(optarg);
                 break;
+            case 'w':
+            {
+                nDPIsrvd_ull workers;
+
+                if (str_value_to_ull(optarg, &workers) != CONVERSION_OK ||
+                    workers > nDPIsrvd_MAX_COLLECTOR_WORKERS)
+                {
+                    fprintf(stderr,
+                            "%s: Invalid number of collector workers `%s', max %u\n",
+                            argv[0],
+                            optarg,
+                            nDPIsrvd_MAX_COLLECTOR_WORKERS);
+                    return 1;
+                }
+                nDPIsrvd_options.collector_workers = workers;
+                break;
+            }
+            case 'x':
+                free(nDPIsrvd_options.stats_sockpath);
+                nDPIsrvd_options.stats_sockpath = strdup(optarg);
+                break;
             case 'v':
                 fprintf(stderr, "%s", get_nDPId_version());
                 return 1;
@@ -264,9 +449,9 @@ static int nDPIsrvd_parse_options(int argc, char ** argv)
             default:
                 fprintf(stderr, "%s\n", get_nDPId_version());
                 fprintf(stderr,
-                        "Usage: %s [-l] [-c path-to-unix-sock] [-d] [-p pidfile]\n"
+                        "Usage: %s [-l] [-c path-to-unix-sock] [-d] [-D] [-p pidfile]\n"
                         "\t[-s path-to-unix-socket|distributor-host:port] [-u user] [-g group]\n"
-                        "\t[-v] [-h]\n",
+                        "\t[-w collector-worker-threads] [-x path-to-stats-unix-sock] [-v] [-h]\n",
                         argv[0]);
                 return 1;
         }
@@ -305,6 +490,12 @@ static int nDPIsrvd_parse_options(int argc, char ** argv)
         return 1;
     }
 
+    if (nDPIsrvd_options.stats_sockpath != NULL &&
+        is_path_absolute("Statistics socket", nDPIsrvd_options.stats_sockpath) != 0)
+    {
+        return 1;
+    }
+
     if (optind < argc)
     {
         fprintf(stderr, "%s: Unexpected argument after options\n", argv[0]);
@@ -336,6 +527,41 @@ static struct remote_desc * accept_remote(int server_fd,
     return current;
 }
 
+static int hand_over_collector(void)
+{
+    struct sockaddr_un peer;
+    socklen_t peer_addr_len = sizeof(peer);
+    int collector_fd = accept(json_sockfd, (struct sockaddr *)&peer, &peer_addr_len);
+
+    if (collector_fd < 0)
+    {
+        syslog(LOG_DAEMON | LOG_ERR, "Accept failed: %s", strerror(errno));
+        return 1;
+    }
+
+    /* nonblocking fd is mandatory */
+    if (fcntl_add_flags(collector_fd, O_NONBLOCK) != 0)
+    {
+        syslog(LOG_DAEMON | LOG_ERR, "Error setting collector fd flags: %s", strerror(errno));
+        close(collector_fd);
+        return 1;
+    }
+    shutdown(collector_fd, SHUT_WR);
+
+    size_t const worker_index = collector_workers.next_worker++ % collector_workers.worker_count;
+    if (write(collector_workers.workers[worker_index].collector_pipefds[1], &collector_fd, sizeof(collector_fd)) !=
+        sizeof(collector_fd))
+    {
+        syslog(LOG_DAEMON | LOG_ERR, "Could not hand over collector to worker %zu: %s", worker_index, strerror(errno));
+        close(collector_fd);
+        return 1;
+    }
+
+    syslog(LOG_DAEMON, "New collector connection, handled by worker %zu", worker_index);
+
+    return 0;
+}
+
 static int new_connection(int epollfd, int eventfd)
 {
     union {
@@ -346,7 +572,11 @@ static int new_connection(int epollfd, int eventfd)
     socklen_t peer_addr_len;
     enum sock_type stype;
     int server_fd;
-    if (eventfd == json_sockfd)
+    if (eventfd == json_sockfd && collector_workers.worker_count > 0)
+    {
+        return hand_over_collector();
+    }
+    else if (eventfd == json_sockfd)
     {
         peer_addr_len = sizeof(sockaddr.event_json);
         stype = JSON_SOCK;
@@ -379,6 +609,12 @@ static int new_connection(int epollfd, int eventfd)
             break;
         case SERV_SOCK:
             sock_type = "distributor";
+            /* keep the TCP peer address for the log and the statistics */
+            memset(&current->event_serv.peer, 0, sizeof(current->event_serv.peer));
+            if (((struct sockaddr *)&sockaddr)->sa_family == AF_INET)
+            {
+                memcpy(&current->event_serv.peer, &sockaddr, sizeof(current->event_serv.peer));
+            }
             if (inet_ntop(current->event_serv.peer.sin_family,
                           &current->event_serv.peer.sin_addr,
                           &current->event_serv.peer_addr[0],
@@ -403,6 +639,8 @@ static int new_connection(int epollfd, int eventfd)
                        ntohs(current->event_serv.peer.sin_port));
             }
             break;
+        case WORKER_SOCK:
+            break;
     }
 
     /* nonblocking fd is mandatory */
@@ -427,6 +665,12 @@ static int new_connection(int epollfd, int eventfd)
     else
     {
         shutdown(current->fd, SHUT_RD); // distributor
+        /* EPOLLOUT gets armed as soon as there are pending bytes */
+        if (ctl_event(epollfd, EPOLL_CTL_ADD, current->fd, current, EPOLLET) != 0)
+        {
+            disconnect_client(epollfd, current);
+            return 1;
+        }
     }
 
     return 0;
@@ -495,238 +739,783 @@ static int handle_collector_protocol(int epollfd, struct remote_desc * const cur
     return 0;
 }
 
-static int handle_incoming_data(int epollfd, struct remote_desc * const current)
+static void log_distributor_error(struct remote_desc const * const current, char const * const reason)
 {
-    if (current->sock_type != JSON_SOCK)
-    {
-        return 0;
-    }
-
-    /* read JSON strings (or parts) from the UNIX socket (collecting) */
-    if (current->buf.used == current->buf.max)
+    if (current->event_serv.peer_addr[0] == '\0')
     {
-        syslog(LOG_DAEMON, "Collector read buffer full. No more read possible.");
+        syslog(LOG_DAEMON | LOG_ERR, "Distributor connection closed, %s", reason);
     }
     else
     {
-        errno = 0;
-        ssize_t bytes_read =
-            read(current->fd, current->buf.ptr.raw + current->buf.used, current->buf.max - current->buf.used);
-        if (bytes_read < 0 || errno != 0)
-        {
-            disconnect_client(epollfd, current);
-            return 1;
-        }
-        if (bytes_read == 0)
-        {
-            syslog(LOG_DAEMON, "Collector connection closed during read");
-            disconnect_client(epollfd, current);
-            return 1;
-        }
-        current->buf.used += bytes_read;
-    }
-
-    while (current->buf.used >= NETWORK_BUFFER_LENGTH_DIGITS + 1)
-    {
-        if (handle_collector_protocol(epollfd, current) != 0)
-        {
-            break;
-        }
-
-        for (size_t i = 0; i < remotes.desc_size; ++i)
-        {
-            if (remotes.desc[i].fd < 0)
-            {
-                continue;
-            }
-            if (remotes.desc[i].sock_type != SERV_SOCK)
-            {
-                continue;
-            }
-            if (current->event_json.json_bytes > remotes.desc[i].buf.max - remotes.desc[i].buf.used)
-            {
-                syslog(LOG_DAEMON | LOG_ERR,
-                       "Buffer capacity threshold (%zu of max %zu bytes) reached, "
-                       "falling back to blocking mode.",
-                       remotes.desc[i].buf.used,
-                       remotes.desc[i].buf.max);
-                /*
-                 * FIXME: Maybe switch to a Multithreading distributor data transmission,
-                 *        so that we do not have to switch back to blocking mode here!
-                 * NOTE: If *one* distributer peer is too slow, all other distributors are
-                 *       affected by this. This causes starvation and leads to a possible data loss on
-                 *       the nDPId collector side.
-                 */
-                if (fcntl_del_flags(remotes.desc[i].fd, O_NONBLOCK) != 0)
-                {
-                    syslog(LOG_DAEMON | LOG_ERR, "Error setting distributor fd flags: %s", strerror(errno));
-                    disconnect_client(epollfd, &remotes.desc[i]);
-                    continue;
-                }
-                if (write(remotes.desc[i].fd, remotes.desc[i].buf.ptr.raw, remotes.desc[i].buf.used) !=
-                    (ssize_t)remotes.desc[i].buf.used)
-                {
-                    syslog(LOG_DAEMON | LOG_ERR,
-                           "Could not drain buffer by %zu bytes. (forced)",
-                           remotes.desc[i].buf.used);
-                    disconnect_client(epollfd, &remotes.desc[i]);
-                    continue;
-                }
-                remotes.desc[i].buf.used = 0;
-                if (fcntl_add_flags(remotes.desc[i].fd, O_NONBLOCK) != 0)
-                {
-                    syslog(LOG_DAEMON | LOG_ERR, "Error setting distributor fd flags: %s", strerror(errno));
-                    disconnect_client(epollfd, &remotes.desc[i]);
-                    continue;
-                }
-            }
-
-            memcpy(remotes.desc[i].buf.ptr.raw + remotes.desc[i].buf.used,
-                   current->buf.ptr.raw,
-                   current->event_json.json_bytes);
-            remotes.desc[i].buf.used += current->event_json.json_bytes;
-
-            errno = 0;
-            ssize_t bytes_written = write(remotes.desc[i].fd, remotes.desc[i].buf.ptr.raw, remotes.desc[i].buf.used);
-            if (errno == EAGAIN)
-            {
-                continue;
-            }
-            if (bytes_written < 0 || errno != 0)
-            {
-                if (remotes.desc[i].event_serv.peer_addr[0] == '\0')
-                {
-                    syslog(LOG_DAEMON | LOG_ERR, "Distributor connection closed, send failed: %s", strerror(errno));
-                }
-                else
-                {
-                    syslog(LOG_DAEMON | LOG_ERR,
-                           "Distributor connection to %.*s:%u closed, send failed: %s",
-                           (int)sizeof(remotes.desc[i].event_serv.peer_addr),
-                           remotes.desc[i].event_serv.peer_addr,
-                           ntohs(remotes.desc[i].event_serv.peer.sin_port),
-                           strerror(errno));
-                }
-                disconnect_client(epollfd, &remotes.desc[i]);
-                continue;
-            }
-            if (bytes_written == 0)
-            {
-                syslog(LOG_DAEMON,
-                       "Distributor connection to %.*s:%u closed during write",
-                       (int)sizeof(remotes.desc[i].event_serv.peer_addr),
-                       remotes.desc[i].event_serv.peer_addr,
-                       ntohs(remotes.desc[i].event_serv.peer.sin_port));
-                disconnect_client(epollfd, &remotes.desc[i]);
-                continue;
-            }
-            if ((size_t)bytes_written < remotes.desc[i].buf.used)
-            {
-                syslog(LOG_DAEMON,
-                       "Distributor wrote less than expected to %.*s:%u: %zd < %zu",
-                       (int)sizeof(remotes.desc[i].event_serv.peer_addr),
-                       remotes.desc[i].event_serv.peer_addr,
-                       ntohs(remotes.desc[i].event_serv.peer.sin_port),
-                       bytes_written,
-                       remotes.desc[i].buf.used);
-                memmove(remotes.desc[i].buf.ptr.raw,
-                        remotes.desc[i].buf.ptr.raw + bytes_written,
-                        remotes.desc[i].buf.used - bytes_written);
-                remotes.desc[i].buf.used -= bytes_written;
-                continue;
-            }
-
-            remotes.desc[i].buf.used = 0;
-        }
-
-        memmove(current->buf.ptr.raw,
-                current->buf.ptr.raw + current->event_json.json_bytes,
-                current->buf.used - current->event_json.json_bytes);
-        current->buf.used -= current->event_json.json_bytes;
-        current->event_json.json_bytes = 0;
+        syslog(LOG_DAEMON | LOG_ERR,
+               "Distributor connection to %.*s:%u closed, %s",
+               (int)sizeof(current->event_serv.peer_addr),
+               current->event_serv.peer_addr,
+               ntohs(current->event_serv.peer.sin_port),
+               reason);
     }
-
-    return 0;
 }
 
-static int handle_incoming_data_event(int epollfd, struct epoll_event * const event)
+static unsigned long long int get_monotonic_time_usec(void)
 {
-    struct remote_desc * current = (struct remote_desc *)event->data.ptr;
+    struct timespec ts;
 
-    if ((event->events & EPOLLIN) == 0)
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
     {
-        return 1;
+        return 0;
     }
 
-    if (current == NULL)
-    {
-        syslog(LOG_DAEMON | LOG_ERR, "%s", "remote descriptor got from event data invalid");
-        return 1;
-    }
+    return (unsigned long long int)ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
 
-    if (current->fd < 0)
+/* time since the distributor socket stopped taking the pending bytes, 0 if it is not blocked */
+static unsigned long long int get_blocked_usec(struct distributor_stats const * const stats)
+{
+    if (stats->blocked_since == 0)
     {
-        syslog(LOG_DAEMON | LOG_ERR, "file descriptor `%d' got from event data invalid", current->fd);
-        return 1;
+        return 0;
     }
 
-    return handle_incoming_data(epollfd, current);
+    return get_monotonic_time_usec() - stats->blocked_since;
 }
 
-static int setup_signalfd(int epollfd)
+static int update_distributor_event(int epollfd, struct remote_desc * const current)
 {
-    sigset_t mask;
-    int sfd;
-
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGINT);
-    sigaddset(&mask, SIGTERM);
-    sigaddset(&mask, SIGQUIT);
+    struct distributor_stats * const stats = &current->event_serv.stats;
+    int const epollout_wanted = (current->buf.used > 0);
 
-    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+    if (epollout_wanted == current->event_serv.epollout_armed)
     {
-        return -1;
+        return 0;
     }
-    sfd = signalfd(-1, &mask, 0);
-    if (sfd == -1)
+    if (mod_event(epollfd, current->fd, current, EPOLLET | (epollout_wanted != 0 ? EPOLLOUT : 0)) != 0)
     {
-        return -1;
+        syslog(LOG_DAEMON | LOG_ERR, "Error updating distributor epoll event: %s", strerror(errno));
+        return 1;
     }
+    current->event_serv.epollout_armed = epollout_wanted;
 
-    if (add_event(epollfd, sfd, NULL) != 0)
+    if (epollout_wanted != 0)
     {
-        return -1;
+        stats->blocked_since = get_monotonic_time_usec();
     }
-
-    if (fcntl_add_flags(sfd, O_NONBLOCK) != 0)
+    else
     {
-        return -1;
+        unsigned long long int const blocked_usec = get_blocked_usec(stats);
+
+        stats->blocked_usec += blocked_usec;
+        if (blocked_usec > stats->max_blocked_usec)
+        {
+            stats->max_blocked_usec = blocked_usec;
+        }
+        stats->blocked_since = 0;
     }
 
-    return sfd;
+    return 0;
 }
 
-static int mainloop(int epollfd)
+/*
+ * Write as many pending bytes as the socket takes. Whatever remains is sent as soon as epoll reports the socket
+ * writable again (EPOLLOUT is armed only while bytes are pending).
+ */
+static int drain_distributor(int epollfd, struct remote_desc * const current)
 {
-    struct epoll_event events[32];
-    size_t const events_size = sizeof(events) / sizeof(events[0]);
-    int signalfd = setup_signalfd(epollfd);
+    size_t bytes_drained = 0;
 
-    while (nDPIsrvd_main_thread_shutdown == 0)
+    while (bytes_drained < current->buf.used)
     {
-        int nready = epoll_wait(epollfd, events, events_size, -1);
-
-        for (int i = 0; i < nready; i++)
+        ssize_t bytes_written =
+            write(current->fd, current->buf.ptr.raw + bytes_drained, current->buf.used - bytes_drained);
+        if (bytes_written < 0 && errno == EINTR)
         {
-            if (events[i].events & EPOLLERR)
-            {
+            continue;
+        }
+        if (bytes_written < 0 && errno == EAGAIN)
+        {
+            break;
+        }
+        if (bytes_written <= 0)
+        {
+            log_distributor_error(current, (bytes_written == 0 ? "during write" : strerror(errno)));
+            disconnect_client(epollfd, current);
+            return 1;
+        }
+
+        /* every event ends with a newline */
+        uint8_t const * sent = current->buf.ptr.raw + bytes_drained;
+        uint8_t const * const sent_end = sent + bytes_written;
+        while ((sent = memchr(sent, '\n', sent_end - sent)) != NULL)
+        {
+            current->event_serv.stats.events_sent++;
+            sent++;
+        }
+        current->event_serv.stats.bytes_sent += bytes_written;
+        bytes_drained += bytes_written;
+    }
+
+    if (bytes_drained > 0)
+    {
+        memmove(current->buf.ptr.raw, current->buf.ptr.raw + bytes_drained, current->buf.used - bytes_drained);
+        current->buf.used -= bytes_drained;
+    }
+
+    if (update_distributor_event(epollfd, current) != 0)
+    {
+        disconnect_client(epollfd, current);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* worst case length a `distributor_seq' adds to a JSON line */
+#define DISTRIBUTOR_SEQ_MAX_LENGTH (sizeof("\"distributor_seq\":18446744073709551615,") - 1)
+_Static_assert(DISTRIBUTOR_SEQ_MAX_LENGTH <= NETWORK_BUFFER_SEQ_RESERVE,
+               "collector lines have to leave room for the distributor_seq");
+
+static int distributors_have_space(size_t json_msg_length)
+{
+    for (size_t i = 0; i < remotes.desc_size; ++i)
+    {
+        if (remotes.desc[i].fd < 0 || remotes.desc[i].sock_type != SERV_SOCK)
+        {
+            continue;
+        }
+        if (json_msg_length + DISTRIBUTOR_SEQ_MAX_LENGTH > remotes.desc[i].buf.max - remotes.desc[i].buf.used)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Appends a JSON line to the distributor buffer with a `distributor_seq' as first key, counted per distributor.
+ * Consumers detect events dropped by nDPIsrvd (-D) by gaps. Collector lines are limited to
+ * NETWORK_BUFFER_COLLECTOR_MAX_SIZE, so every line still fits into NETWORK_BUFFER_MAX_SIZE with the additional key.
+ * The caller has to make sure that the buffer has room for the line and DISTRIBUTOR_SEQ_MAX_LENGTH.
+ */
+static size_t queue_json_message(struct remote_desc * const current,
+                                 uint8_t const * const json_msg,
+                                 size_t json_msg_length)
+{
+    uint8_t * const dst = current->buf.ptr.raw + current->buf.used;
+    char seq_str[DISTRIBUTOR_SEQ_MAX_LENGTH + sizeof("{")];
+    char length_str[NETWORK_BUFFER_LENGTH_DIGITS + 1];
+    int const empty_object = (json_msg[NETWORK_BUFFER_LENGTH_DIGITS + 1] == '}');
+    int const seq_str_len = snprintf(seq_str,
+                                     sizeof(seq_str),
+                                     "{\"distributor_seq\":%llu%s",
+                                     current->event_serv.next_seq,
+                                     (empty_object != 0 ? "" : ","));
+    size_t const sequenced_length = json_msg_length + seq_str_len - 1;
+
+    /* replaces the length digits and the opening brace */
+    snprintf(length_str,
+             sizeof(length_str),
+             "%0" NETWORK_BUFFER_LENGTH_DIGITS_STR "zu",
+             sequenced_length - NETWORK_BUFFER_LENGTH_DIGITS);
+    memcpy(dst, length_str, NETWORK_BUFFER_LENGTH_DIGITS);
+    memcpy(dst + NETWORK_BUFFER_LENGTH_DIGITS, seq_str, seq_str_len);
+    memcpy(dst + NETWORK_BUFFER_LENGTH_DIGITS + seq_str_len,
+           json_msg + NETWORK_BUFFER_LENGTH_DIGITS + 1,
+           json_msg_length - NETWORK_BUFFER_LENGTH_DIGITS - 1);
+    current->event_serv.next_seq++;
+
+    return sequenced_length;
+}
+
+/*
+ * A slow distributor either pauses all collectors until it caught up (default, no event gets lost in nDPIsrvd)
+ * or, with -D, misses the events that do not fit into its buffer anymore.
+ */
+static int distribute_json_message(int epollfd, uint8_t const * const json_msg, size_t json_msg_length)
+{
+    if (nDPIsrvd_options.drop_slow_distributors == 0 && distributors_have_space(json_msg_length) == 0)
+    {
+        if (collectors_paused == 0)
+        {
+            syslog(LOG_DAEMON, "Distributor buffer full, pausing collectors.");
+            collectors_paused = 1;
+            collectors_paused_since = get_monotonic_time_usec();
+        }
+        return 1;
+    }
+
+    for (size_t i = 0; i < remotes.desc_size; ++i)
+    {
+        struct remote_desc * const current = &remotes.desc[i];
+
+        if (current->fd < 0 || current->sock_type != SERV_SOCK)
+        {
+            continue;
+        }
+        if (json_msg_length + DISTRIBUTOR_SEQ_MAX_LENGTH > current->buf.max - current->buf.used)
+        {
+            if (current->event_serv.dropping == 0)
+            {
+                syslog(LOG_DAEMON | LOG_ERR,
+                       "Distributor buffer capacity threshold (%zu of max %zu bytes) reached, dropping events.",
+                       current->buf.used,
+                       current->buf.max);
+                current->event_serv.dropping = 1;
+            }
+            current->event_serv.stats.bytes_dropped += json_msg_length;
+            current->event_serv.stats.events_dropped++;
+            current->event_serv.next_seq++;
+            continue;
+        }
+        current->event_serv.dropping = 0;
+
+        size_t const queued_length = queue_json_message(current, json_msg, json_msg_length);
+        current->buf.used += queued_length;
+        current->event_serv.stats.bytes_queued += queued_length;
+        current->event_serv.stats.events_queued++;
+        if (current->buf.used > current->event_serv.stats.max_bytes_pending)
+        {
+            current->event_serv.stats.max_bytes_pending = current->buf.used;
+        }
+
+        /* Pending bytes are written in one go once the distributor becomes writable. */
+        if (current->event_serv.epollout_armed == 0)
+        {
+            drain_distributor(epollfd, current);
+        }
+    }
+
+    return 0;
+}
+
+static int read_collector_data(int epollfd, struct remote_desc * const current)
+{
+    /* read JSON strings (or parts) from the UNIX socket (collecting) */
+    if (current->buf.used == current->buf.max)
+    {
+        syslog(LOG_DAEMON, "Collector read buffer full. No more read possible.");
+    }
+    else
+    {
+        errno = 0;
+        ssize_t bytes_read =
+            read(current->fd, current->buf.ptr.raw + current->buf.used, current->buf.max - current->buf.used);
+        if (bytes_read < 0 || errno != 0)
+        {
+            disconnect_client(epollfd, current);
+            return 1;
+        }
+        if (bytes_read == 0)
+        {
+            syslog(LOG_DAEMON, "Collector connection closed during read");
+            disconnect_client(epollfd, current);
+            return 1;
+        }
+        current->buf.used += bytes_read;
+    }
+
+    return 0;
+}
+
+static void drain_collector_buffer(struct remote_desc * const current)
+{
+    memmove(current->buf.ptr.raw,
+            current->buf.ptr.raw + current->event_json.json_bytes,
+            current->buf.used - current->event_json.json_bytes);
+    current->buf.used -= current->event_json.json_bytes;
+    current->event_json.json_bytes = 0;
+}
+
+/* A ring entry is the JSON line length followed by the JSON line, padded to keep the length fields aligned. */
+static size_t ring_entry_size(size_t json_msg_length)
+{
+    return (sizeof(size_t) + json_msg_length + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+}
+
+static void signal_eventfd(int fd)
+{
+    uint64_t const value = 1;
+
+    if (write(fd, &value, sizeof(value)) != sizeof(value) && errno != EAGAIN)
+    {
+        syslog(LOG_DAEMON | LOG_ERR, "Could not signal eventfd: %s", strerror(errno));
+    }
+}
+
+static int collector_worker_push(struct collector_worker * const worker,
+                                 uint8_t const * const json_msg,
+                                 size_t json_msg_length)
+{
+    size_t const entry_size = ring_entry_size(json_msg_length);
+    size_t const mask = worker->ring.size - 1;
+    size_t const head = worker->ring.head;
+
+    /* Back-pressure: Wait for the main thread instead of dropping, the collectors block meanwhile. */
+    while (worker->ring.size - (head - __sync_fetch_and_add(&worker->ring.tail, 0)) < entry_size)
+    {
+        uint64_t value;
+
+        signal_eventfd(worker->data_eventfd);
+        __sync_fetch_and_or(&worker->waiting_for_space, 1);
+        if (worker->ring.size - (head - __sync_fetch_and_add(&worker->ring.tail, 0)) >= entry_size)
+        {
+            __sync_fetch_and_and(&worker->waiting_for_space, 0);
+            break;
+        }
+        if (read(worker->space_eventfd, &value, sizeof(value)) != sizeof(value) && errno != EINTR)
+        {
+            return 1;
+        }
+        if (__sync_fetch_and_add(&nDPIsrvd_main_thread_shutdown, 0) != 0)
+        {
+            return 1;
+        }
+    }
+
+    size_t const offset = (head + sizeof(size_t)) & mask;
+    size_t const first_part =
+        (json_msg_length < worker->ring.size - offset ? json_msg_length : worker->ring.size - offset);
+
+    *(size_t *)(worker->ring.data + (head & mask)) = json_msg_length;
+    memcpy(worker->ring.data + offset, json_msg, first_part);
+    memcpy(worker->ring.data, json_msg + first_part, json_msg_length - first_part);
+    __sync_add_and_fetch(&worker->ring.head, entry_size);
+
+    return 0;
+}
+
+static int drain_collector_worker(int epollfd, struct collector_worker * const worker)
+{
+    static uint8_t wrapped_json_msg[NETWORK_BUFFER_MAX_SIZE];
+    size_t const mask = worker->ring.size - 1;
+    size_t head;
+    size_t tail = worker->ring.tail;
+    uint64_t value;
+
+    if (read(worker->data_eventfd, &value, sizeof(value)) != sizeof(value) && errno != EAGAIN)
+    {
+        syslog(LOG_DAEMON | LOG_ERR, "Could not read worker eventfd: %s", strerror(errno));
+    }
+
+    head = __sync_fetch_and_add(&worker->ring.head, 0);
+    while (tail != head)
+    {
+        size_t const json_msg_length = *(size_t *)(worker->ring.data + (tail & mask));
+        size_t const offset = (tail + sizeof(size_t)) & mask;
+        uint8_t const * json_msg = worker->ring.data + offset;
+
+        if (json_msg_length > worker->ring.size - offset)
+        {
+            size_t const first_part = worker->ring.size - offset;
+
+            memcpy(wrapped_json_msg, json_msg, first_part);
+            memcpy(wrapped_json_msg + first_part, worker->ring.data, json_msg_length - first_part);
+            json_msg = wrapped_json_msg;
+        }
+
+        if (distribute_json_message(epollfd, json_msg, json_msg_length) != 0)
+        {
+            break;
+        }
+        tail += ring_entry_size(json_msg_length);
+    }
+
+    __sync_add_and_fetch(&worker->ring.tail, tail - worker->ring.tail);
+    if (__sync_bool_compare_and_swap(&worker->waiting_for_space, 1, 0) != 0)
+    {
+        signal_eventfd(worker->space_eventfd);
+    }
+
+    return 0;
+}
+
+static int handle_worker_collector_data(struct collector_worker * const worker, struct remote_desc * const current)
+{
+    int retval = 0;
+
+    if (read_collector_data(worker->epollfd, current) != 0)
+    {
+        return 0;
+    }
+
+    while (current->buf.used >= NETWORK_BUFFER_LENGTH_DIGITS + 1)
+    {
+        if (handle_collector_protocol(worker->epollfd, current) != 0)
+        {
+            break;
+        }
+
+        if (collector_worker_push(worker, current->buf.ptr.raw, current->event_json.json_bytes) != 0)
+        {
+            retval = 1;
+            break;
+        }
+        drain_collector_buffer(current);
+    }
+
+    signal_eventfd(worker->data_eventfd);
+
+    return retval;
+}
+
+static int add_worker_collector(struct collector_worker * const worker)
+{
+    int collector_fd;
+
+    /* EOF: the main thread shuts down */
+    if (read(worker->collector_pipefds[0], &collector_fd, sizeof(collector_fd)) != sizeof(collector_fd))
+    {
+        return 1;
+    }
+
+    struct remote_desc * const current = get_unused_descriptor(&worker->collectors, JSON_SOCK, collector_fd);
+    if (current == NULL)
+    {
+        syslog(LOG_DAEMON | LOG_ERR,
+               "Max number of collector connections per worker reached: %zu",
+               worker->collectors.desc_used);
+        close(collector_fd);
+        return 0;
+    }
+
+    current->event_json.json_bytes = 0;
+    if (add_event(worker->epollfd, collector_fd, current) != 0)
+    {
+        disconnect_client(worker->epollfd, current);
+    }
+
+    return 0;
+}
+
+static void * collector_worker_thread(void * const arg)
+{
+    struct collector_worker * const worker = (struct collector_worker *)arg;
+    struct epoll_event events[32];
+    size_t const events_size = sizeof(events) / sizeof(events[0]);
+
+    while (__sync_fetch_and_add(&nDPIsrvd_main_thread_shutdown, 0) == 0)
+    {
+        int nready = epoll_wait(worker->epollfd, events, events_size, -1);
+
+        for (int i = 0; i < nready; i++)
+        {
+            if (events[i].data.fd == worker->collector_pipefds[0])
+            {
+                if (add_worker_collector(worker) != 0)
+                {
+                    return NULL;
+                }
+                continue;
+            }
+
+            struct remote_desc * const current = (struct remote_desc *)events[i].data.ptr;
+            if (current->fd < 0)
+            {
+                continue;
+            }
+            if ((events[i].events & EPOLLERR) != 0)
+            {
+                syslog(LOG_DAEMON | LOG_ERR, "Epoll event error: %s", "Collector disconnected");
+                disconnect_client(worker->epollfd, current);
+                continue;
+            }
+
+            if (handle_worker_collector_data(worker, current) != 0)
+            {
+                return NULL;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static void distribute_collector_buffer(int epollfd, struct remote_desc * const current)
+{
+    while (current->buf.used >= NETWORK_BUFFER_LENGTH_DIGITS + 1)
+    {
+        if (handle_collector_protocol(epollfd, current) != 0)
+        {
+            break;
+        }
+
+        if (distribute_json_message(epollfd, current->buf.ptr.raw, current->event_json.json_bytes) != 0)
+        {
+            break;
+        }
+        drain_collector_buffer(current);
+    }
+}
+
+static void resume_collectors(int epollfd)
+{
+    if (collectors_paused == 0 || distributors_have_space(NETWORK_BUFFER_MAX_SIZE) == 0)
+    {
+        return;
+    }
+
+    syslog(LOG_DAEMON, "Distributors caught up, resuming collectors.");
+    collectors_paused = 0;
+    collectors_paused_usec += get_monotonic_time_usec() - collectors_paused_since;
+    for (size_t i = 0; i < remotes.desc_size && collectors_paused == 0; ++i)
+    {
+        if (remotes.desc[i].fd < 0 || remotes.desc[i].sock_type != JSON_SOCK)
+        {
+            continue;
+        }
+        mod_event(epollfd, remotes.desc[i].fd, &remotes.desc[i], EPOLLIN);
+        distribute_collector_buffer(epollfd, &remotes.desc[i]);
+    }
+    for (size_t i = 0; i < collector_workers.worker_count && collectors_paused == 0; ++i)
+    {
+        struct collector_worker * const worker = &collector_workers.workers[i];
+
+        mod_event(epollfd, worker->data_eventfd, &worker->event_desc, EPOLLIN);
+        drain_collector_worker(epollfd, worker);
+    }
+}
+
+/* Returns the length of the framed JSON line written to `json_msg' or 0 if it did not fit. */
+static size_t jsonize_distributor_stats(char * const json_msg, size_t json_msg_size, size_t distributor_id)
+{
+    struct remote_desc const * const current = &remotes.desc[distributor_id];
+    struct distributor_stats const * const stats = &current->event_serv.stats;
+    char json_str[NETWORK_BUFFER_MAX_SIZE];
+    char peer[INET_ADDRSTRLEN + sizeof(":65535")] = "unix";
+    unsigned long long int const blocked_usec = get_blocked_usec(stats);
+    unsigned long long int const paused_usec =
+        collectors_paused_usec + (collectors_paused != 0 ? get_monotonic_time_usec() - collectors_paused_since : 0);
+    int json_str_len;
+    int s_ret;
+
+    if (current->event_serv.peer_addr[0] != '\0')
+    {
+        snprintf(peer,
+                 sizeof(peer),
+                 "%.*s:%u",
+                 (int)sizeof(current->event_serv.peer_addr),
+                 current->event_serv.peer_addr,
+                 ntohs(current->event_serv.peer.sin_port));
+    }
+    json_str_len = snprintf(json_str,
+                            sizeof(json_str),
+                            "{\"srvd_event_id\":%d,\"srvd_event_name\":\"%s\",\"distributor_id\":%zu,"
+                            "\"peer\":\"%s\",\"bytes-queued\":%llu,\"events-queued\":%llu,"
+                            "\"bytes-sent\":%llu,\"events-sent\":%llu,\"bytes-dropped\":%llu,"
+                            "\"events-dropped\":%llu,\"bytes-pending\":%zu,\"max-bytes-pending\":%zu,"
+                            "\"blocked-usec\":%llu,\"max-blocked-usec\":%llu,\"collectors-paused-usec\":%llu}",
+                            SRVD_EVENT_DISTRIBUTOR_STATS,
+                            srvd_event_name_table[SRVD_EVENT_DISTRIBUTOR_STATS],
+                            distributor_id,
+                            peer,
+                            stats->bytes_queued,
+                            stats->events_queued,
+                            stats->bytes_sent,
+                            stats->events_sent,
+                            stats->bytes_dropped,
+                            stats->events_dropped,
+                            current->buf.used,
+                            stats->max_bytes_pending,
+                            stats->blocked_usec + blocked_usec,
+                            (blocked_usec > stats->max_blocked_usec ? blocked_usec : stats->max_blocked_usec),
+                            paused_usec);
+    if (json_str_len < 0 || json_str_len >= (int)sizeof(json_str))
+    {
+        return 0;
+    }
+
+    s_ret = snprintf(json_msg,
+                     json_msg_size,
+                     "%0" NETWORK_BUFFER_LENGTH_DIGITS_STR "d%s\n",
+                     json_str_len + 1,
+                     json_str);
+    if (s_ret < 0 || s_ret >= (int)json_msg_size)
+    {
+        return 0;
+    }
+
+    return s_ret;
+}
+
+static void inject_distributor_stats(int epollfd)
+{
+    char json_msg[NETWORK_BUFFER_MAX_SIZE];
+
+    for (size_t i = 0; i < remotes.desc_size; ++i)
+    {
+        if (remotes.desc[i].fd < 0 || remotes.desc[i].sock_type != SERV_SOCK)
+        {
+            continue;
+        }
+
+        size_t const json_msg_length = jsonize_distributor_stats(json_msg, sizeof(json_msg), i);
+        if (json_msg_length == 0 || distribute_json_message(epollfd, (uint8_t *)json_msg, json_msg_length) != 0)
+        {
+            syslog(LOG_DAEMON | LOG_ERR, "Could not inject the distributor statistics.");
+            return;
+        }
+    }
+}
+
+static void serve_distributor_stats_socket(void)
+{
+    char json_msg[NETWORK_BUFFER_MAX_SIZE];
+    int client_fd = accept(distributor_stats_sockfd, NULL, NULL);
+
+    if (client_fd < 0)
+    {
+        return;
+    }
+
+    /* the few lines fit into the socket buffer, a client that does not read them gets nothing */
+    if (fcntl_add_flags(client_fd, O_NONBLOCK) == 0)
+    {
+        for (size_t i = 0; i < remotes.desc_size; ++i)
+        {
+            if (remotes.desc[i].fd < 0 || remotes.desc[i].sock_type != SERV_SOCK)
+            {
+                continue;
+            }
+
+            size_t const json_msg_length = jsonize_distributor_stats(json_msg, sizeof(json_msg), i);
+            if (json_msg_length == 0 || write(client_fd, json_msg, json_msg_length) != (ssize_t)json_msg_length)
+            {
+                break;
+            }
+        }
+    }
+    close(client_fd);
+}
+
+static int handle_distributor_event(int epollfd, struct remote_desc * const current, uint32_t events)
+{
+    if ((events & (EPOLLERR | EPOLLHUP)) != 0)
+    {
+        log_distributor_error(current, "hang up");
+        disconnect_client(epollfd, current);
+    }
+    else if ((events & EPOLLOUT) != 0)
+    {
+        drain_distributor(epollfd, current);
+    }
+
+    resume_collectors(epollfd);
+
+    return (current->fd < 0 ? 1 : 0);
+}
+
+static int handle_incoming_data(int epollfd, struct remote_desc * const current)
+{
+    if (collectors_paused != 0)
+    {
+        /* Stop polling until the distributors caught up, see resume_collectors(). A hang up is still reported once. */
+        mod_event(epollfd, current->fd, current, EPOLLET);
+        return 0;
+    }
+    if (current->sock_type == WORKER_SOCK)
+    {
+        return drain_collector_worker(epollfd, current->event_worker.worker);
+    }
+    if (current->sock_type != JSON_SOCK)
+    {
+        return 0;
+    }
+
+    if (read_collector_data(epollfd, current) != 0)
+    {
+        return 1;
+    }
+
+    distribute_collector_buffer(epollfd, current);
+
+    return 0;
+}
+
+static int handle_incoming_data_event(int epollfd, struct epoll_event * const event)
+{
+    struct remote_desc * current = (struct remote_desc *)event->data.ptr;
+
+    if ((event->events & EPOLLIN) == 0 && (current == NULL || current->sock_type != SERV_SOCK))
+    {
+        return 1;
+    }
+
+    if (current == NULL)
+    {
+        syslog(LOG_DAEMON | LOG_ERR, "%s", "remote descriptor got from event data invalid");
+        return 1;
+    }
+
+    if (current->fd < 0)
+    {
+        syslog(LOG_DAEMON | LOG_ERR, "file descriptor `%d' got from event data invalid", current->fd);
+        return 1;
+    }
+
+    if (current->sock_type == SERV_SOCK)
+    {
+        return handle_distributor_event(epollfd, current, event->events);
+    }
+
+    return handle_incoming_data(epollfd, current);
+}
+
+static int setup_signalfd(int epollfd)
+{
+    sigset_t mask;
+    int sfd;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGQUIT);
+    sigaddset(&mask, SIGUSR1);
+
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+    {
+        return -1;
+    }
+    sfd = signalfd(-1, &mask, 0);
+    if (sfd == -1)
+    {
+        return -1;
+    }
+
+    if (add_event(epollfd, sfd, NULL) != 0)
+    {
+        return -1;
+    }
+
+    if (fcntl_add_flags(sfd, O_NONBLOCK) != 0)
+    {
+        return -1;
+    }
+
+    return sfd;
+}
+
+static int mainloop(int epollfd)
+{
+    struct epoll_event events[32];
+    size_t const events_size = sizeof(events) / sizeof(events[0]);
+    int signalfd = setup_signalfd(epollfd);
+
+    while (nDPIsrvd_main_thread_shutdown == 0)
+    {
+        int nready = epoll_wait(epollfd, events, events_size, -1);
+
+        for (int i = 0; i < nready; i++)
+        {
+            if (events[i].events & EPOLLERR)
+            {
                 syslog(LOG_DAEMON | LOG_ERR,
                        "Epoll event error: %s",
                        (errno != 0 ? strerror(errno) : "Client disconnected"));
-                if (events[i].data.fd != json_sockfd && events[i].data.fd != serv_sockfd)
+                if (events[i].data.fd != json_sockfd && events[i].data.fd != serv_sockfd &&
+                    events[i].data.fd != distributor_stats_sockfd)
                 {
                     struct remote_desc * current = (struct remote_desc *)events[i].data.ptr;
                     disconnect_client(epollfd, current);
+                    resume_collectors(epollfd);
                 }
                 continue;
             }
@@ -739,6 +1528,10 @@ static int mainloop(int epollfd)
                     continue;
                 }
             }
+            else if (events[i].data.fd == distributor_stats_sockfd)
+            {
+                serve_distributor_stats_socket();
+            }
             else if (events[i].data.fd == signalfd)
             {
                 struct signalfd_siginfo fdsi;
@@ -759,6 +1552,10 @@ static int mainloop(int epollfd)
                     nDPIsrvd_main_thread_shutdown = 1;
                     break;
                 }
+                if (fdsi.ssi_signo == SIGUSR1)
+                {
+                    inject_distributor_stats(epollfd);
+                }
             }
             else
             {
@@ -802,6 +1599,12 @@ static int setup_event_queue(void)
         return -1;
     }
 
+    if (distributor_stats_sockfd >= 0 && add_event(epollfd, distributor_stats_sockfd, NULL) != 0)
+    {
+        syslog(LOG_DAEMON | LOG_ERR, "Error adding statistics fd to epoll: %s", strerror(errno));
+        return -1;
+    }
+
     return epollfd;
 }
 
@@ -814,23 +1617,167 @@ static void close_event_queue(int epollfd)
     close(epollfd);
 }
 
-static int setup_remote_descriptors(size_t max_descriptors)
+static int setup_descriptors(struct remote_descs * const descs, size_t max_descriptors)
 {
-    remotes.desc_used = 0;
-    remotes.desc_size = max_descriptors;
-    remotes.desc = (struct remote_desc *)calloc(remotes.desc_size, sizeof(*remotes.desc));
-    if (remotes.desc == NULL)
+    descs->desc_used = 0;
+    descs->desc_size = max_descriptors;
+    descs->desc = (struct remote_desc *)calloc(descs->desc_size, sizeof(*descs->desc));
+    if (descs->desc == NULL)
     {
         return -1;
     }
-    for (size_t i = 0; i < remotes.desc_size; ++i)
+    for (size_t i = 0; i < descs->desc_size; ++i)
+    {
+        descs->desc[i].fd = -1;
+    }
+
+    return 0;
+}
+
+static int setup_remote_descriptors(size_t max_descriptors)
+{
+    return setup_descriptors(&remotes, max_descriptors);
+}
+
+static int start_collector_worker(int epollfd, struct collector_worker * const worker)
+{
+    worker->epollfd = create_evq();
+    worker->data_eventfd = eventfd(0, EFD_NONBLOCK);
+    worker->space_eventfd = eventfd(0, 0);
+    if (worker->epollfd < 0 || worker->data_eventfd < 0 || worker->space_eventfd < 0 ||
+        pipe(worker->collector_pipefds) != 0)
+    {
+        syslog(LOG_DAEMON | LOG_ERR, "Error creating collector worker fds: %s", strerror(errno));
+        return 1;
+    }
+
+    worker->ring.size = nDPIsrvd_COLLECTOR_WORKER_RING_SIZE;
+    worker->ring.data = (uint8_t *)malloc(worker->ring.size);
+    if (worker->ring.data == NULL || setup_descriptors(&worker->collectors, nDPIsrvd_MAX_COLLECTORS_PER_WORKER) != 0)
+    {
+        syslog(LOG_DAEMON | LOG_ERR, "Error allocating collector worker memory");
+        return 1;
+    }
+
+    worker->event_desc.sock_type = WORKER_SOCK;
+    worker->event_desc.fd = worker->data_eventfd;
+    worker->event_desc.event_worker.worker = worker;
+    if (add_event(worker->epollfd, worker->collector_pipefds[0], NULL) != 0 ||
+        add_event(epollfd, worker->data_eventfd, &worker->event_desc) != 0)
     {
-        remotes.desc[i].fd = -1;
+        syslog(LOG_DAEMON | LOG_ERR, "Error adding collector worker fds to epoll: %s", strerror(errno));
+        return 1;
+    }
+
+    /* Termination signals and SIGUSR1 are read by the main thread using a signalfd, the workers never see them. */
+    sigset_t termination_signals;
+    sigset_t old_signals;
+    sigemptyset(&termination_signals);
+    sigaddset(&termination_signals, SIGINT);
+    sigaddset(&termination_signals, SIGTERM);
+    sigaddset(&termination_signals, SIGQUIT);
+    sigaddset(&termination_signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &termination_signals, &old_signals);
+    int const error = pthread_create(&worker->thread, NULL, collector_worker_thread, worker);
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    if (error != 0)
+    {
+        syslog(LOG_DAEMON | LOG_ERR, "Error creating collector worker thread: %s", strerror(error));
+        return 1;
     }
 
     return 0;
 }
 
+static int start_collector_workers(int epollfd)
+{
+    if (nDPIsrvd_options.collector_workers == 0)
+    {
+        return 0;
+    }
+
+    collector_workers.workers =
+        (struct collector_worker *)calloc(nDPIsrvd_options.collector_workers, sizeof(*collector_workers.workers));
+    if (collector_workers.workers == NULL)
+    {
+        return 1;
+    }
+
+    /* stop_collector_workers() cleans up all workers, including those never started after a failure */
+    for (size_t i = 0; i < nDPIsrvd_options.collector_workers; ++i)
+    {
+        struct collector_worker * const worker = &collector_workers.workers[i];
+
+        worker->epollfd = worker->data_eventfd = worker->space_eventfd = -1;
+        worker->collector_pipefds[0] = worker->collector_pipefds[1] = -1;
+    }
+
+    for (size_t i = 0; i < nDPIsrvd_options.collector_workers; ++i)
+    {
+        struct collector_worker * const worker = &collector_workers.workers[i];
+
+        if (start_collector_worker(epollfd, worker) != 0)
+        {
+            return 1;
+        }
+        collector_workers.worker_count++;
+    }
+
+    syslog(LOG_DAEMON, "%zu collector worker threads started", collector_workers.worker_count);
+
+    return 0;
+}
+
+static void stop_collector_workers(int epollfd)
+{
+    if (collector_workers.workers == NULL)
+    {
+        return;
+    }
+
+    nDPIsrvd_main_thread_shutdown = 1;
+    for (size_t i = 0; i < collector_workers.worker_count; ++i)
+    {
+        struct collector_worker * const worker = &collector_workers.workers[i];
+
+        /* The worker returns on EOF or, if it waits for ring space, on the wakeup. */
+        close(worker->collector_pipefds[1]);
+        worker->collector_pipefds[1] = -1;
+        signal_eventfd(worker->space_eventfd);
+        pthread_join(worker->thread, NULL);
+    }
+
+    for (size_t i = 0; i < nDPIsrvd_options.collector_workers; ++i)
+    {
+        struct collector_worker * const worker = &collector_workers.workers[i];
+
+        for (size_t j = 0; j < worker->collectors.desc_size; ++j)
+        {
+            disconnect_client(worker->epollfd, &worker->collectors.desc[j]);
+        }
+        free(worker->collectors.desc);
+        free(worker->ring.data);
+        if (worker->data_eventfd >= 0)
+        {
+            del_event(epollfd, worker->data_eventfd);
+            close(worker->data_eventfd);
+        }
+        int const fds[] = {
+            worker->space_eventfd, worker->collector_pipefds[0], worker->collector_pipefds[1], worker->epollfd};
+        for (size_t j = 0; j < sizeof(fds) / sizeof(fds[0]); ++j)
+        {
+            if (fds[j] >= 0)
+            {
+                close(fds[j]);
+            }
+        }
+    }
+
+    free(collector_workers.workers);
+    collector_workers.workers = NULL;
+    collector_workers.worker_count = 0;
+}
+
 #ifndef NO_MAIN
 int main(int argc, char ** argv)
 {
@@ -870,7 +1817,7 @@ int main(int argc, char ** argv)
         goto error;
     }
 
-    if (create_listen_sockets() != 0)
+    if (create_listen_sockets() != 0 || create_distributor_stats_socket() != 0)
     {
         goto error;
     }
@@ -896,7 +1843,8 @@ int main(int argc, char ** argv)
                           nDPIsrvd_options.group,
                           nDPIsrvd_options.pidfile,
                           nDPIsrvd_options.json_sockpath,
-                          (serv_address.raw.sa_family == AF_UNIX ? nDPIsrvd_options.serv_optarg : NULL)) != 0)
+                          (serv_address.raw.sa_family == AF_UNIX ? nDPIsrvd_options.serv_optarg : NULL),
+                          nDPIsrvd_options.stats_sockpath) != 0)
     {
         if (errno != 0)
         {
@@ -914,6 +1862,7 @@ int main(int argc, char ** argv)
     signal(SIGINT, SIG_IGN);
     signal(SIGTERM, SIG_IGN);
     signal(SIGQUIT, SIG_IGN);
+    signal(SIGUSR1, SIG_IGN);
 
     epollfd = setup_event_queue();
     if (epollfd < 0)
@@ -921,11 +1870,16 @@ int main(int argc, char ** argv)
         goto error;
     }
 
-    retval = mainloop(epollfd);
+    if (start_collector_workers(epollfd) == 0)
+    {
+        retval = mainloop(epollfd);
+    }
+    stop_collector_workers(epollfd);
     close_event_queue(epollfd);
 error:
     close(json_sockfd);
     close(serv_sockfd);
+    close_distributor_stats_socket();
 
     daemonize_shutdown(nDPIsrvd_options.pidfile);
     syslog(LOG_DAEMON | LOG_NOTICE, "Bye.");
@@ -0,0 +1,159 @@
+#!/usr/bin/env python3
+#
+# Generates dependencies/nDPIsrvd_keys.h: a collision free (perfect) hash
+# of all JSON keys found in schema/*.json, used by nDPIsrvd.h to map well-known
+# keys to fixed token slots without any hash table lookup.
+#
+# Run it whenever a key is added to or removed from the schema files.
+
+import glob
+import json
+import os
+import re
+import sys
+
+FNV_PRIME = 16777619
+MAX_SEEDS = 10000
+
+
+def collect_keys(schema_dir):
+    keys = set()
+
+    def walk(obj):
+        if isinstance(obj, dict):
+            for key, value in obj.items():
+                if key == 'properties' and isinstance(value, dict):
+                    keys.update(value.keys())
+                walk(value)
+        elif isinstance(obj, list):
+            for value in obj:
+                walk(value)
+
+    for schema_file in sorted(glob.glob(os.path.join(schema_dir, '*.json'))):
+        with open(schema_file, 'r') as f:
+            walk(json.load(f))
+
+    return sorted(keys)
+
+
+def get_json_key_strlen(header_file):
+    with open(header_file, 'r') as f:
+        match = re.search(r'^#define nDPIsrvd_JSON_KEY_STRLEN (\d+)$', f.read(), re.MULTILINE)
+    if match is None:
+        sys.stderr.write('nDPIsrvd_JSON_KEY_STRLEN not found in {}\n'.format(header_file))
+        sys.exit(1)
+    return int(match.group(1))
+
+
+def key_hash(seed, key):
+    h = seed
+    for c in key.encode('ascii'):
+        h ^= c
+        h = (h * FNV_PRIME) & 0xFFFFFFFF
+    return h
+
+
+def find_perfect_hash(keys):
+    slots = 1
+    while slots < len(keys) * 8:
+        slots *= 2
+
+    while True:
+        for seed in range(0x811c9dc5, 0x811c9dc5 + MAX_SEEDS):
+            used = set()
+            for key in keys:
+                slot = key_hash(seed, key) & (slots - 1)
+                if slot in used:
+                    break
+                used.add(slot)
+            else:
+                return seed, slots
+        slots *= 2
+
+
+def generate(keys, seed, slots):
+    table = [0] * slots
+    for index, key in enumerate(keys):
+        table[key_hash(seed, key) & (slots - 1)] = index + 1
+
+    out = list()
+    out.append('/* Generated by scripts/gen-nDPIsrvd-keys.py from the files in schema/, do not edit. */')
+    out.append('#ifndef NDPISRVD_KEYS_H')
+    out.append('#define NDPISRVD_KEYS_H 1')
+    out.append('')
+    out.append('#include <stdint.h>')
+    out.append('#include <string.h>')
+    out.append('')
+    out.append('#define nDPIsrvd_KNOWN_KEYS {}'.format(len(keys)))
+    out.append('#define nDPIsrvd_KNOWN_KEY_SLOTS {}'.format(slots))
+    out.append('#define nDPIsrvd_KNOWN_KEY_SEED 0x{:08x}u'.format(seed))
+    out.append('')
+    out.append('static char const * const nDPIsrvd_known_keys[nDPIsrvd_KNOWN_KEYS] = {')
+    for key in keys:
+        out.append('    "{}",'.format(key))
+    out.append('};')
+    out.append('')
+    out.append('static uint8_t const nDPIsrvd_known_key_lengths[nDPIsrvd_KNOWN_KEYS] = {')
+    line = '   '
+    for key in keys:
+        entry = ' {},'.format(len(key))
+        if len(line) + len(entry) > 120:
+            out.append(line)
+            line = '   '
+        line += entry
+    out.append(line)
+    out.append('};')
+    out.append('')
+    out.append('/* key index + 1, 0 marks an empty slot */')
+    out.append('static uint8_t const nDPIsrvd_known_key_slots[nDPIsrvd_KNOWN_KEY_SLOTS] = {')
+    line = '   '
+    for value in table:
+        entry = ' {},'.format(value)
+        if len(line) + len(entry) > 120:
+            out.append(line)
+            line = '   '
+        line += entry
+    out.append(line)
+    out.append('};')
+    out.append('')
+    out.append('static inline int nDPIsrvd_known_key_index(char const * const key, size_t key_length)')
+    out.append('{')
+    out.append('    uint32_t hash = nDPIsrvd_KNOWN_KEY_SEED;')
+    out.append('')
+    out.append('    for (size_t i = 0; i < key_length; ++i)')
+    out.append('    {')
+    out.append('        hash ^= (uint8_t)key[i];')
+    out.append('        hash *= {}u;'.format(FNV_PRIME))
+    out.append('    }')
+    out.append('')
+    out.append('    int const index = nDPIsrvd_known_key_slots[hash & (nDPIsrvd_KNOWN_KEY_SLOTS - 1)] - 1;')
+    out.append('    if (index < 0 || nDPIsrvd_known_key_lengths[index] != key_length ||')
+    out.append('        memcmp(nDPIsrvd_known_keys[index], key, key_length) != 0)')
+    out.append('    {')
+    out.append('        return -1;')
+    out.append('    }')
+    out.append('')
+    out.append('    return index;')
+    out.append('}')
+    out.append('')
+    out.append('#endif')
+
+    return '\n'.join(out) + '\n'
+
+
+if __name__ == '__main__':
+    root_dir = os.path.join(os.path.dirname(os.path.abspath(sys.argv[0])), '..')
+    keys = collect_keys(os.path.join(root_dir, 'schema'))
+    if len(keys) == 0 or len(keys) > 255:
+        sys.stderr.write('Unsupported number of keys: {}\n'.format(len(keys)))
+        sys.exit(1)
+    # nDPIsrvd.h stores keys NUL terminated in char[nDPIsrvd_JSON_KEY_STRLEN]
+    key_strlen = get_json_key_strlen(os.path.join(root_dir, 'dependencies', 'nDPIsrvd.h'))
+    for key in keys:
+        if len(key) >= key_strlen:
+            sys.stderr.write('Key too long: {} ({} >= nDPIsrvd_JSON_KEY_STRLEN {})\n'.format(key, len(key), key_strlen))
+            sys.exit(1)
+
+    seed, slots = find_perfect_hash(keys)
+    with open(os.path.join(root_dir, 'dependencies', 'nDPIsrvd_keys.h'), 'w') as f:
+        f.write(generate(keys, seed, slots))